@@ -0,0 +1,64 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef BLOCKCACHE_H_INCLUDED
+#define BLOCKCACHE_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Bounded cache of image data, shared by all images and connections of the
+// process. The unit is a chunk of an image file: BLOCK_CACHE_CHUNK bytes at an
+// offset aligned to its size, so checksums stored between blocks are cached
+// as well and reads are suitable for O_DIRECT. With --dedup it is a chunk of
+// the device instead (see dedup.h).
+//
+// The cache is split into shards, each with its own lock. Every shard is
+// managed by W-TinyLFU: new chunks enter a small LRU window; a chunk leaving
+// the window is admitted to the main (segmented LRU) part only if it was
+// requested more often than the chunk it would replace. Frequencies are
+// estimated by a count-min sketch, so a long sequential scan does not push
+// out frequently read chunks (filesystem metadata etc.).
+
+#define BLOCK_CACHE_CHUNK (64 * kilobyte)
+
+struct chunk;
+
+// --block-cache; the cache is disabled when its size is 0
+status initialize_block_cache(struct options *options);
+void close_block_cache(void);
+int block_cache_enabled(void);
+
+// a chunk of the image; read with load_chunk() (see ssdcache.h) on a
+// miss. The data stays valid until release_chunk(). NULL on a read error or
+// when every buffer is in use.
+struct chunk *get_chunk(struct image *img, u64 index);
+void release_chunk(struct chunk *chunk);
+
+const u8 *chunk_data(struct chunk *chunk);
+// shorter than BLOCK_CACHE_CHUNK at the end of the file (or the device)
+u32 chunk_length(struct chunk *chunk);
+
+void block_cache_stats(u64 *hits, u64 *misses);
+
+#endif // BLOCKCACHE_H_INCLUDED
@@ -0,0 +1,41 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef BUDGET_H_INCLUDED
+#define BUDGET_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+
+// Memory budget shared by every image (bitmaps, caches) of the process. The
+// limit comes from --memory-limit; 0 means no limit.
+
+void initialize_budget(struct options *options);
+status reserve_memory(u64 size, const char *purpose);
+void release_memory(u64 size);
+u64 reserved_memory(void);
+// 1 if a reservation of the calling thread was refused because of the limit
+// since the last call; tells a load which failed for lack of memory from one
+// which failed for any other reason
+int memory_exhausted(void);
+
+#endif // BUDGET_H_INCLUDED
@@ -0,0 +1,43 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef BUFFERS_H_INCLUDED
+#define BUFFERS_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+
+// Pool of buffers for reading images with O_DIRECT (--direct-io). Buffers
+// are allocated once, aligned to DIRECT_ALIGNMENT, and reads through them
+// cover aligned supersets of requested ranges.
+
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_BUFFER_SIZE (1 * megabyte)
+
+status initialize_buffers(struct options *options);
+void close_buffers(void);
+
+// NULL when all buffers are in use
+u8 *acquire_buffer(void);
+void release_buffer(u8 *buffer);
+
+#endif // BUFFERS_H_INCLUDED
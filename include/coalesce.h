@@ -0,0 +1,47 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef COALESCE_H_INCLUDED
+#define COALESCE_H_INCLUDED
+
+#include "partclone.h"
+#include "image.h"
+
+#include <sys/types.h>
+
+// Single-flight reads. Many clients booting from one image read the same
+// chunks at about the same time; a read of a range of an image file which is
+// already being read by another thread waits for that read and copies its
+// data instead of reading the image again. Ranges are matched exactly (the
+// image, the offset and the length), so callers read in fixed units: chunks
+// of the block and SSD caches, windows of direct I/O.
+
+// the length read - shorter at the end of the file - or -1
+typedef ssize_t (*range_function)(struct image *img, u64 offset, size_t length, u8 *data);
+
+// the read function is called once for concurrent calls with the same range
+ssize_t read_coalesced(struct image *img, u64 offset, size_t length, u8 *data,
+        range_function read);
+
+// reads done, and reads answered by another one
+void coalesce_stats(u64 *reads, u64 *joined);
+
+#endif // COALESCE_H_INCLUDED
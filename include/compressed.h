@@ -0,0 +1,110 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef COMPRESSED_H_INCLUDED
+#define COMPRESSED_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+// Random access to compressed images. A format module splits the
+// uncompressed data into units which can be decompressed independently -
+// spans between access points of gzip (see gzip.c), xz blocks or zstd frames
+// - and decodes them on request. Remote images are read the same way, in
+// extents fetched on request (see http.c).
+//
+// A read decompresses exactly the units it touches; when there are more of
+// them, all but the first are decompressed in parallel by the worker pool.
+// Decompressed units are kept in a cache of --window-cache MiB per image,
+// which readahead fills as well.
+
+struct compressed;
+struct image;
+struct segments;
+
+// decompress a unit; data holds its whole length
+typedef status (*decode_function)(struct compressed *c, u64 unit, u8 *data);
+
+enum unit_state {unit_queued, unit_decoding, unit_decoded, unit_failed};
+
+struct cached_unit
+{
+    u64 unit;
+    u8 *data;
+    u32 refs;
+    enum unit_state state;
+
+    struct cached_unit *prev;
+    struct cached_unit *next;
+};
+
+struct compressed
+{
+    // the image file, and its size
+    struct segments *segments;
+    u64 source_size;
+    const char *format_name;
+
+    // uncompressed offsets at which the units start; the entry after the last
+    // unit holds the size of the uncompressed data
+    u64 *starts;
+    u64 units;
+
+    decode_function decode;
+    // frees the data of the format module
+    void (*close)(struct compressed *c);
+    void *format;
+
+    // decompressed units; the most recently used one is at head.next
+    pthread_mutex_t lock;
+    pthread_cond_t decoded;
+    struct cached_unit head;
+    u64 cached;
+    u64 capacity;
+    u64 reserved;
+};
+
+// img->compressed is set if the image file is compressed (NULL otherwise)
+status open_compressed(struct image *img, struct options *options);
+void close_compressed(struct compressed *c);
+
+// read uncompressed data; the length read - shorter at the end - or -1
+ssize_t read_compressed(struct compressed *c, void *buf, size_t length, u64 offset);
+
+// start decompressing the units of the range into the cache
+void prefetch_compressed(struct compressed *c, u64 offset, u64 length);
+
+// 1 if the image is read over HTTP (see http.c)
+int is_http_url(const char *path);
+
+// read compressed data from the image file; the length read or -1
+ssize_t read_source(struct compressed *c, void *buf, size_t length, u64 offset);
+
+// format modules; error if the file cannot be read in the format
+status open_gzip(struct compressed *c, const char *path, struct options *options);
+status open_http(struct compressed *c, const char *url, struct options *options);
+status open_xz(struct compressed *c, const char *path, struct options *options);
+status open_zstd(struct compressed *c, const char *path, struct options *options);
+
+#endif // COMPRESSED_H_INCLUDED
@@ -0,0 +1,45 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef DAEMON_H_INCLUDED
+#define DAEMON_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+
+// Long-running daemon which attaches images to NBD devices on request. Requests
+// come through a local UNIX socket, one text line per connection:
+//
+//   attach IMAGE DEVICE   connect the device to the image
+//   detach DEVICE         disconnect the device
+//   list                  attached devices
+//   stats                 loaded images and counters
+//
+// Each reply line is followed by "ok" or "error: MESSAGE". Images stay loaded
+// after their devices are detached, until the memory limit needs room.
+
+status start_daemon(struct options *options);
+
+// send one request to the daemon and print the reply
+status control_daemon(struct options *options, char **words, int count);
+
+#endif // DAEMON_H_INCLUDED
@@ -0,0 +1,60 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef DEDUP_H_INCLUDED
+#define DEDUP_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Content-addressed caching (--dedup). The caches then hold chunks of the
+// device instead of chunks of the image file: BLOCK_CACHE_CHUNK bytes (see
+// blockcache.h) of the data of present blocks, without checksums, absent
+// blocks read as zeroes. Every chunk holding a present block is identified by
+// the SHA-256 of its data, so chunks with the same content - in different
+// images, or in one image - take one slot of the block cache and of the SSD
+// cache. Images of one file system differing in a few blocks share all other
+// chunks, wherever their blocks are stored in the image files.
+//
+// The hashes are computed once, reading the present blocks when the image is
+// loaded for the first time, and saved next to it as IMAGE.hashidx; the file
+// is built again when the image changes. Only the first 128 bits of each hash
+// are kept in memory. Images with blocks which do not divide a chunk are
+// cached as without --dedup.
+
+status load_hashes(struct image *img, struct options *options);
+void free_hashes(struct image *img);
+
+// 1 if chunks of the image are chunks of the device (in both caches and in
+// load_chunk(), see ssdcache.h); 0 if they are chunks of the image file
+int device_chunks(struct image *img);
+
+// read a chunk of the device; the length read - shorter at the end of the
+// device - or -1
+ssize_t read_device_chunk(struct image *img, u64 index, u8 *data);
+
+// 1 and the (truncated) hash of the chunk if the image has hashes and the
+// chunk holds present blocks; 0 if the chunk is identified by the image and
+// its index
+int chunk_hash(struct image *img, u64 index, u64 hash[2]);
+
+#endif // DEDUP_H_INCLUDED
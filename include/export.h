@@ -0,0 +1,54 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef EXPORT_H_INCLUDED
+#define EXPORT_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// An image served under a name. Images are loaded once, when the server
+// starts, and shared by all connections. An export does not move once loaded
+// (other modules keep pointers to its image and its segments).
+struct export
+{
+    // name of the export (the file name of the image)
+    char *name;
+    // path to the image
+    char *path;
+    // loaded image
+    struct image img;
+};
+
+// load images given as files or directories of images
+status load_exports(char **paths, int count, struct options *options);
+void close_exports(void);
+
+// an export by name (not terminated with null); the empty name selects the
+// first export. NULL if not found.
+struct export *find_export(const u8 *name, u32 length);
+
+size_t exports_count(void);
+struct export *export_at(size_t index);
+
+#endif // EXPORT_H_INCLUDED
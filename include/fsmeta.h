@@ -0,0 +1,45 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#ifndef FSMETA_H_INCLUDED
+#define FSMETA_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Prefetch of file system metadata. Mounting, checking or walking a file
+// system reads many small pieces of metadata scattered over the device; when
+// the first session of an image starts, a plugin chosen by the file system
+// named in the image header (fs_string) finds them in the image - ext2/3/4
+// group descriptors, inode tables, root directory and journal superblock, or
+// the NTFS $MFT - and they are prefetched in the background, sorted and merged
+// into a few large reads. At most --metadata-prefetch bytes are prefetched.
+
+// --metadata-prefetch (0 disables the prefetch)
+status initialize_metadata_prefetch(struct options *options);
+
+// called when a session starts serving the image; only the first call counts
+void prefetch_metadata(struct image *img);
+
+#endif // FSMETA_H_INCLUDED
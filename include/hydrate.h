@@ -0,0 +1,64 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#ifndef HYDRATE_H_INCLUDED
+#define HYDRATE_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Hydration onto local storage (--hydrate=DIR). When the first session of an
+// image starts, a background thread copies the data of present blocks into
+// a local file in DIR, compacted like the in-memory arena (the block with
+// rank r at r * block_size, no checksums). Copied units are tracked in a
+// bitmap saved next to the copy, so hydration resumes after a restart.
+//
+// Reads of ranges already copied are served from the local file. Ranges read
+// from the image are copied next; while such reads are in progress, or their
+// latency rises above the lowest seen, the copier waits.
+
+struct hydration;
+
+status initialize_hydration(struct options *options);
+
+// called when a session starts serving the image; a copy hydrated by another
+// process (the data file is locked) is left alone
+void start_hydration(struct image *img);
+void stop_hydration(struct image *img);
+
+// img->hydration, set by another session; NULL if the image is not hydrated.
+// Read it once per request and pass it to the functions below.
+struct hydration *current_hydration(struct image *img);
+
+// 1 if the data of present blocks starting from the rank (skip bytes into
+// it) is in the local copy; *fd is set to the copy then. Otherwise the range
+// is copied before the rest.
+int hydrated_range(struct image *img, struct hydration *h, u64 rank, u64 skip,
+        u64 length, int *fd);
+
+// around reads from the image file
+u64 begin_foreground(struct hydration *h);
+void end_foreground(struct hydration *h, u64 started);
+
+#endif // HYDRATE_H_INCLUDED
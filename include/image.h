@@ -23,6 +23,9 @@
 #define IMAGE_H_INCLUDED
 
 #include "partclone.h"
+#include "segments.h"
+
+#include <sys/types.h>
 
 /* NONE - all blocks are used (like dd tool) */
 #define BITMAP_NONE 0x00
@@ -31,6 +34,13 @@
 /* BYTE - each byte corresponds to one block (especially used in 0001 images) */
 #define BITMAP_BYTE 0x08
 
+/* checksum modes stored in 0002 image header */
+#define CHECKSUM_NONE  0x00
+#define CHECKSUM_CRC32 0x20
+
+/* length of the name of a shared memory object with image metadata */
+#define SHARED_NAME_LENGTH 64
+
 #define ENDIANNESS_COMPATIBLE   0xC0DE
 #define ENDIANNESS_INCOMPATIBLE 0xDEC0
 
@@ -43,25 +53,6 @@ enum bitmap_mode   {bit = 0x01, byte = 0x08, none = 0x00};
 
 struct image
 {
-    // ------------------------------ OFFSET -------------------------------
-
-    // the file descriptor of the partclone image
-    int fd;
-    // a number of the current block starting from 0
-    u64 o_num;
-    // the number of remaining bytes of this block
-    u32 o_remaining_bytes;
-    // is this block present in the image or does it remain unused?
-    u8  o_existence;
-    // no. of set blocks from the beginning of the image to this block
-    u64 o_blocks_set;
-    // the pointer to the last element of the bitmap
-    u64 *o_bitmap_ptr;
-    // which bit of the element of the bitmap represents this block?
-    u8  o_bitmap_bit;
- 
-
-
     // ------------------------- BITMAP AND CACHE --------------------------
 
     // pointer to the first element of the bitmap
@@ -82,10 +73,63 @@ struct image
     // cache elements (cache_size * 8)
     size_t cache_elements;
 
+    // bitmap of blocks differing from the base image (NULL if not compared);
+    // the same number of elements as the bitmap
+    u64 *diff_ptr;
+
+    // shared memory object holding the bitmap and the cache (see shared.h);
+    // NULL when they are private to this process
+    void *shared_ptr;
+    size_t shared_size;
+    int shared_fd;
+    char shared_name[SHARED_NAME_LENGTH];
+
+    // prefetch profile being recorded or replayed (see profile.h)
+    struct profile *profile;
+    // set once metadata prefetch is started (see fsmeta.h)
+    int metadata_prefetched;
+    // local copy being hydrated (see hydrate.h)
+    struct hydration *hydration;
+
+    // data of present blocks in memory (--in-memory, see arena.h); NULL if
+    // the data is read from the file
+    u8 *arena;
+    size_t arena_size;
+
     // ---------------------------- PARAMETERS -----------------------------
 
+    // the pieces of the image file (see segments.h); offsets in the image
+    // file are offsets in the logical file
+    struct segments segments;
+    // the file descriptor of the partclone image (of its first piece)
+    int fd;
+    // a compressed image file (see compressed.h); NULL if the file is not
+    // compressed. Offsets in the image file are offsets of uncompressed data.
+    struct compressed *compressed;
+    // identical copies the image file is also read from (see replicas.h);
+    // NULL if there are none
+    struct replicas *replicas;
+    // content hashes of the chunks of the device holding present blocks, two
+    // words each (see dedup.h); NULL without --dedup
+    u64 *chunk_hashes;
+    u64 hashes_count;
+    // chunks with hashes: a bitmap word for every 64 chunks of the device,
+    // followed by the number of chunks with hashes before them
+    u64 *hashed_chunks;
+    // present blocks without the ones holding only zeroes (see zeroes.h);
+    // NULL without --zero-blocks or if there are none
+    u64 *nonzero_ptr;
+    // the same file opened with O_DIRECT (--direct-io); -1 if not used
+    int direct_fd;
+    // unique in the process; identifies data of the image in the block cache
+    u64 id;
+    // identifies the image file in the SSD cache (see ssdcache.h); 0 until
+    // it is computed
+    u64 ssd_tag;
     // file system path to an image
     char *path;
+    // file system of the device as named by partclone (EXTFS, NTFS, ...)
+    char fs_string[17];
     // ENDIANNESS_COMPATIBLE (0xCODE) or ENDIANNESS_INCOMPATIBLE (0xDECO)
     u16 endianess_checker;
     // size of the source device in bytes
@@ -102,6 +146,8 @@ struct image
 	u16 checksum_size;
 	// how many blocks are checksumed together
 	u32 blocks_per_checksum;
+    // is checksum reseeded after each group of blocks (1 - yes, 0 - no)
+    u8  reseed_checksum;
     // offset of data (from the beginning of the image)
     u64 data_offset;
     // offset of on-disk bitmap (from the beginning of the image)
@@ -109,12 +155,30 @@ struct image
 };
 
 // initialization
-status load_image(struct image *img, struct options *options);
+status load_image(struct image *img, char *path, struct options *options);
 status close_image(struct image *img);
-status initialize_offset(struct image *img);
 
-status set_block(struct image *obj, u64 block);
-status next_block(struct image *obj);
-status offset_in_current_block(struct image *obj, u64 offset);
+// number of blocks present in the image before the given block
+u64 block_rank(struct image *img, u64 block);
+// offset in the image file of the first byte of the block with a given rank
+u64 rank_offset(struct image *img, u64 rank);
+// length of the run of blocks (ending not further than the limit) which are
+// all present or all absent, like the given block
+u64 find_extent(struct image *img, u64 block, u64 limit, u8 *existence);
+// the same for any bitmap: length of the run of equal bits
+u64 find_run(const u64 *bitmap, u64 block, u64 limit, u8 *value);
+
+// read a range of the image file (decompressed if needed); the length read -
+// shorter at the end of the file - or -1
+ssize_t read_image_file(struct image *img, void *buf, size_t length, u64 offset);
+// start reading present blocks of the device range in the background
+status prefetch(struct image *img, u64 offset, u64 length);
+// number of blocks present in the image (counted in the bitmap)
+u64 present_blocks(struct image *img);
+// read a range of the device; absent blocks read as zeroes
+status read_device(struct image *img, void *buf, u64 offset, u64 length);
+// read blocks with consecutive ranks, without checksums; the buffer must hold
+// rank_offset(rank + count) - rank_offset(rank) bytes
+status read_ranks(struct image *img, void *buf, u64 rank, u64 count);
 
 #endif /* IMAGE_H_INCLUDED */
@@ -53,6 +53,46 @@ static inline status read_whole(int fd, void *dest, size_t size)
     return ok;
 }
 
+// pread() until the whole length is read or the end of the file; the length
+// read or -1
+static inline ssize_t read_full(int fd, void *data, size_t length, u64 offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t once = pread(fd, (u8*) data + done, length - done, offset + done);
+
+        if(once == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        if(once == 0) break;
+        done += once;
+    }
+
+    return done;
+}
+
+// pwrite() the whole data; errno is set on error
+static inline status write_full(int fd, const void *data, size_t length, u64 offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t once = pwrite(fd, (const u8*) data + done, length - done, offset + done);
+
+        if(once == -1) {
+            if(errno == EINTR) continue;
+            return error;
+        }
+
+        done += once;
+    }
+
+    return ok;
+}
+
 static inline status set_file_offset(int fd, s64 offset, int whence)
 {
     if(lseek(fd, offset, whence) != -1) return ok;
@@ -25,7 +25,15 @@
 #include "partclone.h"
 #include "image.h"
 
-status start_server(struct image *img, struct options *options);
+status start_server(struct options *options);
 status start_client(struct image *img, struct options *options);
 
+// a NBD device connected to an image; used by client mode and the daemon
+struct link;
+
+struct link *link_device(struct image *img, const char *device_path);
+void serve_link(struct link *link);
+status disconnect_link(struct link *link);
+void unlink_device(struct link *link);
+
 #endif
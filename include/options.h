@@ -28,10 +28,33 @@
 struct options {
     char* device_path;
     char* image_path;
+    char** image_paths;
+    char* base_image_path;
     char* log_file;
     u64 elems_per_cache;
+    u64 memory_limit;
+    u64 block_cache_size;
+    char* ssd_cache_path;
+    u64 ssd_cache_size;
+    u64 readahead_window;
+    char* profile_dir;
+    u64 profile_time;
+    u64 profile_size;
+    u64 metadata_prefetch;
+    char* hydrate_dir;
+    u64 index_span;
+    u64 window_cache;
+    char* replica_dirs;
+    int image_count;
+    char* control_path;
     int server_mode;
     int client_mode;
+    int daemon_mode;
+    int shared_metadata;
+    int direct_io;
+    int in_memory;
+    int dedup;
+    int zero_blocks;
     int port;
     int custom_log_file;
     int quiet;
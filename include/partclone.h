@@ -35,6 +35,8 @@ typedef enum {fatal = -2, error, ok} status;
 
 /* why 8-bit integer? because on 64-bit machines it is the fastest algorithm */
 #define popcount(x)     __builtin_popcountll(x)
+/* number of trailing zero bits; undefined for 0 */
+#define ctz(x)          __builtin_ctzll(x)
 
 /* shorter fixed types for storing integers */
 typedef uint64_t    u64;
@@ -75,4 +77,8 @@ typedef int32_t     utf32;
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+#ifndef MAX
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#endif
+
 #endif
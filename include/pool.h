@@ -0,0 +1,41 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+#include "partclone.h"
+
+// Small pool of worker threads for background work (readahead, decompression
+// of compressed images, metadata prefetch, profile replay). Tasks are
+// advisory: submit_task() fails instead of waiting when the queue is full.
+
+typedef void (*task_function)(void *owner, u64 offset, u64 length);
+
+status start_pool(int threads);
+void stop_pool(void);
+
+status submit_task(task_function function, void *owner, u64 offset, u64 length);
+// drop queued tasks of the owner and wait for its running ones
+void cancel_tasks(void *owner);
+
+#endif // POOL_H_INCLUDED
@@ -0,0 +1,51 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Prefetch profiles (--profile-dir). The first sessions of an image record
+// which parts of the device are read, in the order of first access, for at
+// most --profile-time seconds and --profile-size bytes; the profile is saved
+// in the directory under the identity of the image file (see shared.h). When
+// a profile of the image exists, it is replayed instead: the recorded ranges
+// are prefetched in the background as soon as the first client connects.
+//
+// Profiles are not updated once written; remove the file to record again.
+
+struct profile;
+
+status initialize_profiles(struct options *options);
+
+// called when a session starts serving the image
+void start_profile(struct image *img);
+// called for every read request
+void record_read(struct image *img, u64 offset, u64 length);
+// stop replaying, save a recording in progress
+void close_profile(struct image *img);
+
+#endif // PROFILE_H_INCLUDED
@@ -0,0 +1,84 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef READAHEAD_H_INCLUDED
+#define READAHEAD_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Readahead of image data. Read requests of a connection are matched to
+// streams - sequential, or strided (the same distance between requests).
+// Once a stream is confirmed, present extents ahead of it are prefetched in
+// the background: into the block cache if there is one, otherwise into the
+// page cache. Holes are skipped using the bitmap.
+//
+// The window of a stream doubles every time a request hits prefetched data.
+// Streams broken with unused prefetched data halve the window new streams
+// of the connection start with.
+
+#define READAHEAD_STREAMS 4
+
+struct read_stream
+{
+    // offset and length of the last request
+    u64 last;
+    u64 length;
+    // distance between requests; 0 if the stream is sequential
+    u64 stride;
+    // number of requests matching the stream
+    u32 hits;
+    // data up to this offset is already prefetched
+    u64 prefetched;
+    u64 window;
+    // when the stream was used last
+    u64 used;
+};
+
+struct readahead
+{
+    struct read_stream streams[READAHEAD_STREAMS];
+    u64 initial_window;
+    u64 tick;
+};
+
+// --readahead (maximum window; 0 disables readahead)
+status initialize_readahead(struct options *options);
+void close_readahead(void);
+
+void reset_readahead(struct readahead *ra);
+// called for every read request
+void observe_read(struct readahead *ra, struct image *img, u64 offset, u64 length);
+
+// prefetch present blocks of the device range in the background; error if
+// the queue is full (or readahead is disabled)
+status schedule_prefetch(struct image *img, u64 offset, u64 length);
+// the same, synchronously
+void fetch_range(struct image *img, u64 offset, u64 length);
+// wait for background prefetch of the image; before it is closed
+void cancel_prefetch(struct image *img);
+
+// ranges queued for prefetch by readahead, and ranges fetched
+void readahead_stats(u64 *scheduled, u64 *fetched);
+
+#endif // READAHEAD_H_INCLUDED
@@ -0,0 +1,56 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef REPLICAS_H_INCLUDED
+#define REPLICAS_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+#include <sys/types.h>
+
+// Identical copies of an image kept on other disks or mounts (--replicas=
+// DIR[:DIR...]): a file with the name of the image in one of the directories
+// is its replica if its size, header and bitmap are the same. Only plain
+// images - not compressed, streamed or remote - have replicas.
+//
+// Reads of image data are queued to the copy with the fewest reads queued,
+// each copy serving its own queue with a few threads; with equal queues,
+// every MiB of the file has its own preferred copy, which keeps the page
+// cache of each copy useful. A read not done within the 95th percentile of
+// recent read latencies is hedged: issued to a second copy as well, and the
+// first answer is used. A failed read is retried on another copy.
+
+struct replicas;
+
+// none found is not an error; img->replicas is NULL then
+status open_replicas(struct image *img, struct options *options);
+void close_replicas(struct image *img);
+
+// the length read - shorter at the end of the file - or -1
+ssize_t read_replicas(struct replicas *r, void *buf, size_t length, u64 offset);
+
+// posix_fadvise() on the preferred copy of each part of the range; 0 or an
+// error number
+int advise_replicas(struct replicas *r, u64 offset, u64 length, int advice);
+
+#endif // REPLICAS_H_INCLUDED
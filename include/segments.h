@@ -0,0 +1,90 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SEGMENTS_H_INCLUDED
+#define SEGMENTS_H_INCLUDED
+
+#include "partclone.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+// An image file split into pieces (IMAGE.aa, IMAGE.ab, ... as written by
+// split and Clonezilla) is read as one logical file. The pieces are named by
+// the first one - the following ones are found by their suffixes - or by a
+// glob pattern, in the order of their names. A file which is not split is a
+// table of one segment, and so is a stream (see stream.h): the segment is its
+// spill file then. A remote image has no segments.
+
+struct stream;
+
+struct file_segment
+{
+    int fd;
+    // offset of the piece in the logical file
+    u64 offset;
+    u64 size;
+};
+
+struct segments
+{
+    struct file_segment *table;
+    u32 count;
+    // of the logical file
+    u64 size;
+    // the latest modification time of the pieces
+    time_t mtime;
+    // the path of the logical file: the path of the first piece without its
+    // suffix; files kept next to the image are named after it
+    char *name;
+    // NULL unless the image is read from a pipe
+    struct stream *stream;
+};
+
+// the size of a stream until it ends
+#define STREAM_SIZE ((u64) INT64_MAX)
+
+status open_segments(struct segments *s, const char *path);
+status close_segments(struct segments *s);
+
+// the segment holding the offset (the last one if it is beyond the end)
+struct file_segment *find_segment(struct segments *s, u64 offset);
+
+// read from the logical file; the length read - shorter at the end - or -1
+ssize_t read_segments(struct segments *s, void *buf, size_t length, u64 offset);
+
+// wait until the range of a stream has arrived; ok at once for files
+status wait_segments(struct segments *s, u64 offset, u64 length);
+
+// 1 if the image is one file which can be mapped or opened again
+static inline int single_file(struct segments *s)
+{
+    return s->count == 1 && s->stream == NULL;
+}
+
+// posix_fadvise() on the range (to the end if the length is 0); 0 or an
+// error number
+int advise_segments(struct segments *s, u64 offset, u64 length, int advice);
+
+// 1 if the file is a piece other than the first of a split image
+int later_segment(const char *path);
+
+#endif // SEGMENTS_H_INCLUDED
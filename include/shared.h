@@ -0,0 +1,71 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef SHARED_H_INCLUDED
+#define SHARED_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// The bitmap and the rank cache of an image can be published in a POSIX shared
+// memory object (/dev/shm/partclone-nbd-*) by the first process which loads the
+// image; other processes map them read-only instead of building their own
+// copies. The object is named after the identity of the image file (device,
+// inode, size, modification time and header fields) and removed when the last
+// process using it closes the image.
+
+// identity of an image; computed from the header, before the bitmap is loaded
+struct shared_identity
+{
+    u64 dev;
+    u64 ino;
+    u64 size;
+    u64 mtime_sec;
+    u64 mtime_nsec;
+    u64 device_size;
+    u64 blocks_count;
+    u64 used_blocks;
+    u64 data_offset;
+    u64 bitmap_offset;
+    u64 elems_per_cache;
+    u32 block_size;
+    u32 blocks_per_checksum;
+    u32 checksum_size;
+    u32 bmpmode;
+};
+
+status shared_identity(struct image *img, struct shared_identity *id);
+
+// name for files kept for the image elsewhere (profiles, local copies):
+// "<CRC32 of the identity>-<inode>"; the CRC32 is stored in *hash
+#define IMAGE_KEY_LENGTH 32
+status image_key(struct image *img, u32 *hash, char *key);
+
+// map the bitmap and cache published by another process; error if there are
+// none (the image is loaded as usual then)
+status map_shared(struct image *img, struct shared_identity *id);
+// move the loaded bitmap and cache to shared memory
+status publish_shared(struct image *img, struct shared_identity *id);
+void unmap_shared(struct image *img);
+
+#endif // SHARED_H_INCLUDED
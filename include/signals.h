@@ -23,12 +23,16 @@
 #ifndef SIGNALS_H_INCLUDED
 #define SIGNALS_H_INCLUDED
 
-#include <setjmp.h>
-
 typedef int signal_t;
-extern sigjmp_buf env; // defined in signal.c
 
-void initialize_handling();
 void block_signals_in_thread();
 
+// Stopping signals (SIGINT, SIGTERM, ...) blocked in the calling thread and in
+// threads it starts later, and read from the returned descriptor (signalfd)
+// by a loop which polls it, outside of any lock; -1 on error. SIGPIPE is
+// ignored.
+int open_signal_fd();
+// a signal read from the descriptor; 0 on error
+signal_t read_signal(int fd);
+
 #endif // SIGNALS_H_INCLUDED
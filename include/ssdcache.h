@@ -0,0 +1,58 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#ifndef SSDCACHE_H_INCLUDED
+#define SSDCACHE_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Persistent cache of image data on local storage (--ssd-cache=FILE, sized by
+// --ssd-cache-size). It sits under the block cache: chunks of image files
+// (BLOCK_CACHE_CHUNK bytes, see blockcache.h) missing there are looked up in
+// the cache file, and chunks read from images are written to it. Chunks are
+// evicted by segmented LRU.
+//
+// The file starts with an index of its slots (image, chunk, length, CRC32 of
+// the data), so the cache survives restarts; images are identified like
+// shared metadata (see shared.h), chunks with --dedup by their content (see
+// dedup.h). Data is written before its index entry, and
+// the CRC32 is checked on the first use of a slot after the cache is opened,
+// so chunks torn by a crash are dropped.
+
+status initialize_ssd_cache(struct options *options);
+void close_ssd_cache(void);
+int ssd_cache_enabled(void);
+
+// read a chunk of the image file, or of the device with --dedup (see
+// dedup.h), through the cache file if there is one; the length read - shorter
+// at the end - or -1
+ssize_t load_chunk(struct image *img, u64 index, u8 *data);
+
+// whether the chunk is in the cache file; the cache is not updated
+int ssd_chunk_cached(struct image *img, u64 index);
+
+void ssd_cache_stats(u64 *hits, u64 *misses);
+
+#endif // SSDCACHE_H_INCLUDED
@@ -0,0 +1,47 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef STREAM_H_INCLUDED
+#define STREAM_H_INCLUDED
+
+#include "partclone.h"
+
+#include <sys/types.h>
+
+// Images read from a pipe (standard input given as "-", or a FIFO). A
+// thread consumes the stream as it arrives and writes it to a spill file in
+// $TMPDIR (/var/tmp by default), removed when the image is closed. Reads of
+// data the stream has passed are served from the spill file; reads ahead of
+// it wait until the stream reaches them.
+
+struct stream;
+
+// start consuming the source; *spill_fd is set to the spill file
+struct stream *open_stream(int source, const char *path, int *spill_fd);
+void close_stream(struct stream *st);
+
+// wait until the range has arrived; error if the stream ended before it
+status wait_stream(struct stream *st, u64 offset, u64 length);
+
+// the length read - shorter at the end of the stream - or -1
+ssize_t read_stream(struct stream *st, void *buf, size_t length, u64 offset);
+
+#endif // STREAM_H_INCLUDED
@@ -0,0 +1,42 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef ZEROES_H_INCLUDED
+#define ZEROES_H_INCLUDED
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+
+// Present blocks holding only zeroes (--zero-blocks). File systems mark
+// preallocated or zeroed blocks used, so partclone stores them; the image is
+// read once as a whole when it is loaded for the first time to find them,
+// and the result is saved next to it as IMAGE.zeroidx (built again when the
+// image changes).
+//
+// Such blocks are then served like absent ones - as holes, without reading
+// the image - and reported as holes by NBD_CMD_BLOCK_STATUS: img->nonzero_ptr
+// is the bitmap of present blocks without them, which find_extent() uses.
+
+status find_zero_blocks(struct image *img, struct options *options);
+void free_zero_blocks(struct image *img);
+
+#endif // ZEROES_H_INCLUDED
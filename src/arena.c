@@ -0,0 +1,154 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#define _GNU_SOURCE // MAP_HUGETLB
+
+#include "partclone.h"
+#include "log.h"
+#include "image.h"
+#include "budget.h"
+#include "arena.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define HUGE_PAGE (2 * megabyte)
+// the image file is read in pieces of about this size
+#define LOAD_BUFFER (8 * megabyte)
+
+// the size is a multiple of HUGE_PAGE
+static u8 *allocate_arena(size_t size)
+{
+    // explicit huge pages first (if some are reserved), then transparent ones
+    u8 *arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if(arena != MAP_FAILED) {
+        log_debug("Arena uses huge pages.");
+        return arena;
+    }
+
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(arena == MAP_FAILED) return NULL;
+
+    madvise(arena, size, MADV_HUGEPAGE);
+
+    return arena;
+}
+
+status load_arena(struct image *img)
+{
+    u64 size = present_blocks(img) * img->block_size;
+    size_t mapped = divide_up(size, HUGE_PAGE) * HUGE_PAGE;
+
+    img->arena = NULL;
+    img->arena_size = 0;
+
+    if(size == 0) return ok;
+
+    if(reserve_memory(mapped, "in-memory image") == error) return error;
+
+    u8 *arena = allocate_arena(mapped);
+
+    if(arena == NULL) {
+        log_error("Cannot allocate " fu64 " MiB for the in-memory image: %s.",
+                size / megabyte, strerror(errno));
+        release_memory(mapped);
+        return error;
+    }
+
+    // blocks are stored in groups followed by a checksum; whole groups are
+    // read at once and their blocks copied one group after another
+    u64 group = (u64) img->blocks_per_checksum * img->block_size;
+    u64 stride = group + img->checksum_size;
+    u64 groups_per_read = MAX(1, LOAD_BUFFER / stride);
+    u8 *buffer = malloc(groups_per_read * stride);
+
+    if(buffer == NULL) {
+        log_error("Cannot allocate memory for loading the image.");
+        goto error;
+    }
+
+    advise_segments(&img->segments, img->data_offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    u64 loaded = 0;
+    u64 offset = img->data_offset;
+
+    while (loaded < size) {
+        u64 groups = MIN(groups_per_read, divide_up(size - loaded, group));
+        // the last group may be shorter
+        u64 length = MIN(groups * stride, (size - loaded) + (groups - 1) * img->checksum_size);
+        u64 i;
+
+        if(read_image_file(img, buffer, length, offset) != (ssize_t) length) {
+            log_error("Cannot read image data for the in-memory image.");
+            free(buffer);
+            goto error;
+        }
+
+        for (i = 0; i < groups; i++) {
+            u64 once = MIN(group, size - loaded);
+
+            memcpy(arena + loaded, buffer + i * stride, once);
+            loaded += once;
+        }
+
+        offset += groups * stride;
+    }
+
+    free(buffer);
+
+    // the file is not read any more
+    advise_segments(&img->segments, img->data_offset, 0, POSIX_FADV_DONTNEED);
+
+    if(mlock(arena, size) == -1) {
+        log_warning("Cannot lock the in-memory image (%s); it may be swapped out.",
+                strerror(errno));
+    }
+
+    img->arena = arena;
+    img->arena_size = mapped;
+
+    log_info("Image loaded in memory (" fu64 " MiB).", size / megabyte);
+    return ok;
+
+error:
+    munmap(arena, mapped);
+    release_memory(mapped);
+    return error;
+}
+
+void free_arena(struct image *img)
+{
+    if(img->arena == NULL) return;
+
+    munmap(img->arena, img->arena_size);
+    release_memory(img->arena_size);
+
+    img->arena = NULL;
+}
@@ -0,0 +1,519 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "budget.h"
+#include "image.h"
+#include "blockcache.h"
+#include "ssdcache.h"
+#include "dedup.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_SHARDS 16
+// buffers are aligned for O_DIRECT
+#define BUFFER_ALIGNMENT 4096
+// part of the capacity given to the window, and to protected chunks of the
+// main part (in percents)
+#define WINDOW_PERCENT 1
+#define PROTECTED_PERCENT 80
+// counters of the frequency sketch
+#define SKETCH_ROWS 4
+#define MAX_FREQUENCY 15
+// set in the owner of chunks identified by their content
+#define CONTENT_OWNER (1ULL << 63)
+
+enum segment {window, probation, protected, evicted};
+
+struct chunk
+{
+    // image and index of the chunk, or the content hash of the chunk (see
+    // dedup.h)
+    u64 owner;
+    u64 index;
+
+    u8 *data;
+    u32 length;
+
+    // number of users; the cache itself is not counted
+    u32 refs;
+    // evicted chunks are freed by their last user
+    enum segment segment;
+
+    // list of the segment (or of free chunks)
+    struct chunk *prev;
+    struct chunk *next;
+    // next chunk in the hash table bucket
+    struct chunk *bucket_next;
+};
+
+// LRU list; the most recently used chunk is at head.next
+struct list
+{
+    struct chunk head;
+    u64 count;
+};
+
+struct shard
+{
+    pthread_mutex_t lock;
+
+    struct chunk **buckets;
+    u64 buckets_mask;
+
+    struct list lists[3];
+    struct chunk *free;
+
+    u64 capacity;
+    u64 window_capacity;
+    u64 protected_capacity;
+
+    // count-min sketch: SKETCH_ROWS rows of (sketch_mask + 1) counters
+    u8 *sketch;
+    u64 sketch_mask;
+    // counters are halved after sample_size increments
+    u64 additions;
+    u64 sample_size;
+
+    u64 hits;
+    u64 misses;
+};
+
+static struct shard *shards;
+static u64 shards_count;
+
+static struct chunk *chunks;
+static u8 *arena;
+static u64 reserved;
+
+/* ---------------------------- HELPERS --------------------------------- */
+
+static inline u64 hash_key(u64 owner, u64 index)
+{
+    // splitmix64 finalizer
+    u64 x = owner * 0x9E3779B97F4A7C15ULL ^ index;
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static u64 round_up_power(u64 x)
+{
+    u64 power = 1;
+    while (power < x) power <<= 1;
+    return power;
+}
+
+static inline void list_remove(struct list *list, struct chunk *chunk)
+{
+    chunk->prev->next = chunk->next;
+    chunk->next->prev = chunk->prev;
+    list->count--;
+}
+
+static inline void list_push(struct list *list, struct chunk *chunk)
+{
+    chunk->next = list->head.next;
+    chunk->prev = &list->head;
+    list->head.next->prev = chunk;
+    list->head.next = chunk;
+    list->count++;
+}
+
+static inline struct chunk *list_last(struct list *list)
+{
+    return list->count ? list->head.prev : NULL;
+}
+
+/* ----------------------------- SKETCH --------------------------------- */
+
+static void record(struct shard *shard, u64 hash)
+{
+    u64 i, step = (hash >> 32) | 1;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        u8 *counter = shard->sketch + i * (shard->sketch_mask + 1) +
+            ((hash + i * step) & shard->sketch_mask);
+
+        if(*counter < MAX_FREQUENCY) (*counter)++;
+    }
+
+    // aging - old popularity fades away
+    if(++shard->additions >= shard->sample_size) {
+        for (i = 0; i < SKETCH_ROWS * (shard->sketch_mask + 1); i++) {
+            shard->sketch[i] >>= 1;
+        }
+
+        shard->additions /= 2;
+    }
+}
+
+static u8 frequency(struct shard *shard, struct chunk *chunk)
+{
+    u64 hash = hash_key(chunk->owner, chunk->index);
+    u64 i, step = (hash >> 32) | 1;
+    u8 result = MAX_FREQUENCY;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        u8 counter = shard->sketch[i * (shard->sketch_mask + 1) +
+            ((hash + i * step) & shard->sketch_mask)];
+
+        if(counter < result) result = counter;
+    }
+
+    return result;
+}
+
+/* ----------------------------- TABLE ---------------------------------- */
+
+static struct chunk *lookup(struct shard *shard, u64 hash, u64 owner, u64 index)
+{
+    struct chunk *chunk = shard->buckets[hash & shard->buckets_mask];
+
+    while (chunk && (chunk->owner != owner || chunk->index != index)) {
+        chunk = chunk->bucket_next;
+    }
+
+    return chunk;
+}
+
+static void discard(struct shard *shard, struct chunk *chunk)
+{
+    u64 hash = hash_key(chunk->owner, chunk->index);
+    struct chunk **it = &shard->buckets[hash & shard->buckets_mask];
+
+    while (*it != chunk) it = &(*it)->bucket_next;
+    *it = chunk->bucket_next;
+
+    chunk->segment = evicted;
+
+    if(chunk->refs == 0) {
+        chunk->next = shard->free;
+        shard->free = chunk;
+    }
+}
+
+/* ----------------------------- POLICY --------------------------------- */
+
+static void touch(struct shard *shard, struct chunk *chunk)
+{
+    struct list *lists = shard->lists;
+
+    switch (chunk->segment) {
+    case window:
+    case protected:
+        list_remove(&lists[chunk->segment], chunk);
+        list_push(&lists[chunk->segment], chunk);
+        break;
+
+    case probation:
+        // requested again - promote; the protected segment overflows into
+        // the probation one
+        list_remove(&lists[probation], chunk);
+        list_push(&lists[protected], chunk);
+        chunk->segment = protected;
+
+        if(lists[protected].count > shard->protected_capacity) {
+            struct chunk *demoted = list_last(&lists[protected]);
+
+            list_remove(&lists[protected], demoted);
+            list_push(&lists[probation], demoted);
+            demoted->segment = probation;
+        }
+        break;
+
+    case evicted:
+        break;
+    }
+}
+
+static void insert(struct shard *shard, u64 hash, struct chunk *chunk)
+{
+    struct list *lists = shard->lists;
+    struct chunk **bucket = &shard->buckets[hash & shard->buckets_mask];
+
+    chunk->bucket_next = *bucket;
+    *bucket = chunk;
+
+    list_push(&lists[window], chunk);
+    chunk->segment = window;
+
+    // chunks leaving the window compete with the probation victim
+    while (lists[window].count > shard->window_capacity) {
+        struct chunk *candidate = list_last(&lists[window]);
+        list_remove(&lists[window], candidate);
+
+        u64 main_count = lists[probation].count + lists[protected].count;
+
+        if(main_count < shard->capacity - shard->window_capacity) {
+            list_push(&lists[probation], candidate);
+            candidate->segment = probation;
+            continue;
+        }
+
+        enum segment victim_segment = lists[probation].count ? probation : protected;
+        struct chunk *victim = list_last(&lists[victim_segment]);
+
+        if(frequency(shard, candidate) > frequency(shard, victim)) {
+            list_remove(&lists[victim_segment], victim);
+            discard(shard, victim);
+
+            list_push(&lists[probation], candidate);
+            candidate->segment = probation;
+        } else {
+            discard(shard, candidate);
+        }
+    }
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+struct chunk *get_chunk(struct image *img, u64 index)
+{
+    u64 owner = img->id, key = index, content[2];
+
+    // chunks with the same content are cached once; image ids are small
+    if(chunk_hash(img, index, content)) {
+        owner = content[0] | CONTENT_OWNER;
+        key = content[1];
+    }
+
+    u64 hash = hash_key(owner, key);
+    struct shard *shard = &shards[(hash >> 48) % shards_count];
+    struct chunk *chunk, *other;
+
+    pthread_mutex_lock(&shard->lock);
+
+    record(shard, hash);
+    chunk = lookup(shard, hash, owner, key);
+
+    if(chunk != NULL) {
+        shard->hits++;
+        touch(shard, chunk);
+        chunk->refs++;
+
+        pthread_mutex_unlock(&shard->lock);
+        return chunk;
+    }
+
+    shard->misses++;
+    chunk = shard->free;
+
+    // every buffer is in use; the caller reads directly
+    if(chunk != NULL) shard->free = chunk->next;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if(chunk == NULL) return NULL;
+
+    // the chunk is read without the lock held
+    ssize_t length = load_chunk(img, index, chunk->data);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(length == -1) {
+        chunk->next = shard->free;
+        shard->free = chunk;
+        chunk = NULL;
+
+    } else if((other = lookup(shard, hash, owner, key)) != NULL) {
+        // read by another thread in the meantime
+        chunk->next = shard->free;
+        shard->free = chunk;
+
+        chunk = other;
+        chunk->refs++;
+
+    } else {
+        chunk->owner = owner;
+        chunk->index = key;
+        chunk->length = length;
+        chunk->refs = 1;
+
+        insert(shard, hash, chunk);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return chunk;
+}
+
+void release_chunk(struct chunk *chunk)
+{
+    struct shard *shard = &shards[(hash_key(chunk->owner, chunk->index) >> 48) % shards_count];
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(--chunk->refs == 0 && chunk->segment == evicted) {
+        chunk->next = shard->free;
+        shard->free = chunk;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+const u8 *chunk_data(struct chunk *chunk)
+{
+    return chunk->data;
+}
+
+u32 chunk_length(struct chunk *chunk)
+{
+    return chunk->length;
+}
+
+int block_cache_enabled(void)
+{
+    return shards != NULL;
+}
+
+void block_cache_stats(u64 *hits, u64 *misses)
+{
+    u64 i;
+
+    *hits = *misses = 0;
+
+    for (i = 0; i < shards_count; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        *hits += shards[i].hits;
+        *misses += shards[i].misses;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+status initialize_block_cache(struct options *options)
+{
+    u64 capacity = options->block_cache_size / BLOCK_CACHE_CHUNK;
+    u64 i, j;
+
+    if(capacity == 0) return ok;
+
+    // small caches are not split; a shard holds at least 64 chunks
+    shards_count = MIN(MAX_SHARDS, divide_up(capacity, 64));
+
+    u64 shard_capacity = divide_up(capacity, shards_count);
+    // spare buffers for chunks evicted while they are being sent
+    u64 shard_buffers = shard_capacity + shard_capacity / 8 + 4;
+    u64 buckets = round_up_power(shard_capacity);
+    u64 sketch_width = round_up_power(shard_capacity);
+
+    u64 buffers = shard_buffers * shards_count;
+
+    reserved = buffers * (BLOCK_CACHE_CHUNK + sizeof(struct chunk)) +
+        shards_count * (buckets * sizeof(struct chunk*) + SKETCH_ROWS * sketch_width);
+
+    if(reserve_memory(reserved, "block cache") == error) goto error_1;
+
+    shards = calloc(shards_count, sizeof *shards);
+    chunks = calloc(buffers, sizeof *chunks);
+
+    if(shards == NULL || chunks == NULL ||
+       posix_memalign((void**) &arena, BUFFER_ALIGNMENT, buffers * BLOCK_CACHE_CHUNK) != 0) {
+    /* ---------------------------------------------------------------------- */
+        log_error("Cannot allocate memory for the block cache.");
+        arena = NULL;
+        goto error_2;
+    }
+
+    for (i = 0; i < shards_count; i++) {
+        struct shard *shard = &shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+
+        shard->capacity = shard_capacity;
+        shard->window_capacity = MAX(1, shard_capacity * WINDOW_PERCENT / 100);
+        shard->protected_capacity =
+            (shard_capacity - shard->window_capacity) * PROTECTED_PERCENT / 100;
+
+        shard->buckets = calloc(buckets, sizeof(struct chunk*));
+        shard->buckets_mask = buckets - 1;
+        shard->sketch = calloc(SKETCH_ROWS, sketch_width);
+        shard->sketch_mask = sketch_width - 1;
+        shard->sample_size = 10 * shard_capacity;
+
+        if(shard->buckets == NULL || shard->sketch == NULL) {
+            log_error("Cannot allocate memory for the block cache.");
+            shards_count = i + 1;
+            goto error_2;
+        }
+
+        for (j = 0; j < 3; j++) {
+            shard->lists[j].head.next = shard->lists[j].head.prev = &shard->lists[j].head;
+            shard->lists[j].count = 0;
+        }
+
+        for (j = i * shard_buffers; j < (i + 1) * shard_buffers; j++) {
+            chunks[j].data = arena + j * BLOCK_CACHE_CHUNK;
+            chunks[j].segment = evicted;
+            chunks[j].next = shard->free;
+            shard->free = &chunks[j];
+        }
+    }
+
+    log_info("Block cache of " fu64 " chunks (" fu64 " shards) created.", capacity, shards_count);
+    return ok;
+
+error_2:
+    close_block_cache();
+    return error;
+
+error_1:
+    log_error("Cannot create the block cache.");
+    return error;
+}
+
+void close_block_cache(void)
+{
+    u64 i;
+
+    if(shards == NULL && chunks == NULL) return;
+
+    if(shards) {
+        u64 hits, misses;
+        block_cache_stats(&hits, &misses);
+        log_debug("Block cache: " fu64 " hits, " fu64 " misses.", hits, misses);
+
+        for (i = 0; i < shards_count; i++) {
+            pthread_mutex_destroy(&shards[i].lock);
+            free(shards[i].buckets);
+            free(shards[i].sketch);
+        }
+    }
+
+    free(arena);
+    free(chunks);
+    free(shards);
+
+    release_memory(reserved);
+
+    arena = NULL;
+    chunks = NULL;
+    shards = NULL;
+    shards_count = 0;
+}
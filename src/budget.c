@@ -0,0 +1,89 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "budget.h"
+
+#include <pthread.h>
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u64 limit;
+static u64 reserved;
+
+static __thread int refused;
+
+void initialize_budget(struct options *options)
+{
+    limit = options->memory_limit;
+    reserved = 0;
+
+    if(limit != 0) {
+        log_debug("Memory limit: " fu64 " bytes.", limit);
+    }
+}
+
+status reserve_memory(u64 size, const char *purpose)
+{
+    status result = ok;
+
+    pthread_mutex_lock(&budget_lock);
+
+    if(limit != 0 && reserved + size > limit) {
+        log_error("Memory limit exceeded by %s (" fu64 " of " fu64 " bytes "
+                "reserved, " fu64 " more requested).", purpose, reserved, limit, size);
+        refused = 1;
+        result = error;
+    } else {
+        reserved += size;
+    }
+
+    pthread_mutex_unlock(&budget_lock);
+
+    return result;
+}
+
+void release_memory(u64 size)
+{
+    pthread_mutex_lock(&budget_lock);
+    reserved -= size;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+u64 reserved_memory(void)
+{
+    pthread_mutex_lock(&budget_lock);
+    u64 result = reserved;
+    pthread_mutex_unlock(&budget_lock);
+
+    return result;
+}
+
+int memory_exhausted(void)
+{
+    int result = refused;
+
+    refused = 0;
+    return result;
+}
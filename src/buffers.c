@@ -0,0 +1,95 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "budget.h"
+#include "buffers.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define DIRECT_BUFFERS 32
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u8 *arena;
+// stack of free buffers
+static u8 *free_buffers[DIRECT_BUFFERS];
+static int free_count;
+
+status initialize_buffers(struct options *options)
+{
+    int i;
+
+    if(!options->direct_io) return ok;
+
+    if(reserve_memory(DIRECT_BUFFERS * DIRECT_BUFFER_SIZE, "direct I/O buffers") == error) {
+        return error;
+    }
+
+    if(posix_memalign((void**) &arena, DIRECT_ALIGNMENT, DIRECT_BUFFERS * DIRECT_BUFFER_SIZE) != 0) {
+        log_error("Cannot allocate memory for direct I/O buffers.");
+        release_memory(DIRECT_BUFFERS * DIRECT_BUFFER_SIZE);
+        arena = NULL;
+        return error;
+    }
+
+    for (i = 0; i < DIRECT_BUFFERS; i++) {
+        free_buffers[i] = arena + (size_t) i * DIRECT_BUFFER_SIZE;
+    }
+
+    free_count = DIRECT_BUFFERS;
+
+    log_debug("%i direct I/O buffers allocated.", DIRECT_BUFFERS);
+    return ok;
+}
+
+void close_buffers(void)
+{
+    if(arena == NULL) return;
+
+    free(arena);
+    release_memory(DIRECT_BUFFERS * DIRECT_BUFFER_SIZE);
+
+    arena = NULL;
+    free_count = 0;
+}
+
+u8 *acquire_buffer(void)
+{
+    u8 *buffer = NULL;
+
+    pthread_mutex_lock(&buffers_lock);
+    if(free_count > 0) buffer = free_buffers[--free_count];
+    pthread_mutex_unlock(&buffers_lock);
+
+    return buffer;
+}
+
+void release_buffer(u8 *buffer)
+{
+    pthread_mutex_lock(&buffers_lock);
+    free_buffers[free_count++] = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+}
@@ -0,0 +1,139 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "image.h"
+#include "coalesce.h"
+
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+
+// a read in progress; it is kept on the stack of the reading thread, which
+// waits until the threads which joined it have copied the data
+struct flight
+{
+    u64 image;
+    u64 offset;
+    size_t length;
+    // the buffer of the reading thread
+    const u8 *data;
+    ssize_t result;
+    int error;
+    int done;
+    // threads waiting for the data or copying it
+    int joined;
+    struct flight *next;
+};
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_changed = PTHREAD_COND_INITIALIZER;
+
+// few reads are in progress at a time
+static struct flight *flights;
+
+static u64 reads;
+static u64 joined;
+
+static ssize_t join(struct flight *f, u8 *data)
+{
+    f->joined++;
+    joined++;
+
+    while (!f->done) {
+        pthread_cond_wait(&flight_changed, &flights_lock);
+    }
+
+    pthread_mutex_unlock(&flights_lock);
+
+    ssize_t result = f->result;
+    int error_number = f->error;
+
+    if(result > 0) memcpy(data, f->data, result);
+
+    pthread_mutex_lock(&flights_lock);
+
+    if(--f->joined == 0) pthread_cond_broadcast(&flight_changed);
+
+    pthread_mutex_unlock(&flights_lock);
+
+    if(result == -1) errno = error_number;
+    return result;
+}
+
+ssize_t read_coalesced(struct image *img, u64 offset, size_t length, u8 *data,
+        range_function read)
+{
+    struct flight *f, **link;
+
+    pthread_mutex_lock(&flights_lock);
+
+    for (f = flights; f != NULL; f = f->next) {
+        if(f->image == img->id && f->offset == offset && f->length == length) {
+            return join(f, data);
+        }
+    }
+
+    struct flight own = {
+        .image = img->id,
+        .offset = offset,
+        .length = length,
+        .data = data,
+        .next = flights
+    };
+
+    flights = &own;
+    reads++;
+
+    pthread_mutex_unlock(&flights_lock);
+
+    own.result = read(img, offset, length, data);
+    own.error = errno;
+
+    pthread_mutex_lock(&flights_lock);
+
+    // later reads of the range are not joined to this one
+    for (link = &flights; *link != &own; link = &(*link)->next);
+    *link = own.next;
+
+    own.done = 1;
+    pthread_cond_broadcast(&flight_changed);
+
+    while (own.joined > 0) {
+        pthread_cond_wait(&flight_changed, &flights_lock);
+    }
+
+    pthread_mutex_unlock(&flights_lock);
+
+    errno = own.error;
+    return own.result;
+}
+
+void coalesce_stats(u64 *reads_done, u64 *reads_joined)
+{
+    pthread_mutex_lock(&flights_lock);
+
+    *reads_done = reads;
+    *reads_joined = joined;
+
+    pthread_mutex_unlock(&flights_lock);
+}
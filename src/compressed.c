@@ -0,0 +1,416 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "budget.h"
+#include "image.h"
+#include "pool.h"
+#include "compressed.h"
+
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const struct
+{
+    const char *name;
+    // the signature, at the offset in the file
+    const char *magic;
+    size_t offset;
+    size_t length;
+    status (*open)(struct compressed *c, const char *path, struct options *options);
+} formats[] = {
+    {"gzip", "\x1f\x8b", 0, 2, open_gzip},
+    {"xz", "\xfd" "7zXZ\0", 0, 6, open_xz},
+    {"zstd", "\x28\xb5\x2f\xfd", 0, 4, open_zstd},
+    // a skippable frame (magic 0x184D2A5?), as written by pzstd
+    {"zstd", "\x2a\x4d\x18", 1, 3, open_zstd},
+};
+
+/* ------------------------- INITIALIZATION ----------------------------- */
+
+static status open_units(struct image *img, const char *format_name,
+        status (*open_format)(struct compressed*, const char*, struct options*),
+        struct options *options)
+{
+    struct compressed *c = calloc(1, sizeof *c);
+
+    if(c == NULL) {
+        log_error("Cannot allocate memory for a compressed image.");
+        return error;
+    }
+
+    c->segments = &img->segments;
+    c->source_size = img->segments.size;
+    c->format_name = format_name;
+    c->capacity = options->window_cache;
+    c->head.next = c->head.prev = &c->head;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->decoded, NULL);
+
+    if(open_format(c, img->segments.name, options) == error) goto error;
+
+    u64 size = c->capacity + (c->units + 1) * sizeof *c->starts;
+
+    if(reserve_memory(size, "compressed image") == error) goto error;
+
+    c->reserved = size;
+    img->compressed = c;
+
+    log_debug(fu64 " independently compressed units, " fu64 " bytes of data.",
+            c->units, c->starts[c->units]);
+    return ok;
+
+error:
+    close_compressed(c);
+    return error;
+}
+
+status open_compressed(struct image *img, struct options *options)
+{
+    u8 magic[8];
+    size_t i;
+
+    img->compressed = NULL;
+
+    if(is_http_url(img->path)) {
+        return open_units(img, "HTTP", open_http, options);
+    }
+
+    ssize_t length = read_segments(&img->segments, magic, sizeof magic, 0);
+
+    if(length == -1) {
+        log_error("Cannot read image file: %s.", strerror(errno));
+        return error;
+    }
+
+    for (i = 0; i < sizeof formats / sizeof *formats; i++) {
+        if((size_t) length >= formats[i].offset + formats[i].length &&
+           memcmp(magic + formats[i].offset, formats[i].magic, formats[i].length) == 0) {
+            break;
+        }
+    }
+
+    // not compressed
+    if(i == sizeof formats / sizeof *formats) return ok;
+
+    log_info("Image file is compressed with %s.", formats[i].name);
+
+    // compressed data is read at random
+    if(img->segments.stream) {
+        log_error("A compressed image cannot be read from a pipe; "
+                "decompress it on the way (zcat, xzcat, zstdcat).");
+        return error;
+    }
+
+    return open_units(img, formats[i].name, formats[i].open, options);
+}
+
+void close_compressed(struct compressed *c)
+{
+    struct cached_unit *entry, *next;
+
+    if(c == NULL) return;
+
+    // units queued for the workers, or being decompressed by them
+    cancel_tasks(c);
+
+    for (entry = c->head.next; entry != &c->head; entry = next) {
+        next = entry->next;
+        free(entry->data);
+        free(entry);
+    }
+
+    if(c->close) c->close(c);
+
+    release_memory(c->reserved);
+    pthread_cond_destroy(&c->decoded);
+    pthread_mutex_destroy(&c->lock);
+    free(c->starts);
+    free(c);
+}
+
+/* ------------------------------ CACHE --------------------------------- */
+
+static inline u64 unit_length(struct compressed *c, u64 unit)
+{
+    return c->starts[unit + 1] - c->starts[unit];
+}
+
+// the unit holding the offset
+static u64 find_unit(struct compressed *c, u64 offset)
+{
+    u64 low = 0, high = c->units;
+
+    while (high - low > 1) {
+        u64 middle = low + (high - low) / 2;
+
+        if(c->starts[middle] <= offset) low = middle;
+        else high = middle;
+    }
+
+    return low;
+}
+
+// the functions below are called with the lock held
+
+static void unlink_entry(struct cached_unit *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void push_entry(struct compressed *c, struct cached_unit *entry)
+{
+    entry->next = c->head.next;
+    entry->prev = &c->head;
+    c->head.next->prev = entry;
+    c->head.next = entry;
+}
+
+static struct cached_unit *find_entry(struct compressed *c, u64 unit)
+{
+    struct cached_unit *entry;
+
+    for (entry = c->head.next; entry != &c->head; entry = entry->next) {
+        if(entry->unit == unit) return entry;
+    }
+
+    return NULL;
+}
+
+// a new entry, referenced once
+static struct cached_unit *add_entry(struct compressed *c, u64 unit, enum unit_state state)
+{
+    struct cached_unit *entry = malloc(sizeof *entry);
+
+    if(entry == NULL || (entry->data = malloc(MAX(unit_length(c, unit), 1))) == NULL) {
+        log_error("Cannot allocate memory for decompressed data.");
+        free(entry);
+        return NULL;
+    }
+
+    entry->unit = unit;
+    entry->refs = 1;
+    entry->state = state;
+
+    push_entry(c, entry);
+    c->cached += unit_length(c, unit);
+
+    return entry;
+}
+
+// evict units nobody uses from the end of the list, and failed ones
+static void trim_cache(struct compressed *c)
+{
+    struct cached_unit *entry = c->head.prev;
+
+    while (entry != &c->head) {
+        struct cached_unit *prev = entry->prev;
+
+        if(entry->refs == 0 && (c->cached > c->capacity || entry->state == unit_failed)) {
+            unlink_entry(entry);
+            c->cached -= unit_length(c, entry->unit);
+
+            free(entry->data);
+            free(entry);
+        }
+
+        entry = prev;
+    }
+}
+
+static void put_entry(struct compressed *c, struct cached_unit *entry)
+{
+    entry->refs--;
+    trim_cache(c);
+}
+
+/* ---------------------------- DECODING -------------------------------- */
+
+// the entry is in the decoding state; the lock is not held
+static void decode_entry(struct compressed *c, struct cached_unit *entry)
+{
+    status result = c->decode(c, entry->unit, entry->data);
+
+    pthread_mutex_lock(&c->lock);
+    entry->state = result == ok ? unit_decoded : unit_failed;
+    pthread_cond_broadcast(&c->decoded);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// a worker decompresses a queued unit, unless a reader took it over already
+static void decode_task(void *owner, u64 unit, u64 length)
+{
+    struct compressed *c = owner;
+
+    (void) length;
+
+    pthread_mutex_lock(&c->lock);
+
+    struct cached_unit *entry = find_entry(c, unit);
+
+    if(entry && entry->state == unit_queued) {
+        entry->state = unit_decoding;
+        pthread_mutex_unlock(&c->lock);
+
+        decode_entry(c, entry);
+
+        pthread_mutex_lock(&c->lock);
+    }
+
+    // the reference of the task
+    if(entry) put_entry(c, entry);
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+// queue the unit for a worker; it is decompressed here if the pool is busy
+static void request_unit(struct compressed *c, u64 unit)
+{
+    pthread_mutex_lock(&c->lock);
+
+    struct cached_unit *entry = find_entry(c, unit);
+
+    if(entry == NULL) entry = add_entry(c, unit, unit_queued);
+    else entry = NULL;
+
+    pthread_mutex_unlock(&c->lock);
+
+    if(entry && submit_task(decode_task, c, unit, 0) == error) {
+        decode_task(c, unit, 0);
+    }
+}
+
+// the decompressed unit; readers never wait for queued units - they take
+// them over - only for units being decompressed by another thread
+static struct cached_unit *get_unit(struct compressed *c, u64 unit)
+{
+    pthread_mutex_lock(&c->lock);
+
+    struct cached_unit *entry = find_entry(c, unit);
+
+    if(entry == NULL) {
+        entry = add_entry(c, unit, unit_decoding);
+
+        if(entry == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+
+        pthread_mutex_unlock(&c->lock);
+        decode_entry(c, entry);
+        pthread_mutex_lock(&c->lock);
+    } else {
+        entry->refs++;
+        unlink_entry(entry);
+        push_entry(c, entry);
+
+        if(entry->state == unit_queued) {
+            entry->state = unit_decoding;
+
+            pthread_mutex_unlock(&c->lock);
+            decode_entry(c, entry);
+            pthread_mutex_lock(&c->lock);
+        }
+
+        while (entry->state == unit_decoding) {
+            pthread_cond_wait(&c->decoded, &c->lock);
+        }
+    }
+
+    if(entry->state == unit_failed) {
+        put_entry(c, entry);
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return entry;
+}
+
+// units of the range are requested while they fit in the cache
+static void request_units(struct compressed *c, u64 first, u64 last)
+{
+    u64 unit, requested = 0;
+
+    for (unit = first; unit <= last; unit++) {
+        requested += unit_length(c, unit);
+
+        if(requested > c->capacity) break;
+        request_unit(c, unit);
+    }
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+ssize_t read_source(struct compressed *c, void *buf, size_t length, u64 offset)
+{
+    return read_segments(c->segments, buf, length, offset);
+}
+
+ssize_t read_compressed(struct compressed *c, void *buf, size_t length, u64 offset)
+{
+    u64 size = c->starts[c->units];
+    size_t done = 0;
+
+    if(offset >= size || length == 0) return 0;
+
+    length = MIN(length, size - offset);
+
+    u64 unit = find_unit(c, offset);
+    u64 last = find_unit(c, offset + length - 1);
+
+    // the units after the first one are decompressed by the workers meanwhile
+    if(last > unit) request_units(c, unit + 1, last);
+
+    for (; unit <= last; unit++) {
+        struct cached_unit *entry = get_unit(c, unit);
+
+        if(entry == NULL) return -1;
+
+        u64 skip = offset + done - c->starts[unit];
+        u64 once = MIN(unit_length(c, unit) - skip, length - done);
+
+        memcpy((u8*) buf + done, entry->data + skip, once);
+
+        pthread_mutex_lock(&c->lock);
+        put_entry(c, entry);
+        pthread_mutex_unlock(&c->lock);
+
+        done += once;
+    }
+
+    return done;
+}
+
+void prefetch_compressed(struct compressed *c, u64 offset, u64 length)
+{
+    u64 size = c->starts[c->units];
+
+    if(offset >= size || length == 0) return;
+
+    request_units(c, find_unit(c, offset), find_unit(c, MIN(offset + length, size) - 1));
+}
@@ -0,0 +1,634 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "budget.h"
+#include "blockcache.h"
+#include "ssdcache.h"
+#include "compressed.h"
+#include "coalesce.h"
+#include "nbd.h"
+#include "signals.h"
+#include "daemon.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAX_REQUEST_LENGTH (2 * PATH_MAX + 16)
+// seconds a control connection may take to send its request (or to take the
+// reply); requests are read one at a time
+#define REQUEST_TIMEOUT 2
+
+// A loaded image. Entries stay on the list when no device uses them, so that
+// attaching the same image again costs only the ioctls.
+struct entry
+{
+    // canonical path of the image
+    char *path;
+    // identity of the file, to notice that it was replaced
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+
+    struct image img;
+
+    // number of devices using the image
+    int refs;
+    // when the image was used last (ticks of the daemon)
+    u64 last_used;
+    u64 attaches;
+
+    struct entry *next;
+};
+
+// a device attached to an image; served by its own thread
+struct device
+{
+    char *path;
+    struct entry *entry;
+    struct link *link;
+    pthread_t thread;
+    // set by the thread when the kernel disconnects the device
+    int finished;
+
+    struct device *next;
+};
+
+static struct entry *entries;
+static struct device *devices;
+
+// only "finished" is written by device threads
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct options *daemon_options;
+
+static u64 tick;
+
+static struct {
+    u64 attaches;
+    u64 detaches;
+    u64 loads;
+    u64 warm_attaches;
+    u64 evictions;
+} counters;
+
+/* ---------------------------- IMAGES ---------------------------------- */
+
+static void free_entry(struct entry *entry)
+{
+    close_image(&entry->img);
+    free(entry->path);
+    free(entry);
+}
+
+static void remove_entry(struct entry *entry)
+{
+    struct entry **it = &entries;
+    while (*it != entry) it = &(*it)->next;
+    *it = entry->next;
+
+    free_entry(entry);
+}
+
+// least recently used image which is not attached; NULL if there is none
+static struct entry *idle_entry(void)
+{
+    struct entry *entry, *found = NULL;
+
+    for (entry = entries; entry; entry = entry->next) {
+        if(entry->refs == 0 && (found == NULL || entry->last_used < found->last_used)) {
+            found = entry;
+        }
+    }
+
+    return found;
+}
+
+static struct entry *acquire_entry(const char *image_path)
+{
+    char *path;
+    struct stat st;
+
+    // a remote image is known by its URL only
+    if(is_http_url(image_path)) {
+        memset(&st, 0, sizeof st);
+        path = strdup(image_path);
+    } else {
+        path = realpath(image_path, NULL);
+
+        if(path && stat(path, &st) == -1) {
+            free(path);
+            path = NULL;
+        }
+    }
+
+    if(path == NULL) {
+        log_error("Cannot access image %s: %s.", image_path, strerror(errno));
+        return NULL;
+    }
+
+    struct entry *entry, *next;
+
+    for (entry = entries; entry; entry = next) {
+        next = entry->next;
+
+        if(strcmp(entry->path, path) != 0) continue;
+
+        if(entry->dev == st.st_dev && entry->ino == st.st_ino &&
+           entry->size == st.st_size && entry->mtime == st.st_mtime) {
+            log_debug("Image %s is already loaded.", path);
+            counters.warm_attaches++;
+            free(path);
+            goto acquired;
+        }
+
+        // the file was replaced; its old version is dropped once unused
+        if(entry->refs == 0) {
+            log_info("Image %s changed; loading it again.", path);
+            remove_entry(entry);
+        }
+    }
+
+    entry = malloc(sizeof *entry);
+
+    if(entry == NULL) {
+        log_error("Cannot allocate memory for an image.");
+        free(path);
+        return NULL;
+    }
+
+    *entry = (struct entry) {
+        .path = path,
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime = st.st_mtime
+    };
+
+    // make room for the image by dropping idle ones, least recently used first;
+    // other failures (a missing or damaged file) are not helped by that
+    memory_exhausted();
+
+    while (load_image(&entry->img, entry->path, daemon_options) == error) {
+        struct entry *idle = memory_exhausted() ? idle_entry() : NULL;
+
+        if(idle == NULL) {
+            free(path);
+            free(entry);
+            return NULL;
+        }
+
+        log_info("Unloading idle image %s.", idle->path);
+        counters.evictions++;
+        remove_entry(idle);
+    }
+
+    counters.loads++;
+
+    entry->next = entries;
+    entries = entry;
+
+acquired:
+    entry->refs++;
+    entry->last_used = ++tick;
+
+    return entry;
+}
+
+static void release_entry(struct entry *entry)
+{
+    entry->refs--;
+    entry->last_used = ++tick;
+}
+
+/* ---------------------------- DEVICES --------------------------------- */
+
+static void *serve_device(void *device_addr)
+{
+    struct device *device = device_addr;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    serve_link(device->link);
+
+    pthread_mutex_lock(&devices_lock);
+    device->finished = 1;
+    pthread_mutex_unlock(&devices_lock);
+
+    return NULL;
+}
+
+static struct device *find_device(const char *path)
+{
+    struct device *device;
+
+    for (device = devices; device; device = device->next) {
+        if(strcmp(device->path, path) == 0) return device;
+    }
+
+    return NULL;
+}
+
+static status attach(const char *image_path, const char *device_path)
+{
+    if(find_device(device_path)) {
+        log_error("Device %s is already attached.", device_path);
+        return error;
+    }
+
+    struct device *device = calloc(1, sizeof *device);
+
+    if(device == NULL || (device->path = strdup(device_path)) == NULL) {
+        log_error("Cannot allocate memory for a device.");
+        goto error_1;
+    }
+
+    device->entry = acquire_entry(image_path);
+    if(device->entry == NULL) goto error_1;
+
+    device->link = link_device(&device->entry->img, device->path);
+    if(device->link == NULL) goto error_2;
+
+    if(pthread_create(&device->thread, NULL, serve_device, device) != 0) {
+        log_error("Failed to create a thread for device %s.", device_path);
+        unlink_device(device->link);
+        goto error_2;
+    }
+
+    device->next = devices;
+    devices = device;
+
+    device->entry->attaches++;
+    counters.attaches++;
+    log_info("Image %s attached to %s.", device->entry->path, device->path);
+
+    return ok;
+
+error_2:
+    release_entry(device->entry);
+
+error_1:
+    if(device) free(device->path);
+    free(device);
+    return error;
+}
+
+// join the thread of a device which is finished or being disconnected
+static void remove_device(struct device *device)
+{
+    struct device **it = &devices;
+    while (*it != device) it = &(*it)->next;
+    *it = device->next;
+
+    pthread_join(device->thread, NULL);
+    unlink_device(device->link);
+    release_entry(device->entry);
+
+    counters.detaches++;
+    log_info("Device %s detached.", device->path);
+
+    free(device->path);
+    free(device);
+}
+
+static status detach(const char *device_path)
+{
+    struct device *device = find_device(device_path);
+
+    if(device == NULL) {
+        log_error("Device %s is not attached.", device_path);
+        return error;
+    }
+
+    if(disconnect_link(device->link) == error) return error;
+
+    remove_device(device);
+    return ok;
+}
+
+// devices disconnected by someone else (e.g. nbd-client -d)
+static void reap_devices(void)
+{
+    struct device *device, *next;
+
+    for (device = devices; device; device = next) {
+        next = device->next;
+
+        pthread_mutex_lock(&devices_lock);
+        int finished = device->finished;
+        pthread_mutex_unlock(&devices_lock);
+
+        if(finished) remove_device(device);
+    }
+}
+
+/* ---------------------------- REQUESTS -------------------------------- */
+
+static void reply(int sock, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vdprintf(sock, format, args);
+    va_end(args);
+}
+
+static void handle_request(int sock, char *request)
+{
+    status result = error;
+    char *space;
+
+    request[strcspn(request, "\r\n")] = '\0';
+    log_debug("Request \"%s\" received.", request);
+
+    reap_devices();
+
+    if(strncmp(request, "attach ", 7) == 0) {
+        // the image path may contain spaces; the device is the last word
+        char *image_path = request + 7;
+
+        if((space = strrchr(image_path, ' ')) != NULL && space != image_path) {
+            *space = '\0';
+            result = attach(image_path, space + 1);
+        }
+
+    } else if(strncmp(request, "detach ", 7) == 0) {
+        result = detach(request + 7);
+
+    } else if(strcmp(request, "list") == 0) {
+        struct device *device;
+
+        for (device = devices; device; device = device->next) {
+            reply(sock, "%s %s\n", device->path, device->entry->path);
+        }
+
+        result = ok;
+
+    } else if(strcmp(request, "stats") == 0) {
+        struct entry *entry;
+
+        for (entry = entries; entry; entry = entry->next) {
+            reply(sock, "image %s devices %i attaches " fu64 " memory " fsize "\n",
+                    entry->path, entry->refs, entry->attaches,
+                    entry->img.bitmap_size + entry->img.cache_size);
+        }
+
+        reply(sock, "memory " fu64 " limit " fu64 "\n", reserved_memory(),
+                daemon_options->memory_limit);
+        reply(sock, "attaches " fu64 " detaches " fu64 "\n", counters.attaches,
+                counters.detaches);
+        reply(sock, "loads " fu64 " warm " fu64 " evictions " fu64 "\n",
+                counters.loads, counters.warm_attaches, counters.evictions);
+
+        if(block_cache_enabled()) {
+            u64 hits, misses;
+            block_cache_stats(&hits, &misses);
+            reply(sock, "block cache hits " fu64 " misses " fu64 "\n", hits, misses);
+        }
+
+        if(ssd_cache_enabled()) {
+            u64 hits, misses;
+            ssd_cache_stats(&hits, &misses);
+            reply(sock, "ssd cache hits " fu64 " misses " fu64 "\n", hits, misses);
+        }
+
+        u64 reads, joined;
+        coalesce_stats(&reads, &joined);
+        reply(sock, "chunk reads " fu64 " shared " fu64 "\n", reads, joined);
+
+        result = ok;
+
+    } else {
+        reply(sock, "error: unknown request\n");
+        return;
+    }
+
+    if(result == ok) {
+        reply(sock, "ok\n");
+    } else {
+        reply(sock, "error: request failed, see log file %s\n",
+                daemon_options->log_file);
+    }
+}
+
+static void read_request(int sock)
+{
+    char request[MAX_REQUEST_LENGTH];
+    size_t length = 0;
+
+    // one line per connection
+    while (length < sizeof request - 1) {
+        ssize_t once = recv(sock, request + length, sizeof request - 1 - length, 0);
+
+        if(once <= 0) break;
+        length += once;
+
+        if(memchr(request, '\n', length)) break;
+    }
+
+    request[length] = '\0';
+
+    if(memchr(request, '\n', length) == NULL) {
+        log_error("Incomplete control request.");
+        reply(sock, "error: incomplete request\n");
+        return;
+    }
+
+    handle_request(sock, request);
+}
+
+/* ----------------------------- DAEMON --------------------------------- */
+
+static int control_address(struct options *options, struct sockaddr_un *addr)
+{
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+
+    if(strlen(options->control_path) >= sizeof addr->sun_path) {
+        log_error("Control socket path %s is too long.", options->control_path);
+        return 0;
+    }
+
+    strcpy(addr->sun_path, options->control_path);
+    return 1;
+}
+
+status start_daemon(struct options *options)
+{
+    struct sockaddr_un addr;
+
+    daemon_options = options;
+
+    if(!control_address(options, &addr)) return error;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(sock == -1) {
+        log_error("Failed to create a control socket: %s.", strerror(errno));
+        return error;
+    }
+
+    // a socket left by a daemon which was killed
+    unlink(options->control_path);
+
+    if(bind(sock, (struct sockaddr*) &addr, sizeof addr) == -1 ||
+       listen(sock, 16) == -1                                  ){
+    /* ---------------------------------------------------------------------- */
+        log_error("Failed to listen on %s: %s.", options->control_path, strerror(errno));
+        close(sock);
+        return error;
+    }
+
+    // signals are taken here, between requests, never inside a lock
+    int signal_fd = open_signal_fd();
+
+    if(signal_fd == -1) {
+        close(sock);
+        unlink(options->control_path);
+        return error;
+    }
+
+    log_info("Daemon initialized. Waiting for requests on %s ...", options->control_path);
+
+    for(;;) {
+        struct pollfd polled[2] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = signal_fd, .events = POLLIN }
+        };
+
+        if(poll(polled, 2, -1) == -1) {
+            if(errno != EINTR) log_error("Failed to wait for a request: %s.", strerror(errno));
+            continue;
+        }
+
+        if(polled[1].revents & POLLIN) {
+            signal_t sig_num = read_signal(signal_fd);
+            log_info("Signal \"%s\" caught. Stopping daemon ...", strsignal(sig_num));
+
+            while (devices) {
+                disconnect_link(devices->link);
+                remove_device(devices);
+            }
+
+            while (entries) remove_entry(entries);
+
+            close(signal_fd);
+            close(sock);
+            unlink(options->control_path);
+
+            return ok;
+        }
+
+        if(!(polled[0].revents & POLLIN)) continue;
+
+        int cl_sock = accept(sock, NULL, NULL);
+
+        if(cl_sock == -1) {
+            log_error("Failed to accept a control connection.");
+            continue;
+        }
+
+        struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT };
+
+        if(setsockopt(cl_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) == -1 ||
+           setsockopt(cl_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) == -1) {
+            log_error("Failed to set a timeout of a control connection: %s.", strerror(errno));
+            close(cl_sock);
+            continue;
+        }
+
+        read_request(cl_sock);
+        close(cl_sock);
+    }
+}
+
+status control_daemon(struct options *options, char **words, int count)
+{
+    struct sockaddr_un addr;
+    char buffer[4096];
+    int i;
+
+    if(!control_address(options, &addr)) return error;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof addr) == -1) {
+        fprintf(stderr, "Cannot connect to the daemon at %s: %s.\n",
+                options->control_path, strerror(errno));
+        if(sock != -1) close(sock);
+        return error;
+    }
+
+    for (i = 0; i < count; i++) {
+        dprintf(sock, i + 1 < count ? "%s " : "%s\n", words[i]);
+    }
+
+    // the reply ends with "ok" or "error: ..." line
+    size_t length = 0;
+    ssize_t once;
+
+    while ((once = recv(sock, buffer + length, sizeof buffer - 1 - length, 0)) > 0) {
+        length += once;
+        buffer[length] = '\0';
+
+        char *end;
+
+        // print complete lines, keep the rest
+        while ((end = strchr(buffer, '\n')) != NULL) {
+            *end = '\0';
+            printf("%s\n", buffer);
+
+            int last = strcmp(buffer, "ok") == 0 || strncmp(buffer, "error", 5) == 0;
+            int failed = strncmp(buffer, "error", 5) == 0;
+
+            length -= end + 1 - buffer;
+            memmove(buffer, end + 1, length + 1);
+
+            if(last) {
+                close(sock);
+                return failed ? error : ok;
+            }
+        }
+
+        if(length == sizeof buffer - 1) length = 0; // too long line; drop it
+    }
+
+    close(sock);
+    fprintf(stderr, "The daemon closed the connection.\n");
+    return error;
+}
@@ -0,0 +1,392 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "io.h"
+#include "image.h"
+#include "budget.h"
+#include "blockcache.h"
+#include "sha256.h"
+#include "dedup.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define HASHES_MAGIC "PCNBDHS2"
+// digests written to the file at once
+#define WRITE_DIGESTS 64
+
+// file format; all fields are little-endian. The header is followed by the
+// SHA-256 of every chunk of the device holding present blocks, in order.
+struct hashes_header
+{
+    char magic[8];
+    // of the image file (the compressed one, if it is compressed)
+    u64 size;
+    s64 mtime;
+    u32 chunk_size;
+    u32 block_size;
+    u64 count;
+};
+
+static inline u64 digest_offset(u64 position)
+{
+    return sizeof(struct hashes_header) + position * SHA256_SIZE;
+}
+
+static inline u64 chunks_count(struct image *img)
+{
+    return divide_up(img->device_size, BLOCK_CACHE_CHUNK);
+}
+
+// whether any block of the chunk is present; blocks holding only zeroes (see
+// zeroes.h) count as present, so the hashes do not depend on --zero-blocks
+static int holds_blocks(struct image *img, u64 index)
+{
+    u64 block = index * (BLOCK_CACHE_CHUNK / img->block_size);
+    u64 last_block = MIN(block + BLOCK_CACHE_CHUNK / img->block_size, img->blocks_count);
+    u8 present;
+
+    if(block >= last_block) return 0;
+
+    return find_run(img->bitmap_ptr, block, last_block, &present) < last_block - block || present;
+}
+
+// fill img->hashed_chunks; the number of chunks holding present blocks
+static u64 mark_chunks(struct image *img)
+{
+    u64 count = 0, index;
+
+    for (index = 0; index < chunks_count(img); index++) {
+        u64 *word = &img->hashed_chunks[2 * (index / 64)];
+
+        if(index % 64 == 0) {
+            word[0] = 0;
+            word[1] = count;
+        }
+
+        if(holds_blocks(img, index)) {
+            word[0] |= 1ULL << (index % 64);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// the first 128 bits of the digest
+static inline void keep_digest(struct image *img, u64 position, const u8 *digest)
+{
+    u64 words[2];
+
+    memcpy(words, digest, sizeof words);
+
+    img->chunk_hashes[2 * position] = le64toh(words[0]);
+    img->chunk_hashes[2 * position + 1] = le64toh(words[1]);
+}
+
+static status load_file(struct image *img, const char *path)
+{
+    struct hashes_header header;
+    u8 digests[WRITE_DIGESTS * SHA256_SIZE];
+    u64 i, j;
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1) return error;
+
+    if(read_full(fd, &header, sizeof header, 0) != sizeof header ||
+       memcmp(header.magic, HASHES_MAGIC, sizeof header.magic) != 0 ||
+       le64toh(header.size) != img->segments.size ||
+       (s64) le64toh(header.mtime) != (s64) img->segments.mtime ||
+       le32toh(header.chunk_size) != BLOCK_CACHE_CHUNK ||
+       le32toh(header.block_size) != img->block_size ||
+       le64toh(header.count) != img->hashes_count) {
+        log_info("Hashes %s are stale; they are computed again.", path);
+        close(fd);
+        return error;
+    }
+
+    for (i = 0; i < img->hashes_count; i += WRITE_DIGESTS) {
+        u64 count = MIN(img->hashes_count - i, WRITE_DIGESTS);
+
+        if(read_full(fd, digests, count * SHA256_SIZE, digest_offset(i)) !=
+           (ssize_t) (count * SHA256_SIZE)) {
+            log_warning("Cannot read hashes %s; they are computed again.", path);
+            close(fd);
+            return error;
+        }
+
+        for (j = 0; j < count; j++) {
+            keep_digest(img, i + j, digests + j * SHA256_SIZE);
+        }
+    }
+
+    close(fd);
+
+    log_info("Content hashes of the image loaded (" fu64 " chunks).", img->hashes_count);
+    return ok;
+}
+
+static status compute_hashes(struct image *img, const char *path)
+{
+    char tmp_path[PATH_MAX + 16];
+    u8 digests[WRITE_DIGESTS * SHA256_SIZE];
+    u64 index, position = 0, pending = 0;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", path, (long) getpid());
+
+    // without the file the hashes are computed again next time
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd == -1) {
+        log_warning("Cannot create %s (%s); the hashes are not saved.", tmp_path, strerror(errno));
+    }
+
+    u8 *buffer = malloc(BLOCK_CACHE_CHUNK);
+
+    if(buffer == NULL) {
+        log_error("Cannot allocate memory for computing content hashes.");
+        goto error;
+    }
+
+    log_info("Computing content hashes of the image (present blocks are read once) ...");
+
+    for (index = 0; index < chunks_count(img); index++) {
+        if(!holds_blocks(img, index)) continue;
+
+        ssize_t length = read_device_chunk(img, index, buffer);
+
+        if(length == -1) {
+            log_error("Cannot read the image to compute content hashes.");
+            goto error;
+        }
+
+        u8 *digest = digests + pending * SHA256_SIZE;
+
+        count_sha256(buffer, length, digest);
+        keep_digest(img, position + pending, digest);
+
+        if(++pending < WRITE_DIGESTS && position + pending < img->hashes_count) continue;
+
+        if(fd != -1 && write_full(fd, digests, pending * SHA256_SIZE, digest_offset(position)) == error) {
+            log_warning("Cannot write %s (%s); the hashes are not saved.", tmp_path, strerror(errno));
+            close(fd);
+            unlink(tmp_path);
+            fd = -1;
+        }
+
+        position += pending;
+        pending = 0;
+    }
+
+    free(buffer);
+    buffer = NULL;
+
+    if(fd != -1) {
+        struct hashes_header header;
+
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, HASHES_MAGIC, sizeof header.magic);
+        header.size = htole64(img->segments.size);
+        header.mtime = htole64(img->segments.mtime);
+        header.chunk_size = htole32(BLOCK_CACHE_CHUNK);
+        header.block_size = htole32(img->block_size);
+        header.count = htole64(img->hashes_count);
+
+        // the header last: a partial file is never valid
+        if(write_full(fd, &header, sizeof header, 0) == error ||
+           fdatasync(fd) == -1 || rename(tmp_path, path) == -1) {
+            log_warning("Cannot save %s: %s.", path, strerror(errno));
+            unlink(tmp_path);
+        }
+
+        close(fd);
+    }
+
+    log_info("Content hashes of " fu64 " chunks computed.", img->hashes_count);
+    return ok;
+
+error:
+    free(buffer);
+
+    if(fd != -1) {
+        close(fd);
+        unlink(tmp_path);
+    }
+
+    return error;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+status load_hashes(struct image *img, struct options *options)
+{
+    char path[PATH_MAX];
+
+    img->chunk_hashes = NULL;
+    img->hashed_chunks = NULL;
+    img->hashes_count = 0;
+
+    if(!options->dedup) return ok;
+
+    if(img->segments.count == 0 || img->segments.stream != NULL) {
+        log_info("Content hashes are not computed for streamed or remote images.");
+        return ok;
+    }
+
+    if(img->block_size == 0 || BLOCK_CACHE_CHUNK % img->block_size != 0) {
+        log_info("Blocks of the image do not divide a chunk; it is cached without hashes.");
+        return ok;
+    }
+
+    u64 marks_size = divide_up(chunks_count(img), 64) * 2 * sizeof *img->hashed_chunks;
+
+    if(reserve_memory(marks_size, "content hashes") == error) return error;
+
+    img->hashed_chunks = malloc(MAX(marks_size, 1));
+
+    if(img->hashed_chunks == NULL) {
+        log_error("Cannot allocate memory for content hashes.");
+        release_memory(marks_size);
+        return error;
+    }
+
+    u64 count = mark_chunks(img);
+    u64 size = count * 2 * sizeof *img->chunk_hashes;
+
+    if(reserve_memory(size, "content hashes") == error) goto error;
+
+    img->chunk_hashes = malloc(MAX(size, 1));
+
+    if(img->chunk_hashes == NULL) {
+        log_error("Cannot allocate memory for content hashes.");
+        release_memory(size);
+        goto error;
+    }
+
+    img->hashes_count = count;
+
+    snprintf(path, sizeof path, "%s.hashidx", img->segments.name);
+
+    if(load_file(img, path) == error && compute_hashes(img, path) == error) {
+        free_hashes(img);
+        return error;
+    }
+
+    return ok;
+
+error:
+    release_memory(marks_size);
+    free(img->hashed_chunks);
+    img->hashed_chunks = NULL;
+
+    return error;
+}
+
+void free_hashes(struct image *img)
+{
+    if(img->chunk_hashes == NULL) return;
+
+    release_memory(img->hashes_count * 2 * sizeof *img->chunk_hashes);
+    release_memory(divide_up(chunks_count(img), 64) * 2 * sizeof *img->hashed_chunks);
+    free(img->chunk_hashes);
+    free(img->hashed_chunks);
+
+    img->chunk_hashes = NULL;
+    img->hashed_chunks = NULL;
+    img->hashes_count = 0;
+}
+
+int device_chunks(struct image *img)
+{
+    return img->chunk_hashes != NULL;
+}
+
+ssize_t read_device_chunk(struct image *img, u64 index, u8 *data)
+{
+    u64 start = index * BLOCK_CACHE_CHUNK;
+
+    if(start >= img->device_size) return 0;
+
+    u64 length = MIN(BLOCK_CACHE_CHUNK, img->device_size - start);
+    u64 block = start / img->block_size;
+    u64 last_block = MIN(divide_up(start + length, img->block_size), img->blocks_count);
+
+    memset(data, 0, length);
+
+    while (block < last_block) {
+        u8 present;
+        u64 blocks = find_run(img->bitmap_ptr, block, last_block, &present);
+
+        u64 position = block * img->block_size;
+        u64 end = MIN((block + blocks) * img->block_size, start + length);
+        u64 rank = present ? block_rank(img, block) : 0;
+
+        // blocks are stored one after another up to the next checksum
+        while (present && position < end) {
+            u64 group = img->checksum_size ?
+                img->blocks_per_checksum - rank % img->blocks_per_checksum : blocks;
+
+            u64 once = MIN(group * img->block_size, end - position);
+            ssize_t length_read = read_image_file(img, data + (position - start), once,
+                    rank_offset(img, rank));
+
+            if(length_read != (ssize_t) once) {
+                log_error("Cannot read image data: %s.",
+                        length_read == -1 ? strerror(errno) : "unexpected end of file");
+                return -1;
+            }
+
+            position += once;
+            rank += group;
+        }
+
+        block += blocks;
+    }
+
+    return length;
+}
+
+int chunk_hash(struct image *img, u64 index, u64 hash[2])
+{
+    if(img->chunk_hashes == NULL || index >= chunks_count(img)) return 0;
+
+    u64 bits = img->hashed_chunks[2 * (index / 64)];
+    u64 mask = 1ULL << (index % 64);
+
+    if(!(bits & mask)) return 0;
+
+    u64 position = img->hashed_chunks[2 * (index / 64) + 1] + popcount(bits & (mask - 1));
+
+    hash[0] = img->chunk_hashes[2 * position];
+    hash[1] = img->chunk_hashes[2 * position + 1];
+
+    return 1;
+}
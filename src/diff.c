@@ -0,0 +1,199 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "log.h"
+#include "image.h"
+#include "budget.h"
+#include "diff.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+// state of the group of blocks covered by one checksum of the image
+struct chunk
+{
+    // the first block of the group
+    u64 first_block;
+    // rank in the image minus rank in the base image of the first block
+    s64 delta;
+    // may the group be compared with a group of the base image?
+    int comparable;
+};
+
+static status read_checksum(struct image *img, u64 group, u32 *checksum)
+{
+    // the checksum follows the last block of the group
+    u64 offset = rank_offset(img, (group + 1) * img->blocks_per_checksum)
+        - img->checksum_size;
+
+    if(read_image_file(img, checksum, 4, offset) != 4) {
+        log_error("Cannot read checksum at offset " fu64 ".", offset);
+        return error;
+    }
+
+    return ok;
+}
+
+// mark the blocks present in the image between first and last block (inclusive)
+static void mark_present(struct image *img, u64 first, u64 last)
+{
+    u64 block;
+
+    for (block = first; block <= last; block++) {
+        img->diff_ptr[block / 64] |=
+            img->bitmap_ptr[block / 64] & ((u64) 1 << (block % 64));
+    }
+}
+
+// can the checksums of both images be compared at all?
+static int checksums_comparable(struct image *img, struct image *base)
+{
+    return img->chkmode == crc32 && base->chkmode == crc32 &&
+           img->checksum_size == 4 && base->checksum_size == 4 &&
+           img->blocks_per_checksum == base->blocks_per_checksum;
+}
+
+status compute_diff(struct image *img, struct image *base)
+{
+    if(img->block_size != base->block_size     ||
+       img->blocks_count != base->blocks_count ||
+       img->device_size != base->device_size   ){
+    /* ---------------------------------------------------------------------- */
+        log_error("Base image describes a device of different geometry.");
+        return error;
+    }
+
+    if(reserve_memory(img->bitmap_size, "difference bitmap") == error) {
+        return error;
+    }
+
+    img->diff_ptr = calloc(img->bitmap_size, 1);
+
+    if(img->diff_ptr == NULL) {
+        log_error("Cannot allocate memory for difference bitmap.");
+        release_memory(img->bitmap_size);
+        return error;
+    } else {
+        log_debug("Memory for difference bitmap allocated.");
+    }
+
+    int compare = checksums_comparable(img, base);
+
+    if(!compare) {
+        log_warning("Checksums of the images cannot be compared; every block "
+                "present in both images is reported as changed.");
+    } else if(!img->reseed_checksum || !base->reseed_checksum) {
+        log_warning("Checksums are not reseeded; a change is also reported "
+                "for every block following a changed one.");
+    }
+
+    /* Blocks present in both images are compared group by group, where a
+     * group is made of the blocks covered by one checksum of the image. Two
+     * groups hold the same blocks if each block of the group is present in
+     * both images and the difference of block ranks does not change within
+     * the group; a group of the base image starts at the same block if the
+     * difference is a multiple of the group size. Groups which do not match
+     * (and the last, incomplete group) are marked as changed.
+     */
+
+    u64 i, used_blocks = 0;
+
+    for (i = 0; i < img->bitmap_elements; i++) {
+        used_blocks += popcount(img->bitmap_ptr[i]);
+    }
+
+    u32 per_checksum = img->blocks_per_checksum;
+
+    struct chunk chunk = { 0, 0, 0 };
+
+    u64 rank_before = 0, base_rank_before = 0, changed = 0;
+
+    for (i = 0; i < img->bitmap_elements; i++) {
+        u64 word = img->bitmap_ptr[i];
+        u64 base_word = base->bitmap_ptr[i];
+
+        // presence differs
+        img->diff_ptr[i] |= word ^ base_word;
+
+        u64 remaining = word;
+
+        while (remaining != 0) {
+            u8 bit = ctz(remaining);
+            remaining &= remaining - 1;
+
+            u64 below = bit ? 0xFFFFFFFFFFFFFFFF >> (64 - bit) : 0;
+            u64 rank = rank_before + popcount(word & below);
+            u64 base_rank = base_rank_before + popcount(base_word & below);
+            s64 delta = rank - base_rank;
+
+            u64 block = i * 64 + bit;
+
+            if(rank % per_checksum == 0) {
+                chunk.first_block = block;
+                chunk.delta = delta;
+                chunk.comparable = compare && delta % per_checksum == 0;
+            }
+
+            if(!((base_word >> bit) & 1) || delta != chunk.delta) {
+                chunk.comparable = 0;
+            }
+
+            int last_in_group = rank % per_checksum == per_checksum - 1;
+
+            if(!last_in_group && rank != used_blocks - 1) continue;
+
+            int equal = chunk.comparable && last_in_group;
+
+            if(equal) {
+                u32 checksum, base_checksum;
+
+                if(read_checksum(img, rank / per_checksum, &checksum) == error ||
+                   read_checksum(base, base_rank / per_checksum, &base_checksum) == error) {
+                    goto error;
+                }
+
+                equal = checksum == base_checksum;
+            }
+
+            if(!equal) {
+                mark_present(img, chunk.first_block, block);
+                changed++;
+            }
+        }
+
+        rank_before += popcount(word);
+        base_rank_before += popcount(base_word);
+    }
+
+    log_debug("Difference bitmap created (" fu64 " groups changed).", changed);
+    return ok;
+
+error:
+    free(img->diff_ptr);
+    img->diff_ptr = NULL;
+    release_memory(img->bitmap_size);
+
+    log_error("Cannot compare images.");
+    return error;
+}
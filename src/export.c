@@ -0,0 +1,219 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "export.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// each export is allocated on its own: modules keep pointers to its image
+static struct export **exports;
+static size_t count_loaded;
+static size_t count_allocated;
+
+static status add_export(char *path, int from_directory, struct options *options)
+{
+    char *slash = strrchr(path, '/');
+    char *name = slash ? slash + 1 : path;
+
+    if(*name != '\0' && find_export((u8*) name, strlen(name))) {
+        log_error("Two images named \"%s\".", name);
+        return error;
+    }
+
+    if(count_loaded == count_allocated) {
+        size_t allocated = count_allocated ? 2 * count_allocated : 16;
+        struct export **extended = realloc(exports, allocated * sizeof *exports);
+
+        if(extended == NULL) {
+            log_error("Cannot allocate memory for exports.");
+            return error;
+        }
+
+        exports = extended;
+        count_allocated = allocated;
+    }
+
+    struct export *export = malloc(sizeof *export);
+
+    if(export == NULL) {
+        log_error("Cannot allocate memory for an export.");
+        return error;
+    }
+
+    export->name = strdup(name);
+    export->path = strdup(path);
+
+    if(export->name == NULL || export->path == NULL) {
+        log_error("Cannot allocate memory for export name.");
+        free(export->name);
+        free(export->path);
+        free(export);
+        return error;
+    }
+
+    if(load_image(&export->img, export->path, options) == error) {
+        free(export->name);
+        free(export->path);
+        free(export);
+
+        // a directory may hold other files as well
+        if(from_directory) {
+            log_warning("Skipping \"%s\": not a supported image.", path);
+            return ok;
+        }
+
+        return error;
+    }
+
+    log_info("Image \"%s\" exported as \"%s\".", path, export->name);
+    exports[count_loaded++] = export;
+
+    return ok;
+}
+
+static status add_directory(char *path, struct options *options)
+{
+    struct dirent **entries;
+    int i, entries_count = scandir(path, &entries, NULL, alphasort);
+
+    if(entries_count == -1) {
+        log_error("Cannot read directory %s: %s.", path, strerror(errno));
+        return error;
+    }
+
+    status result = ok;
+
+    for (i = 0; i < entries_count; i++) {
+        char *entry_path;
+        struct stat st;
+
+        if(result == error || entries[i]->d_name[0] == '.') {
+            free(entries[i]);
+            continue;
+        }
+
+        size_t length = strlen(path) + strlen(entries[i]->d_name) + 2;
+        entry_path = malloc(length);
+
+        if(entry_path == NULL) {
+            log_error("Cannot allocate memory for a path.");
+            result = error;
+        } else {
+            snprintf(entry_path, length, "%s/%s", path, entries[i]->d_name);
+
+            // the following pieces of a split image are loaded with the first
+            if(stat(entry_path, &st) == 0 && S_ISREG(st.st_mode) && !later_segment(entry_path)) {
+                result = add_export(entry_path, 1, options);
+            }
+
+            free(entry_path);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return result;
+}
+
+status load_exports(char **paths, int count, struct options *options)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct stat st;
+
+        if(stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if(add_directory(paths[i], options) == error) goto error;
+        } else {
+            if(add_export(paths[i], 0, options) == error) goto error;
+        }
+    }
+
+    if(count_loaded == 0) {
+        log_error("No image to export.");
+        goto error;
+    }
+
+    log_debug(fsize " images loaded.", count_loaded);
+    return ok;
+
+error:
+    close_exports();
+    return error;
+}
+
+void close_exports(void)
+{
+    size_t i;
+
+    for (i = 0; i < count_loaded; i++) {
+        close_image(&exports[i]->img);
+        free(exports[i]->name);
+        free(exports[i]->path);
+        free(exports[i]);
+    }
+
+    free(exports);
+
+    exports = NULL;
+    count_loaded = count_allocated = 0;
+}
+
+struct export *find_export(const u8 *name, u32 length)
+{
+    size_t i;
+
+    if(length == 0) {
+        return count_loaded ? exports[0] : NULL;
+    }
+
+    for (i = 0; i < count_loaded; i++) {
+        if(strlen(exports[i]->name) == length &&
+           memcmp(exports[i]->name, name, length) == 0) {
+            return exports[i];
+        }
+    }
+
+    return NULL;
+}
+
+size_t exports_count(void)
+{
+    return count_loaded;
+}
+
+struct export *export_at(size_t index)
+{
+    return exports[index];
+}
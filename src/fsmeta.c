@@ -0,0 +1,508 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "pool.h"
+#include "readahead.h"
+#include "fsmeta.h"
+
+#include <endian.h>
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ranges closer than this are prefetched as one
+#define MERGE_GAP (256 * kilobyte)
+
+struct range
+{
+    u64 offset;
+    u64 length;
+};
+
+// metadata found by a plugin
+struct ranges
+{
+    struct image *img;
+    struct range *items;
+    size_t count;
+    size_t allocated;
+    // bytes which can still be added
+    u64 budget;
+};
+
+typedef status (*metadata_plugin)(struct image *img, struct ranges *r);
+
+static status find_ext_metadata(struct image *img, struct ranges *r);
+static status find_ntfs_metadata(struct image *img, struct ranges *r);
+
+// chosen by the prefix of fs_string
+static const struct
+{
+    const char *prefix;
+    metadata_plugin find;
+} plugins[] = {
+    {"EXT",  find_ext_metadata},
+    {"NTFS", find_ntfs_metadata}
+};
+
+static u64 metadata_budget;
+
+status initialize_metadata_prefetch(struct options *options)
+{
+    metadata_budget = options->metadata_prefetch;
+    return ok;
+}
+
+static inline u16 get16(const u8 *p) { u16 v; memcpy(&v, p, 2); return le16toh(v); }
+static inline u32 get32(const u8 *p) { u32 v; memcpy(&v, p, 4); return le32toh(v); }
+static inline u64 get64(const u8 *p) { u64 v; memcpy(&v, p, 8); return le64toh(v); }
+
+// error when the budget is used up (or memory is not available) - plugins
+// stop looking then
+static status add_range(struct ranges *r, u64 offset, u64 length)
+{
+    if(r->budget == 0) return error;
+    if(offset >= r->img->device_size || length == 0) return ok;
+
+    length = MIN(length, MIN(r->budget, r->img->device_size - offset));
+
+    if(r->count == r->allocated) {
+        size_t allocated = r->allocated ? 2 * r->allocated : 64;
+        struct range *extended = realloc(r->items, allocated * sizeof *r->items);
+
+        if(extended == NULL) {
+            log_error("Cannot allocate memory for metadata ranges.");
+            return error;
+        }
+
+        r->items = extended;
+        r->allocated = allocated;
+    }
+
+    r->items[r->count++] = (struct range) { .offset = offset, .length = length };
+    r->budget -= length;
+
+    return ok;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const struct range *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// ============================== EXT2/3/4 ================================== //
+
+#define EXT_MAGIC 0xEF53
+#define EXT_COMPAT_HAS_JOURNAL 0x0004
+#define EXT_INCOMPAT_64BIT 0x0080
+#define EXT_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT_BG_INODE_UNINIT 0x0001
+#define EXT_EXTENTS_FL 0x00080000
+#define EXT_EXTENT_MAGIC 0xF30A
+#define EXT_ROOT_INO 2
+
+struct ext
+{
+    u64 block_size;
+    u64 groups;
+    u32 inodes_per_group;
+    u32 inode_size;
+    u32 desc_size;
+    // unused inodes at the end of inode tables are known
+    int itable_unused;
+    // group descriptors
+    u8 *gdt;
+};
+
+static u64 inode_table(struct ext *fs, u64 group)
+{
+    u8 *desc = fs->gdt + group * fs->desc_size;
+    u64 block = get32(desc + 0x08);
+
+    if(fs->desc_size >= 64) block |= (u64) get32(desc + 0x28) << 32;
+
+    return block;
+}
+
+// blocks of a (small) inode: extents of the inode itself or direct blocks
+static status add_inode_data(struct image *img, struct ext *fs, struct ranges *r, u32 ino)
+{
+    u8 inode[256];
+    u64 group = (ino - 1) / fs->inodes_per_group;
+    u64 index = (ino - 1) % fs->inodes_per_group;
+    int i;
+
+    if(ino == 0 || group >= fs->groups) return ok;
+
+    u64 offset = inode_table(fs, group) * fs->block_size + index * fs->inode_size;
+
+    if(add_range(r, offset, fs->inode_size) == error) return error;
+    if(read_device(img, inode, offset, MIN(sizeof inode, fs->inode_size)) == error) return ok;
+
+    const u8 *i_block = inode + 40;
+
+    if(get32(inode + 32) & EXT_EXTENTS_FL) {
+        // index nodes of deeper trees are not followed
+        if(get16(i_block) != EXT_EXTENT_MAGIC || get16(i_block + 6) != 0) return ok;
+
+        for (i = 0; i < MIN(get16(i_block + 2), 4); i++) {
+            const u8 *extent = i_block + 12 + 12 * i;
+            u64 length = get16(extent + 4);
+            u64 start = (u64) get16(extent + 6) << 32 | get32(extent + 8);
+
+            // uninitialized extents are not read by anybody
+            if(length > 32768) continue;
+
+            if(add_range(r, start * fs->block_size, length * fs->block_size) == error) {
+                return error;
+            }
+        }
+    } else {
+        for (i = 0; i < 12; i++) {
+            u64 block = get32(i_block + 4 * i);
+
+            if(block && add_range(r, block * fs->block_size, fs->block_size) == error) {
+                return error;
+            }
+        }
+    }
+
+    return ok;
+}
+
+static status find_ext_metadata(struct image *img, struct ranges *r)
+{
+    u8 sb[1024];
+    struct ext fs;
+    u64 group;
+
+    if(read_device(img, sb, 1024, sizeof sb) == error) return error;
+
+    if(get16(sb + 56) != EXT_MAGIC) {
+        log_debug("No ext superblock found.");
+        return error;
+    }
+
+    u32 log_block_size = get32(sb + 24);
+    u64 first_data_block = get32(sb + 20);
+    u64 blocks_per_group = get32(sb + 32);
+    u32 compat = get32(sb + 92);
+    u32 incompat = get32(sb + 96);
+    u32 ro_compat = get32(sb + 100);
+    u64 blocks_count = get32(sb + 4);
+
+    if(incompat & EXT_INCOMPAT_64BIT) blocks_count |= (u64) get32(sb + 0x150) << 32;
+
+    fs.inodes_per_group = get32(sb + 40);
+    fs.inode_size = get32(sb + 76) >= 1 ? get16(sb + 88) : 128;
+    fs.desc_size = (incompat & EXT_INCOMPAT_64BIT) ? MAX(get16(sb + 254), 32) : 32;
+    fs.itable_unused = (ro_compat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    if(log_block_size > 6 || blocks_per_group == 0 || fs.inodes_per_group == 0 ||
+       fs.inode_size < 128 || blocks_count <= first_data_block) {
+        log_warning("Unexpected values in ext superblock.");
+        return error;
+    }
+
+    fs.block_size = 1024 << log_block_size;
+    fs.groups = divide_up(blocks_count - first_data_block, blocks_per_group);
+
+    // the group descriptor table follows the superblock
+    u64 gdt_offset = (first_data_block + 1) * fs.block_size;
+    u64 gdt_length = fs.groups * fs.desc_size;
+
+    if(gdt_offset + gdt_length > img->device_size) {
+        log_warning("Ext group descriptors beyond the device.");
+        return error;
+    }
+
+    fs.gdt = malloc(gdt_length);
+
+    if(fs.gdt == NULL) {
+        log_error("Cannot allocate memory for group descriptors.");
+        return error;
+    }
+
+    if(read_device(img, fs.gdt, gdt_offset, gdt_length) == error) goto error;
+
+    // in order of importance - the budget may end anywhere
+    if(add_range(r, 0, gdt_offset) == error) goto done;
+    if(add_range(r, gdt_offset, gdt_length) == error) goto done;
+    if(add_inode_data(img, &fs, r, EXT_ROOT_INO) == error) goto done;
+
+    // only the journal superblock is read when mounting a clean file system
+    if(compat & EXT_COMPAT_HAS_JOURNAL) {
+        struct ranges journal = { .img = img, .budget = 64 * fs.block_size };
+
+        add_inode_data(img, &fs, &journal, get32(sb + 224));
+
+        // the inode, then its first extent
+        if(journal.count > 1) {
+            if(add_range(r, journal.items[0].offset, journal.items[0].length) == error ||
+               add_range(r, journal.items[1].offset, fs.block_size) == error) {
+                free(journal.items);
+                goto done;
+            }
+        }
+
+        free(journal.items);
+    }
+
+    for (group = 0; group < fs.groups; group++) {
+        u8 *desc = fs.gdt + group * fs.desc_size;
+        u64 inodes = fs.inodes_per_group;
+
+        if(fs.itable_unused) {
+            if(get16(desc + 0x12) & EXT_BG_INODE_UNINIT) continue;
+
+            u64 unused = get16(desc + 0x1C);
+            if(fs.desc_size >= 64) unused |= (u64) get16(desc + 0x32) << 16;
+
+            inodes -= MIN(unused, inodes);
+        }
+
+        if(add_range(r, inode_table(&fs, group) * fs.block_size, inodes * fs.inode_size) == error) {
+            break;
+        }
+    }
+
+done:
+    free(fs.gdt);
+    return ok;
+
+error:
+    free(fs.gdt);
+    return error;
+}
+
+// ================================ NTFS ==================================== //
+
+#define NTFS_SECTOR 512
+#define NTFS_ATTR_DATA 0x80
+#define NTFS_ATTR_END 0xFFFFFFFF
+
+// undo the update sequence of an MFT record (last two bytes of each sector)
+static status fix_record(u8 *record, u32 size)
+{
+    u32 usa_offset = get16(record + 4);
+    u32 usa_count = get16(record + 6);
+    u32 i;
+
+    if(usa_count == 0 || usa_offset + 2 * usa_count > size ||
+       (usa_count - 1) * NTFS_SECTOR > size) {
+        return error;
+    }
+
+    for (i = 1; i < usa_count; i++) {
+        u8 *end = record + i * NTFS_SECTOR - 2;
+
+        if(memcmp(end, record + usa_offset, 2) != 0) return error;
+
+        memcpy(end, record + usa_offset + 2 * i, 2);
+    }
+
+    return ok;
+}
+
+// extents of $MFT from the run list of its unnamed $DATA attribute
+static status add_mft_runs(struct ranges *r, const u8 *record, u32 size, u64 cluster)
+{
+    u32 attribute = get16(record + 0x14);
+
+    while (attribute + 16 <= size && get32(record + attribute) != NTFS_ATTR_END) {
+        const u8 *attr = record + attribute;
+        u32 length = get32(attr + 4);
+
+        if(length < 16 || attribute + length > size) break;
+
+        if(get32(attr) == NTFS_ATTR_DATA && attr[8] != 0 && attr[9] == 0 && length > 0x40) {
+            const u8 *run = attr + get16(attr + 0x20);
+            const u8 *end = attr + length;
+            s64 lcn = 0;
+
+            while (run < end && *run != 0) {
+                int length_size = *run & 0x0F;
+                int offset_size = *run >> 4;
+                u64 clusters = 0;
+                s64 delta = 0;
+                int i;
+
+                if(length_size == 0 || length_size > 8 || offset_size > 8 ||
+                   run + 1 + length_size + offset_size > end) {
+                    break;
+                }
+
+                for (i = 0; i < length_size; i++) clusters |= (u64) run[1 + i] << (8 * i);
+
+                for (i = 0; i < offset_size; i++) {
+                    delta |= (s64) ((u64) run[1 + length_size + i] << (8 * i));
+                }
+
+                // sign extension
+                if(offset_size > 0 && offset_size < 8 && (run[length_size + offset_size] & 0x80)) {
+                    delta -= (s64) 1 << (8 * offset_size);
+                }
+
+                run += 1 + length_size + offset_size;
+
+                // sparse runs have no offset
+                if(offset_size == 0) continue;
+
+                lcn += delta;
+
+                if(lcn < 0) break;
+                if(add_range(r, (u64) lcn * cluster, clusters * cluster) == error) break;
+            }
+
+            return ok;
+        }
+
+        attribute += length;
+    }
+
+    return error;
+}
+
+static status find_ntfs_metadata(struct image *img, struct ranges *r)
+{
+    u8 boot[NTFS_SECTOR];
+
+    if(read_device(img, boot, 0, sizeof boot) == error) return error;
+
+    if(memcmp(boot + 3, "NTFS    ", 8) != 0) {
+        log_debug("No NTFS boot sector found.");
+        return error;
+    }
+
+    u64 sector = get16(boot + 0x0B);
+    u64 cluster = sector * boot[0x0D];
+    u64 mft = get64(boot + 0x30);
+    s8 clusters_per_record = (s8) boot[0x40];
+
+    u64 record_size = clusters_per_record > 0 ?
+        clusters_per_record * cluster : (u64) 1 << -clusters_per_record;
+
+    if(sector < 256 || sector > 4096 || cluster == 0 || cluster > 2 * megabyte ||
+       record_size < 1024 || record_size > 64 * kilobyte ||
+       mft > img->device_size / cluster) {
+        log_warning("Unexpected values in NTFS boot sector.");
+        return error;
+    }
+
+    u8 *record = malloc(record_size);
+
+    if(record == NULL) {
+        log_error("Cannot allocate memory for an MFT record.");
+        return error;
+    }
+
+    if(read_device(img, record, mft * cluster, record_size) == error ||
+       memcmp(record, "FILE", 4) != 0 || fix_record(record, record_size) == error) {
+        log_warning("Cannot read $MFT record.");
+        free(record);
+        return error;
+    }
+
+    add_range(r, 0, sector);
+
+    if(add_mft_runs(r, record, record_size, cluster) == error) {
+        // at least the system files at the beginning of $MFT
+        add_range(r, mft * cluster, 16 * record_size);
+    }
+
+    free(record);
+    return ok;
+}
+
+// ============================== PREFETCH ================================== //
+
+static void metadata_task(void *owner, u64 offset, u64 length)
+{
+    struct image *img = owner;
+    struct ranges r = { .img = img, .budget = metadata_budget };
+    size_t i, j, k;
+    u64 total = 0;
+
+    (void) offset;
+    (void) length;
+
+    for (i = 0; i < sizeof plugins / sizeof *plugins; i++) {
+        if(strncasecmp(img->fs_string, plugins[i].prefix, strlen(plugins[i].prefix)) == 0) {
+            break;
+        }
+    }
+
+    if(i == sizeof plugins / sizeof *plugins) {
+        log_debug("No metadata prefetch for file system \"%s\".", img->fs_string);
+        return;
+    }
+
+    if(plugins[i].find(img, &r) == error || r.count == 0) {
+        log_debug("No metadata found in image \"%s\".", img->path);
+        free(r.items);
+        return;
+    }
+
+    // sort and merge close ranges
+    qsort(r.items, r.count, sizeof *r.items, compare_ranges);
+
+    for (j = 1, k = 0; j < r.count; j++) {
+        struct range *last = &r.items[k];
+        struct range *next = &r.items[j];
+
+        if(next->offset <= last->offset + last->length + MERGE_GAP) {
+            u64 end = MAX(last->offset + last->length, next->offset + next->length);
+            last->length = end - last->offset;
+        } else {
+            r.items[++k] = *next;
+        }
+    }
+
+    for (j = 0; j <= k; j++) {
+        fetch_range(img, r.items[j].offset, r.items[j].length);
+        total += r.items[j].length;
+    }
+
+    log_info("Metadata of %s prefetched: " fu64 " KiB in " fsize " ranges.",
+            img->fs_string, total / kilobyte, k + 1);
+
+    free(r.items);
+}
+
+void prefetch_metadata(struct image *img)
+{
+    if(metadata_budget == 0) return;
+
+    if(__atomic_exchange_n(&img->metadata_prefetched, 1, __ATOMIC_RELAXED)) return;
+
+    if(submit_task(metadata_task, img, 0, 0) == error) {
+        log_debug("Metadata prefetch not started: the worker queue is full.");
+    }
+}
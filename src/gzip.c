@@ -0,0 +1,537 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "io.h"
+#include "segments.h"
+#include "compressed.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// The whole file is inflated once to build an index of access points: every
+// --index-span MiB of uncompressed data, at a deflate block boundary, the
+// position in both streams and the last 32 KiB of data (the dictionary) are
+// recorded. The data between two points is a unit of the compressed image,
+// inflated starting from the point before it.
+//
+// The index is saved next to the image (IMAGE.gzidx) and used again while
+// the size and modification time of the image match.
+
+#define GZIP_MAGIC "PCNBDGZ1"
+// size of the deflate dictionary
+#define WINDOW_SIZE 32768
+// compressed data is read in pieces of this size
+#define INPUT_SIZE (256 * kilobyte)
+#define MIN_SPAN (256 * kilobyte)
+
+// file format of the index; all fields are little-endian. The header is
+// followed by the dictionaries of the points (WINDOW_SIZE bytes each) and
+// then by the points.
+struct index_header
+{
+    char magic[8];
+    // of the image file the index was built from
+    u64 compressed_size;
+    s64 compressed_mtime;
+    // of the uncompressed data
+    u64 size;
+    u64 points;
+};
+
+struct index_point
+{
+    // offset of the uncompressed data
+    u64 out;
+    // offset of the first compressed byte which belongs to the point whole
+    u64 in;
+    // number of bits (0-7) of the byte before which belong to the point
+    u32 bits;
+    u32 padding;
+};
+
+struct gzip
+{
+    // the index file, for the dictionaries
+    int index_fd;
+    // of the uncompressed data
+    u64 size;
+
+    struct index_point *points;
+    u64 points_count;
+};
+
+/* ---------------------------- HELPERS --------------------------------- */
+
+static inline u64 window_offset(u64 point)
+{
+    return sizeof(struct index_header) + point * WINDOW_SIZE;
+}
+
+/* ------------------------------ INDEX --------------------------------- */
+
+static status load_index(struct compressed *c, struct gzip *gz, const char *path)
+{
+    struct index_header header;
+    u64 i;
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1) return error;
+
+    if(read_full(fd, &header, sizeof header, 0) != sizeof header ||
+       memcmp(header.magic, GZIP_MAGIC, sizeof header.magic) != 0 ||
+       le64toh(header.compressed_size) != c->source_size ||
+       (s64) le64toh(header.compressed_mtime) != (s64) c->segments->mtime ||
+       le64toh(header.points) == 0) {
+        log_info("Index %s is stale; it is built again.", path);
+        close(fd);
+        return error;
+    }
+
+    u64 count = le64toh(header.points);
+    size_t length = count * sizeof *gz->points;
+
+    gz->points = malloc(length);
+
+    if(gz->points == NULL ||
+       read_full(fd, gz->points, length, window_offset(count)) != (ssize_t) length) {
+        log_warning("Cannot read index %s; it is built again.", path);
+        free(gz->points);
+        gz->points = NULL;
+        close(fd);
+        return error;
+    }
+
+    for (i = 0; i < count; i++) {
+        gz->points[i].out = le64toh(gz->points[i].out);
+        gz->points[i].in = le64toh(gz->points[i].in);
+        gz->points[i].bits = le32toh(gz->points[i].bits);
+    }
+
+    gz->index_fd = fd;
+    gz->size = le64toh(header.size);
+    gz->points_count = count;
+
+    log_info("Index of the compressed image loaded (" fu64 " access points).", count);
+    return ok;
+}
+
+// a new point at a block boundary; the dictionary is the last WINDOW_SIZE
+// bytes inflated, which wrap around in the window
+static status add_point(struct gzip *gz, u64 *allocated, z_stream *strm,
+        u64 in, u64 out, const u8 *window, u8 *dictionary)
+{
+    if(gz->points_count == *allocated) {
+        u64 extended_count = *allocated ? 2 * *allocated : 1024;
+        struct index_point *extended = realloc(gz->points, extended_count * sizeof *extended);
+
+        if(extended == NULL) {
+            log_error("Cannot allocate memory for the index of a compressed image.");
+            return error;
+        }
+
+        gz->points = extended;
+        *allocated = extended_count;
+    }
+
+    u64 left = strm->avail_out;
+
+    memcpy(dictionary, window + WINDOW_SIZE - left, left);
+    memcpy(dictionary + left, window, WINDOW_SIZE - left);
+
+    if(write_full(gz->index_fd, dictionary, WINDOW_SIZE, window_offset(gz->points_count)) == error) {
+        log_error("Cannot write the index of a compressed image: %s.", strerror(errno));
+        return error;
+    }
+
+    struct index_point *point = &gz->points[gz->points_count++];
+
+    point->out = out;
+    point->in = in;
+    point->bits = strm->data_type & 7;
+    point->padding = 0;
+
+    return ok;
+}
+
+// inflate the whole image once, adding a point every span bytes
+static status scan_image(struct compressed *c, struct gzip *gz, u64 span)
+{
+    z_stream strm;
+    status result = error;
+
+    memset(&strm, 0, sizeof strm);
+
+    // 47: a zlib or gzip stream
+    if(inflateInit2(&strm, 47) != Z_OK) {
+        log_error("Cannot initialize zlib.");
+        return error;
+    }
+
+    u8 *input = malloc(INPUT_SIZE);
+    u8 *window = calloc(WINDOW_SIZE, 1);
+    u8 *dictionary = malloc(WINDOW_SIZE);
+
+    if(input == NULL || window == NULL || dictionary == NULL) {
+        log_error("Cannot allocate memory for indexing a compressed image.");
+        goto end;
+    }
+
+    u64 allocated = 0, read_offset = 0, out = 0, last = 0;
+
+    for (;;) {
+        if(strm.avail_in == 0) {
+            ssize_t length = read_source(c, input, INPUT_SIZE, read_offset);
+
+            if(length <= 0) {
+                log_error("Cannot read the compressed image: %s.",
+                        length == 0 ? "unexpected end of file" : strerror(errno));
+                goto end;
+            }
+
+            strm.next_in = input;
+            strm.avail_in = length;
+            read_offset += length;
+        }
+
+        if(strm.avail_out == 0) {
+            strm.next_out = window;
+            strm.avail_out = WINDOW_SIZE;
+        }
+
+        u64 before = strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+
+        out += before - strm.avail_out;
+
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            log_error("Cannot decompress the image: %s.", strm.msg ? strm.msg : "corrupted data");
+            goto end;
+        }
+
+        if(ret == Z_STREAM_END) {
+            // gzip members may be concatenated
+            if(strm.avail_in < 2) {
+                memmove(input, strm.next_in, strm.avail_in);
+
+                ssize_t length = read_source(c, input + strm.avail_in,
+                        INPUT_SIZE - strm.avail_in, read_offset);
+
+                if(length == -1) {
+                    log_error("Cannot read the compressed image: %s.", strerror(errno));
+                    goto end;
+                }
+
+                strm.next_in = input;
+                strm.avail_in += length;
+                read_offset += length;
+            }
+
+            if(strm.avail_in >= 2 && strm.next_in[0] == 0x1f && strm.next_in[1] == 0x8b) {
+                inflateReset(&strm);
+                continue;
+            }
+
+            if(strm.avail_in > 0) log_warning("Data after the end of the compressed image ignored.");
+            break;
+        }
+
+        // at the end of a block which is not the last one
+        if((strm.data_type & 128) && !(strm.data_type & 64) &&
+           (gz->points_count == 0 || out - last >= span)) {
+
+            if(add_point(gz, &allocated, &strm, read_offset - strm.avail_in, out,
+                        window, dictionary) == error) {
+                goto end;
+            }
+
+            last = out;
+        }
+    }
+
+    gz->size = out;
+    result = gz->points_count ? ok : error;
+
+    if(result == error) log_error("No data in the compressed image.");
+
+end:
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    free(dictionary);
+
+    return result;
+}
+
+static status build_index(struct compressed *c, struct gzip *gz, const char *path, u64 span)
+{
+    char tmp_path[PATH_MAX + 16];
+    u64 i;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", path, (long) getpid());
+
+    int persistent = 1;
+    gz->index_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    // the dictionaries are kept in a temporary file then
+    if(gz->index_fd == -1) {
+        char temporary[] = "/var/tmp/partclone-nbd-XXXXXX";
+
+        log_warning("Cannot create %s (%s); the index is not saved.", tmp_path, strerror(errno));
+
+        persistent = 0;
+        gz->index_fd = mkstemp(temporary);
+
+        if(gz->index_fd == -1) {
+            log_error("Cannot create a temporary file: %s.", strerror(errno));
+            return error;
+        }
+
+        unlink(temporary);
+    }
+
+    log_info("Indexing the compressed image (it is read once as a whole) ...");
+
+    if(scan_image(c, gz, span) == error) goto error;
+
+    u64 count = gz->points_count;
+    struct index_point *points = malloc(count * sizeof *points);
+
+    if(points == NULL) {
+        log_error("Cannot allocate memory for the index of a compressed image.");
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        points[i].out = htole64(gz->points[i].out);
+        points[i].in = htole64(gz->points[i].in);
+        points[i].bits = htole32(gz->points[i].bits);
+        points[i].padding = 0;
+    }
+
+    struct index_header header;
+
+    memcpy(header.magic, GZIP_MAGIC, sizeof header.magic);
+    header.compressed_size = htole64(c->source_size);
+    header.compressed_mtime = htole64(c->segments->mtime);
+    header.size = htole64(gz->size);
+    header.points = htole64(count);
+
+    // the header last: a partial index is never valid
+    status result = write_full(gz->index_fd, points, count * sizeof *points, window_offset(count));
+    free(points);
+
+    if(result == error ||
+       write_full(gz->index_fd, &header, sizeof header, 0) == error) {
+        log_error("Cannot write the index of a compressed image: %s.", strerror(errno));
+        goto error;
+    }
+
+    if(persistent && (fdatasync(gz->index_fd) == -1 || rename(tmp_path, path) == -1)) {
+        log_warning("Cannot save %s: %s.", path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    log_info("Compressed image indexed: " fu64 " MiB in " fu64 " access points.",
+            gz->size / megabyte, count);
+    return ok;
+
+error:
+    if(persistent) unlink(tmp_path);
+
+    close(gz->index_fd);
+    gz->index_fd = -1;
+    free(gz->points);
+    gz->points = NULL;
+    gz->points_count = 0;
+
+    return error;
+}
+
+/* ---------------------------- INFLATING ------------------------------- */
+
+static status refill(struct compressed *c, z_stream *strm, u8 *input, u64 *offset)
+{
+    ssize_t length = read_source(c, input, INPUT_SIZE, *offset);
+
+    if(length <= 0) {
+        log_error("Cannot read the compressed image: %s.",
+                length == 0 ? "unexpected end of file" : strerror(errno));
+        return error;
+    }
+
+    strm->next_in = input;
+    strm->avail_in = length;
+    *offset += length;
+
+    return ok;
+}
+
+// inflate the data between the point and the next one
+static status inflate_span(struct compressed *c, u64 index, u8 *data)
+{
+    struct gzip *gz = c->format;
+    struct index_point *point = &gz->points[index];
+    z_stream strm;
+    status result = error;
+
+    memset(&strm, 0, sizeof strm);
+
+    // -15: raw deflate data
+    if(inflateInit2(&strm, -15) != Z_OK) {
+        log_error("Cannot initialize zlib.");
+        return error;
+    }
+
+    u8 *input = malloc(INPUT_SIZE);
+    u8 *dictionary = malloc(WINDOW_SIZE);
+    u64 offset = point->in;
+
+    if(input == NULL || dictionary == NULL) {
+        log_error("Cannot allocate memory for decompressing the image.");
+        goto end;
+    }
+
+    if(read_full(gz->index_fd, dictionary, WINDOW_SIZE, window_offset(index)) != WINDOW_SIZE) {
+        log_error("Cannot read the index of the compressed image.");
+        goto end;
+    }
+
+    if(point->bits) {
+        u8 byte;
+
+        if(read_source(c, &byte, 1, point->in - 1) != 1) {
+            log_error("Cannot read the compressed image.");
+            goto end;
+        }
+
+        inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+
+    inflateSetDictionary(&strm, dictionary, WINDOW_SIZE);
+
+    strm.next_out = data;
+    strm.avail_out = c->starts[index + 1] - c->starts[index];
+
+    int raw = 1;
+
+    while (strm.avail_out > 0) {
+        if(strm.avail_in == 0 && refill(c, &strm, input, &offset) == error) goto end;
+
+        int ret = inflate(&strm, Z_NO_FLUSH);
+
+        if(ret == Z_STREAM_END) {
+            // the next gzip member; the trailer (CRC32 and size) of a raw
+            // stream is skipped here
+            u64 trailer = raw ? 8 : 0;
+
+            while (trailer > 0) {
+                if(strm.avail_in == 0 && refill(c, &strm, input, &offset) == error) goto end;
+
+                u64 skip = MIN(trailer, strm.avail_in);
+
+                strm.next_in += skip;
+                strm.avail_in -= skip;
+                trailer -= skip;
+            }
+
+            // 31: a gzip stream
+            inflateReset2(&strm, 31);
+            raw = 0;
+        } else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+            log_error("Cannot decompress the image: %s.", strm.msg ? strm.msg : "corrupted data");
+            goto end;
+        }
+    }
+
+    result = ok;
+
+end:
+    inflateEnd(&strm);
+    free(input);
+    free(dictionary);
+
+    return result;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+static void close_gzip(struct compressed *c)
+{
+    struct gzip *gz = c->format;
+
+    close(gz->index_fd);
+    free(gz->points);
+    free(gz);
+}
+
+status open_gzip(struct compressed *c, const char *path, struct options *options)
+{
+    char index_path[PATH_MAX];
+    u64 i;
+
+    struct gzip *gz = calloc(1, sizeof *gz);
+
+    if(gz == NULL) {
+        log_error("Cannot allocate memory for a compressed image.");
+        return error;
+    }
+
+    gz->index_fd = -1;
+
+    snprintf(index_path, sizeof index_path, "%s.gzidx", path);
+
+    if(load_index(c, gz, index_path) == error &&
+       build_index(c, gz, index_path, MAX(options->index_span, MIN_SPAN)) == error) {
+        free(gz);
+        return error;
+    }
+
+    // a span starts at every point
+    c->starts = malloc((gz->points_count + 1) * sizeof *c->starts);
+
+    if(c->starts == NULL) {
+        log_error("Cannot allocate memory for the index of a compressed image.");
+        c->format = gz;
+        close_gzip(c);
+        return error;
+    }
+
+    for (i = 0; i < gz->points_count; i++) c->starts[i] = gz->points[i].out;
+
+    c->starts[gz->points_count] = gz->size;
+    c->units = gz->points_count;
+    c->decode = inflate_span;
+    c->close = close_gzip;
+    c->format = gz;
+
+    return ok;
+}
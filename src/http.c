@@ -0,0 +1,517 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "compressed.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Images read over HTTP (http://HOST[:PORT]/PATH) with Range requests. The
+// remote file is read in extents, the units of the image (see compressed.h):
+// reads of one extent are served by one request, the extents of a longer
+// read are fetched in parallel by the workers, and fetched extents are kept
+// in the --window-cache of the image. Requests go over a pool of keep-alive
+// connections; a connection which fails is opened again once.
+
+#define EXTENT_SIZE (1 * megabyte)
+#define MAX_CONNECTIONS 8
+// of the response header
+#define HEADER_SIZE 8192
+// seconds without progress of a request before it fails
+#define TIMEOUT 30
+
+struct connection
+{
+    int sock;
+    // the start of the body read with the header
+    u8 header[HEADER_SIZE];
+    struct connection *next;
+};
+
+struct http
+{
+    char *host;
+    char *port;
+    char *path;
+
+    // idle connections; more are opened while all are in use, up to
+    // MAX_CONNECTIONS
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    struct connection *idle;
+    u32 opened;
+};
+
+int is_http_url(const char *path)
+{
+    return strncmp(path, "http://", 7) == 0;
+}
+
+/* ---------------------------- CONNECTIONS ----------------------------- */
+
+static int connect_server(struct http *http)
+{
+    struct addrinfo hints, *addresses, *address;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int result = getaddrinfo(http->host, http->port, &hints, &addresses);
+
+    if(result != 0) {
+        log_error("Cannot resolve %s: %s.", http->host, gai_strerror(result));
+        return -1;
+    }
+
+    for (address = addresses; address; address = address->ai_next) {
+        sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+        if(sock == -1) continue;
+        if(connect(sock, address->ai_addr, address->ai_addrlen) == 0) break;
+
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if(sock == -1) {
+        log_error("Cannot connect to %s:%s: %s.", http->host, http->port, strerror(errno));
+        return -1;
+    }
+
+    struct timeval timeout = {TIMEOUT, 0};
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    return sock;
+}
+
+// an idle connection, or a new one (sock is -1 until connected)
+static struct connection *acquire_connection(struct http *http)
+{
+    struct connection *connection = NULL;
+
+    pthread_mutex_lock(&http->lock);
+
+    while (http->idle == NULL && http->opened == MAX_CONNECTIONS) {
+        pthread_cond_wait(&http->released, &http->lock);
+    }
+
+    if(http->idle) {
+        connection = http->idle;
+        http->idle = connection->next;
+    } else {
+        connection = malloc(sizeof *connection);
+
+        if(connection) {
+            connection->sock = -1;
+            http->opened++;
+        }
+    }
+
+    pthread_mutex_unlock(&http->lock);
+
+    if(connection == NULL) log_error("Cannot allocate memory for a connection.");
+    return connection;
+}
+
+static void release_connection(struct http *http, struct connection *connection)
+{
+    pthread_mutex_lock(&http->lock);
+    connection->next = http->idle;
+    http->idle = connection;
+    pthread_cond_signal(&http->released);
+    pthread_mutex_unlock(&http->lock);
+}
+
+static void drop_socket(struct connection *connection)
+{
+    if(connection->sock != -1) close(connection->sock);
+    connection->sock = -1;
+}
+
+/* ----------------------------- REQUESTS ------------------------------- */
+
+static status send_all(int sock, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t once = send(sock, data, length, MSG_NOSIGNAL);
+
+        if(once == -1) {
+            if(errno == EINTR) continue;
+            return error;
+        }
+
+        data += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+static status receive_all(int sock, u8 *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t once = recv(sock, data, length, 0);
+
+        if(once <= 0) {
+            if(once == -1 && errno == EINTR) continue;
+            if(once == 0) errno = ECONNRESET;
+            return error;
+        }
+
+        data += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+// the value of a header field, or NULL
+static const char *find_field(const char *header, const char *name)
+{
+    size_t length = strlen(name);
+    const char *line = strstr(header, "\r\n");
+
+    while (line && line[2] != '\r') {
+        line += 2;
+
+        if(strncasecmp(line, name, length) == 0 && line[length] == ':') {
+            line += length + 1;
+            while (*line == ' ' || *line == '\t') line++;
+            return line;
+        }
+
+        line = strstr(line, "\r\n");
+    }
+
+    return NULL;
+}
+
+/* Sends a request for the range (offset..offset+length) and reads the
+ * body to data. *total is set to the size of the file from Content-Range,
+ * *received to the length of the body; it may be shorter than the range.
+ * A failure to send the request or to read its header is ECONNRESET, and
+ * can be retried on a new connection.
+ */
+static status request_range(struct http *http, struct connection *connection,
+        u8 *data, u64 offset, u64 length, u64 *total, u64 *received_length)
+{
+    char request[PATH_MAX + 512];
+    char *header = (char*) connection->header;
+    size_t received = 0;
+    char *end = NULL;
+
+    // IPv6 literals are bracketed, as in the URL
+    int literal = strchr(http->host, ':') != NULL;
+
+    int request_length = snprintf(request, sizeof request,
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s%s%s:%s\r\n"
+            "Range: bytes=" fu64 "-" fu64 "\r\n"
+            "User-Agent: partclone-nbd\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n", http->path, literal ? "[" : "", http->host, literal ? "]" : "",
+            http->port, offset, offset + length - 1);
+
+    if(send_all(connection->sock, request, request_length) == error) {
+        errno = ECONNRESET;
+        return error;
+    }
+
+    // the header, and possibly the start of the body
+    while (end == NULL) {
+        if(received == HEADER_SIZE - 1) {
+            log_error("The response of %s has too long header.", http->host);
+            errno = EPROTO;
+            return error;
+        }
+
+        ssize_t once = recv(connection->sock, header + received, HEADER_SIZE - 1 - received, 0);
+
+        if(once <= 0) {
+            if(once == -1 && errno == EINTR) continue;
+            if(once == 0 || received == 0) errno = ECONNRESET;
+            return error;
+        }
+
+        received += once;
+        header[received] = '\0';
+        end = strstr(header, "\r\n\r\n");
+    }
+
+    int code = 0;
+    const char *field;
+    u64 first, last, content_length = 0;
+
+    sscanf(header, "HTTP/1.%*d %d", &code);
+
+    if(code != 206) {
+        log_error("%s answered a range request with %d%s.", http->host, code,
+                code == 200 ? " (range requests are not supported)" : "");
+        errno = EPROTO;
+        return error;
+    }
+
+    field = find_field(header, "Content-Range");
+
+    if(field == NULL || sscanf(field, "bytes %" SCNu64 "-%" SCNu64 "/%" SCNu64, &first, &last, total) != 3 ||
+       first != offset || last < first || last - first + 1 > length) {
+        log_error("%s sent an unexpected range.", http->host);
+        errno = EPROTO;
+        return error;
+    }
+
+    field = find_field(header, "Content-Length");
+
+    if(field == NULL || sscanf(field, "%" SCNu64, &content_length) != 1 ||
+       content_length != last - first + 1) {
+        log_error("%s sent a response without a valid length.", http->host);
+        errno = EPROTO;
+        return error;
+    }
+
+    // the start of the body came with the header
+    size_t body = received - (end + 4 - header);
+    size_t copied = MIN(body, content_length);
+
+    memcpy(data, end + 4, copied);
+
+    if(receive_all(connection->sock, data + copied, content_length - copied) == error) {
+        return error;
+    }
+
+    field = find_field(header, "Connection");
+
+    if(body > content_length || (field && strncasecmp(field, "close", 5) == 0)) {
+        drop_socket(connection);
+    }
+
+    *received_length = content_length;
+    return ok;
+}
+
+// a range over a pooled connection, retried once on a new one
+static status fetch_part(struct http *http, u8 *data, u64 offset, u64 length, u64 *total,
+        u64 *received)
+{
+    struct connection *connection = acquire_connection(http);
+    status result = error;
+    int attempt;
+
+    if(connection == NULL) return error;
+
+    for (attempt = 0; attempt < 2 && result == error; attempt++) {
+        int reused = connection->sock != -1;
+
+        if(!reused && (connection->sock = connect_server(http)) == -1) break;
+
+        result = request_range(http, connection, data, offset, length, total, received);
+
+        if(result == error) {
+            int failure = errno;
+
+            drop_socket(connection);
+
+            // a keep-alive connection closed by the server meanwhile
+            if(reused && failure == ECONNRESET) continue;
+
+            if(failure != EPROTO) {
+                log_error("Cannot read from %s: %s.", http->host, strerror(failure));
+            }
+
+            break;
+        }
+    }
+
+    release_connection(http, connection);
+    return result;
+}
+
+// a range; servers may answer with a part of it, the rest is requested
+// again. Only the range past the end of the file is read as zeroes.
+static status fetch_range(struct http *http, u8 *data, u64 offset, u64 length, u64 *total)
+{
+    u64 done = 0;
+
+    while (done < length) {
+        u64 received;
+
+        if(fetch_part(http, data + done, offset + done, length - done, total, &received) == error) {
+            return error;
+        }
+
+        done += received;
+
+        if(done < length && offset + done >= *total) {
+            memset(data + done, 0, length - done);
+            break;
+        }
+    }
+
+    return ok;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+static status fetch_extent(struct compressed *c, u64 unit, u8 *data)
+{
+    u64 total;
+
+    return fetch_range(c->format, data, c->starts[unit], c->starts[unit + 1] - c->starts[unit], &total);
+}
+
+static void close_http(struct compressed *c)
+{
+    struct http *http = c->format;
+
+    while (http->idle) {
+        struct connection *connection = http->idle;
+
+        http->idle = connection->next;
+        drop_socket(connection);
+        free(connection);
+    }
+
+    pthread_cond_destroy(&http->released);
+    pthread_mutex_destroy(&http->lock);
+    free(http->host);
+    free(http);
+}
+
+// http://HOST[:PORT][/PATH]; [IPv6] hosts are accepted
+static status parse_url(struct http *http, const char *url)
+{
+    const char *host = url + 7;
+    const char *path = strchr(host, '/');
+    const char *host_end = path ? path : host + strlen(host);
+    const char *port = NULL;
+
+    if(*host == '[') {
+        const char *bracket = memchr(host, ']', host_end - host);
+
+        if(bracket == NULL) return error;
+        if(bracket + 1 < host_end && bracket[1] == ':') port = bracket + 2;
+
+        host++;
+        host_end = bracket;
+    } else {
+        port = memchr(host, ':', host_end - host);
+
+        if(port) host_end = port++;
+    }
+
+    if(host_end == host) return error;
+
+    size_t host_length = host_end - host;
+    size_t port_length = port ? (size_t) ((path ? path : port + strlen(port)) - port) : 2;
+    size_t path_length = path ? strlen(path) : 1;
+
+    // one allocation: host, port and path
+    http->host = malloc(host_length + port_length + path_length + 3);
+
+    if(http->host == NULL) return error;
+
+    http->port = http->host + host_length + 1;
+    http->path = http->port + port_length + 1;
+
+    memcpy(http->host, host, host_length);
+    http->host[host_length] = '\0';
+
+    memcpy(http->port, port && port_length ? port : "80", port && port_length ? port_length : 2);
+    http->port[port && port_length ? port_length : 2] = '\0';
+
+    memcpy(http->path, path ? path : "/", path_length);
+    http->path[path_length] = '\0';
+
+    return ok;
+}
+
+status open_http(struct compressed *c, const char *url, struct options *options)
+{
+    u64 i, size;
+    u8 byte;
+
+    (void) options;
+
+    struct http *http = calloc(1, sizeof *http);
+
+    if(http == NULL) {
+        log_error("Cannot allocate memory for an HTTP image.");
+        return error;
+    }
+
+    if(parse_url(http, url) == error) {
+        log_error("Cannot parse the URL %s.", url);
+        free(http->host);
+        free(http);
+        return error;
+    }
+
+    pthread_mutex_init(&http->lock, NULL);
+    pthread_cond_init(&http->released, NULL);
+
+    c->format = http;
+    c->close = close_http;
+
+    // the size of the file comes with any range
+    if(fetch_range(http, &byte, 0, 1, &size) == error) return error;
+
+    u64 extents = divide_up(size, EXTENT_SIZE);
+
+    c->starts = malloc((extents + 1) * sizeof *c->starts);
+
+    if(c->starts == NULL) {
+        log_error("Cannot allocate memory for an HTTP image.");
+        return error;
+    }
+
+    for (i = 0; i < extents; i++) c->starts[i] = i * EXTENT_SIZE;
+
+    c->starts[extents] = size;
+    c->units = extents;
+    c->source_size = size;
+    c->decode = fetch_extent;
+
+    log_info("Image is read from %s:%s (" fu64 " MiB).", http->host, http->port, size / megabyte);
+    return ok;
+}
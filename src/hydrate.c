@@ -0,0 +1,491 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "io.h"
+#include "image.h"
+#include "shared.h"
+#include "signals.h"
+#include "hydrate.h"
+
+#include <pthread.h>
+#include <endian.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HYDRATE_MAGIC "PCNBDHY1"
+// data is copied in units of about this size
+#define HYDRATE_UNIT (1 * megabyte)
+// units read by clients and waiting to be copied first
+#define URGENT_UNITS 64
+// the bitmap is saved after this many units
+#define SAVE_INTERVAL 256
+// microseconds
+#define MIN_DELAY 1000
+#define MAX_DELAY 200000
+#define MAX_WAIT 50000
+
+// file format of the bitmap; all fields are little-endian
+struct map_header
+{
+    char magic[8];
+    // CRC32 of the identity of the image
+    u32 identity;
+    u32 unit_size;
+    u64 units;
+};
+
+struct hydration
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+
+    // local copy
+    int fd;
+    char data_path[PATH_MAX];
+    char map_path[PATH_MAX];
+    u32 identity;
+
+    // size of the compacted data
+    u64 size;
+    // a multiple of the block size
+    u64 unit_size;
+    u64 units;
+    // copied units
+    u64 *copied;
+    u64 copied_count;
+
+    u64 urgent[URGENT_UNITS];
+    int urgent_count;
+
+    // reads from the image file in progress
+    int foreground;
+    // average and the lowest average latency of these reads (microseconds)
+    u64 latency;
+    u64 baseline;
+};
+
+static pthread_mutex_t hydrations_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *hydrate_dir;
+
+status initialize_hydration(struct options *options)
+{
+    hydrate_dir = options->hydrate_dir;
+
+    if(hydrate_dir != NULL) log_debug("Images hydrated to \"%s\".", hydrate_dir);
+
+    return ok;
+}
+
+static u64 now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000 + (u64) ts.tv_nsec / 1000;
+}
+
+static inline int is_copied(struct hydration *h, u64 unit)
+{
+    return (__atomic_load_n(&h->copied[unit / 64], __ATOMIC_ACQUIRE) >> (unit % 64)) & 1;
+}
+
+// ============================== BITMAP ==================================== //
+
+static status load_map(struct hydration *h)
+{
+    struct map_header header;
+    u64 i;
+
+    FILE *file = fopen(h->map_path, "rb");
+
+    if(file == NULL) return error;
+
+    if(fread(&header, sizeof header, 1, file) != 1 ||
+       memcmp(header.magic, HYDRATE_MAGIC, sizeof header.magic) != 0 ||
+       le32toh(header.identity) != h->identity ||
+       le32toh(header.unit_size) != h->unit_size ||
+       le64toh(header.units) != h->units ||
+       fread(h->copied, sizeof *h->copied, divide_up(h->units, 64), file) != divide_up(h->units, 64)) {
+        log_warning("Hydration map %s is not valid; starting over.", h->map_path);
+        fclose(file);
+        return error;
+    }
+
+    fclose(file);
+
+    for (i = 0; i < divide_up(h->units, 64); i++) {
+        h->copied[i] = le64toh(h->copied[i]);
+        h->copied_count += popcount(h->copied[i]);
+    }
+
+    return ok;
+}
+
+// the copied data is synced first, so the map never claims more than the copy
+static void save_map(struct hydration *h)
+{
+    char tmp_path[PATH_MAX + 16];
+    struct map_header header;
+    u64 i;
+
+    if(fdatasync(h->fd) == -1) {
+        log_warning("Cannot sync %s: %s.", h->data_path, strerror(errno));
+        return;
+    }
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", h->map_path, (long) getpid());
+
+    FILE *file = fopen(tmp_path, "wb");
+
+    if(file == NULL) {
+        log_warning("Cannot create %s: %s.", tmp_path, strerror(errno));
+        return;
+    }
+
+    memcpy(header.magic, HYDRATE_MAGIC, sizeof header.magic);
+    header.identity = htole32(h->identity);
+    header.unit_size = htole32(h->unit_size);
+    header.units = htole64(h->units);
+
+    int failed = fwrite(&header, sizeof header, 1, file) != 1;
+
+    for (i = 0; i < divide_up(h->units, 64) && !failed; i++) {
+        u64 word = htole64(__atomic_load_n(&h->copied[i], __ATOMIC_ACQUIRE));
+        failed = fwrite(&word, sizeof word, 1, file) != 1;
+    }
+
+    if(fclose(file) != 0) failed = 1;
+
+    if(failed || rename(tmp_path, h->map_path) == -1) {
+        log_warning("Cannot save %s: %s.", h->map_path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+// ============================== COPIER ==================================== //
+
+// wait; 1 if the hydration is being stopped
+static int pause_copier(struct hydration *h, u64 microseconds)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += microseconds / 1000000;
+    until.tv_nsec += (microseconds % 1000000) * 1000;
+
+    if(until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&h->lock);
+
+    if(!h->stopping) pthread_cond_timedwait(&h->wake, &h->lock, &until);
+    int stopping = h->stopping;
+
+    pthread_mutex_unlock(&h->lock);
+
+    return stopping;
+}
+
+// units read by clients first, then the first one not copied yet
+static int next_unit(struct hydration *h, u64 *cursor, u64 *unit)
+{
+    pthread_mutex_lock(&h->lock);
+
+    while (h->urgent_count > 0) {
+        *unit = h->urgent[--h->urgent_count];
+
+        if(!is_copied(h, *unit)) {
+            pthread_mutex_unlock(&h->lock);
+            return 1;
+        }
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    while (*cursor < h->units && is_copied(h, *cursor)) (*cursor)++;
+
+    *unit = *cursor;
+    return *cursor < h->units;
+}
+
+static status copy_unit(struct image *img, struct hydration *h, u64 unit, u8 *buffer)
+{
+    u64 offset = unit * h->unit_size;
+    u64 length = MIN(h->unit_size, h->size - offset);
+
+    if(read_ranks(img, buffer, offset / img->block_size, length / img->block_size) == error) {
+        return error;
+    }
+
+    if(write_full(h->fd, buffer, length, offset) == error) {
+        log_error("Cannot write %s: %s.", h->data_path, strerror(errno));
+        return error;
+    }
+
+    __atomic_or_fetch(&h->copied[unit / 64], (u64) 1 << (unit % 64), __ATOMIC_RELEASE);
+    h->copied_count++;
+
+    return ok;
+}
+
+static void *copier(void *img_addr)
+{
+    struct image *img = img_addr;
+    struct hydration *h = img->hydration;
+    u64 cursor = 0, unit, delay = 0, since_saved = 0;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    // checksums of the blocks of a unit are read as well
+    u8 *buffer = malloc(h->unit_size + (h->unit_size / img->block_size + 1) * img->checksum_size);
+
+    if(buffer == NULL) {
+        log_error("Cannot allocate memory for hydration.");
+        return NULL;
+    }
+
+    while (next_unit(h, &cursor, &unit)) {
+        u64 waited = 0;
+
+        // clients go first
+        while (__atomic_load_n(&h->foreground, __ATOMIC_RELAXED) > 0 && waited < MAX_WAIT) {
+            if(pause_copier(h, MIN_DELAY)) goto stop;
+            waited += MIN_DELAY;
+        }
+
+        if(__atomic_load_n(&h->stopping, __ATOMIC_RELAXED)) break;
+
+        if(copy_unit(img, h, unit, buffer) == error) {
+            log_warning("Hydration of image \"%s\" stopped.", img->path);
+            break;
+        }
+
+        if(++since_saved == SAVE_INTERVAL) {
+            save_map(h);
+            since_saved = 0;
+        }
+
+        // back off while reads from the image are slower than usual
+        u64 latency = __atomic_load_n(&h->latency, __ATOMIC_RELAXED);
+        u64 baseline = __atomic_load_n(&h->baseline, __ATOMIC_RELAXED);
+
+        if(baseline && latency > 2 * baseline + MIN_DELAY) {
+            delay = MIN(MAX_DELAY, MAX(MIN_DELAY, delay * 2));
+        } else {
+            delay /= 2;
+        }
+
+        if(delay >= MIN_DELAY && pause_copier(h, delay)) break;
+    }
+
+stop:
+    free(buffer);
+
+    if(since_saved) save_map(h);
+
+    if(h->copied_count == h->units) {
+        log_info("Image \"%s\" hydrated to %s.", img->path, h->data_path);
+    }
+
+    return NULL;
+}
+
+// ============================== SESSIONS ================================== //
+
+void start_hydration(struct image *img)
+{
+    char key[IMAGE_KEY_LENGTH];
+
+    if(hydrate_dir == NULL || img->arena != NULL) return;
+
+    pthread_mutex_lock(&hydrations_lock);
+
+    if(img->hydration != NULL) {
+        pthread_mutex_unlock(&hydrations_lock);
+        return;
+    }
+
+    struct hydration *h = calloc(1, sizeof *h);
+
+    if(h == NULL || image_key(img, &h->identity, key) == error) goto error_1;
+
+    h->size = present_blocks(img) * img->block_size;
+    h->unit_size = divide_up(HYDRATE_UNIT, img->block_size) * img->block_size;
+    h->units = divide_up(h->size, h->unit_size);
+    h->copied = calloc(divide_up(h->units, 64) + 1, sizeof *h->copied);
+
+    if(h->copied == NULL) goto error_1;
+
+    snprintf(h->data_path, sizeof h->data_path, "%s/%s.data", hydrate_dir, key);
+    snprintf(h->map_path, sizeof h->map_path, "%s/%s.map", hydrate_dir, key);
+
+    h->fd = open(h->data_path, O_RDWR | O_CREAT, 0600);
+
+    if(h->fd == -1) {
+        log_warning("Cannot open %s: %s.", h->data_path, strerror(errno));
+        goto error_1;
+    }
+
+    // held while the copy is used; another process would truncate it below
+    if(flock(h->fd, LOCK_EX | LOCK_NB) == -1) {
+        log_warning("Cannot lock %s (%s); it is hydrated by another process.",
+                h->data_path, strerror(errno));
+        goto error_2;
+    }
+
+    // a copy without a valid map is written again
+    if(load_map(h) == error) {
+        memset(h->copied, 0, divide_up(h->units, 64) * sizeof *h->copied);
+        h->copied_count = 0;
+
+        if(ftruncate(h->fd, 0) == -1 || ftruncate(h->fd, h->size) == -1) {
+            log_warning("Cannot resize %s: %s.", h->data_path, strerror(errno));
+            goto error_2;
+        }
+    }
+
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->wake, NULL);
+    __atomic_store_n(&img->hydration, h, __ATOMIC_RELEASE);
+
+    if(pthread_create(&h->thread, NULL, copier, img) != 0) {
+        log_warning("Cannot start hydration thread.");
+        __atomic_store_n(&img->hydration, NULL, __ATOMIC_RELEASE);
+        pthread_cond_destroy(&h->wake);
+        pthread_mutex_destroy(&h->lock);
+        goto error_2;
+    }
+
+    log_info("Hydrating image \"%s\" to %s (" fu64 " of " fu64 " MiB copied).",
+            img->path, h->data_path, MIN(h->copied_count * h->unit_size, h->size) / megabyte,
+            h->size / megabyte);
+
+    pthread_mutex_unlock(&hydrations_lock);
+    return;
+
+error_2:
+    close(h->fd);
+
+error_1:
+    log_warning("Image \"%s\" is not hydrated.", img->path);
+
+    if(h != NULL) free(h->copied);
+    free(h);
+
+    pthread_mutex_unlock(&hydrations_lock);
+}
+
+void stop_hydration(struct image *img)
+{
+    struct hydration *h = img->hydration;
+
+    if(h == NULL) return;
+
+    pthread_mutex_lock(&h->lock);
+    h->stopping = 1;
+    pthread_cond_signal(&h->wake);
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_join(h->thread, NULL);
+
+    close(h->fd);
+    pthread_cond_destroy(&h->wake);
+    pthread_mutex_destroy(&h->lock);
+    free(h->copied);
+    free(h);
+
+    __atomic_store_n(&img->hydration, NULL, __ATOMIC_RELEASE);
+}
+
+struct hydration *current_hydration(struct image *img)
+{
+    return __atomic_load_n(&img->hydration, __ATOMIC_ACQUIRE);
+}
+
+int hydrated_range(struct image *img, struct hydration *h, u64 rank, u64 skip,
+        u64 length, int *fd)
+{
+    u64 offset = rank * img->block_size + skip;
+    u64 unit = offset / h->unit_size;
+    u64 last_unit = divide_up(offset + length, h->unit_size);
+    int copied = 1;
+
+    for (; unit < last_unit; unit++) {
+        if(is_copied(h, unit)) continue;
+
+        copied = 0;
+
+        pthread_mutex_lock(&h->lock);
+
+        int i = 0;
+        while (i < h->urgent_count && h->urgent[i] != unit) i++;
+
+        if(i == h->urgent_count && h->urgent_count < URGENT_UNITS) {
+            h->urgent[h->urgent_count++] = unit;
+        }
+
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    *fd = h->fd;
+    return copied;
+}
+
+u64 begin_foreground(struct hydration *h)
+{
+    __atomic_add_fetch(&h->foreground, 1, __ATOMIC_RELAXED);
+    return now_us();
+}
+
+void end_foreground(struct hydration *h, u64 started)
+{
+    u64 sample = now_us() - started;
+
+    __atomic_sub_fetch(&h->foreground, 1, __ATOMIC_RELAXED);
+
+    // updates may be lost when reads finish at once; it is only an estimate
+    u64 latency = __atomic_load_n(&h->latency, __ATOMIC_RELAXED);
+    latency = latency ? (7 * latency + sample) / 8 : sample;
+    __atomic_store_n(&h->latency, latency, __ATOMIC_RELAXED);
+
+    u64 baseline = __atomic_load_n(&h->baseline, __ATOMIC_RELAXED);
+    if(baseline == 0 || latency < baseline) {
+        __atomic_store_n(&h->baseline, latency, __ATOMIC_RELAXED);
+    }
+}
@@ -19,11 +19,22 @@
  * IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE // O_DIRECT
+
 #include "partclone.h"
 #include "options.h"
 #include "log.h"
 #include "image.h"
-#include "io.h"
+#include "budget.h"
+#include "shared.h"
+#include "readahead.h"
+#include "profile.h"
+#include "arena.h"
+#include "hydrate.h"
+#include "compressed.h"
+#include "replicas.h"
+#include "dedup.h"
+#include "zeroes.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -83,26 +94,58 @@ static inline status load_byte_bitmap(struct image *img);
 static inline u64 compute_additional_blocks(struct image *img);
 static status load_bit_bitmap(struct image *img);
 
-status load_image(struct image *img, struct options *options)
+status load_image(struct image *img, char *path, struct options *options)
 {
     /* -------------------- OPEN IMAGE FILE -------------------- */
 
-    img->path = options->image_path;
-
-    img->fd = open(img->path, O_RDONLY);
-
-    if(img->fd == -1) {
-        log_error("Cannot open image file: %s.", strerror(errno));
+    static u64 last_id;
+
+    img->path = path;
+    img->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+    img->diff_ptr = NULL;
+    img->shared_ptr = NULL;
+    img->arena = NULL;
+    img->profile = NULL;
+    img->metadata_prefetched = 0;
+    img->hydration = NULL;
+    img->ssd_tag = 0;
+    img->compressed = NULL;
+    img->replicas = NULL;
+    img->chunk_hashes = NULL;
+    img->hashed_chunks = NULL;
+    img->nonzero_ptr = NULL;
+    img->hashes_count = 0;
+
+    if(open_segments(&img->segments, img->path) == error) {
         goto error_1;
     } else {
+        img->fd = img->segments.count ? img->segments.table[0].fd : -1;
         log_debug("Image file opened.");
     }
 
+    // the header and the bitmap are read once, through the page cache; only
+    // block data is read directly
+    img->direct_fd = -1;
+
+    if(open_compressed(img, options) == error) goto error_2;
+
+    // O_DIRECT reads are aligned to the start of a single file
+    if(img->compressed == NULL && single_file(&img->segments) && options->direct_io) {
+        img->direct_fd = open(img->path, O_RDONLY | O_DIRECT);
+
+        if(img->direct_fd == -1) {
+            log_warning("Cannot open image file for direct I/O (%s); "
+                    "the page cache is used.", strerror(errno));
+        }
+    }
+
     /* -------------------- LOAD DATA FROM IMAGE HEADER -------------------- */
 
     union header head;
 
-    if(read_whole(img->fd, &head, sizeof(union header)) == error) {
+    memset(&head, 0, sizeof head);
+
+    if(read_image_file(img, &head, sizeof head, 0) == -1) {
         log_error("Cannot read image header: %s.", strerror(errno));
         goto error_2;
     } else {
@@ -124,6 +167,8 @@ status load_image(struct image *img, struct options *options)
         img->block_size = head.v1.block_size;
         img->device_size = head.v1.device_size;
         img->used_blocks = head.v1.used_blocks;
+        memcpy(img->fs_string, head.v1.fs_string, sizeof head.v1.fs_string);
+        img->fs_string[sizeof head.v1.fs_string] = '\0';
         img->bitmap_offset = sizeof(struct old_header);
         img->data_offset = img->bitmap_offset + head.v1.blocks_count + 8;
         img->bitmap_elements_in_cache_element = options->elems_per_cache;
@@ -137,6 +182,7 @@ status load_image(struct image *img, struct options *options)
         img->checksum_size = 4; /* CRC32 size */
         img->blocks_per_checksum = 1;
         img->bmpmode = byte;
+        img->reseed_checksum = 0;
 
         log_debug("Header data loaded.");
 
@@ -152,9 +198,19 @@ status load_image(struct image *img, struct options *options)
         img->checksum_size = head.v2.checksum_size;
         img->device_size = head.v2.device_size;
         img->used_blocks = head.v2.used_blocks_bitmap;
+        memcpy(img->fs_string, head.v2.fs_string, sizeof head.v2.fs_string);
+        img->fs_string[sizeof head.v2.fs_string] = '\0';
         img->bitmap_offset = sizeof(struct new_header);
         img->bitmap_elements_in_cache_element = options->elems_per_cache;
         img->data_offset = img->bitmap_offset + divide_up(img->blocks_count, 8) + img->checksum_size;
+        img->chkmode = head.v2.checksum_mode == CHECKSUM_CRC32 ? crc32 : ignore;
+        img->reseed_checksum = head.v2.reseed_checksum;
+
+        // images created without checksums store 0 here; blocks are then
+        // laid out one after another
+        if(img->blocks_per_checksum == 0) {
+            img->blocks_per_checksum = 1;
+        }
 
         log_debug("Header data loaded.");
 
@@ -168,6 +224,7 @@ status load_image(struct image *img, struct options *options)
 
     log_debug("%s", "");
     log_debug("Information from header:");
+    log_debug("- file system: %s", img->fs_string);
     log_debug("- device size: " fu64 " bytes", img->device_size);
     log_debug("- blocks count: " fu64, img->blocks_count);
     log_debug("- used blocks: " fu64, img->used_blocks);
@@ -178,6 +235,12 @@ status load_image(struct image *img, struct options *options)
 
     /* -------------------- LOAD BITMAP -------------------- */
 
+    struct shared_identity id;
+    int shared = options->shared_metadata && shared_identity(img, &id) == ok;
+
+    // another process may have loaded the image already
+    if(shared && map_shared(img, &id) == ok) goto loaded;
+
     switch (img->bmpmode)
     {
     case bit:
@@ -213,10 +276,15 @@ status load_image(struct image *img, struct options *options)
 
     log_debug("Memory required by cache array: " fu64 ".", img->cache_size);
 
+    if(reserve_memory(img->bitmap_size + img->cache_size, "image bitmap") == error) {
+        goto error_3;
+    }
+
     img->cache_ptr = calloc(img->cache_size, 1);
 
     if(img->cache_ptr == NULL) {
         log_error("Allocation failed.");
+        release_memory(img->bitmap_size + img->cache_size);
         goto error_3;
     } else {
         log_debug("Memory for bitmap cache allocated.");
@@ -239,10 +307,36 @@ status load_image(struct image *img, struct options *options)
     }
 
     log_debug("Cache created.");
-    
-    /* -------------------- OFFSET -------------------- */
 
-    initialize_offset(img);
+    // failure is not an error - the image is just not shared
+    if(shared) publish_shared(img, &id);
+
+loaded:
+    if(open_replicas(img, options) == error ||
+       load_hashes(img, options) == error ||
+       find_zero_blocks(img, options) == error ||
+       (options->in_memory && load_arena(img) == error)) {
+        free_zero_blocks(img);
+        free_hashes(img);
+        close_replicas(img);
+
+        if(img->shared_ptr != NULL) {
+            unmap_shared(img);
+        } else {
+            release_memory(img->bitmap_size + img->cache_size);
+            free(img->cache_ptr);
+            free(img->bitmap_ptr);
+        }
+
+        goto error_2;
+    }
+
+    // reads of a replicated image are spread over the copies
+    if(img->replicas && img->direct_fd != -1) {
+        log_info("Direct I/O is not used for an image with replicas.");
+        close(img->direct_fd);
+        img->direct_fd = -1;
+    }
 
     log_info("Image loaded.");
     return ok;
@@ -256,9 +350,10 @@ error_3:
 
 error_2:
 
-    if(close(img->fd) == -1) {
-        log_error("Cannot close image file: %s", strerror(errno));
-    } else {
+    close_compressed(img->compressed);
+    if(img->direct_fd != -1) close(img->direct_fd);
+
+    if(close_segments(&img->segments) == ok) {
         log_debug("Image file closed.");
     }
 
@@ -269,13 +364,34 @@ error_1:
 
 status close_image(struct image *img)
 {
-    free(img->cache_ptr);
-    free(img->bitmap_ptr);
+    close_profile(img);
+    cancel_prefetch(img);
+    free_arena(img);
+    stop_hydration(img);
+    free_zero_blocks(img);
+    free_hashes(img);
+    close_replicas(img);
+
+    if(img->diff_ptr != NULL) {
+        release_memory(img->bitmap_size);
+    }
+
+    free(img->diff_ptr);
+
+    if(img->shared_ptr != NULL) {
+        unmap_shared(img);
+    } else {
+        release_memory(img->bitmap_size + img->cache_size);
+        free(img->cache_ptr);
+        free(img->bitmap_ptr);
+    }
 
     log_debug("Memory allocated by bitmap and cache released.");
 
-    if(close(img->fd) == -1) {
-        log_error("Cannot close an image file: %s.", strerror(errno));
+    close_compressed(img->compressed);
+    if(img->direct_fd != -1) close(img->direct_fd);
+
+    if(close_segments(&img->segments) == error) {
         return error;
     } else {
         log_debug("Image file closed.");
@@ -301,6 +417,36 @@ static inline u64 compute_additional_blocks(struct image *img)
     return additional_blocks;
 }
 
+// a compressed, split or streamed file cannot be mapped; the bytemap is read
+// to memory then
+static u8 *map_bytemap(struct image *img, size_t length)
+{
+    if(img->compressed == NULL && single_file(&img->segments)) {
+        u8 *ptr = mmap(NULL, length, PROT_READ, MAP_SHARED, img->fd, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    u8 *ptr = malloc(length);
+
+    if(ptr != NULL && read_image_file(img, ptr, length, 0) != (ssize_t) length) {
+        free(ptr);
+        errno = EIO;
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static status unmap_bytemap(struct image *img, u8 *ptr, size_t length)
+{
+    if(img->compressed != NULL || !single_file(&img->segments)) {
+        free(ptr);
+        return ok;
+    }
+
+    return munmap(ptr, length) == 0 ? ok : error;
+}
+
 static status load_byte_bitmap(struct image *img)
 {
    /* -------------------- MAP BYTEMAP TO MEMORY -------------------- */
@@ -308,9 +454,9 @@ static status load_byte_bitmap(struct image *img)
     u8 *bytearray_ptr;
     int length = img->blocks_count + 8 + img->bitmap_offset;
 
-    bytearray_ptr = mmap(NULL, length, PROT_READ, MAP_SHARED, img->fd, 0);
+    bytearray_ptr = map_bytemap(img, length);
 
-    if(bytearray_ptr == MAP_FAILED) {
+    if(bytearray_ptr == NULL) {
         log_error("Cannot map bytemap to memory: %s.", strerror(errno));
         goto error_2;
     }
@@ -391,7 +537,7 @@ static status load_byte_bitmap(struct image *img)
 
     log_debug("Bytemap loaded to bitmap.");
 
-    if(munmap(bytearray_ptr, length) == -1) {
+    if(unmap_bytemap(img, bytearray_ptr, length) == error) {
         log_error("Cannot unmap bytemap: %s.", strerror(errno));
         goto error_1;
     } else {
@@ -406,7 +552,7 @@ static status load_byte_bitmap(struct image *img)
 
 error_3:
 
-    if(munmap(bytearray_ptr, length) == -1) {
+    if(unmap_bytemap(img, bytearray_ptr, length) == error) {
         log_error("Cannot unmap bytemap: %s.", strerror(errno));
     } else {
         log_debug("Bytemap unmapped.");
@@ -442,15 +588,10 @@ static status load_bit_bitmap(struct image *img)
         log_debug("Memory for bitmap allocated.");
     }
 
-    if(set_file_offset(img->fd, img->bitmap_offset, SEEK_SET) == error) {
-        log_error("Cannot set file image offset to bitmap.");
-        goto error_2;
-    } else {
-        log_debug("Offset set to bitmap.");
-    }
+    size_t length = divide_up(img->blocks_count, 8);
 
-    if(read_whole(img->fd, img->bitmap_ptr, divide_up(img->blocks_count, 8)) == error) {
-        log_error("Cannot read bitmap: %s.", strerror(errno));
+    if(read_image_file(img, img->bitmap_ptr, length, img->bitmap_offset) != (ssize_t) length) {
+        log_error("Cannot read bitmap.");
         goto error_2;
     }
 
@@ -469,187 +610,219 @@ error_1:
 
 /* ----------------- READING IMAGE ----------------- */
 
-static inline status set_block_from_the_ground(struct image *img, u64 block);
-
-status initialize_offset(struct image *img)
-{
-    img->o_num = 0;
-    img->o_bitmap_bit = 0;
-    img->o_bitmap_ptr = img->bitmap_ptr;
-    img->o_blocks_set = 0;
-    img->o_existence = *img->bitmap_ptr & 1;
-    img->o_remaining_bytes = img->block_size;
-
-    if(set_file_offset(img->fd, img->data_offset, SEEK_SET) == error) {
-        log_error("Cannot set file offset to data starting point.");
-        return error;
-    }
-
-    log_debug("Image image created.");
-    return ok;
-}
-
-status set_block(struct image *img, u64 block)
-{
-    if(block == img->o_num + 1) {
-        if(next_block(img) == error) goto error;
-
-    } else if(block != img->o_num) {
-        if(set_block_from_the_ground(img, block) == error) goto error;
-
-    } else {
-        if(offset_in_current_block(img, 0) == error) goto error;
-    }
-
-    return ok;
-
-    error: {
-        log_error("Cannot set offset in " fu64 " block.", block);
-        return error;
-    }
-}
-
-static inline status set_block_from_the_ground(struct image *img, u64 block)
+u64 block_rank(struct image *img, u64 block)
 {
-    u64 i;
-
-    /* (a) compute basic values
-     * (a) assign calculated data to the image
-     * (b) find bitmap element corresponding to this block
-     * (c) is the block present in the image
-     * (d) find bitmap cache element corresponding to this block
-     * (e) how many blocks are not included in finded bitmap cache element
-     * (f) how many iterations are required
-     * (g) count bits from 64 bit elements
-     * (h) set bitmap pointer on the bitmap cache element
-     * (i) how many bits are not included in the last iteration - create a mask
-     *     for the last bitmap element
-     * (j) add remaining bits by masking the current element using mask computed
-     *     in point (g)
-     * (k) compute offset
+    /* (a) find bitmap element and bitmap cache element of this block
+     * (b) take the number of set blocks preceding the cache element
+     * (c) count bits from whole 64 bit elements up to the block's element
+     * (d) add remaining bits of the block's element masked below the block
      */
 
     /* (a) ----------------------------------------------------------------- */
-    img->o_num = block;
-    img->o_remaining_bytes = img->block_size;
+    u64 bitmap_element = block / 64;
+    u64 cache_element = bitmap_element / img->bitmap_elements_in_cache_element;
 
     /* (b) ----------------------------------------------------------------- */
-    u64 bitmap_element = img->o_num / 64;
-    img->o_bitmap_ptr = img->bitmap_ptr + bitmap_element;
-    img->o_bitmap_bit = img->o_num % 64;
+    u64 rank = img->cache_ptr[cache_element];
 
     /* (c) ----------------------------------------------------------------- */
-    img->o_existence = (*img->o_bitmap_ptr >> img->o_bitmap_bit) & 1;
+    u64 *bitmap_ptr =
+        img->bitmap_ptr + cache_element * img->bitmap_elements_in_cache_element;
+
+    while (bitmap_ptr < img->bitmap_ptr + bitmap_element) {
+        rank += popcount(*bitmap_ptr++);
+    }
 
     /* (d) ----------------------------------------------------------------- */
 
-    u64 cache_element =
-        bitmap_element / img->bitmap_elements_in_cache_element;
+    /* The element is not touched when the bit is 0 - the block may be the
+     * first one after the bitmap.
+     */
 
-    img->o_blocks_set = img->cache_ptr[cache_element];
+    u8 bit = block % 64;
 
-    /* (e) ----------------------------------------------------------------- */
-    u64 remaining_blocks =
-        img->o_num - cache_element *
-        img->bitmap_elements_in_cache_element * 64;
+    if(bit != 0) {
+        rank += popcount(*bitmap_ptr & (0xFFFFFFFFFFFFFFFF >> (64 - bit)));
+    }
 
-    /* (f) ----------------------------------------------------------------- */
-    u64 iterations_num = remaining_blocks / 64;
+    return rank;
+}
 
-    /* (g) ----------------------------------------------------------------- */
-    u64 *bitmap_ptr =
-        img->bitmap_ptr + cache_element *
-        img->bitmap_elements_in_cache_element;
+u64 rank_offset(struct image *img, u64 rank)
+{
+    return img->data_offset
+        + rank * img->block_size
+        + (rank / img->blocks_per_checksum) * img->checksum_size;
+}
 
-    /* (h) ----------------------------------------------------------------- */
-    for (i = 0; i < iterations_num; i++) {
-        img->o_blocks_set += popcount(*bitmap_ptr++);
-    }
+u64 find_extent(struct image *img, u64 block, u64 limit, u8 *existence)
+{
+    const u64 *bitmap = img->nonzero_ptr ? img->nonzero_ptr : img->bitmap_ptr;
 
-    /* (i) ----------------------------------------------------------------- */
+    return find_run(bitmap, block, limit, existence);
+}
 
-    /* Why not 0xFFFFFFFFFFFFFFFF >> 64? This trick is necessary, because
-     * shifting a 64-bit variable 64 bits is in fact shifting 0 bits.
+u64 find_run(const u64 *bitmap, u64 block, u64 limit, u8 *value)
+{
+    /* A run ends on the first bit which differs from the bit of the first
+     * block; the bitmap elements are inverted when looking for zeroes, so both
+     * cases come down to searching for the first set bit.
      */
 
-    u64 shifter = 64 - (remaining_blocks - iterations_num * 64);
+    u64 element = block / 64;
+    u8 bit = block % 64;
 
-    u64 last_bitmap_elem_mask =
-        (0xFFFFFFFFFFFFFFFF >> shifter) & (-(shifter < 64));
+    *value = (bitmap[element] >> bit) & 1;
 
-    /* (j) ----------------------------------------------------------------- */
-    img->o_blocks_set += popcount(*bitmap_ptr & last_bitmap_elem_mask);
+    u64 invert = -(u64) *value;
+    u64 word = (bitmap[element] ^ invert) >> bit;
 
-    /* (h) ----------------------------------------------------------------- */
-    u64 file_offset =
-        img->o_blocks_set * img->block_size
-        + (img->o_blocks_set / img->blocks_per_checksum) * img->checksum_size
-        + img->data_offset;
+    u64 end;
 
-    if(set_file_offset(img->fd, file_offset, SEEK_SET) == error) {
-        return error;
+    if(word != 0) {
+        end = block + ctz(word);
+    } else {
+        end = (element + 1) * 64;
+
+        while (end < limit) {
+            word = bitmap[end / 64] ^ invert;
+
+            if(word != 0) {
+                end += ctz(word);
+                break;
+            }
+
+            end += 64;
+        }
     }
 
-    return ok;
+    return MIN(end, limit) - block;
 }
 
-status next_block(struct image *img)
+status prefetch(struct image *img, u64 offset, u64 length)
 {
-    /* (1) is the next element of bitmap in a new byte, or in an old byte?
-     * (2) compute addional offset when jumping to next block
-     * (3) is the block present in the image?
-     * (4) change the total number of set blocks
-     * (5) reset remaining bytes number
-     * (6) jump to next block
-     */
+    if(length == 0) return ok;
 
+    u64 block = offset / img->block_size;
+    u64 last_block = divide_up(offset + length, img->block_size);
 
-    /* (1) ----------------------------------------------------------------- */
+    /* Only present blocks are read ahead; a run of present blocks is stored
+     * as one range of the image file (with checksums in between).
+     */
 
-    u8 next_bit_raw = img->o_bitmap_bit + 1;
+    while (block < last_block) {
+        u8 existence;
+        u64 blocks = find_extent(img, block, last_block, &existence);
+
+        if(existence) {
+            u64 rank = block_rank(img, block);
+            u64 start = rank_offset(img, rank);
+            u64 end = rank_offset(img, rank + blocks);
+
+            // spans of a compressed image are decompressed into its cache
+            if(img->compressed) {
+                prefetch_compressed(img->compressed, start, end - start);
+            } else {
+                int result = img->replicas ?
+                    advise_replicas(img->replicas, start, end - start, POSIX_FADV_WILLNEED) :
+                    advise_segments(&img->segments, start, end - start, POSIX_FADV_WILLNEED);
+
+                if(result != 0) {
+                    log_error("posix_fadvise(): %s (offset: " fu64 ").", strerror(result), start);
+                    return error;
+                }
+            }
+        }
 
-    img->o_bitmap_bit = next_bit_raw % 64;
-    img->o_bitmap_ptr += (next_bit_raw - 63) * (next_bit_raw / 63);
-    img->o_num++;
+        block += blocks;
+    }
 
-    /* (2) ----------------------------------------------------------------- */
+    return ok;
+}
 
-    u64 addional_offset = img->o_existence *
-    (((((img->o_blocks_set + 1) % img->blocks_per_checksum) == 0) * img->checksum_size) + img->o_remaining_bytes);
+ssize_t read_image_file(struct image *img, void *buf, size_t length, u64 offset)
+{
+    if(img->compressed) return read_compressed(img->compressed, buf, length, offset);
+    if(img->replicas) return read_replicas(img->replicas, buf, length, offset);
 
-    /* (3) ----------------------------------------------------------------- */
+    return read_segments(&img->segments, buf, length, offset);
+}
 
-    img->o_existence =
-        (*img->o_bitmap_ptr >> img->o_bitmap_bit) & 1;
+u64 present_blocks(struct image *img)
+{
+    u64 i, count = 0;
 
-    /* (4) ----------------------------------------------------------------- */
+    for (i = 0; i < img->bitmap_elements; i++) {
+        count += popcount(img->bitmap_ptr[i]);
+    }
 
-    img->o_blocks_set += img->o_existence;
+    return count;
+}
 
-    /* (5) ----------------------------------------------------------------- */
+status read_device(struct image *img, void *buf, u64 offset, u64 length)
+{
+    u8 *dest = buf;
 
-    img->o_remaining_bytes = img->block_size;
+    if(offset > img->device_size || length > img->device_size - offset) {
+        log_error("Reading beyond the device (offset: " fu64 ").", offset);
+        return error;
+    }
 
-    /* (6) ----------------------------------------------------------------- */
+    // block by block; used for small reads of metadata
+    while (length > 0) {
+        u64 block = offset / img->block_size;
+        u64 skip = offset % img->block_size;
+        u64 part = MIN(length, img->block_size - skip);
+        u8 existence = 0;
+
+        if(block < img->blocks_count) find_extent(img, block, block + 1, &existence);
+
+        if(existence) {
+            u64 start = rank_offset(img, block_rank(img, block)) + skip;
+            ssize_t once = read_image_file(img, dest, part, start);
+
+            if(once != (ssize_t) part) {
+                log_error("Cannot read image data: %s (offset: " fu64 ").",
+                        once == -1 ? strerror(errno) : "unexpected end of file", start);
+                return error;
+            }
+        } else {
+            memset(dest, 0, part);
+        }
 
-    if(set_file_offset(img->fd, addional_offset, SEEK_CUR) == error) {
-        log_error("Cannot set offset in next block.");
-        return error;
+        dest += part;
+        offset += part;
+        length -= part;
     }
 
     return ok;
 }
 
-/* set a new offset inside a current block */
-status offset_in_current_block(struct image *img, u64 offset)
+status read_ranks(struct image *img, void *buf, u64 rank, u64 count)
 {
-    u32 blk_remaining = img->block_size - offset;
-
-    if(set_file_offset(img->fd, img->o_remaining_bytes - blk_remaining, SEEK_CUR) == error) {
-        log_error("Cannot set offset inside block.");
+    u8 *dest = buf;
+    u64 start = rank_offset(img, rank);
+    u64 span = rank_offset(img, rank + count) - start;
+    ssize_t once = read_image_file(img, dest, span, start);
+
+    if(once != (ssize_t) span) {
+        log_error("Cannot read image data: %s (offset: " fu64 ").",
+                once == -1 ? strerror(errno) : "unexpected end of file", start);
         return error;
     }
 
-    img->o_remaining_bytes = blk_remaining;
+    // move blocks over the checksums between them
+    u64 end = rank + count;
+    u64 r = rank;
+
+    while (r < end && img->checksum_size) {
+        u64 blocks = MIN(img->blocks_per_checksum - r % img->blocks_per_checksum, end - r);
+
+        memmove(dest + (r - rank) * img->block_size,
+                dest + (rank_offset(img, r) - start), blocks * img->block_size);
+
+        r += blocks;
+    }
+
     return ok;
 }
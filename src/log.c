@@ -88,13 +88,17 @@ NOT_LITERAL void log_msg(enum log_priority priority, const char *format, ...)
 
     // ---------------------------------------------------------------------
 
+    // connections are served by many threads; lock the stream, so that their
+    // messages are not interleaved
+
     va_start(args, format);
 
+    flockfile(log_fd);
     fprintf(log_fd, "%s", file_priority_string[priority]);
     vfprintf(log_fd, format, args);
     fprintf(log_fd, "\n");
-
     fflush(log_fd);
+    funlockfile(log_fd);
 
     va_end(args);
 
@@ -126,10 +130,12 @@ NOT_LITERAL void log_msg(enum log_priority priority, const char *format, ...)
 
     va_start(args, format);
 
+    flockfile(stream);
     fprintf(stream, "%s", print_priority_string[priority]);
     vfprintf(stream, format, args);
     fprintf(stream, "\n");
     fflush(stream);
+    funlockfile(stream);
 
     va_end(args);
 }
@@ -23,7 +23,18 @@
 #include "options.h"
 #include "log.h"
 #include "image.h"
+#include "diff.h"
+#include "budget.h"
+#include "blockcache.h"
+#include "buffers.h"
+#include "readahead.h"
+#include "profile.h"
+#include "fsmeta.h"
+#include "hydrate.h"
+#include "ssdcache.h"
+#include "export.h"
 #include "nbd.h"
+#include "daemon.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -39,11 +50,34 @@ int main(int argc, char **argv)
     struct options options = {
         .device_path = "/dev/nbd0",
         .image_path = NULL,
+        .image_paths = NULL,
+        .image_count = 0,
+        .base_image_path = NULL,
         .custom_log_file = 0,
         .log_file = "/var/log/partclone-nbd.log",
         .elems_per_cache = 512,
+        .memory_limit = 0,
+        .block_cache_size = 0,
+        .ssd_cache_path = NULL,
+        .ssd_cache_size = 1024 * megabyte,
+        .readahead_window = 8 * megabyte,
+        .profile_dir = NULL,
+        .profile_time = 60,
+        .profile_size = 256 * megabyte,
+        .metadata_prefetch = 64 * megabyte,
+        .hydrate_dir = NULL,
+        .index_span = 4 * megabyte,
+        .window_cache = 32 * megabyte,
+        .replica_dirs = NULL,
+        .control_path = NULL,
         .server_mode = 0,
         .client_mode = 0,
+        .daemon_mode = 0,
+        .shared_metadata = 0,
+        .direct_io = 0,
+        .in_memory = 0,
+        .dedup = 0,
+        .zero_blocks = 0,
         .port = 10809,
         .debug = 0,
         .quiet = 0
@@ -52,10 +86,31 @@ int main(int argc, char **argv)
     static struct option longopts[] = {
         {"port",                required_argument,  NULL, 'p'},
         {"elems-per-cache",     required_argument,  NULL, 'x'},
+        {"diff-base",           required_argument,  NULL, 'b'},
+        {"memory-limit",        required_argument,  NULL, 'm'},
+        {"shared-metadata",     no_argument,        NULL, 'H'},
+        {"block-cache",         required_argument,  NULL, 'C'},
+        {"ssd-cache",           required_argument,  NULL, 'F'},
+        {"ssd-cache-size",      required_argument,  NULL, 'G'},
+        {"direct-io",           no_argument,        NULL, 'O'},
+        {"in-memory",           no_argument,        NULL, 'I'},
+        {"dedup",               no_argument,        NULL, 'e'},
+        {"zero-blocks",         no_argument,        NULL, 'z'},
+        {"readahead",           required_argument,  NULL, 'R'},
+        {"profile-dir",         required_argument,  NULL, 'P'},
+        {"profile-time",        required_argument,  NULL, 'T'},
+        {"profile-size",        required_argument,  NULL, 'Z'},
+        {"metadata-prefetch",   required_argument,  NULL, 'M'},
+        {"hydrate",             required_argument,  NULL, 'Y'},
+        {"index-span",          required_argument,  NULL, 'g'},
+        {"window-cache",        required_argument,  NULL, 'w'},
+        {"replicas",            required_argument,  NULL, 'r'},
         {"help",                no_argument,        NULL, 'h'},
         {"quiet",               no_argument,        NULL, 'q'},
         {"server-mode",         no_argument,        NULL, 's'},
         {"client-mode",         no_argument,        NULL, 'c'},
+        {"daemon",              no_argument,        NULL, 'a'},
+        {"control-socket",      required_argument,  NULL, 'S'},
         {"device",              required_argument,  NULL, 'd'},
         {"log-file",            required_argument,  NULL, 'L'},
         {"debug",               no_argument,        NULL, 'D'},
@@ -65,7 +120,7 @@ int main(int argc, char **argv)
 
     for(;;) {
         int idx = 0; // it'll be incremented
-        int opt = getopt_long(argc, argv, "p:d:x:hL:DqscV", longopts, &idx);
+        int opt = getopt_long(argc, argv, "p:d:x:b:m:HC:F:G:OIezR:P:T:Z:M:Y:g:w:r:hL:DqscaS:V", longopts, &idx);
 
         if(opt == -1) break;
 
@@ -78,14 +133,102 @@ int main(int argc, char **argv)
             options.elems_per_cache = atoll(optarg);
             break;
 
+        case 'b':
+            options.base_image_path = optarg;
+            break;
+
+        case 'm':
+            options.memory_limit = atoll(optarg) * megabyte;
+            break;
+
+        case 'H':
+            options.shared_metadata = 1;
+            break;
+
+        case 'C':
+            options.block_cache_size = atoll(optarg) * megabyte;
+            break;
+
+        case 'F':
+            options.ssd_cache_path = optarg;
+            break;
+
+        case 'G':
+            options.ssd_cache_size = atoll(optarg) * megabyte;
+            break;
+
+        case 'O':
+            options.direct_io = 1;
+            break;
+
+        case 'I':
+            options.in_memory = 1;
+            break;
+
+        case 'e':
+            options.dedup = 1;
+            break;
+
+        case 'z':
+            options.zero_blocks = 1;
+            break;
+
+        case 'R':
+            options.readahead_window = atoll(optarg) * megabyte;
+            break;
+
+        case 'P':
+            options.profile_dir = optarg;
+            break;
+
+        case 'T':
+            options.profile_time = atoll(optarg);
+            break;
+
+        case 'Z':
+            options.profile_size = atoll(optarg) * megabyte;
+            break;
+
+        case 'M':
+            options.metadata_prefetch = atoll(optarg) * megabyte;
+            break;
+
+        case 'Y':
+            options.hydrate_dir = optarg;
+            break;
+
+        case 'g':
+            options.index_span = atoll(optarg) * megabyte;
+            break;
+
+        case 'w':
+            options.window_cache = atoll(optarg) * megabyte;
+            break;
+
+        case 'r':
+            options.replica_dirs = optarg;
+            break;
+
         case 'h':
             printf(
-                "Usage: partclone-nbd [OPTION...] partclone_image\n"
+                "Usage: partclone-nbd [OPTION...] partclone_image...\n"
+                "  or:  partclone-nbd -a [OPTION...]\n"
+                "  or:  partclone-nbd -S SOCKET REQUEST...\n"
                 "Serve a partclone image as a block device.\n"
                 "\n"
+                "In server mode many images (or directories of images) may be given; each\n"
+                "is exported under its file name, the first one also as the default export.\n"
+                "An image given as \"-\" (or a FIFO) is read from the pipe as it arrives.\n"
+                "An image given as an http:// URL is read with HTTP range requests.\n"
+                "\n"
+                "A daemon attaches images to NBD devices on requests sent with -S:\n"
+                "\"attach IMAGE DEVICE\", \"detach DEVICE\", \"list\" or \"stats\". Detached\n"
+                "images stay loaded until the memory limit needs room.\n"
+                "\n"
                 "modes:\n"
                 "  -c, --client-mode          Create a block device locally\n"
                 "  -s, --server-mode          Listen on a port for clients.\n"
+                "  -a, --daemon               Attach images to devices on request.\n"
                 "\n"
                 "log_options:\n"
                 "  -L, --log-file=FILE        Specify an alternative path for a log file.\n"
@@ -97,6 +240,49 @@ int main(int argc, char **argv)
                 "                             element (default: 512). Higher value means better\n"
                 "                             performance, but more RAM is consumed. Details in\n"
                 "                             manual.\n"
+                "  -b, --diff-base=IMAGE      Compare with an older image of the same device\n"
+                "                             and export changed blocks as the\n"
+                "                             \"partclone:diff\" metadata context.\n"
+                "  -m, --memory-limit=MiB     Limit memory used by bitmaps and caches of all\n"
+                "                             images (default: no limit).\n"
+                "  -H, --shared-metadata      Share bitmaps and caches with other processes\n"
+                "                             serving the same image (through /dev/shm).\n"
+                "  -C, --block-cache=MiB      Cache frequently read image data in memory\n"
+                "                             (default: 0 - rely on the page cache only).\n"
+                "  -F, --ssd-cache=FILE       Keep read image data in a persistent cache file\n"
+                "                             (or device) on local storage.\n"
+                "  -G, --ssd-cache-size=MiB   Size of the SSD cache (default: 1024).\n"
+                "  -e, --dedup                Cache device chunks with the same content once,\n"
+                "                             across images (hashes saved as IMAGE.hashidx).\n"
+                "  -z, --zero-blocks          Serve used blocks holding only zeroes as holes\n"
+                "                             (found once, saved as IMAGE.zeroidx).\n"
+                "  -O, --direct-io            Read image data with O_DIRECT, bypassing the\n"
+                "                             page cache (data is not cached twice in client\n"
+                "                             mode).\n"
+                "  -I, --in-memory            Load data of present blocks into memory and\n"
+                "                             serve all reads from there (memory used equals\n"
+                "                             the used data of images).\n"
+                "  -R, --readahead=MiB        Maximum readahead of detected sequential and\n"
+                "                             strided streams (default: 8; 0 disables).\n"
+                "  -P, --profile-dir=DIR      Record reads of the first sessions of each image\n"
+                "                             to a profile in DIR and replay it as prefetch\n"
+                "                             when the image is served again.\n"
+                "  -T, --profile-time=SEC     Record at most SEC seconds (default: 60).\n"
+                "  -Z, --profile-size=MiB     Record at most MiB of reads (default: 256).\n"
+                "  -M, --metadata-prefetch=MiB\n"
+                "                             Prefetch up to MiB of file system metadata (ext,\n"
+                "                             NTFS) when a client connects (default: 64; 0\n"
+                "                             disables).\n"
+                "  -Y, --hydrate=DIR          Copy images to local storage in DIR in the\n"
+                "                             background while serving them; copied parts\n"
+                "                             are read from there.\n"
+                "  -g, --index-span=MiB       Distance between access points in the index of\n"
+                "                             gzip-compressed images (default: 4).\n"
+                "  -w, --window-cache=MiB     Memory for recently decompressed data of each\n"
+                "                             compressed or remote image (default: 32).\n"
+                "  -r, --replicas=DIR[:DIR...]\n"
+                "                             Read images also from identical copies of the\n"
+                "                             same name in DIRs; slow reads are hedged.\n"
                 "\n"
                 "server mode options:\n"
                 "  -p, --port=NUM             Specify a port (default: 10809).\n"
@@ -104,6 +290,10 @@ int main(int argc, char **argv)
                 "client mode options:\n"
                 "  -d, --device=DEV           Specify another NBD device (default: /dev/nbd0)\n"
                 "\n"
+                "daemon options:\n"
+                "  -S, --control-socket=PATH  Specify a control socket of the daemon (default:\n"
+                "                             /var/run/partclone-nbd.sock).\n"
+                "\n"
                 "other options:\n"
                 "  -h, --help                 Give this help list.\n"
                 "  -q, --quiet                Print messages only to log file.\n"
@@ -126,7 +316,7 @@ int main(int argc, char **argv)
             break;
 
         case 'c':
-            if(options.server_mode) {
+            if(options.server_mode || options.daemon_mode) {
                 fprintf(stderr, "You can specify only one mode!\n");
                 return (int) error;
             }
@@ -135,7 +325,7 @@ int main(int argc, char **argv)
             break;
 
         case 's':
-            if(options.client_mode) {
+            if(options.client_mode || options.daemon_mode) {
                 fprintf(stderr, "You can specify only one (client or server) mode!\n");
                 return (int) error;
             }
@@ -144,6 +334,19 @@ int main(int argc, char **argv)
 
             break;
 
+        case 'a':
+            if(options.client_mode || options.server_mode) {
+                fprintf(stderr, "You can specify only one mode!\n");
+                return (int) error;
+            }
+
+            options.daemon_mode = 1;
+            break;
+
+        case 'S':
+            options.control_path = optarg;
+            break;
+
         case 'd':
             options.device_path = optarg;
             break;
@@ -158,12 +361,67 @@ int main(int argc, char **argv)
         }
     }
 
+    // content hashes only key the caches
+    if(options.dedup && options.block_cache_size == 0 && options.ssd_cache_path == NULL) {
+        fprintf(stderr, "%s: --dedup needs --block-cache or --ssd-cache.\n", argv[0]);
+        return (int) error;
+    }
+
+    // a request for a running daemon
+    if(options.control_path && !options.daemon_mode) {
+        if(options.client_mode || options.server_mode || optind >= argc) {
+            fprintf(stderr, "%s: give a request for the daemon.\n", argv[0]);
+            return (int) error;
+        }
+
+        return (int) control_daemon(&options, &argv[optind], argc - optind);
+    }
+
+    if(options.control_path == NULL) {
+        options.control_path = "/var/run/partclone-nbd.sock";
+    }
+
+    // images are given in requests
+    if(options.daemon_mode) {
+        if(optind < argc) {
+            fprintf(stderr, "%s: daemon takes images from requests.\n", argv[0]);
+            return (int) error;
+        }
+
+        if(initialize_log(&options) == error) return (int) error;
+
+        initialize_budget(&options);
+
+        status result = initialize_block_cache(&options);
+        if(result == ok) result = initialize_ssd_cache(&options);
+        if(result == ok) result = initialize_buffers(&options);
+        if(result == ok) result = initialize_readahead(&options);
+        if(result == ok) result = initialize_profiles(&options);
+        if(result == ok) result = initialize_metadata_prefetch(&options);
+        if(result == ok) result = initialize_hydration(&options);
+        if(result == ok) result = start_daemon(&options);
+
+        close_readahead();
+        close_buffers();
+        close_block_cache();
+        close_ssd_cache();
+
+        if(result == error) {
+            log_error("Errors occured - see log file \"%s\" for details.", options.log_file);
+        }
+
+        close_log();
+        return (int) result;
+    }
+
     // check if image is given
     if(optind >= argc) {
         fprintf(stderr, "%s: no image file specified.\n", argv[0]);
         return (int) error;
     } else {
         options.image_path = argv[optind];
+        options.image_paths = &argv[optind];
+        options.image_count = argc - optind;
     }
 
     // check if mode is set
@@ -172,22 +430,68 @@ int main(int argc, char **argv)
         return (int) error;
     }
 
-    struct image img;
+    // a block device is created for exactly one image
+    if(options.client_mode && options.image_count > 1) {
+        fprintf(stderr, "%s: client mode serves only one image.\n", argv[0]);
+        return (int) error;
+    }
+
+    struct image base;
 
     if(initialize_log(&options) == error) goto error_1;
-    if(load_image(&img, &options) == error) goto error_2;
+
+    initialize_budget(&options);
+
+    if(initialize_block_cache(&options) == error) goto error_2;
+    if(initialize_ssd_cache(&options) == error) goto error_3;
+    if(initialize_buffers(&options) == error) goto error_3;
+    if(initialize_readahead(&options) == error) goto error_3;
+    if(initialize_profiles(&options) == error) goto error_3;
+    if(initialize_metadata_prefetch(&options) == error) goto error_3;
+    if(initialize_hydration(&options) == error) goto error_3;
+    if(load_exports(options.image_paths, options.image_count, &options) == error) goto error_3;
+
+    struct image *img = &export_at(0)->img;
+
+    // the base image is needed only to build the difference bitmap
+    if(options.base_image_path) {
+        if(exports_count() != 1) {
+            log_error("Only a single image can be compared with a base image.");
+            goto error_3;
+        }
+
+        // only checksums of the base image are read
+        struct options base_options = options;
+        base_options.in_memory = 0;
+
+        if(load_image(&base, options.base_image_path, &base_options) == error) goto error_3;
+
+        status compared = compute_diff(img, &base);
+
+        close_image(&base);
+        if(compared == error) goto error_3;
+    }
+
     // it is a mess with client and server mode (methods); see nbd.c, everything
     // is explained in comments (somwhere in the middle of the file).
-    if(options.client_mode) if(start_client(&img, &options) == error) goto error_3;
-    if(options.server_mode) if(start_server(&img, &options) == error) goto error_3;
-    if(close_image(&img) == error) goto error_2;
-    if(close_log() == error) goto error_1;
-
+    if(options.client_mode) if(start_client(img, &options) == error) goto error_3;
+    if(options.server_mode) if(start_server(&options) == error) goto error_3;
+    close_readahead();
+    close_exports();
+    close_buffers();
+    close_block_cache();
+    close_ssd_cache();
     log_debug("Closing program with status 0.");
+
+    if(close_log() == error) goto error_1;
     return (int) ok;
 
 error_3:
-    close_image(&img);
+    close_readahead();
+    close_exports();
+    close_buffers();
+    close_block_cache();
+    close_ssd_cache();
 
 error_2:
     log_error("Errors occured - see log file \"%s\" for details.", options.log_file);
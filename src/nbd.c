@@ -24,6 +24,16 @@
 #include "partclone.h"
 #include "image.h"
 #include "nbd.h"
+#include "export.h"
+#include "blockcache.h"
+#include "buffers.h"
+#include "readahead.h"
+#include "profile.h"
+#include "fsmeta.h"
+#include "hydrate.h"
+#include "ssdcache.h"
+#include "coalesce.h"
+#include "dedup.h"
 #include "signals.h"
 
 #include <sys/types.h>
@@ -31,8 +41,10 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
@@ -57,6 +69,126 @@
 #define NBD_SET_FLAGS       _IO( 0xab, 10)
 #define BLKROSET            _IO( 0x12, 93) /* set RO */
 
+// Constants from the NBD protocol specification (doc/proto.md in nbd sources).
+
+#define NBD_OPTS_MAGIC              0x49484156454F5054 /* "IHAVEOPT" */
+#define NBD_REP_MAGIC               0x0003e889045565a9
+#define NBD_REQUEST_MAGIC           0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC      0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_EXTENDED_REQUEST_MAGIC  0x21e41c71
+#define NBD_EXTENDED_REPLY_MAGIC    0x6e8a278c
+
+// handshake flags (server and client)
+#define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)
+#define NBD_FLAG_NO_ZEROES          (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES        (1 << 1)
+
+// transmission flags
+#define NBD_FLAG_HAS_FLAGS          (1 << 0)
+#define NBD_FLAG_READ_ONLY          (1 << 1)
+#define NBD_FLAG_CAN_MULTI_CONN     (1 << 8)
+#define NBD_FLAG_SEND_CACHE         (1 << 10)
+
+// options
+#define NBD_OPT_EXPORT_NAME         1
+#define NBD_OPT_ABORT               2
+#define NBD_OPT_LIST                3
+#define NBD_OPT_INFO                6
+#define NBD_OPT_GO                  7
+#define NBD_OPT_STRUCTURED_REPLY    8
+#define NBD_OPT_LIST_META_CONTEXT   9
+#define NBD_OPT_SET_META_CONTEXT    10
+#define NBD_OPT_EXTENDED_HEADERS    11
+
+// option replies
+#define NBD_REP_ACK                 1
+#define NBD_REP_SERVER              2
+#define NBD_REP_INFO                3
+#define NBD_REP_META_CONTEXT        4
+#define NBD_REP_ERR_UNSUP           (0x80000000 | 1)
+#define NBD_REP_ERR_INVALID         (0x80000000 | 3)
+#define NBD_REP_ERR_UNKNOWN         (0x80000000 | 6)
+#define NBD_REP_ERR_TOO_BIG         (0x80000000 | 9)
+#define NBD_REP_ERR_EXT_HEADER_REQD (0x80000000 | 10)
+
+// information types of NBD_REP_INFO
+#define NBD_INFO_EXPORT             0
+#define NBD_INFO_NAME               1
+#define NBD_INFO_BLOCK_SIZE         3
+
+// commands and command flags
+#define NBD_CMD_READ                0
+#define NBD_CMD_WRITE               1
+#define NBD_CMD_DISC                2
+#define NBD_CMD_FLUSH               3
+#define NBD_CMD_TRIM                4
+#define NBD_CMD_CACHE               5
+#define NBD_CMD_BLOCK_STATUS        7
+#define NBD_CMD_FLAG_REQ_ONE        (1 << 3)
+
+// structured replies
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_BLOCK_STATUS_EXT 6
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
+
+// "base:allocation" metadata context
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+// "partclone:diff" metadata context (like "qemu:dirty-bitmap:")
+#define NBD_STATE_DIRTY             (1 << 0)
+
+// Limits of this implementation.
+
+// the longest option data accepted during negotiation
+#define MAX_OPTION_LENGTH           4096
+// the largest number of extents sent in one NBD_REPLY_TYPE_BLOCK_STATUS chunk
+#define MAX_EXTENTS                 (64 * kilobyte)
+// the largest request advertised in NBD_INFO_BLOCK_SIZE (larger requests are
+// served too, but well-behaved clients split them)
+#define MAX_PAYLOAD_SIZE            (32 * megabyte)
+// the longest chunk of a structured reply with a 32-bit length (block size
+// aligned, so that the offset and the header fit as well)
+#define MAX_CHUNK_SIZE              (0xFFFFFFFF & ~(u64) 0xFFFF)
+// size of the buffer filled with zeroes, sent in place of absent blocks
+#define ZERO_BUFFER_SIZE            (128 * kilobyte)
+
+// metadata context identifiers, as sent in NBD_REP_META_CONTEXT replies
+#define CONTEXT_BASE_ALLOCATION     1
+#define CONTEXT_DIFF                2
+
+// state of one connection
+struct session
+{
+    // socket connected to the client
+    int sock;
+    // exported image (selected during negotiation in server mode)
+    struct image *img;
+    // export which selected metadata contexts belong to
+    struct export *meta_export;
+    // structured replies negotiated (NBD_OPT_STRUCTURED_REPLY)?
+    int structured;
+    // extended headers negotiated (NBD_OPT_EXTENDED_HEADERS)? Implies
+    // structured replies.
+    int extended;
+    // "base:allocation" metadata context selected?
+    int base_allocation;
+    // "partclone:diff" metadata context selected?
+    int diff;
+
+    // buffer filled with zeroes (ZERO_BUFFER_SIZE)
+    void *zero;
+    // streams of read requests
+    struct readahead readahead;
+    // buffer for block status descriptors (MAX_EXTENTS pairs)
+    u64 *extents;
+};
+
 
 int get(int sock, void *buff, int count)
 {
@@ -140,9 +272,19 @@ static inline status put64(int sock, u64 v) {
     return ok;
 }
 
+// header of a request (simple or extended)
+struct request
+{
+    u16 flags;
+    u16 type;
+    u64 handle;
+    u64 offset;
+    u64 length;
+};
+
 static status send_reply(int sock, u64 handle, u32 error_number)
 {
-    if(     put32(sock, 0x67446698) == error      ||
+    if(     put32(sock, NBD_SIMPLE_REPLY_MAGIC) == error      ||
             put32(sock, error_number) == error    ||
             put64(sock, handle) == error          ){
     /* ---------------------------------------------------------------------- */
@@ -153,33 +295,612 @@ static status send_reply(int sock, u64 handle, u32 error_number)
     return ok;
 }
 
-static status WORKER(int sock, struct image *img)
+// header of a structured reply chunk; extended headers carry the offset of
+// the request and 64-bit length
+static status send_chunk(struct session *s, struct request *req, u16 flags,
+        u16 type, u64 length)
 {
-    void *zero;
+    status result;
+
+    if(s->extended) {
+        result = put32(s->sock, NBD_EXTENDED_REPLY_MAGIC) == ok &&
+                 put16(s->sock, flags) == ok                    &&
+                 put16(s->sock, type) == ok                     &&
+                 put64(s->sock, req->handle) == ok              &&
+                 put64(s->sock, req->offset) == ok              &&
+                 put64(s->sock, length) == ok ? ok : error;
+    } else {
+        result = put32(s->sock, NBD_STRUCTURED_REPLY_MAGIC) == ok &&
+                 put16(s->sock, flags) == ok                      &&
+                 put16(s->sock, type) == ok                       &&
+                 put64(s->sock, req->handle) == ok                &&
+                 put32(s->sock, length) == ok ? ok : error;
+    }
+
+    if(result == error) {
+        log_error("Failed to send reply chunk for the request.");
+    }
+
+    return result;
+}
+
+// reply with success to a request which carries no data
+static status send_done(struct session *s, struct request *req)
+{
+    if(!s->extended) {
+        return send_reply(s->sock, req->handle, 0);
+    }
+
+    // simple replies are not allowed with extended headers
+    return send_chunk(s, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, 0);
+}
+
+// reply with an error; in structured mode NBD_REPLY_TYPE_ERROR chunk is used,
+// as simple replies are not allowed for every command
+static status send_error(struct session *s, struct request *req, u32 error_number)
+{
+    if(!s->structured) {
+        return send_reply(s->sock, req->handle, error_number);
+    }
+
+    // error (32 bits) and length of the message (16 bits, no message)
+    if(send_chunk(s, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, 6) == error ||
+       put32(s->sock, error_number) == error                                      ||
+       put16(s->sock, 0) == error                                                 ){
+    /* ---------------------------------------------------------------------- */
+        log_error("Failed to send error for the request.");
+        return error;
+    }
+
+    return ok;
+}
+
+static status send_zeroes(struct session *s, u64 length)
+{
+    while (length > 0) {
+        size_t once = MIN(length, ZERO_BUFFER_SIZE);
+
+        if(put(s->sock, s->zero, once) != (ssize_t) once) {
+            log_error("Failed to write some zeroes to device: %s.", strerror(errno));
+            return error;
+        }
+
+        length -= once;
+    }
+
+    return ok;
+}
+
+// direct transmission from the image file to the socket using sendfile
+static status send_file(int sock, int fd, u64 offset, u64 length)
+{
+    off_t file_offset = offset;
+
+    while (length > 0) {
+        ssize_t once = sendfile(sock, fd, &file_offset, length);
+
+        if(once <= 0) {
+            if(once == -1 && errno == EINTR) continue;
+
+            log_error("Failed to send some data from image to device: %s.",
+                    once == 0 ? "unexpected end of file" : strerror(errno));
+            return error;
+        }
+
+        length -= once;
+    }
+
+    return ok;
+}
+
+// ... from the pieces of the image file which the range spans
+static status send_image(int sock, struct image *img, u64 offset, u64 length)
+{
+    // data of a stream is sent once it has arrived in the spill file
+    if(wait_segments(&img->segments, offset, length) == error) return error;
+
+    while (length > 0) {
+        struct file_segment *segment = find_segment(&img->segments, offset);
+        u64 position = offset - segment->offset;
+        u64 once = position < segment->size ? MIN(length, segment->size - position) : length;
+
+        if(send_file(sock, segment->fd, position, once) == error) return error;
+
+        offset += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+// the same through load_chunk(): through the SSD cache, decompressed, or from
+// replicas. Chunks are copied to the buffer, as slots of the cache file are
+// overwritten when reused - data passed to sendfile() could change before it
+// is sent.
+static status send_loaded(int sock, struct image *img, u64 offset, u64 length,
+        u8 **buffer)
+{
+    if(*buffer == NULL &&
+       posix_memalign((void**) buffer, DIRECT_ALIGNMENT, BLOCK_CACHE_CHUNK) != 0) {
+        *buffer = NULL;
+        log_error("Cannot allocate memory for a chunk.");
+        return error;
+    }
+
+    while (length > 0) {
+        u64 index = offset / BLOCK_CACHE_CHUNK;
+        u64 skip = offset % BLOCK_CACHE_CHUNK;
+        u64 once = MIN(BLOCK_CACHE_CHUNK - skip, length);
+
+        ssize_t length_read = load_chunk(img, index, *buffer);
+
+        if(length_read < (ssize_t) (skip + once)) {
+            log_error("Failed to send some data from image to device: "
+                    "unexpected end of file.");
+            return error;
+        }
+
+        if(put(sock, *buffer + skip, once) != (ssize_t) once) return error;
+
+        offset += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+// the same through the block cache; chunks which cannot be cached are sent
+// directly (or through the buffer). The last chunk used is kept in *current
+// (its index in *current_index), so that blocks of one chunk split by
+// checksums are looked up (and counted by the cache) once. Offsets are in the
+// device with --dedup (see dedup.h).
+static status send_cached(int sock, struct image *img, u64 offset, u64 length,
+        struct chunk **current, u64 *current_index, u8 **buffer)
+{
+    while (length > 0) {
+        u64 index = offset / BLOCK_CACHE_CHUNK;
+        u64 skip = offset % BLOCK_CACHE_CHUNK;
+        u64 once = MIN(BLOCK_CACHE_CHUNK - skip, length);
+
+        if(*current == NULL || *current_index != index) {
+            if(*current) release_chunk(*current);
+            *current = get_chunk(img, index);
+            *current_index = index;
+        }
+
+        if(*current == NULL) {
+            status result = img->compressed || device_chunks(img) ?
+                send_loaded(sock, img, offset, once, buffer) :
+                send_image(sock, img, offset, once);
+
+            if(result == error) return error;
+        } else if(skip + once > chunk_length(*current)) {
+            log_error("Failed to send some data from image to device: "
+                    "unexpected end of file.");
+            return error;
+        } else if(put(sock, (u8*) chunk_data(*current) + skip, once) != (ssize_t) once) {
+            return error;
+        }
+
+        offset += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+// A part of the image file read with O_DIRECT: an aligned superset of the
+// requested ranges, so that consecutive blocks (and checksums between them)
+// are read at once.
+struct window
+{
+    u8 *buffer;
+    u64 start;
+    u64 length;
+};
+
+static ssize_t read_direct(struct image *img, u64 offset, size_t length, u8 *buffer)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t once = pread(img->direct_fd, buffer + done, length - done, offset + done);
+
+        if(once == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        // a short read happens only at the end of the file
+        if(once == 0 || once % DIRECT_ALIGNMENT != 0) return done + once;
+        done += once;
+    }
+
+    return done;
+}
+
+static status send_direct(int sock, struct image *img, u64 offset, u64 length,
+        struct window *window)
+{
+    while (length > 0) {
+        if(offset < window->start || offset >= window->start + window->length) {
+            window->start = offset & ~(u64) (DIRECT_ALIGNMENT - 1);
+
+            // clients reading the same data at once share one read
+            ssize_t length_read = read_coalesced(img, window->start, DIRECT_BUFFER_SIZE,
+                    window->buffer, read_direct);
+
+            if(length_read == -1) {
+                log_error("Failed to read image data: %s.", strerror(errno));
+                window->length = 0;
+                return error;
+            }
+
+            window->length = length_read;
+
+            if(offset >= window->start + window->length) {
+                log_error("Failed to send some data from image to device: "
+                        "unexpected end of file.");
+                return error;
+            }
+        }
+
+        u64 once = MIN(length, window->start + window->length - offset);
+
+        if(put(sock, window->buffer + (offset - window->start), once) != (ssize_t) once) {
+            return error;
+        }
+
+        offset += once;
+        length -= once;
+    }
+
+    return ok;
+}
+
+// send the data of present blocks starting from the given device offset
+static status send_blocks(struct session *s, u64 position, u64 length)
+{
+    struct image *img = s->img;
+    struct chunk *current = NULL;
+    u64 current_index = 0;
+    struct window window = { NULL, 0, 0 };
+    status result = ok;
+
+    u64 rank = block_rank(img, position / img->block_size);
+    u64 skip = position % img->block_size;
+
+    // present blocks are stored one after another in the arena
+    if(img->arena) {
+        u8 *data = img->arena + rank * img->block_size + skip;
+        return put(s->sock, data, length) == (ssize_t) length ? ok : error;
+    }
+
+    // ... and in the local copy; read once, so begin and end always match
+    struct hydration *hydration = current_hydration(img);
+    u64 started = 0;
+
+    if(hydration) {
+        int fd;
+
+        if(hydrated_range(img, hydration, rank, skip, length, &fd)) {
+            return send_file(s->sock, fd, rank * img->block_size + skip, length);
+        }
+
+        started = begin_foreground(hydration);
+    }
+
+    u8 *chunk_buffer = NULL;
+
+    // without a free buffer the page cache is used
+    if(!block_cache_enabled() && !ssd_cache_enabled() && img->direct_fd != -1) {
+        window.buffer = acquire_buffer();
+    }
+
+    // chunks of the caches are chunks of the device, not of the image file
+    if(device_chunks(img)) {
+        result = block_cache_enabled() ?
+            send_cached(s->sock, img, position, length, &current, &current_index, &chunk_buffer) :
+            send_loaded(s->sock, img, position, length, &chunk_buffer);
+    } else {
+        while (length > 0) {
+            // blocks are stored one after another up to the next checksum
+            u64 blocks = img->checksum_size ?
+                img->blocks_per_checksum - rank % img->blocks_per_checksum :
+                divide_up(skip + length, img->block_size);
+
+            u64 once = MIN(blocks * img->block_size - skip, length);
+            u64 offset = rank_offset(img, rank) + skip;
+
+            if(block_cache_enabled()) {
+                result = send_cached(s->sock, img, offset, once, &current, &current_index,
+                        &chunk_buffer);
+            } else if(ssd_cache_enabled() || img->compressed || img->replicas) {
+                result = send_loaded(s->sock, img, offset, once, &chunk_buffer);
+            } else if(window.buffer) {
+                result = send_direct(s->sock, img, offset, once, &window);
+            } else {
+                result = send_image(s->sock, img, offset, once);
+            }
+
+            if(result == error) break;
+
+            length -= once;
+            rank += blocks;
+            skip = 0;
+        }
+    }
+
+    if(current) release_chunk(current);
+    if(window.buffer) release_buffer(window.buffer);
+    free(chunk_buffer);
+    if(hydration) end_foreground(hydration, started);
+
+    return result;
+}
+
+static status handle_read(struct session *s, struct request *req)
+{
+    struct image *img = s->img;
+
+    if(!s->structured) {
+        if(send_reply(s->sock, req->handle, 0) == error) return error;
+    } else if(req->length == 0) {
+        return send_chunk(s, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, 0);
+    }
+
+    u64 position = req->offset;
+    u64 end = req->offset + req->length;
+    u64 last_block = divide_up(end, img->block_size);
+
+    // The request is sent extent by extent; an extent is a run of present (or
+    // absent) blocks. A chunk cannot be longer than its 32-bit length field
+    // allows - except data chunks with extended headers - and the size of a
+    // hole is always 32-bit.
+
+    u64 max_data = s->extended ? end - position : MAX_CHUNK_SIZE;
+
+    while (position < end) {
+        u8 existence;
+
+        u64 block = position / img->block_size;
+        u64 blocks = find_extent(img, block, last_block, &existence);
+        u64 extent_end = MIN((block + blocks) * img->block_size, end);
+        u64 once = extent_end - position;
+
+        if(s->structured) {
+            once = MIN(once, existence ? max_data : MAX_CHUNK_SIZE);
+        }
+
+        u16 flags = position + once == end ? NBD_REPLY_FLAG_DONE : 0;
+
+        if(!s->structured) {
+            if(existence == 0) {
+                if(send_zeroes(s, once) == error) return error;
+            } else {
+                if(send_blocks(s, position, once) == error) return error;
+            }
+        } else if(existence == 0) {
+            // offset (64 bits) and length of the hole (32 bits)
+            if(send_chunk(s, req, flags, NBD_REPLY_TYPE_OFFSET_HOLE, 12) == error ||
+               put64(s->sock, position) == error                                  ||
+               put32(s->sock, once) == error                                      ){
+            /* -------------------------------------------------------------- */
+                return error;
+            }
+        } else {
+            // offset (64 bits) followed by the data
+            if(send_chunk(s, req, flags, NBD_REPLY_TYPE_OFFSET_DATA, 8 + once) == error ||
+               put64(s->sock, position) == error                                        ||
+               send_blocks(s, position, once) == error                                  ){
+            /* -------------------------------------------------------------- */
+                return error;
+            }
+        }
+
+        position += once;
+    }
+
+    return ok;
+}
+
+// describe the runs of equal bits of the bitmap in s->extents; runs of set
+// bits get set_flags, runs of cleared bits get clear_flags. Descriptors are
+// 32-bit (length, flags) pairs or, with extended headers, 64-bit ones.
+static u32 collect_extents(struct session *s, const u64 *bitmap, u64 offset,
+        u64 length, u32 max_extents, u32 set_flags, u32 clear_flags)
+{
+    struct image *img = s->img;
+    u32 extents = 0;
+
+    u64 position = offset;
+    u64 end = offset + length;
+    u64 last_block = divide_up(end, img->block_size);
+
+    u32 *narrow = (u32*) s->extents;
+
+    // neighbouring extents always differ, as find_run() returns the whole
+    // run of blocks
+    while (position < end && extents < max_extents) {
+        u8 value;
+
+        u64 block = position / img->block_size;
+        u64 blocks = find_run(bitmap, block, last_block, &value);
+        u64 extent_end = MIN((block + blocks) * img->block_size, end);
+        u32 flags = value ? set_flags : clear_flags;
+
+        if(s->extended) {
+            s->extents[2 * extents] = swap64(extent_end - position);
+            s->extents[2 * extents + 1] = swap64(flags);
+        } else {
+            narrow[2 * extents] = swap32(extent_end - position);
+            narrow[2 * extents + 1] = swap32(flags);
+        }
+
+        extents++;
+        position = extent_end;
+    }
+
+    return extents;
+}
+
+static status handle_block_status(struct session *s, struct request *req)
+{
+    struct image *img = s->img;
+
+    if((!s->base_allocation && !s->diff) || req->length == 0) {
+        log_error("Parsing request: Unexpected block status request.");
+        return send_error(s, req, EINVAL);
+    }
+
+    // a 32-bit extent length cannot describe requests longer than 4 GiB;
+    // the reply is shorter then, which is allowed
+    u64 length = s->extended ? req->length :
+        MIN(req->length, 0xFFFFFFFF - img->block_size + 1);
+
+    u32 max_extents = (req->flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : MAX_EXTENTS;
+
+    // one chunk per selected context, the last one ends the reply
+    int context;
+
+    for (context = 0; context < 2; context++) {
+        u32 id, extents;
+
+        if(context == 0 && s->base_allocation) {
+            // absent blocks, and blocks of zeroes (--zero-blocks), read as zeroes
+            const u64 *bitmap = img->nonzero_ptr ? img->nonzero_ptr : img->bitmap_ptr;
+
+            id = CONTEXT_BASE_ALLOCATION;
+            extents = collect_extents(s, bitmap, req->offset, length,
+                    max_extents, 0, NBD_STATE_HOLE | NBD_STATE_ZERO);
+        } else if(context == 1 && s->diff) {
+            id = CONTEXT_DIFF;
+            extents = collect_extents(s, img->diff_ptr, req->offset, length,
+                    max_extents, NBD_STATE_DIRTY, 0);
+        } else {
+            continue;
+        }
+
+        u16 flags = (context == 1 || !s->diff) ? NBD_REPLY_FLAG_DONE : 0;
+        status result;
+
+        if(s->extended) {
+            // context id, number of descriptors, 128-bit descriptors
+            u64 size = extents * 2 * sizeof(u64);
+
+            result = send_chunk(s, req, flags,
+                        NBD_REPLY_TYPE_BLOCK_STATUS_EXT, 8 + size) == ok &&
+                     put32(s->sock, id) == ok                            &&
+                     put32(s->sock, extents) == ok                       &&
+                     put(s->sock, s->extents, size) == (ssize_t) size ? ok : error;
+        } else {
+            // context id, 64-bit descriptors
+            u64 size = extents * 2 * sizeof(u32);
+
+            result = send_chunk(s, req, flags,
+                        NBD_REPLY_TYPE_BLOCK_STATUS, 4 + size) == ok &&
+                     put32(s->sock, id) == ok                        &&
+                     put(s->sock, s->extents, size) == (ssize_t) size ? ok : error;
+        }
+
+        if(result == error) {
+            log_error("Failed to send block status.");
+            return error;
+        }
+    }
+
+    return ok;
+}
+
+// NBD_CMD_CACHE - the range is read ahead into the block cache or the page
+// cache; the reply does not wait for it unless the background queue is full
+static status handle_cache(struct session *s, struct request *req)
+{
+    // in the background if possible
+    if(schedule_prefetch(s->img, req->offset, req->length) == error) {
+        fetch_range(s->img, req->offset, req->length);
+    }
+
+    return send_done(s, req);
+}
+
+static status get_request(struct session *s, struct request *req)
+{
+    u32 magic, length;
+
+    if(get32(s->sock, &magic) == error) return error;
+
+    if(magic == NBD_REQUEST_MAGIC && !s->extended) {
+        if(get16(s->sock, &req->flags) == error   || // command flags
+           get16(s->sock, &req->type) == error    || // 0 -read
+           get64(s->sock, &req->handle) == error  || // handle
+           get64(s->sock, &req->offset) == error  || // seek
+           get32(s->sock, &length) == error       ){ // length
+        // ----------------------------------------------------------------- //
+            return error;
+        }
+
+        req->length = length;
+    } else if(magic == NBD_EXTENDED_REQUEST_MAGIC && s->extended) {
+        if(get16(s->sock, &req->flags) == error   ||
+           get16(s->sock, &req->type) == error    ||
+           get64(s->sock, &req->handle) == error  ||
+           get64(s->sock, &req->offset) == error  ||
+           get64(s->sock, &req->length) == error  ){
+        // ----------------------------------------------------------------- //
+            return error;
+        }
+    } else {
+        log_error("Parsing request: Bad magic.");
+        return error;
+    }
+
+    return ok;
+}
+
+static status open_session(struct session *s, int sock, struct image *img)
+{
+    *s = (struct session) {
+        .sock = sock,
+        .img = img,
+        .meta_export = NULL,
+        .structured = 0,
+        .extended = 0,
+        .base_allocation = 0,
+        .diff = 0
+    };
+
+    reset_readahead(&s->readahead);
 
     // calloc do malloc and fills buffer with zeroes
-    zero = calloc(img->block_size, 1); // "1" means size, NOT "fill with 1"
+    s->zero = calloc(ZERO_BUFFER_SIZE, 1); // "1" means size, NOT "fill with 1"
+    s->extents = malloc(MAX_EXTENTS * 2 * sizeof(u64));
 
-    if(zero == NULL) /* allocation failed */ {
+    if(s->zero == NULL || s->extents == NULL) /* allocation failed */ {
         log_error("Cannot allocate memory for storing a chunk.");
-        goto error_1;
+        free(s->extents);
+        free(s->zero);
+        return error;
     } else {
         log_debug("Memory for storing a chunk allocated.");
     }
-    
-    // set signal return point; must be before initialize_handling() (!)
-    int sig_num = sigsetjmp(env, 1); 
 
-    if (sig_num != 0) {
-        block_signals_in_thread();
-        log_error("Signal \"%s\" caught.", strsignal(sig_num));
-        goto error_3;
-    } else {
-        log_debug("Signal return point set.");
-    }
-    
-    
-    initialize_handling(); // initialize signal handling
+    return ok;
+}
+
+static void close_session(struct session *s)
+{
+    free(s->extents);
+    free(s->zero);
+}
+
+static status WORKER(struct session *s)
+{
+    struct image *img = s->img;
+
+    start_profile(img);
+    prefetch_metadata(img);
+    start_hydration(img);
 
     // ====================================================================== //
     // ======================== REQUEST & REPLIES =========================== //
@@ -190,207 +911,606 @@ static status WORKER(int sock, struct image *img)
     /* the great loop */
     for(;;)
     {
-        u32 magic, count, type;
-        u64 seek, handle;
-
-        if(get32(sock, &magic) == error   || // 0x25609513
-           get32(sock, &type) == error    || // 0 -read
-           get64(sock, &handle) == error  || // handle
-           get64(sock, &seek) == error    || // seek
-           get32(sock, &count) == error   ){ // length
-        // ----------------------------------------------------------------- //
+        struct request req;
+
+        if(get_request(s, &req) == error) {
             log_error("Failed to read request.");
             break;
         }
 
-        if(magic != 0x25609513) {
-            log_error("Parsing request: Bad magic.");
-        }
+        // verify request
+        if(req.offset > img->device_size ||
+           req.length > img->device_size - req.offset) {
+        // ----------------------------------------------------------------- //
+            log_msg(log_error,
+                    "Parsing request: Offset is beyond the end of the image.");
+            if(send_error(s, &req, EINVAL) == ok) continue;
+            else break;
+        // write (1), flush (3) or trim (4) on a RO device is not permitted
+        } else if(req.type == NBD_CMD_WRITE || req.type == NBD_CMD_FLUSH ||
+                  req.type == NBD_CMD_TRIM) {
+            log_error("Parsing request: Unexpected operation in "
+                               "RO mode.");
+            if(send_error(s, &req, EPERM) == ok) continue;
+            else break;
+        } else if(req.type == NBD_CMD_DISC) { /* disconnect request */
+            log_error("Client sent a disconnect request.");
+            break;
+        } else if(req.type == NBD_CMD_BLOCK_STATUS) {
+            if(handle_block_status(s, &req) == error) break;
+            continue;
+        } else if(req.type == NBD_CMD_CACHE) {
+            if(handle_cache(s, &req) == error) break;
+            continue;
+        } else if(req.type != NBD_CMD_READ) { /* unknown request */
+            log_error("Parsing request: Unexpected request type.");
+            if(send_error(s, &req, EINVAL) == ok) continue;
+            else break;
+        }
+
+        observe_read(&s->readahead, img, req.offset, req.length);
+        record_read(img, req.offset, req.length);
+
+        if(handle_read(s, &req) == error) break;
+    }
+
+    log_error("WORKER closed.");
+    return error;
+}
+
+// SERVER MODE vs CLIENT MODE
+
+// Both client mode and server mode try to gain socket to communicate with a
+// client. Client can be on the same computer as partclone-nbd, or somewhere in
+// the internet.
+
+// Server mode can serve image to another computers through the INET socks.
+
+// Client mode is much faster than server, because it uses UNIX(r) sockets,
+// not INET sockets. But, of course, it's limited to one machine.
+
+// Both client mode and server mode finally call WORKER function.
+
+/* ------------------------- SERVER MODE --------------------------------- */
+
+static status server_negotiation(int sock);
+
+// Every connection is served by its own thread. Connections in progress are
+// listed, so that they can be shut down when the server stops.
+struct connection
+{
+    int sock;
+    pthread_t thread;
+    struct connection *next;
+};
+
+static struct connection *connections = NULL;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_finished = PTHREAD_COND_INITIALIZER;
+
+static void *serve_connection(void *connection_addr)
+{
+    struct connection *conn = connection_addr;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    server_negotiation(conn->sock);
+
+    pthread_mutex_lock(&connections_lock);
+
+    struct connection **it = &connections;
+    while (*it != conn) it = &(*it)->next;
+    *it = conn->next;
+
+    if(close(conn->sock) == -1) {
+        log_error("Failed to close client sock: %s.", strerror(errno));
+    } else {
+        log_debug("Client sock closed.");
+    }
+
+    pthread_cond_signal(&connections_finished);
+    pthread_mutex_unlock(&connections_lock);
+
+    free(conn);
+    return NULL;
+}
+
+static void start_connection(int sock)
+{
+    struct connection *conn = malloc(sizeof *conn);
+
+    if(conn == NULL) {
+        log_error("Cannot allocate memory for a connection.");
+        close(sock);
+        return;
+    }
+
+    conn->sock = sock;
+
+    pthread_mutex_lock(&connections_lock);
+
+    conn->next = connections;
+    connections = conn;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int result = pthread_create(&conn->thread, &attr, serve_connection, conn);
+
+    pthread_attr_destroy(&attr);
+
+    if(result != 0) {
+        log_error("Failed to create connection thread: %s.", strerror(result));
+        connections = conn->next;
+        close(sock);
+        free(conn);
+    }
+
+    pthread_mutex_unlock(&connections_lock);
+}
+
+// shut down sockets of all connections and wait for their threads
+static void stop_connections(void)
+{
+    pthread_mutex_lock(&connections_lock);
+
+    struct connection *conn;
+
+    for (conn = connections; conn; conn = conn->next) {
+        shutdown(conn->sock, SHUT_RDWR);
+    }
+
+    while (connections != NULL) {
+        pthread_cond_wait(&connections_finished, &connections_lock);
+    }
+
+    pthread_mutex_unlock(&connections_lock);
+
+    log_debug("All connections closed.");
+}
+
+status start_server(struct options *options)
+{
+    // create listener socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(sock == -1) {
+        log_error("Failed to create a socket: %s.", strerror(errno));
+        return error;
+    } else {
+        log_debug("Socket created.");
+    }
+
+    // allow to reuse address
+    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
+        log_error("Failed to reuse address: %s.", strerror(errno));
+    } else {
+        log_debug("Address reused.");
+    }
+
+    // bind port to a socket
+    struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(options->port),
+        .sin_zero = { 0 }
+    };
+
+    if(bind(sock, (struct sockaddr*) &server_addr, sizeof server_addr) == -1) {
+        log_error("Failed to bind port to a socket: %s.", strerror(errno));
+        goto error;
+    } else {
+        log_debug("Socket binded to a port.");
+    }
+
+    // start listening on a port
+    if(listen(sock, 5) == -1) {
+        log_error("Failed to start listening on a port.");
+        goto error;
+    } else {
+        log_debug("Listening on a port started.");
+    }
+
+    // signals are taken here, between connections, never inside a lock
+    int signal_fd = open_signal_fd();
+
+    if(signal_fd == -1) goto error;
+
+    log_info("Server initialized. Listening on a port %i ...", options->port);
+
+    for(;;) {
+        struct pollfd polled[2] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = signal_fd, .events = POLLIN }
+        };
+
+        if(poll(polled, 2, -1) == -1) {
+            if(errno != EINTR) log_error("Failed to wait for a connection: %s.", strerror(errno));
+            continue;
+        }
+
+        if(polled[1].revents & POLLIN) {
+            signal_t sig_num = read_signal(signal_fd);
+            log_info("Signal \"%s\" caught. Stopping server ...", strsignal(sig_num));
+
+            stop_connections();
+            close(signal_fd);
+            close(sock);
+
+            u64 reads, joined;
+            coalesce_stats(&reads, &joined);
+            log_debug("Chunk reads: " fu64 ", shared: " fu64 ".", reads, joined);
+
+            u64 scheduled, fetched;
+            readahead_stats(&scheduled, &fetched);
+            log_debug("Prefetch ranges: " fu64 " queued, " fu64 " fetched.", scheduled, fetched);
+
+            return ok;
+        }
+
+        if(!(polled[0].revents & POLLIN)) continue;
+
+        /* accept a connection */
+        struct sockaddr_in clientaddr;
+        socklen_t clientaddrlen = sizeof clientaddr;
+
+        int cl_sock = accept(sock, (struct sockaddr*) &clientaddr, &clientaddrlen);
+
+        if(cl_sock == -1) {
+            log_error("Failed to accept a connection.");
+            continue;
+        }
+
+        log_info("Connection made with %s.", inet_ntoa(clientaddr.sin_addr));
+
+        // a reply header and its data are sent separately; do not let the
+        // data wait for the acknowledgement of the header
+        if(setsockopt(cl_sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1) {
+            log_error("Failed to disable Nagle's algorithm: %s.", strerror(errno));
+        }
+
+        start_connection(cl_sock);
+    }
+
+error:
+    if(close(sock) == -1) {
+        log_error("Failed to close main sock: %s.", strerror(errno));
+    } else {
+        log_debug("Main sock closed.");
+    }
+
+    return error;
+}
+
+static status send_option_reply(int sock, u32 option, u32 type, u32 length)
+{
+    if(put64(sock, NBD_REP_MAGIC) == error  ||
+       put32(sock, option) == error         ||
+       put32(sock, type) == error           ||
+       put32(sock, length) == error         ){
+    /* ---------------------------------------------------------------------- */
+        log_error("Failed to send reply for an option.");
+        return error;
+    }
+
+    return ok;
+}
+
+
+// transmission flags of the export
+static u16 export_flags(void)
+{
+    // bit 0 (HAS_FLAGS) should always be 1
+    // bit 1 should be set to 1 if the export is read-only
+    // bit 2 should be set to 1 if the server supports NBD_CMD_FLUSH commands
+    // bit 3 should be set to 1 if the server supports the NBD_CMD_FLAG_FUA flag
+    // bit 4 should be set to 1 to let the client schedule I/O accesses as for a
+    //       rotational medium
+    // bit 5 NBD_FLAG_SEND_TRIM; should be set to 1 if the server supports
+    //       NBD_CMD_TRIM commands
+    // bit 8 NBD_FLAG_CAN_MULTI_CONN; set if many connections to the export
+    //       see the same data - exports are read-only
+    // bit 10 NBD_FLAG_SEND_CACHE; set if the server supports NBD_CMD_CACHE
+    return NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN |
+           NBD_FLAG_SEND_CACHE;
+}
+
+// NBD_OPT_LIST - reply with names of all exports
+static status handle_list(struct session *s, u32 option, u32 length)
+{
+    if(length != 0) {
+        return send_option_reply(s->sock, option, NBD_REP_ERR_INVALID, 0);
+    }
+
+    size_t i;
+
+    for (i = 0; i < exports_count(); i++) {
+        char *name = export_at(i)->name;
+        u32 name_length = strlen(name);
+
+        // (32 bits) length of the name and the name
+        if(send_option_reply(s->sock, option, NBD_REP_SERVER, 4 + name_length) == error ||
+           put32(s->sock, name_length) == error                                        ||
+           put(s->sock, name, name_length) != name_length                              ){
+        /* ------------------------------------------------------------------ */
+            return error;
+        }
+    }
+
+    return send_option_reply(s->sock, option, NBD_REP_ACK, 0);
+}
+
+static status send_block_size(struct session *s, u32 option, struct image *img)
+{
+    /* Reads of any size and alignment are served, but a multiple of the
+     * image block size is the most efficient one: it is sent as whole
+     * extents. Sector alignment is required only if the device size allows.
+     */
+
+    u32 minimum = img->device_size % 512 == 0 ? 512 : 1;
+    u32 preferred = img->block_size;
+
+    // with extended headers a request is limited only by the device size
+    u32 maximum = s->extended ? 0xFFFFFFFF : MAX_PAYLOAD_SIZE;
+
+    // preferred size must be a power of 2, not smaller than the minimum
+    if((preferred & (preferred - 1)) != 0 || preferred < minimum) {
+        preferred = 4 * kilobyte;
+    }
+
+    if(send_option_reply(s->sock, option, NBD_REP_INFO, 14) == error ||
+       put16(s->sock, NBD_INFO_BLOCK_SIZE) == error                  ||
+       put32(s->sock, minimum) == error                              ||
+       put32(s->sock, preferred) == error                            ||
+       put32(s->sock, maximum) == error                              ){
+    /* ---------------------------------------------------------------------- */
+        return error;
+    }
+
+    return ok;
+}
 
-        // verify request
-        if(seek > img->device_size || count + seek > img->device_size) {
-        // ----------------------------------------------------------------- //
-            log_msg(log_error,
-                    "Parsing request: Offset is beyond the end of the image.");
-            if(send_reply(sock, handle, EINVAL) == ok) continue;
-            else break;
-        // write (1), flush (3) or trim (4) on a RO device is not permitted
-        } else if(type == 1 || type == 3 || type == 4) {
-            log_error("Parsing request: Unexpected operation in "
-                               "RO mode.");
-            if(send_reply(sock, handle, EPERM) == ok) continue;
-            else break;
-        } else if(type == 2) { /* disconnect request */
-            log_error("Client sent a disconnect request.");
-            break;
-        } else if(type != 0) { /* unknown request; 0 - read request */
-            log_error("Parsing request: Unexpected request type.");
-            break;
-        }
+static void select_export(struct session *s, struct export *export);
 
-        if(send_reply(sock, handle, 0) == error) break;
+// NBD_OPT_INFO and NBD_OPT_GO
+//   (32 bits) length of the export name, export name,
+//   (16 bits) number of information requests, requests: (16 bits) type
+static status handle_info(struct session *s, u32 option, u8 *data, u32 length,
+        int *acknowledged)
+{
+    u32 name_length;
+    u16 requests, type, i;
 
-        u64 block  = seek / img->block_size;
-        u32 offset = seek % img->block_size;
+    *acknowledged = 0;
 
-        if(set_block(img, block) == error) goto error_3;
-        if(offset_in_current_block(img, offset) == error) goto error_3;
+    if(length < 6) goto invalid;
 
-        // send all chunks; size of chunk = size of image block (see *buff)
-        for (;count > 0;) {
+    memcpy(&name_length, data, 4);
+    name_length = swap32(name_length);
 
-            u32 once_read = MIN(img->o_remaining_bytes, count);
-            count -= once_read;
-            img->o_remaining_bytes -= once_read;
+    if(name_length > length - 6) goto invalid;
 
-            // ------------------------------------------------------------- //
+    memcpy(&requests, data + 4 + name_length, 2);
+    requests = swap16(requests);
 
-            if(img->o_existence == 0) {
+    if(length != 6 + name_length + 2 * (u32) requests) goto invalid;
 
-                if(put(sock, zero, once_read) != once_read) {
-                    log_error("Failed to write some zeroes to device: %s.", strerror(errno));
-                    goto error_3;
-                }
+    struct export *export = find_export(data + 4, name_length);
 
-            } else {
-                
-                // direct transmission from device to device using sendfile
-                if(sendfile(sock, img->fd, NULL, once_read) != once_read) {
-                    log_error("Failed to send some data from image to device: %s.", strerror(errno));
-                    goto error_3;
-                }
+    if(export == NULL) {
+        log_error("Unknown export requested.");
+        return send_option_reply(s->sock, option, NBD_REP_ERR_UNKNOWN, 0);
+    }
 
-            }
+    // NBD_INFO_EXPORT is always sent: (64 bits) size, (16 bits) flags
+    if(send_option_reply(s->sock, option, NBD_REP_INFO, 12) == error ||
+       put16(s->sock, NBD_INFO_EXPORT) == error                      ||
+       put64(s->sock, export->img.device_size) == error              ||
+       put16(s->sock, export_flags()) == error                       ){
+    /* ---------------------------------------------------------------------- */
+        return error;
+    }
+
+    u8 *request = data + 6 + name_length;
+
+    for (i = 0; i < requests; i++, request += 2) {
+        memcpy(&type, request, 2);
+        type = swap16(type);
 
-            // ------------------------------------------------------------- //
+        status result = ok;
 
-            if (next_block(img) == error) goto error_3;
+        if(type == NBD_INFO_BLOCK_SIZE) {
+            result = send_block_size(s, option, &export->img);
+        } else if(type == NBD_INFO_NAME) {
+            // (16 bits) type followed by the name
+            result = send_option_reply(s->sock, option, NBD_REP_INFO, 2 + name_length);
+            if(result == ok) result = put16(s->sock, NBD_INFO_NAME);
+            if(result == ok && put(s->sock, data + 4, name_length) != name_length) result = error;
         }
+
+        if(result == error) return error;
     }
 
-error_3:
-    free(zero);
+    if(option == NBD_OPT_GO) {
+        select_export(s, export);
+    }
 
-error_1:
-    log_error("WORKER closed.");
-    return error;
+    *acknowledged = 1;
+    return send_option_reply(s->sock, option, NBD_REP_ACK, 0);
+
+invalid:
+    log_error("Malformed export information option.");
+    return send_option_reply(s->sock, option, NBD_REP_ERR_INVALID, 0);
 }
 
-// SERVER MODE vs CLIENT MODE
+// metadata contexts known to the server
+static const struct {
+    char *name;
+    u32 id;
+} contexts[] = {
+    {"base:allocation", CONTEXT_BASE_ALLOCATION},
+    // blocks changed since the base image (--diff-base)
+    {"partclone:diff",  CONTEXT_DIFF},
+    {0}
+};
+
+static int context_available(struct export *export, u32 id)
+{
+    return id != CONTEXT_DIFF || export->img.diff_ptr != NULL;
+}
 
-// Both client mode and server mode try to gain socket to communicate with a
-// client. Client can be on the same computer as partclone-nbd, or somewhere in
-// the internet.
+// does the query select the context? Only NBD_OPT_LIST_META_CONTEXT may
+// use a bare namespace ("base:") to select every context within it.
+static int query_matches(const u8 *query, u32 length, const char *context,
+        u32 option)
+{
+    size_t context_length = strlen(context);
 
-// Server mode can serve image to another computers through the INET socks.
+    if(length == context_length && memcmp(query, context, length) == 0) {
+        return 1;
+    }
 
-// Client mode is much faster than server, because it uses UNIX(r) sockets,
-// not INET sockets. But, of course, it's limited to one machine.
+    return option == NBD_OPT_LIST_META_CONTEXT   &&
+           length > 0 && query[length - 1] == ':' &&
+           length < context_length                &&
+           memcmp(query, context, length) == 0;
+}
 
-// Both client mode and server mode finally call WORKER function.
+static status send_meta_context(struct session *s, u32 option, int i)
+{
+    u32 length = strlen(contexts[i].name);
 
-/* ------------------------- SERVER MODE --------------------------------- */
+    if(send_option_reply(s->sock, option, NBD_REP_META_CONTEXT, 4 + length) == error ||
+       put32(s->sock, contexts[i].id) == error                                      ||
+       put(s->sock, contexts[i].name, length) != length                             ){
+    /* ---------------------------------------------------------------------- */
+        return error;
+    }
 
-static status server_negotiation(int sock, struct image *img);
+    return ok;
+}
 
-status start_server(struct image *img, struct options *options)
+static void select_context(struct session *s, u32 id)
 {
-    // create listener socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(id == CONTEXT_BASE_ALLOCATION) s->base_allocation = 1;
+    if(id == CONTEXT_DIFF) s->diff = 1;
+}
 
-    if(sock == -1) {
-        log_error("Failed to create a socket: %s.", strerror(errno));
-        return error;
-    } else {
-        log_debug("Socket created.");
-    }
+// contexts selected for one export do not carry over to another one
+static void select_export(struct session *s, struct export *export)
+{
+    s->img = &export->img;
 
-    // allow to reuse address
-    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
-        log_error("Failed to reuse address: %s.", strerror(errno));
-    } else {
-        log_debug("Address reused.");
+    if(s->meta_export != export) {
+        s->base_allocation = 0;
+        s->diff = 0;
     }
+}
 
-    // bind port to a socket
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_port = htons(options->port),
-        .sin_zero = { 0 }
-    };
+// NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT
+//   (32 bits) length of the export name, export name,
+//   (32 bits) number of queries, queries: (32 bits) length, query
+static status handle_meta_context(struct session *s, u32 option, u8 *data,
+        u32 length)
+{
+    u32 name_length, queries, query_length, i, j;
 
-    if(bind(sock, (struct sockaddr*) &server_addr, sizeof server_addr) == -1) {
-        log_error("Failed to bind port to a socket: %s.", strerror(errno));
-        goto error;
-    } else {
-        log_debug("Socket binded to a port.");
+    if(length < 4) goto invalid;
+
+    memcpy(&name_length, data, 4);
+    name_length = swap32(name_length);
+
+    if(name_length > length - 8 || length < 8) goto invalid;
+
+    struct export *export = find_export(data + 4, name_length);
+
+    if(export == NULL) {
+        log_error("Metadata contexts of an unknown export requested.");
+        return send_option_reply(s->sock, option, NBD_REP_ERR_UNKNOWN, 0);
     }
 
-    // start listening on a port
-    if(listen(sock, 5) == -1) {
-        log_error("Failed to start listening on a port.");
-        goto error;
-    } else {
-        log_debug("Listening on a port started.");
+    memcpy(&queries, data + 4 + name_length, 4);
+    queries = swap32(queries);
+
+    if(option == NBD_OPT_SET_META_CONTEXT) {
+        if(!s->structured) {
+            log_error("Metadata context set before structured replies.");
+            return send_option_reply(s->sock, option, NBD_REP_ERR_INVALID, 0);
+        }
+
+        // every NBD_OPT_SET_META_CONTEXT replaces the previous selection
+        s->base_allocation = 0;
+        s->diff = 0;
+        s->meta_export = export;
     }
 
-    log_info("Server initialized. Listening on a port %i ...", options->port);
+    u8 *query = data + 8 + name_length;
+    u8 *data_end = data + length;
 
-    for(;;) {
+    for (i = 0; i < queries; i++) {
+        if(data_end - query < 4) goto invalid;
 
-        /* accept a connection */
-        struct sockaddr_in clientaddr;
-        socklen_t clientaddrlen = sizeof clientaddr;
+        memcpy(&query_length, query, 4);
+        query_length = swap32(query_length);
+        query += 4;
 
-        int cl_sock = accept(sock, (struct sockaddr*) &clientaddr, &clientaddrlen);
+        if(query_length > data_end - query) goto invalid;
 
-        if(cl_sock == -1) {
-            log_error("Failed to accept a connection.");
-            continue;
+        for (j = 0; contexts[j].name; j++) {
+            if(!context_available(export, contexts[j].id) ||
+               !query_matches(query, query_length, contexts[j].name, option)) {
+                continue;
+            }
+
+            if(option == NBD_OPT_SET_META_CONTEXT) {
+                select_context(s, contexts[j].id);
+            }
+
+            if(send_meta_context(s, option, j) == error) return error;
         }
 
-        log_info("Connection made with %s.", inet_ntoa(clientaddr.sin_addr));
-        server_negotiation(cl_sock, img);
-        break;
+        query += query_length;
     }
 
-error:
-    if(close(sock) == -1) {
-        log_error("Failed to close main sock: %s.", strerror(errno));
-    } else {
-        log_debug("Main sock closed.");
+    // with no queries, NBD_OPT_LIST_META_CONTEXT returns every context
+    if(queries == 0 && option == NBD_OPT_LIST_META_CONTEXT) {
+        for (j = 0; contexts[j].name; j++) {
+            if(!context_available(export, contexts[j].id)) continue;
+            if(send_meta_context(s, option, j) == error) return error;
+        }
     }
 
-    return error;
+    log_debug("Metadata contexts negotiated.");
+    return send_option_reply(s->sock, option, NBD_REP_ACK, 0);
+
+invalid:
+    log_error("Malformed metadata context option.");
+    return send_option_reply(s->sock, option, NBD_REP_ERR_INVALID, 0);
 }
 
-static status server_negotiation(int sock, struct image *img)
+static status server_negotiation(int sock)
 {
     u8 zero[124] = { 0 };
+    u8 data[MAX_OPTION_LENGTH];
+
+    struct session session;
+
+    if(open_session(&session, sock, NULL) == error) return error;
 
     // ====================================================================== //
     // ============================ NEGOTIATION ============================= //
     // ====================================================================== //
 
     char *magic1 = "NBDMAGIC";
-    u64   magic2 = 0x49484156454F5054;
+    u64   magic2 = NBD_OPTS_MAGIC;
 
     // bit 0 - should be set by servers that support the fixed newstyle protocol
     // bit 1 - if set, and if the client replies with NBD_FLAG_C_NO_zero in
     //         the client flags field, the server MUST NOT send the 124 bytes of
     //         zero at the end of the negotiation.
-    u16 flags1 = 0x00000000;
-
-    // bit 0 (HAS_FLAGS) should always be 1
-    // bit 1 should be set to 1 if the export is read-only
-    // bit 2 should be set to 1 if the server supports NBD_CMD_FLUSH commands
-    // bit 3 should be set to 1 if the server supports the NBD_CMD_FLAG_FUA flag
-    // bit 4 should be set to 1 to let the client schedule I/O accesses as for a
-    //       rotational medium
-    // bit 5 NBD_FLAG_SEND_TRIM; should be set to 1 if the server supports
-    //       NBD_CMD_TRIM commands
-    u16 flags2 = 0x00000003; // bit 0 and 1 set
+    u16 flags1 = NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES;
 
     u32 cl_flags;
 
@@ -425,78 +1545,171 @@ static status server_negotiation(int sock, struct image *img)
     //       set, the server MUST NOT send the 124 bytes of zero at the end of
     //       the negotiation.
 
-    if(CHECK_BIT(cl_flags, 1)) {
-        log_error("Flag NBD_FLAG_C_NOT_zero must not be set.");
+    if(cl_flags & ~(u32) (NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+        log_error("Unknown client flags set.");
         goto error_1;
     } else {
         log_debug("Flags parsed successfull.");
     }
 
+    int fixed = cl_flags & NBD_FLAG_C_FIXED_NEWSTYLE;
+    int no_zeroes = cl_flags & NBD_FLAG_C_NO_ZEROES;
+
     /* ---------------------------------------------------------------------- */
 
+    // In fixed newstyle the client may send any number of options before
+    // NBD_OPT_EXPORT_NAME; every option except it gets a reply.
+
     u64 cl_magic;
     u32 cl_option, cl_length;
 
-    if(get64(sock, &cl_magic)  == error ||
-       get32(sock, &cl_option) == error ||
-       get32(sock, &cl_length) == error ){
-    /* ---------------------------------------------------------------------- */
-        log_error("Failed to receive an option");
-        goto error_1;
-    } else {
-        log_debug("Option received.");
-    }
+    for(;;) {
+        if(get64(sock, &cl_magic)  == error ||
+           get32(sock, &cl_option) == error ||
+           get32(sock, &cl_length) == error ){
+        /* ------------------------------------------------------------------ */
+            log_error("Failed to receive an option");
+            goto error_1;
+        } else {
+            log_debug("Option received.");
+        }
 
-    if(cl_magic != magic2) {
-        log_error("Unrecognized magic number received.");
-        goto error_1;
-    }
+        if(cl_magic != magic2) {
+            log_error("Unrecognized magic number received.");
+            goto error_1;
+        }
 
-    // NBD_OPT_EXPORT_NAME (1) - This is the first and only option in nonfixed
-    // newstyle handshake (which is used there).
+        if(cl_length > MAX_OPTION_LENGTH) {
+            log_error("Option data is too long.");
 
-    if(cl_option != 1) {
-        log_error("Unrecognized option.");
-        goto error_1;
-    }
+            // drop the data, one buffer at a time
+            while (cl_length > 0) {
+                u32 once = MIN(cl_length, MAX_OPTION_LENGTH);
+                if(get(sock, data, once) != (int) once) goto error_1;
+                cl_length -= once;
+            }
 
-    // If cl_length != 0 the client tries to open custom export. It is not
-    // allowed in our implementation.
+            if(!fixed) goto error_1;
+            if(send_option_reply(sock, cl_option, NBD_REP_ERR_TOO_BIG, 0) == error) goto error_1;
 
-    if(cl_length != 0) {
-        log_error("Custom exports are not supported.");
-        goto error_1;
-    }
+            continue;
+        }
 
-    log_debug("Option parsed. Sending reply...");
+        if(get(sock, data, cl_length) != (int) cl_length) {
+            log_error("Failed to receive option data.");
+            goto error_1;
+        }
 
+        // NBD_OPT_EXPORT_NAME (1) - The only option of nonfixed newstyle
+        // handshake; it ends the negotiation.
 
-    if(put64(sock, img->device_size) == error ||
-       put16(sock, flags2)               == error ){
-    /* ---------------------------------------------------------------------- */
-        log_error("Failed to send reply for an option");
-        goto error_1;
-    } else {
-        log_debug("Reply sent.");
+        if(cl_option == NBD_OPT_EXPORT_NAME) break;
+
+        if(!fixed) {
+            log_error("Unrecognized option.");
+            goto error_1;
+        }
+
+        status result;
+        int acknowledged = 0;
+
+        switch(cl_option) {
+        case NBD_OPT_ABORT:
+            log_info("Client aborted the negotiation.");
+            send_option_reply(sock, cl_option, NBD_REP_ACK, 0);
+            goto error_1;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if(cl_length != 0) {
+                result = send_option_reply(sock, cl_option, NBD_REP_ERR_INVALID, 0);
+            } else if(session.extended) {
+                // extended headers cannot be downgraded
+                result = send_option_reply(sock, cl_option, NBD_REP_ERR_EXT_HEADER_REQD, 0);
+            } else {
+                session.structured = 1;
+                log_debug("Structured replies negotiated.");
+                result = send_option_reply(sock, cl_option, NBD_REP_ACK, 0);
+            }
+            break;
+
+        case NBD_OPT_EXTENDED_HEADERS:
+            if(cl_length != 0) {
+                result = send_option_reply(sock, cl_option, NBD_REP_ERR_INVALID, 0);
+            } else {
+                session.structured = 1;
+                session.extended = 1;
+                log_debug("Extended headers negotiated.");
+                result = send_option_reply(sock, cl_option, NBD_REP_ACK, 0);
+            }
+            break;
+
+        case NBD_OPT_LIST_META_CONTEXT:
+        case NBD_OPT_SET_META_CONTEXT:
+            result = handle_meta_context(&session, cl_option, data, cl_length);
+            break;
+
+        case NBD_OPT_LIST:
+            result = handle_list(&session, cl_option, cl_length);
+            break;
+
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            result = handle_info(&session, cl_option, data, cl_length, &acknowledged);
+            break;
+
+        default:
+            log_debug("Unsupported option " fu32 ".", cl_option);
+            result = send_option_reply(sock, cl_option, NBD_REP_ERR_UNSUP, 0);
+            break;
+        }
+
+        if(result == error) goto error_1;
+
+        // NBD_OPT_GO acknowledged - information about the export is already
+        // sent, transmission starts
+        if(cl_option == NBD_OPT_GO && acknowledged) break;
     }
 
-    if(put(sock, &zero, 124) != 124) {
-        log_error("Failed to send 124 bytes of zero ending negotiation.");
-    } else {
-        log_debug("124 bytes of zero ending negotiation sent successufull.");
+    if(cl_option == NBD_OPT_EXPORT_NAME) {
+
+        // NBD_OPT_EXPORT_NAME cannot be refused with an error reply; the
+        // connection is closed instead
+
+        struct export *export = find_export(data, cl_length);
+
+        if(export == NULL) {
+            log_error("Unknown export requested.");
+            goto error_1;
+        }
+
+        select_export(&session, export);
+
+        log_debug("Option parsed. Sending reply...");
+
+        if(put64(sock, session.img->device_size) == error ||
+           put16(sock, export_flags())   == error ){
+        /* ------------------------------------------------------------------ */
+            log_error("Failed to send reply for an option");
+            goto error_1;
+        } else {
+            log_debug("Reply sent.");
+        }
+
+        if(no_zeroes) {
+            log_debug("Client does not expect 124 bytes of zero.");
+        } else if(put(sock, &zero, 124) != 124) {
+            log_error("Failed to send 124 bytes of zero ending negotiation.");
+        } else {
+            log_debug("124 bytes of zero ending negotiation sent successufull.");
+        }
     }
 
     // FINALLY we gained client socket
 
-    WORKER(sock, img); 
+    WORKER(&session);
 
 error_1:
-    if(close(sock) == -1) {
-        log_error("Failed to close client sock: %s.", strerror(errno));
-    } else {
-        log_debug("Client sock closed.");
-    }
-
+    close_session(&session);
     return error;
 }
 
@@ -519,9 +1732,32 @@ void *lock_on_do_it(void *devsock_addr)
 }
 
 
-status start_client(struct image *img, struct options *options)
+// A block device connected to an image. The device is set up by link_device(),
+// requests are served by serve_link(), and unlink_device() tears everything
+// down. Client mode links one device; the daemon links many, each served by
+// its own thread.
+struct link
+{
+    // opened NBD device
+    int device_sock;
+    // socket[0] goes to the kernel, socket[1] to us
+    int kernel_sock;
+    int communication_sock;
+    // thread locked on NBD_DO_IT
+    pthread_t thread;
+    struct session session;
+};
+
+struct link *link_device(struct image *img, const char *device_path)
 {
-    int socket[2]; // socket[0] goes to the kernel, socket[1] to us
+    struct link *link = malloc(sizeof *link);
+
+    if(link == NULL) {
+        log_error("Cannot allocate memory for a device link.");
+        goto error_1;
+    }
+
+    int socket[2];
 
     if (socketpair(PF_UNIX, SOCK_STREAM, 0, socket) == -1) {
         log_error("Cannot create a pair of sockets: %s.", strerror(errno));
@@ -530,54 +1766,54 @@ status start_client(struct image *img, struct options *options)
         log_debug("A pair of sockets created.");
     }
 
-    int communication_sock = socket[1];
-    int kernel_sock = socket[0];
-    int device_sock = open(options->device_path, O_RDWR);
+    link->communication_sock = socket[1];
+    link->kernel_sock = socket[0];
+    link->device_sock = open(device_path, O_RDWR);
 
- 
-    if (device_sock == -1) {
-        log_error("Failed to open %s device in RW mode: %s.", options->device_path, strerror(errno));
+    if (link->device_sock == -1) {
+        log_error("Failed to open %s device in RW mode: %s.", device_path, strerror(errno));
         goto error_3;
     } else {
-        log_debug("%s device opened.", options->device_path);
+        log_debug("%s device opened.", device_path);
     }
 
-    if (ioctl(device_sock, NBD_CLEAR_SOCK) == -1) {
+    if (ioctl(link->device_sock, NBD_CLEAR_SOCK) == -1) {
         log_error("Failed to clear a NBD device socket: %s.", strerror(errno));
         goto error_4;
     } else {
         log_debug("NBD device socket cleared.");
     }
 
-    if (ioctl(device_sock, NBD_SET_SOCK, kernel_sock) == -1) {
+    if (ioctl(link->device_sock, NBD_SET_SOCK, link->kernel_sock) == -1) {
         log_error("Failed to set socket for communication with kernel: %s.", strerror(errno));
         goto error_4;
     } else {
         log_debug("Socket for communication with kernel set.");
     }
 
-    if (ioctl(device_sock, NBD_SET_BLKSIZE, img->block_size) == -1) {
+    if (ioctl(link->device_sock, NBD_SET_BLKSIZE, img->block_size) == -1) {
         log_error("Failed to send image block size (" fu32 "): %s.", img->block_size, strerror(errno));
         goto error_5;
     } else {
         log_debug("Image block size (" fu32 ") sent.", img->block_size);
     }
 
-    if (ioctl(device_sock, NBD_SET_SIZE_BLOCKS, img->blocks_count) == -1) {
+    if (ioctl(link->device_sock, NBD_SET_SIZE_BLOCKS, img->blocks_count) == -1) {
         log_error("Failed to send number of blocks (" fu64 "): %s.", img->blocks_count, strerror(errno));
         goto error_5;
     } else {
         log_debug("Number of blocks (" fu64 ") sent.", img->blocks_count);
     }
 
-    if (ioctl(device_sock, BLKROSET, &(int){1}) == -1) {
+    if (ioctl(link->device_sock, BLKROSET, &(int){1}) == -1) {
         log_error("Failed to set read only device attribute: %s.", strerror(errno));
         goto error_5;
     } else {
         log_debug("Read only device attribute set.");
     }
 
-    pthread_t thread;
+    // the kernel does not negotiate; it sends only simple requests
+    if(open_session(&link->session, link->communication_sock, img) == error) goto error_5;
 
     // very hackish and complicated; lock thread imitate a client; this thread
     // imitate a server. Quoting official nbd client:
@@ -593,44 +1829,126 @@ status start_client(struct image *img, struct options *options)
              * does not return until the NBD device has
              * disconnected. */
 
-    if(pthread_create(&thread, NULL, lock_on_do_it, &device_sock) == -1) {
+    if(pthread_create(&link->thread, NULL, lock_on_do_it, &link->device_sock) != 0) {
         log_error("Failed to create lock thread.");
+        close_session(&link->session);
         goto error_5;
     } else {
         log_debug("Lock thread created.");
     }
 
-    close(kernel_sock);
-
-    WORKER(communication_sock, img);
+    close(link->kernel_sock);
+    link->kernel_sock = -1;
 
-    // if WORKER returned, it means error so ...
+    return link;
 
 error_5:
-    if (ioctl(device_sock, NBD_DISCONNECT) == -1) {
-        log_error("Cannot disconnect from NBD device");
-        goto error_4;
-    } else {
-        log_debug("Disconnected from NBD device.");
+    ioctl(link->device_sock, NBD_CLEAR_SOCK);
+
+error_4:
+    close(link->device_sock);
+
+error_3:
+    close(link->kernel_sock);
+    close(link->communication_sock);
+
+error_2:
+    free(link);
+
+error_1:
+    log_msg(log_error, "Failed to initialize NBD device.");
+    return NULL;
+}
+
+// serve requests of the kernel until the device is disconnected
+void serve_link(struct link *link)
+{
+    WORKER(&link->session);
+}
+
+// ask the kernel to disconnect the device; serve_link() returns soon after
+status disconnect_link(struct link *link)
+{
+    if (ioctl(link->device_sock, NBD_DISCONNECT) == -1) {
+        log_error("Cannot disconnect from NBD device: %s.", strerror(errno));
+        return error;
     }
 
-    if (ioctl(device_sock, NBD_CLEAR_SOCK) == -1) {
+    log_debug("Disconnected from NBD device.");
+    return ok;
+}
+
+void unlink_device(struct link *link)
+{
+    disconnect_link(link);
+
+    if (ioctl(link->device_sock, NBD_CLEAR_SOCK) == -1) {
         log_error("Failed to clear a NBD device socket: %s.", strerror(errno));
-        goto error_4;
     } else {
         log_debug("NBD device socket cleared.");
     }
 
-    pthread_join(thread, NULL);
+    pthread_join(link->thread, NULL);
 
-error_4:
-    close(device_sock);
-    
-error_3:
-    close(kernel_sock);
-    close(communication_sock);
+    close_session(&link->session);
+    close(link->device_sock);
+    close(link->communication_sock);
+    free(link);
+}
+
+struct watch
+{
+    int signal_fd;
+    struct link *link;
+};
+
+// this thread waits for a signal and disconnects the device, which makes
+// serve_link() return in the main thread
+static void *watch_signals(void *watch_addr)
+{
+    struct watch *watch = watch_addr;
+
+    signal_t sig_num = read_signal(watch->signal_fd);
+
+    // cancelled only while waiting for the signal
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    if(sig_num != 0) {
+        log_error("Signal \"%s\" caught.", strsignal(sig_num));
+        disconnect_link(watch->link);
+    }
+
+    return NULL;
+}
+
+status start_client(struct image *img, struct options *options)
+{
+    struct watch watch;
+    pthread_t watcher;
+
+    watch.signal_fd = open_signal_fd();
+    if(watch.signal_fd == -1) return error;
+
+    watch.link = link_device(img, options->device_path);
+
+    if(watch.link == NULL) {
+        close(watch.signal_fd);
+        return error;
+    }
+
+    if(pthread_create(&watcher, NULL, watch_signals, &watch) != 0) {
+        log_error("Failed to create a thread waiting for signals.");
+    } else {
+        serve_link(watch.link);
+
+        // the device was disconnected by the kernel, not by a signal
+        pthread_cancel(watcher);
+        pthread_join(watcher, NULL);
+    }
+
+    // if WORKER returned, it means error so ...
+    unlink_device(watch.link);
+    close(watch.signal_fd);
 
-error_2:
-    log_msg(log_error, "Failed to initialize NBD device.");
     return error;
 }
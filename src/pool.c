@@ -0,0 +1,184 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "log.h"
+#include "signals.h"
+#include "pool.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 16
+#define QUEUE_LENGTH 256
+
+struct task
+{
+    task_function function;
+    void *owner;
+    u64 offset;
+    u64 length;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_added = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t task_finished = PTHREAD_COND_INITIALIZER;
+
+static pthread_t threads[MAX_THREADS];
+static int threads_count;
+static int stopping;
+
+// ring buffer of queued tasks
+static struct task queue[QUEUE_LENGTH];
+static int queue_first;
+static int queue_count;
+
+// owners of the tasks being run, per thread
+static void *running[MAX_THREADS];
+
+static void *worker(void *index_addr)
+{
+    int index = (int) (size_t) index_addr;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    pthread_mutex_lock(&pool_lock);
+
+    for(;;) {
+        while (queue_count == 0 && !stopping) {
+            pthread_cond_wait(&task_added, &pool_lock);
+        }
+
+        if(stopping) break;
+
+        struct task task = queue[queue_first];
+        queue_first = (queue_first + 1) % QUEUE_LENGTH;
+        queue_count--;
+
+        running[index] = task.owner;
+        pthread_mutex_unlock(&pool_lock);
+
+        task.function(task.owner, task.offset, task.length);
+
+        pthread_mutex_lock(&pool_lock);
+        running[index] = NULL;
+        pthread_cond_broadcast(&task_finished);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+status start_pool(int count)
+{
+    int i;
+
+    stopping = 0;
+    threads_count = 0;
+
+    for (i = 0; i < MIN(count, MAX_THREADS); i++) {
+        if(pthread_create(&threads[i], NULL, worker, (void*) (size_t) i) != 0) {
+            log_error("Failed to create a worker thread.");
+            stop_pool();
+            return error;
+        }
+
+        threads_count++;
+    }
+
+    log_debug("%i worker threads started.", threads_count);
+    return ok;
+}
+
+void stop_pool(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    stopping = 1;
+
+    if(queue_count) log_debug("%i queued tasks dropped.", queue_count);
+
+    queue_count = 0;
+    pthread_cond_broadcast(&task_added);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (i = 0; i < threads_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    threads_count = 0;
+}
+
+status submit_task(task_function function, void *owner, u64 offset, u64 length)
+{
+    status result = error;
+
+    pthread_mutex_lock(&pool_lock);
+
+    if(threads_count > 0 && !stopping && queue_count < QUEUE_LENGTH) {
+        queue[(queue_first + queue_count) % QUEUE_LENGTH] = (struct task) {
+            .function = function,
+            .owner = owner,
+            .offset = offset,
+            .length = length
+        };
+
+        queue_count++;
+        pthread_cond_signal(&task_added);
+        result = ok;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    return result;
+}
+
+void cancel_tasks(void *owner)
+{
+    int i, j, busy;
+
+    pthread_mutex_lock(&pool_lock);
+
+    // compact the queue, keeping tasks of other owners in order
+    for (i = 0, j = 0; i < queue_count; i++) {
+        struct task *task = &queue[(queue_first + i) % QUEUE_LENGTH];
+
+        if(task->owner != owner) {
+            queue[(queue_first + j++) % QUEUE_LENGTH] = *task;
+        }
+    }
+
+    queue_count = j;
+
+    do {
+        for (i = 0, busy = 0; i < threads_count; i++) {
+            if(running[i] == owner) busy = 1;
+        }
+
+        if(busy) pthread_cond_wait(&task_finished, &pool_lock);
+    } while (busy);
+
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,433 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "shared.h"
+#include "pool.h"
+#include "readahead.h"
+#include "profile.h"
+
+#include <pthread.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define PROFILE_MAGIC "PCNBDPF1"
+// accesses are recorded in units of the device
+#define PROFILE_UNIT (64 * kilobyte)
+// a replay task prefetches at most this much before yielding to other tasks
+#define REPLAY_STEP (16 * PROFILE_UNIT)
+#define REPLAY_CHAINS 2
+
+enum profile_state {recording, replaying, finished};
+
+// file format; all fields are little-endian
+struct profile_header
+{
+    char magic[8];
+    // CRC32 of the shared_identity of the image
+    u32 identity;
+    u32 unit;
+    u64 runs_count;
+};
+
+// consecutive units
+struct run
+{
+    u64 first;
+    u64 units;
+};
+
+struct profile
+{
+    pthread_mutex_t lock;
+    enum profile_state state;
+    char path[PATH_MAX];
+    // CRC32 of the identity of the image
+    u32 identity;
+
+    // ----------------------------- RECORDING ------------------------------
+
+    // milliseconds; CLOCK_MONOTONIC
+    u64 started;
+    // units in the order of first access
+    u64 *units;
+    u64 units_count;
+    u64 max_units;
+    // open addressing set of recorded units (+ 1; 0 means empty)
+    u64 *seen;
+    u64 seen_mask;
+
+    // ----------------------------- REPLAYING ------------------------------
+
+    struct run *runs;
+    u64 runs_count;
+    // the next range to prefetch
+    u64 next_run;
+    u64 next_unit;
+    // set when the image is closed
+    int stopping;
+};
+
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *profile_dir;
+static u64 profile_time;
+static u64 profile_size;
+
+status initialize_profiles(struct options *options)
+{
+    profile_dir = options->profile_dir;
+    profile_time = options->profile_time;
+    profile_size = options->profile_size;
+
+    if(profile_dir == NULL) return ok;
+
+    if(profile_time == 0 || profile_size < PROFILE_UNIT) {
+        log_error("Profile budget is too small (%ju s, %ju bytes).",
+                (uintmax_t) profile_time, (uintmax_t) profile_size);
+        return error;
+    }
+
+    log_debug("Prefetch profiles in \"%s\".", profile_dir);
+    return ok;
+}
+
+static u64 now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000 + (u64) ts.tv_nsec / 1000000;
+}
+
+// ============================== FILES ===================================== //
+
+static status load_profile(struct profile *p)
+{
+    struct profile_header header;
+    u64 i, units = 0;
+
+    FILE *file = fopen(p->path, "rb");
+
+    if(file == NULL) {
+        if(errno != ENOENT) {
+            log_warning("Cannot open profile %s: %s.", p->path, strerror(errno));
+        }
+
+        return error;
+    }
+
+    if(fread(&header, sizeof header, 1, file) != 1 ||
+       memcmp(header.magic, PROFILE_MAGIC, sizeof header.magic) != 0 ||
+       le32toh(header.identity) != p->identity ||
+       le32toh(header.unit) != PROFILE_UNIT) {
+        log_warning("Profile %s is not valid for the image.", p->path);
+        goto error;
+    }
+
+    p->runs_count = MIN(le64toh(header.runs_count), p->max_units);
+    p->runs = malloc(p->runs_count * sizeof *p->runs + 1);
+
+    if(p->runs == NULL) {
+        log_error("Cannot allocate memory for a profile.");
+        goto error;
+    }
+
+    // the size budget applies to replays as well
+    for (i = 0; i < p->runs_count && units < p->max_units; i++) {
+        struct run *run = &p->runs[i];
+
+        if(fread(run, sizeof *run, 1, file) != 1) {
+            log_warning("Profile %s is truncated.", p->path);
+            break;
+        }
+
+        run->first = le64toh(run->first);
+        run->units = MIN(le64toh(run->units), p->max_units - units);
+        units += run->units;
+    }
+
+    p->runs_count = i;
+    fclose(file);
+
+    log_info("Replaying profile %s (" fu64 " MiB).", p->path,
+            units * PROFILE_UNIT / megabyte);
+    return ok;
+
+error:
+    free(p->runs);
+    p->runs = NULL;
+    fclose(file);
+    return error;
+}
+
+static void save_profile(struct profile *p)
+{
+    char tmp_path[PATH_MAX + 16];
+    struct profile_header header;
+    u64 i, runs_count = 0;
+
+    if(p->units_count == 0) return;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", p->path, (long) getpid());
+
+    FILE *file = fopen(tmp_path, "wb");
+
+    if(file == NULL) {
+        log_warning("Cannot create profile %s: %s.", tmp_path, strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < p->units_count; i++) {
+        if(i == 0 || p->units[i] != p->units[i - 1] + 1) runs_count++;
+    }
+
+    memcpy(header.magic, PROFILE_MAGIC, sizeof header.magic);
+    header.identity = htole32(p->identity);
+    header.unit = htole32(PROFILE_UNIT);
+    header.runs_count = htole64(runs_count);
+
+    int failed = fwrite(&header, sizeof header, 1, file) != 1;
+
+    // runs of units accessed one after another
+    for (i = 0; i < p->units_count && !failed;) {
+        struct run run = { .first = p->units[i], .units = 1 };
+
+        while (++i < p->units_count && p->units[i] == p->units[i - 1] + 1) {
+            run.units++;
+        }
+
+        run.first = htole64(run.first);
+        run.units = htole64(run.units);
+        failed = fwrite(&run, sizeof run, 1, file) != 1;
+    }
+
+    if(fclose(file) != 0) failed = 1;
+
+    if(failed || rename(tmp_path, p->path) == -1) {
+        log_warning("Cannot save profile %s: %s.", p->path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    log_info("Profile %s saved (" fu64 " MiB in " fu64 " runs).", p->path,
+            p->units_count * PROFILE_UNIT / megabyte, runs_count);
+}
+
+// ============================== REPLAY ==================================== //
+
+static void replay_task(void *owner, u64 offset, u64 length)
+{
+    struct image *img = owner;
+    struct profile *p = __atomic_load_n(&img->profile, __ATOMIC_ACQUIRE);
+
+    (void) offset;
+    (void) length;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (!p->stopping && p->next_run < p->runs_count) {
+        struct run *run = &p->runs[p->next_run];
+        u64 unit = run->first + p->next_unit;
+        u64 units = MIN(run->units - p->next_unit, REPLAY_STEP / PROFILE_UNIT);
+
+        p->next_unit += units;
+
+        if(p->next_unit == run->units) {
+            p->next_run++;
+            p->next_unit = 0;
+        }
+
+        pthread_mutex_unlock(&p->lock);
+
+        if(unit * PROFILE_UNIT < img->device_size) {
+            fetch_range(img, unit * PROFILE_UNIT, units * PROFILE_UNIT);
+        }
+
+        pthread_mutex_lock(&p->lock);
+
+        // give way to readahead of clients; continue here if the queue is full
+        if(!p->stopping && submit_task(replay_task, img, 0, 0) == ok) break;
+    }
+
+    if(p->next_run == p->runs_count && p->state == replaying) {
+        p->state = finished;
+        log_debug("Profile %s replayed.", p->path);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+// ============================== SESSIONS ================================== //
+
+void start_profile(struct image *img)
+{
+    int i;
+
+    if(profile_dir == NULL) return;
+
+    pthread_mutex_lock(&profiles_lock);
+
+    if(img->profile != NULL) {
+        pthread_mutex_unlock(&profiles_lock);
+        return;
+    }
+
+    char key[IMAGE_KEY_LENGTH];
+    struct profile *p = calloc(1, sizeof *p);
+
+    if(p == NULL || image_key(img, &p->identity, key) == error) goto error;
+
+    pthread_mutex_init(&p->lock, NULL);
+    p->max_units = profile_size / PROFILE_UNIT;
+
+    snprintf(p->path, sizeof p->path, "%s/%s.profile", profile_dir, key);
+
+    if(load_profile(p) == ok) {
+        p->state = replaying;
+        __atomic_store_n(&img->profile, p, __ATOMIC_RELEASE);
+
+        for (i = 0; i < REPLAY_CHAINS; i++) {
+            if(submit_task(replay_task, img, 0, 0) == error) break;
+        }
+
+        if(i == 0) log_warning("Profile is not replayed: the worker queue is full.");
+
+        pthread_mutex_unlock(&profiles_lock);
+        return;
+    }
+
+    // no profile yet - record one
+    u64 capacity = 1;
+    while (capacity < 2 * p->max_units) capacity *= 2;
+
+    p->units = malloc(p->max_units * sizeof *p->units);
+    p->seen = calloc(capacity, sizeof *p->seen);
+    p->seen_mask = capacity - 1;
+
+    if(p->units == NULL || p->seen == NULL) goto error;
+
+    p->state = recording;
+    p->started = now();
+
+    // record_read() of other connections takes it without the lock
+    __atomic_store_n(&img->profile, p, __ATOMIC_RELEASE);
+
+    log_info("Recording profile %s.", p->path);
+    pthread_mutex_unlock(&profiles_lock);
+    return;
+
+error:
+    log_warning("Cannot start a profile of image \"%s\".", img->path);
+
+    if(p != NULL) {
+        free(p->units);
+        free(p->seen);
+        free(p);
+    }
+
+    pthread_mutex_unlock(&profiles_lock);
+}
+
+// add the unit to the set; 0 if it was there already
+static int add_unit(struct profile *p, u64 unit)
+{
+    u64 slot = (unit * 0x9E3779B97F4A7C15ull) >> 32;
+
+    for (;; slot++) {
+        u64 *entry = &p->seen[slot & p->seen_mask];
+
+        if(*entry == unit + 1) return 0;
+
+        if(*entry == 0) {
+            *entry = unit + 1;
+            return 1;
+        }
+    }
+}
+
+void record_read(struct image *img, u64 offset, u64 length)
+{
+    struct profile *p = __atomic_load_n(&img->profile, __ATOMIC_ACQUIRE);
+
+    if(p == NULL || __atomic_load_n(&p->state, __ATOMIC_RELAXED) != recording) {
+        return;
+    }
+
+    u64 unit = offset / PROFILE_UNIT;
+    u64 last_unit = divide_up(offset + MAX(length, 1), PROFILE_UNIT);
+    int done = 0;
+
+    pthread_mutex_lock(&p->lock);
+
+    if(p->state == recording) {
+        for (; unit < last_unit && p->units_count < p->max_units; unit++) {
+            if(add_unit(p, unit)) p->units[p->units_count++] = unit;
+        }
+
+        if(p->units_count == p->max_units ||
+           now() - p->started >= profile_time * 1000) {
+            __atomic_store_n(&p->state, finished, __ATOMIC_RELAXED);
+            done = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    // no other thread touches the recording any more
+    if(done) save_profile(p);
+}
+
+void close_profile(struct image *img)
+{
+    struct profile *p = img->profile;
+
+    if(p == NULL) return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_mutex_unlock(&p->lock);
+
+    // replay tasks do not resubmit themselves any more
+    cancel_prefetch(img);
+
+    // sessions shorter than the time budget are saved as well
+    if(p->state == recording) save_profile(p);
+
+    pthread_mutex_destroy(&p->lock);
+    free(p->units);
+    free(p->seen);
+    free(p->runs);
+    free(p);
+
+    __atomic_store_n(&img->profile, NULL, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,261 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "blockcache.h"
+#include "ssdcache.h"
+#include "dedup.h"
+#include "buffers.h"
+#include "pool.h"
+#include "readahead.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define READAHEAD_THREADS 4
+#define MIN_WINDOW (128 * kilobyte)
+// larger distances between requests are not taken for strides
+#define MAX_STRIDE (16 * megabyte)
+// records prefetched ahead of a strided stream
+#define MAX_RECORDS_AHEAD 16
+
+// maximum window; 0 if readahead is disabled
+static u64 max_window;
+
+// ranges queued for prefetch, and fetched
+static u64 scheduled;
+static u64 fetched;
+
+// the workers also decompress units of compressed images in parallel, so
+// they are started without readahead as well
+status initialize_readahead(struct options *options)
+{
+    max_window = options->readahead_window;
+
+    if(max_window) max_window = MAX(max_window, MIN_WINDOW);
+
+    return start_pool(READAHEAD_THREADS);
+}
+
+void close_readahead(void)
+{
+    stop_pool();
+    max_window = 0;
+}
+
+void fetch_range(struct image *img, u64 offset, u64 length)
+{
+    // everything is in memory already
+    if(img->arena) return;
+
+    // without the block cache chunks are loaded to the SSD cache only
+    int ssd_only = !block_cache_enabled() && ssd_cache_enabled();
+    u8 *buffer = NULL;
+
+    // O_DIRECT reads do not use the page cache
+    if(!block_cache_enabled() && !ssd_only) {
+        if(img->direct_fd == -1) prefetch(img, offset, length);
+        return;
+    }
+
+    if(ssd_only && posix_memalign((void**) &buffer, DIRECT_ALIGNMENT, BLOCK_CACHE_CHUNK) != 0) {
+        return;
+    }
+
+    u64 block = offset / img->block_size;
+    u64 last_block = divide_up(MIN(offset + length, img->device_size), img->block_size);
+
+    // load the chunks holding present blocks (and their checksums); with
+    // --dedup chunks of the device (see dedup.h)
+    while (block < last_block) {
+        u8 existence;
+        u64 blocks = find_extent(img, block, last_block, &existence);
+
+        if(existence) {
+            u64 rank = block_rank(img, block);
+            u64 index = rank_offset(img, rank) / BLOCK_CACHE_CHUNK;
+            u64 end = divide_up(rank_offset(img, rank + blocks), BLOCK_CACHE_CHUNK);
+
+            if(device_chunks(img)) {
+                index = block * img->block_size / BLOCK_CACHE_CHUNK;
+                end = divide_up((block + blocks) * img->block_size, BLOCK_CACHE_CHUNK);
+            }
+
+            for (; index < end; index++) {
+                if(ssd_only) {
+                    if(!ssd_chunk_cached(img, index)) load_chunk(img, index, buffer);
+                } else {
+                    struct chunk *chunk = get_chunk(img, index);
+                    if(chunk) release_chunk(chunk);
+                }
+            }
+        }
+
+        block += blocks;
+    }
+
+    free(buffer);
+}
+
+static void prefetch_task(void *owner, u64 offset, u64 length)
+{
+    fetch_range(owner, offset, length);
+    __atomic_add_fetch(&fetched, 1, __ATOMIC_RELAXED);
+}
+
+status schedule_prefetch(struct image *img, u64 offset, u64 length)
+{
+    if(max_window == 0 || offset >= img->device_size) return error;
+
+    length = MIN(length, img->device_size - offset);
+
+    if(submit_task(prefetch_task, img, offset, length) == error) return error;
+
+    __atomic_add_fetch(&scheduled, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+void readahead_stats(u64 *ranges_scheduled, u64 *ranges_fetched)
+{
+    *ranges_scheduled = __atomic_load_n(&scheduled, __ATOMIC_RELAXED);
+    *ranges_fetched = __atomic_load_n(&fetched, __ATOMIC_RELAXED);
+}
+
+void cancel_prefetch(struct image *img)
+{
+    cancel_tasks(img);
+}
+
+void reset_readahead(struct readahead *ra)
+{
+    memset(ra, 0, sizeof *ra);
+    ra->initial_window = MIN_WINDOW;
+}
+
+// find the stream the request belongs to
+static struct read_stream *match_stream(struct readahead *ra, u64 offset)
+{
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        struct read_stream *s = &ra->streams[i];
+
+        if(s->used == 0) continue;
+
+        if(s->stride == 0 && offset == s->last + s->length) return s;
+        if(s->stride != 0 && offset == s->last + s->stride) return s;
+    }
+
+    // the second request of a stream determines its stride
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        struct read_stream *s = &ra->streams[i];
+
+        if(s->used != 0 && s->hits == 1 && offset > s->last + s->length &&
+           offset - s->last <= MAX_STRIDE) {
+        /* ------------------------------------------------------------------ */
+            s->stride = offset - s->last;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+void observe_read(struct readahead *ra, struct image *img, u64 offset, u64 length)
+{
+    if(max_window == 0 || length == 0) return;
+
+    struct read_stream *s = match_stream(ra, offset);
+    int i;
+
+    ra->tick++;
+
+    if(s == NULL) {
+        // replace the least recently used stream
+        s = &ra->streams[0];
+
+        for (i = 1; i < READAHEAD_STREAMS; i++) {
+            if(ra->streams[i].used < s->used) s = &ra->streams[i];
+        }
+
+        // it was broken before reaching prefetched data - prefetch less
+        if(s->hits > 1 && s->prefetched > s->last + s->length) {
+            ra->initial_window = MAX(MIN_WINDOW, ra->initial_window / 2);
+        }
+
+        *s = (struct read_stream) {
+            .last = offset,
+            .length = length,
+            .stride = 0,
+            .hits = 1,
+            .prefetched = offset + length,
+            .window = ra->initial_window,
+            .used = ra->tick
+        };
+
+        return;
+    }
+
+    // the request was prefetched - prefetch more
+    if(offset < s->prefetched && s->hits > 1) {
+        s->window = MIN(max_window, s->window * 2);
+        ra->initial_window = MIN(max_window, ra->initial_window + MIN_WINDOW);
+    }
+
+    s->hits++;
+    s->last = offset;
+    s->length = length;
+    s->used = ra->tick;
+
+    if(s->stride == 0) {
+        u64 end = offset + length;
+
+        // keep at least half of the window prefetched ahead
+        if(s->prefetched < end) s->prefetched = end;
+
+        if(s->prefetched - end < s->window / 2) {
+            u64 target = end + s->window;
+
+            // a range not queued (the pool is full) is tried again with the
+            // next request
+            if(schedule_prefetch(img, s->prefetched, target - s->prefetched) == ok) {
+                s->prefetched = target;
+            }
+        }
+
+    } else if(s->hits >= 3) {
+        // strided streams are confirmed by the third request; prefetched is
+        // the offset of the first record not prefetched yet
+        u64 records = MIN(MAX_RECORDS_AHEAD, MAX(1, s->window / length));
+        u64 limit = offset + records * s->stride;
+        u64 record = MAX(s->prefetched, offset + s->stride);
+
+        for (; record <= limit; record += s->stride) {
+            if(schedule_prefetch(img, record, length) == error) break;
+        }
+
+        s->prefetched = record;
+    }
+}
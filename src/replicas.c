@@ -0,0 +1,613 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "image.h"
+#include "segments.h"
+#include "signals.h"
+#include "replicas.h"
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// the image file and its replicas
+#define MAX_COPIES 4
+// threads serving the queue of each copy
+#define COPY_THREADS 4
+// with equal queues, parts of the file of this size are read from one copy
+#define STRIPE (1 * megabyte)
+// latencies of recent reads (microseconds) for the hedging delay
+#define LATENCY_SAMPLES 256
+#define HEDGE_PERCENTILE 95
+// the delay is computed again after this many reads
+#define UPDATE_INTERVAL 32
+// microseconds
+#define DEFAULT_DELAY 20000
+#define MIN_DELAY 500
+
+struct flight;
+struct replicas;
+
+// a read issued to one copy; data is read into its own buffer, as the
+// attempt may end after the read has been answered by another copy
+struct attempt
+{
+    struct flight *flight;
+    struct copy *copy;
+    // in the queue of the copy
+    struct attempt *next;
+    u64 queued;
+    // issued because the read was slow
+    int hedge;
+    u8 *data;
+    ssize_t result;
+};
+
+// one read of the image file
+struct flight
+{
+    u64 offset;
+    size_t length;
+    // the reader and the attempts not finished yet
+    int refs;
+    int issued;
+    int failed;
+    int error;
+    struct attempt *answer;
+    struct attempt attempts[MAX_COPIES];
+};
+
+struct copy
+{
+    struct replicas *owner;
+    // the image file itself, or the replica opened here
+    struct segments *segments;
+    struct segments opened;
+    char *path;
+
+    pthread_t threads[COPY_THREADS];
+    int threads_count;
+    pthread_cond_t work;
+    struct attempt *first;
+    struct attempt *last;
+    // queued and running attempts
+    u32 depth;
+};
+
+struct replicas
+{
+    pthread_mutex_t lock;
+    // an attempt has finished
+    pthread_cond_t finished;
+    int stopping;
+
+    struct copy copies[MAX_COPIES];
+    u32 count;
+
+    u64 latencies[LATENCY_SAMPLES];
+    u64 samples;
+    // an attempt not finished after this many microseconds is hedged
+    u64 delay;
+
+    u64 reads;
+    u64 hedged;
+    u64 hedges_answered;
+    u64 failures;
+};
+
+static u64 now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000 + (u64) ts.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64*) a, y = *(const u64*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* ---------------------------- OPENING --------------------------------- */
+
+// whether the header and the bitmap of the copy are those of the image; they
+// are compared byte by byte, as in version 0002 each ends with its own CRC32,
+// so the CRC32 of either is the same for every image
+static status same_start(struct image *img, struct segments *copy, int *same)
+{
+    u8 *buffer = malloc(2 * megabyte);
+    u64 offset = 0;
+    status result = ok;
+
+    if(buffer == NULL) {
+        log_error("Cannot allocate memory for comparing replicas.");
+        return error;
+    }
+
+    *same = 1;
+
+    while (offset < img->data_offset && *same) {
+        size_t once = MIN(img->data_offset - offset, megabyte);
+
+        if(read_segments(&img->segments, buffer, once, offset) != (ssize_t) once) {
+            log_error("Cannot read the image to compare it with replicas.");
+            result = error;
+            break;
+        }
+
+        *same = read_segments(copy, buffer + megabyte, once, offset) == (ssize_t) once &&
+                memcmp(buffer, buffer + megabyte, once) == 0;
+        offset += once;
+    }
+
+    free(buffer);
+    return result;
+}
+
+// a file (or the first piece of a split one) named like the image in the
+// directory
+static int replica_exists(const char *path)
+{
+    char first[PATH_MAX + 3];
+    struct stat st;
+
+    snprintf(first, sizeof first, "%s.aa", path);
+
+    if(stat(path, &st) == 0) return S_ISREG(st.st_mode);
+
+    return strpbrk(path, "*?[") != NULL || stat(first, &st) == 0;
+}
+
+static status add_replica(struct image *img, struct replicas *r, const char *dir)
+{
+    char path[PATH_MAX];
+    const char *slash = strrchr(img->path, '/');
+    struct copy *copy = &r->copies[r->count];
+    int same = 0;
+
+    snprintf(path, sizeof path, "%s/%s", dir, slash ? slash + 1 : img->path);
+
+    if(!replica_exists(path)) {
+        log_debug("No replica of the image in %s.", dir);
+        return ok;
+    }
+
+    if(open_segments(&copy->opened, path) == error) return ok;
+
+    if(copy->opened.stream == NULL && copy->opened.size == img->segments.size &&
+       same_start(img, &copy->opened, &same) == error) {
+        close_segments(&copy->opened);
+        return error;
+    }
+
+    if(!same) {
+        log_warning("%s is not the same as the image; it is not used as a replica.", path);
+        close_segments(&copy->opened);
+        return ok;
+    }
+
+    copy->path = strdup(path);
+
+    if(copy->path == NULL) {
+        log_error("Cannot allocate memory for replicas.");
+        close_segments(&copy->opened);
+        return error;
+    }
+
+    copy->segments = &copy->opened;
+    r->count++;
+
+    log_info("Replica of the image: %s.", path);
+    return ok;
+}
+
+static void *serve_copy(void *copy_addr);
+
+static status start_copies(struct replicas *r)
+{
+    u32 i;
+    int j;
+
+    for (i = 0; i < r->count; i++) {
+        struct copy *copy = &r->copies[i];
+
+        copy->owner = r;
+
+        for (j = 0; j < COPY_THREADS; j++) {
+            if(pthread_create(&copy->threads[j], NULL, serve_copy, copy) != 0) {
+                log_error("Failed to create a thread reading replicas.");
+                return error;
+            }
+
+            copy->threads_count++;
+        }
+    }
+
+    return ok;
+}
+
+static void free_replicas(struct replicas *r)
+{
+    u32 i;
+    int j;
+
+    pthread_mutex_lock(&r->lock);
+    r->stopping = 1;
+
+    for (i = 0; i < r->count; i++) {
+        pthread_cond_broadcast(&r->copies[i].work);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    // queued attempts are finished first; their reads were answered already
+    for (i = 0; i < MAX_COPIES; i++) {
+        for (j = 0; j < r->copies[i].threads_count; j++) {
+            pthread_join(r->copies[i].threads[j], NULL);
+        }
+
+        pthread_cond_destroy(&r->copies[i].work);
+        free(r->copies[i].path);
+
+        if(i > 0 && i < r->count) close_segments(&r->copies[i].opened);
+    }
+
+    pthread_cond_destroy(&r->finished);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+/* ---------------------------- READING --------------------------------- */
+
+// called with the lock held
+static void release_flight(struct flight *f)
+{
+    int i;
+
+    if(--f->refs > 0) return;
+
+    for (i = 0; i < f->issued; i++) {
+        free(f->attempts[i].data);
+    }
+
+    free(f);
+}
+
+// called with the lock held
+static void record_latency(struct replicas *r, u64 latency)
+{
+    u64 sorted[LATENCY_SAMPLES];
+
+    r->latencies[r->samples++ % LATENCY_SAMPLES] = latency;
+
+    if(r->samples % UPDATE_INTERVAL != 0) return;
+
+    u64 count = MIN(r->samples, LATENCY_SAMPLES);
+
+    memcpy(sorted, r->latencies, count * sizeof *sorted);
+    qsort(sorted, count, sizeof *sorted, compare_u64);
+
+    r->delay = MAX(sorted[count * HEDGE_PERCENTILE / 100], MIN_DELAY);
+}
+
+static void *serve_copy(void *copy_addr)
+{
+    struct copy *copy = copy_addr;
+    struct replicas *r = copy->owner;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    pthread_mutex_lock(&r->lock);
+
+    for(;;) {
+        while (copy->first == NULL && !r->stopping) {
+            pthread_cond_wait(&copy->work, &r->lock);
+        }
+
+        if(copy->first == NULL) break;
+
+        struct attempt *attempt = copy->first;
+        struct flight *f = attempt->flight;
+
+        copy->first = attempt->next;
+        if(copy->first == NULL) copy->last = NULL;
+
+        // answered by another copy in the meantime
+        if(f->answer == NULL) {
+            pthread_mutex_unlock(&r->lock);
+
+            ssize_t result = read_segments(copy->segments, attempt->data, f->length, f->offset);
+            int error_number = errno;
+
+            // a copy truncated after it was opened fails like an unreadable one
+            u64 size = copy->segments->size;
+            u64 expected = f->offset < size ? MIN(f->length, size - f->offset) : 0;
+
+            if(result != -1 && (u64) result < expected) {
+                result = -1;
+                error_number = EIO;
+            }
+
+            pthread_mutex_lock(&r->lock);
+
+            attempt->result = result;
+
+            if(result == -1) {
+                log_warning("Cannot read %s: %s.", copy->path, strerror(error_number));
+                f->error = error_number;
+                f->failed++;
+                r->failures++;
+            } else {
+                record_latency(r, now_us() - attempt->queued);
+
+                if(f->answer == NULL) {
+                    f->answer = attempt;
+                    if(attempt->hedge) r->hedges_answered++;
+                }
+            }
+
+            pthread_cond_broadcast(&r->finished);
+        }
+
+        copy->depth--;
+        release_flight(f);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// queue the read to the copy with the fewest queued reads, of those not
+// tried yet; called with the lock held
+static status issue(struct replicas *r, struct flight *f)
+{
+    u32 i, start = (f->offset / STRIPE) % r->count;
+    struct copy *best = NULL;
+    int j;
+
+    for (i = 0; i < r->count; i++) {
+        struct copy *copy = &r->copies[(start + i) % r->count];
+        int tried = 0;
+
+        for (j = 0; j < f->issued; j++) {
+            if(f->attempts[j].copy == copy) tried = 1;
+        }
+
+        if(!tried && (best == NULL || copy->depth < best->depth)) best = copy;
+    }
+
+    struct attempt *attempt = &f->attempts[f->issued];
+
+    attempt->data = malloc(MAX(f->length, 1));
+
+    if(attempt->data == NULL) {
+        f->error = ENOMEM;
+        return error;
+    }
+
+    attempt->flight = f;
+    attempt->copy = best;
+    attempt->next = NULL;
+    attempt->queued = now_us();
+    attempt->hedge = 0;
+    attempt->result = -1;
+
+    if(best->last) best->last->next = attempt;
+    else best->first = attempt;
+
+    best->last = attempt;
+    best->depth++;
+
+    f->issued++;
+    f->refs++;
+
+    pthread_cond_signal(&best->work);
+    return ok;
+}
+
+// wait for an attempt to finish until the deadline; 0 once it has passed
+static int wait_attempt(struct replicas *r, u64 deadline)
+{
+    u64 now = now_us();
+
+    if(now >= deadline) return 0;
+
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (deadline - now) / 1000000;
+    until.tv_nsec += ((deadline - now) % 1000000) * 1000;
+
+    if(until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&r->finished, &r->lock, &until);
+    return 1;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+status open_replicas(struct image *img, struct options *options)
+{
+    u32 i;
+
+    img->replicas = NULL;
+
+    if(options->replica_dirs == NULL) return ok;
+
+    if(img->compressed != NULL || img->segments.count == 0 || img->segments.stream != NULL) {
+        log_info("Replicas are used only for uncompressed image files.");
+        return ok;
+    }
+
+    struct replicas *r = calloc(1, sizeof *r);
+
+    if(r == NULL) {
+        log_error("Cannot allocate memory for replicas.");
+        return error;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->finished, NULL);
+
+    for (i = 0; i < MAX_COPIES; i++) {
+        pthread_cond_init(&r->copies[i].work, NULL);
+    }
+
+    r->copies[0].segments = &img->segments;
+    r->copies[0].path = strdup(img->path);
+    r->count = 1;
+    r->delay = DEFAULT_DELAY;
+
+    char *dirs = strdup(options->replica_dirs);
+    status result = ok;
+
+    if(dirs == NULL || r->copies[0].path == NULL) {
+        log_error("Cannot allocate memory for replicas.");
+        result = error;
+    } else {
+        char *position;
+        char *dir = strtok_r(dirs, ":", &position);
+
+        for (; dir != NULL && result == ok; dir = strtok_r(NULL, ":", &position)) {
+            if(r->count == MAX_COPIES) {
+                log_warning("At most %d replicas of an image are used.", MAX_COPIES - 1);
+                break;
+            }
+
+            result = add_replica(img, r, dir);
+        }
+    }
+
+    free(dirs);
+
+    if(result == ok && r->count > 1) result = start_copies(r);
+
+    if(result == error || r->count == 1) {
+        free_replicas(r);
+        return result;
+    }
+
+    img->replicas = r;
+    return ok;
+}
+
+void close_replicas(struct image *img)
+{
+    struct replicas *r = img->replicas;
+
+    if(r == NULL) return;
+
+    log_info("Replicas: " fu64 " reads, " fu64 " hedged (" fu64 " answered by "
+            "the hedge), " fu64 " failed.", r->reads, r->hedged,
+            r->hedges_answered, r->failures);
+
+    free_replicas(r);
+    img->replicas = NULL;
+}
+
+ssize_t read_replicas(struct replicas *r, void *buf, size_t length, u64 offset)
+{
+    struct flight *f = calloc(1, sizeof *f);
+
+    if(f == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    f->offset = offset;
+    f->length = length;
+    f->refs = 1;
+    f->error = EIO;
+
+    pthread_mutex_lock(&r->lock);
+
+    u64 deadline = now_us() + r->delay;
+    int hedged = 0;
+
+    r->reads++;
+
+    if(issue(r, f) == ok) {
+        while (f->answer == NULL) {
+            if(f->failed == f->issued) {
+                // every copy tried so far failed; the next one is tried
+                if(f->issued == (int) r->count || issue(r, f) == error) break;
+            } else if(!hedged && f->issued < (int) r->count) {
+                if(!wait_attempt(r, deadline)) {
+                    hedged = 1;
+                    if(issue(r, f) == ok) {
+                        f->attempts[f->issued - 1].hedge = 1;
+                        r->hedged++;
+                    }
+                }
+            } else {
+                pthread_cond_wait(&r->finished, &r->lock);
+            }
+        }
+    }
+
+    struct attempt *answer = f->answer;
+    int error_number = f->error;
+
+    pthread_mutex_unlock(&r->lock);
+
+    // the flight holds the data until it is released
+    ssize_t result = answer ? answer->result : -1;
+
+    if(answer) memcpy(buf, answer->data, result);
+
+    pthread_mutex_lock(&r->lock);
+    release_flight(f);
+    pthread_mutex_unlock(&r->lock);
+
+    if(result == -1) errno = error_number;
+    return result;
+}
+
+int advise_replicas(struct replicas *r, u64 offset, u64 length, int advice)
+{
+    u64 end = length ? offset + length : r->copies[0].segments->size;
+
+    while (offset < end) {
+        struct copy *copy = &r->copies[(offset / STRIPE) % r->count];
+        u64 once = MIN(end - offset, STRIPE - offset % STRIPE);
+
+        int result = advise_segments(copy->segments, offset, once, advice);
+
+        if(result != 0) return result;
+        offset += once;
+    }
+
+    return 0;
+}
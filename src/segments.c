@@ -0,0 +1,375 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "log.h"
+#include "segments.h"
+#include "stream.h"
+#include "compressed.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* ---------------------------- HELPERS --------------------------------- */
+
+// the length of the split suffix of the path (two or more lowercase letters
+// after the last dot); 0 if there is none
+static size_t suffix_length(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t i, length;
+
+    if(dot == NULL || (slash && slash > dot)) return 0;
+
+    length = strlen(dot + 1);
+
+    if(length < 2) return 0;
+
+    for (i = 1; i <= length; i++) {
+        if(dot[i] < 'a' || dot[i] > 'z') return 0;
+    }
+
+    return length;
+}
+
+// aa, ab, ..., az, ba, ...; 0 after the last one
+static int next_suffix(char *suffix, size_t length)
+{
+    while (length > 0) {
+        if(suffix[length - 1] != 'z') {
+            suffix[length - 1]++;
+            return 1;
+        }
+
+        suffix[--length] = 'a';
+    }
+
+    return 0;
+}
+
+static int first_suffix(const char *suffix, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        if(suffix[i] != 'a') return 0;
+    }
+
+    return 1;
+}
+
+static status add_segment(struct segments *s, const char *path)
+{
+    struct stat st;
+
+    if(s->count % 64 == 0) {
+        struct file_segment *extended = realloc(s->table, (s->count + 64) * sizeof *extended);
+
+        if(extended == NULL) {
+            log_error("Cannot allocate memory for the pieces of an image.");
+            return error;
+        }
+
+        s->table = extended;
+    }
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1 || fstat(fd, &st) == -1) {
+        log_error("Cannot open image file %s: %s.", path, strerror(errno));
+        if(fd != -1) close(fd);
+        return error;
+    }
+
+    struct file_segment *segment = &s->table[s->count++];
+
+    segment->fd = fd;
+    segment->offset = s->size;
+    segment->size = st.st_size;
+
+    s->size += st.st_size;
+    s->mtime = MAX(s->mtime, st.st_mtime);
+
+    return ok;
+}
+
+static status set_name(struct segments *s, const char *first)
+{
+    s->name = strdup(first);
+
+    if(s->name == NULL) {
+        log_error("Cannot allocate memory for the pieces of an image.");
+        return error;
+    }
+
+    // IMAGE.aa is IMAGE
+    if(s->count > 1 && suffix_length(first)) {
+        s->name[strlen(first) - suffix_length(first) - 1] = '\0';
+    }
+
+    return ok;
+}
+
+// the first piece and the ones following it
+static status add_pieces(struct segments *s, const char *first)
+{
+    struct stat st;
+
+    if(add_segment(s, first) == error) return error;
+
+    size_t length = suffix_length(first);
+
+    if(length && first_suffix(first + strlen(first) - length, length)) {
+        char *path = strdup(first);
+
+        if(path == NULL) {
+            log_error("Cannot allocate memory for the pieces of an image.");
+            return error;
+        }
+
+        char *suffix = path + strlen(path) - length;
+
+        while (next_suffix(suffix, length) && stat(path, &st) == 0) {
+            if(add_segment(s, path) == error) {
+                free(path);
+                return error;
+            }
+        }
+
+        free(path);
+    }
+
+    return set_name(s, first);
+}
+
+// the files matching the pattern, in the order of their names
+static status add_matching(struct segments *s, const char *pattern)
+{
+    glob_t matches;
+    size_t i;
+
+    if(glob(pattern, 0, NULL, &matches) != 0 || matches.gl_pathc == 0) {
+        log_error("No image file matches %s.", pattern);
+        globfree(&matches);
+        return error;
+    }
+
+    size_t length = strlen(matches.gl_pathv[0]);
+
+    for (i = 0; i < matches.gl_pathc; i++) {
+        // pieces have names of the same length; other files, like the index
+        // of a compressed image, are left out
+        if(strlen(matches.gl_pathv[i]) != length) continue;
+
+        if(add_segment(s, matches.gl_pathv[i]) == error) {
+            globfree(&matches);
+            return error;
+        }
+    }
+
+    status result = set_name(s, matches.gl_pathv[0]);
+
+    globfree(&matches);
+    return result;
+}
+
+// standard input or a FIFO, through a spill file
+static status add_stream(struct segments *s, const char *path)
+{
+    int source = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+
+    if(source == -1) {
+        log_error("Cannot open image file %s: %s.", path, strerror(errno));
+        return error;
+    }
+
+    s->table = malloc(sizeof *s->table);
+
+    if(s->table == NULL) {
+        log_error("Cannot allocate memory for the pieces of an image.");
+        if(source != STDIN_FILENO) close(source);
+        return error;
+    }
+
+    s->stream = open_stream(source, path, &s->table[0].fd);
+
+    if(s->stream == NULL) {
+        if(source != STDIN_FILENO) close(source);
+        return error;
+    }
+
+    s->count = 1;
+    s->table[0].offset = 0;
+    s->table[0].size = s->size = STREAM_SIZE;
+    s->mtime = time(NULL);
+
+    return set_name(s, path);
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+status open_segments(struct segments *s, const char *path)
+{
+    char first[PATH_MAX];
+    struct stat st;
+    status result;
+
+    memset(s, 0, sizeof *s);
+
+    snprintf(first, sizeof first, "%s.aa", path);
+
+    // a remote image has no pieces; it is read in extents (see http.c)
+    if(is_http_url(path)) {
+        result = set_name(s, path);
+    } else if(strcmp(path, "-") == 0 || (stat(path, &st) == 0 && S_ISFIFO(st.st_mode))) {
+        result = add_stream(s, path);
+    } else if(stat(path, &st) == 0) {
+        result = add_pieces(s, path);
+    } else if(strpbrk(path, "*?[")) {
+        result = add_matching(s, path);
+    } else if(stat(first, &st) == 0) {
+        // IMAGE names IMAGE.aa, IMAGE.ab, ...
+        result = add_pieces(s, first);
+    } else {
+        log_error("Cannot open image file: %s.", strerror(ENOENT));
+        result = error;
+    }
+
+    if(result == error) {
+        close_segments(s);
+        return error;
+    }
+
+    if(s->count > 1) {
+        log_info("Image file is split into %u pieces (" fu64 " MiB).",
+                s->count, s->size / megabyte);
+    }
+
+    return ok;
+}
+
+status close_segments(struct segments *s)
+{
+    status result = ok;
+    u32 i;
+
+    if(s->stream) close_stream(s->stream);
+
+    for (i = 0; i < s->count; i++) {
+        if(close(s->table[i].fd) == -1) {
+            log_error("Cannot close image file: %s.", strerror(errno));
+            result = error;
+        }
+    }
+
+    free(s->table);
+    free(s->name);
+    memset(s, 0, sizeof *s);
+
+    return result;
+}
+
+struct file_segment *find_segment(struct segments *s, u64 offset)
+{
+    u32 low = 0, high = s->count;
+
+    while (high - low > 1) {
+        u32 middle = low + (high - low) / 2;
+
+        if(s->table[middle].offset <= offset) low = middle;
+        else high = middle;
+    }
+
+    return &s->table[low];
+}
+
+ssize_t read_segments(struct segments *s, void *buf, size_t length, u64 offset)
+{
+    size_t done = 0;
+
+    if(s->stream) return read_stream(s->stream, buf, length, offset);
+
+    while (done < length && offset + done < s->size) {
+        struct file_segment *segment = find_segment(s, offset + done);
+        u64 position = offset + done - segment->offset;
+        u64 once = MIN(length - done, segment->size - position);
+
+        ssize_t length_read = pread(segment->fd, (u8*) buf + done, once, position);
+
+        if(length_read == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        // a piece shorter than when it was opened
+        if(length_read == 0) break;
+        done += length_read;
+    }
+
+    return done;
+}
+
+status wait_segments(struct segments *s, u64 offset, u64 length)
+{
+    return s->stream ? wait_stream(s->stream, offset, length) : ok;
+}
+
+int advise_segments(struct segments *s, u64 offset, u64 length, int advice)
+{
+    if(s->count == 0) return 0;
+
+    u64 end = length ? MIN(offset + length, s->size) : s->size;
+
+    while (offset < end) {
+        struct file_segment *segment = find_segment(s, offset);
+        u64 once = MIN(end - offset, segment->offset + segment->size - offset);
+
+        int result = posix_fadvise(segment->fd, offset - segment->offset, once, advice);
+
+        if(result != 0) return result;
+        offset += once;
+    }
+
+    return 0;
+}
+
+int later_segment(const char *path)
+{
+    char first[PATH_MAX];
+    struct stat st;
+
+    size_t length = suffix_length(path);
+
+    if(length == 0 || first_suffix(path + strlen(path) - length, length)) return 0;
+
+    snprintf(first, sizeof first, "%s", path);
+    memset(first + strlen(first) - length, 'a', length);
+
+    return stat(first, &st) == 0;
+}
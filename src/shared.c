@@ -0,0 +1,330 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "partclone.h"
+#include "log.h"
+#include "image.h"
+#include "budget.h"
+#include "crc.h"
+#include "compressed.h"
+#include "shared.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define SHARED_MAGIC   0x6d6e6263 // "cbnm"
+#define SHARED_VERSION 1
+
+// where shm_open() keeps objects; objects are published with link()
+#define SHARED_DIRECTORY "/dev/shm"
+
+// beginning of the shared memory object; the bitmap follows at data_offset,
+// the cache right after the bitmap
+struct shared_header
+{
+    u32 magic;
+    u32 version;
+    struct shared_identity id;
+    u64 data_offset;
+    // fields derived while loading the bitmap
+    u64 blocks_count;
+    u64 bitmap_elements;
+    u64 bitmap_size;
+    u64 cache_elements;
+    u64 cache_size;
+    // set when everything above is written
+    u32 ready;
+};
+
+// An object is filled under a temporary name and then linked under its own
+// name, so an object found by name is always complete. Users of an object hold
+// a shared lock on it; the last user is the one which can take the exclusive
+// lock.
+
+static void shared_name(struct shared_identity *id, char *name)
+{
+    snprintf(name, SHARED_NAME_LENGTH, "/partclone-nbd-%08x-%jx",
+            count_crc32(id, sizeof *id, 0), (uintmax_t) id->ino);
+}
+
+status shared_identity(struct image *img, struct shared_identity *id)
+{
+    struct stat st;
+    u64 size = img->segments.size;
+
+    memset(&st, 0, sizeof st);
+
+    // a remote image is identified by its URL and size
+    if(img->fd == -1) {
+        st.st_ino = count_crc32(img->path, strlen(img->path), 0);
+        size = img->compressed->source_size;
+    } else if(fstat(img->fd, &st) == -1) {
+        log_error("Cannot stat image file: %s.", strerror(errno));
+        return error;
+    }
+
+    memset(id, 0, sizeof *id);
+
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    id->size = size;
+    id->mtime_sec = st.st_mtim.tv_sec;
+    id->mtime_nsec = st.st_mtim.tv_nsec;
+    id->device_size = img->device_size;
+    id->blocks_count = img->blocks_count;
+    id->used_blocks = img->used_blocks;
+    id->data_offset = img->data_offset;
+    id->bitmap_offset = img->bitmap_offset;
+    id->elems_per_cache = img->bitmap_elements_in_cache_element;
+    id->block_size = img->block_size;
+    id->blocks_per_checksum = img->blocks_per_checksum;
+    id->checksum_size = img->checksum_size;
+    id->bmpmode = img->bmpmode;
+
+    return ok;
+}
+
+status image_key(struct image *img, u32 *hash, char *key)
+{
+    struct shared_identity id;
+
+    if(shared_identity(img, &id) == error) return error;
+
+    *hash = count_crc32(&id, sizeof id, 0);
+    snprintf(key, IMAGE_KEY_LENGTH, "%08x-%jx", *hash, (uintmax_t) id.ino);
+
+    return ok;
+}
+
+static void object_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, SHARED_DIRECTORY "%s", name);
+}
+
+// whether the object opened as fd is the one currently named so
+static int same_object(int fd, const char *name)
+{
+    char path[SHARED_NAME_LENGTH + sizeof SHARED_DIRECTORY];
+    struct stat opened, named;
+
+    object_path(name, path, sizeof path);
+
+    return fstat(fd, &opened) == 0 && stat(path, &named) == 0 &&
+           opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+
+status map_shared(struct image *img, struct shared_identity *id)
+{
+    char *name = img->shared_name;
+    struct stat st;
+
+    shared_name(id, name);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if(fd == -1) {
+        log_debug("No shared metadata of the image (%s).", strerror(errno));
+        return error;
+    }
+
+    if(flock(fd, LOCK_SH) == -1 || fstat(fd, &st) == -1) {
+        log_error("Cannot lock shared metadata: %s.", strerror(errno));
+        goto error_1;
+    }
+
+    if((size_t) st.st_size < sizeof(struct shared_header)) goto stale;
+
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(ptr == MAP_FAILED) {
+        log_error("Cannot map shared metadata: %s.", strerror(errno));
+        goto error_1;
+    }
+
+    struct shared_header *header = ptr;
+
+    if(!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) ||
+       header->magic != SHARED_MAGIC                      ||
+       header->version != SHARED_VERSION                  ||
+       memcmp(&header->id, id, sizeof *id) != 0           ||
+       header->data_offset + header->bitmap_size + header->cache_size > (u64) st.st_size) {
+    /* ---------------------------------------------------------------------- */
+        munmap(ptr, st.st_size);
+        goto stale;
+    }
+
+    img->blocks_count = header->blocks_count;
+    img->bitmap_elements = header->bitmap_elements;
+    img->bitmap_size = header->bitmap_size;
+    img->cache_elements = header->cache_elements;
+    img->cache_size = header->cache_size;
+    img->bitmap_ptr = (u64*) ((u8*) ptr + header->data_offset);
+    img->cache_ptr = (u64*) ((u8*) ptr + header->data_offset + header->bitmap_size);
+
+    img->shared_ptr = ptr;
+    img->shared_size = st.st_size;
+    img->shared_fd = fd;
+
+    log_info("Bitmap mapped from shared memory (%s).", name);
+    return ok;
+
+stale:
+    // left by an older version of the program; the next process publishes
+    // again. Removed only if nobody uses it and the name still refers to it.
+    if(flock(fd, LOCK_EX | LOCK_NB) == 0 && same_object(fd, name)) {
+        log_warning("Removing stale shared metadata %s.", name);
+        shm_unlink(name);
+    }
+
+error_1:
+    close(fd);
+    return error;
+}
+
+status publish_shared(struct image *img, struct shared_identity *id)
+{
+    char *name = img->shared_name;
+    char temporary_name[SHARED_NAME_LENGTH + 16];
+    char path[SHARED_NAME_LENGTH + sizeof SHARED_DIRECTORY];
+    char temporary_path[sizeof temporary_name + sizeof SHARED_DIRECTORY];
+
+    shared_name(id, name);
+    snprintf(temporary_name, sizeof temporary_name, "%s.%ld", name, (long) getpid());
+    object_path(name, path, sizeof path);
+    object_path(temporary_name, temporary_path, sizeof temporary_path);
+
+    int fd = shm_open(temporary_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if(fd == -1) {
+        log_warning("Cannot publish shared metadata %s: %s.", name, strerror(errno));
+        return error;
+    }
+
+    u64 data_offset = divide_up(sizeof(struct shared_header), 64) * 64;
+    size_t size = data_offset + img->bitmap_size + img->cache_size;
+
+    // held from the start, so the object is never taken for an unused one
+    if(flock(fd, LOCK_SH) == -1 || ftruncate(fd, size) == -1) {
+        log_warning("Cannot create shared metadata %s: %s.", name, strerror(errno));
+        goto error_1;
+    }
+
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(ptr == MAP_FAILED) {
+        log_warning("Cannot map shared metadata %s: %s.", name, strerror(errno));
+        goto error_1;
+    }
+
+    struct shared_header *header = ptr;
+
+    *header = (struct shared_header) {
+        .magic = SHARED_MAGIC,
+        .version = SHARED_VERSION,
+        .id = *id,
+        .data_offset = data_offset,
+        .blocks_count = img->blocks_count,
+        .bitmap_elements = img->bitmap_elements,
+        .bitmap_size = img->bitmap_size,
+        .cache_elements = img->cache_elements,
+        .cache_size = img->cache_size,
+        .ready = 0
+    };
+
+    u8 *bitmap = (u8*) ptr + data_offset;
+
+    memcpy(bitmap, img->bitmap_ptr, img->bitmap_size);
+    memcpy(bitmap + img->bitmap_size, img->cache_ptr, img->cache_size);
+
+    __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+
+    mprotect(ptr, size, PROT_READ);
+
+    // the object appears complete under its name, or not at all
+    if(link(temporary_path, path) == -1) {
+        int published = errno == EEXIST;
+
+        log_debug("Cannot link shared metadata %s: %s.", name, strerror(errno));
+
+        munmap(ptr, size);
+        shm_unlink(temporary_name);
+        close(fd);
+
+        // another process published the same image first; use its copy
+        u64 *bitmap_ptr = img->bitmap_ptr;
+        u64 *cache_ptr = img->cache_ptr;
+
+        if(published && map_shared(img, id) == ok) {
+            free(bitmap_ptr);
+            free(cache_ptr);
+            release_memory(img->bitmap_size + img->cache_size);
+            return ok;
+        }
+
+        log_warning("Cannot publish shared metadata %s.", name);
+        return error;
+    }
+
+    shm_unlink(temporary_name);
+
+    // the published copy replaces the private one
+    free(img->bitmap_ptr);
+    free(img->cache_ptr);
+    release_memory(img->bitmap_size + img->cache_size);
+
+    img->bitmap_ptr = (u64*) bitmap;
+    img->cache_ptr = (u64*) (bitmap + img->bitmap_size);
+
+    img->shared_ptr = ptr;
+    img->shared_size = size;
+    img->shared_fd = fd;
+
+    log_info("Bitmap published in shared memory (%s).", name);
+    return ok;
+
+error_1:
+    shm_unlink(temporary_name);
+    close(fd);
+    return error;
+}
+
+void unmap_shared(struct image *img)
+{
+    munmap(img->shared_ptr, img->shared_size);
+
+    // nobody else holds the lock - the object is not needed anymore
+    if(flock(img->shared_fd, LOCK_EX | LOCK_NB) == 0) {
+        shm_unlink(img->shared_name);
+        log_debug("Shared metadata %s removed.", img->shared_name);
+    }
+
+    close(img->shared_fd);
+    img->shared_ptr = NULL;
+}
@@ -20,7 +20,9 @@
  */
 
 #include <signal.h>
-#include <setjmp.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
@@ -43,45 +45,60 @@ struct {
     {0}
 };
 
-sigjmp_buf env;
-
-// this handler will jump to function sigsetjmp() called somewhere before
-static void internal_signal_handler(signal_t sig)
+static void handled_signals(sigset_t *mask)
 {
-    /* JUMP .... */ siglongjmp(env, sig);
+    sigemptyset(mask);
+
+    for(int i = 0; sigs_to_handle[i].sig_num; i++) {
+        sigaddset(mask, sigs_to_handle[i].sig_num);
+    }
 }
 
 /* to avoid duplication of signal handling */
 void block_signals_in_thread()
 {
     sigset_t mask;
-    sigemptyset(&mask);
-
-    for(int i = 0; sigs_to_handle[i].sig_num; i++) {
-        sigaddset(&mask, sigs_to_handle[i].sig_num);
-    }
+    handled_signals(&mask);
 
     pthread_sigmask(SIG_SETMASK, &mask, NULL);
 }
 
-void initialize_handling()
+int open_signal_fd()
 {
-    // mask every signal during signal handler execution
     sigset_t mask;
-    sigfillset(&mask);
-    
-    struct sigaction sa = {
-        .sa_handler = &internal_signal_handler, 
-        .sa_mask = mask,
-        .sa_flags = SA_RESTART // Restart the system call, if at all possible
-    };
+    handled_signals(&mask);
 
-    for(int i = 0; sigs_to_handle[i].sig_num; i++) {
+    // writing to a socket closed by a client must fail with EPIPE instead of
+    // killing the whole process
+    signal(SIGPIPE, SIG_IGN);
+
+    // threads started later inherit the mask
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
-        if (sigaction(sigs_to_handle[i].sig_num, &sa, NULL) == -1) {
-            log_error("Cannot set %s handler.", sigs_to_handle[i].sig_char); 
-        } else {
-            log_debug("%s handler set.", sigs_to_handle[i].sig_char);
-        }
+    int fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    if(fd == -1) {
+        log_error("Cannot create a signal descriptor: %s.", strerror(errno));
+    } else {
+        log_debug("Signal descriptor created.");
     }
+
+    return fd;
+}
+
+signal_t read_signal(int fd)
+{
+    struct signalfd_siginfo info;
+    ssize_t once;
+
+    do {
+        once = read(fd, &info, sizeof info);
+    } while (once == -1 && errno == EINTR);
+
+    if(once != sizeof info) {
+        log_error("Cannot read a signal: %s.", strerror(errno));
+        return 0;
+    }
+
+    return info.ssi_signo;
 }
@@ -0,0 +1,626 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "io.h"
+#include "image.h"
+#include "budget.h"
+#include "crc.h"
+#include "shared.h"
+#include "blockcache.h"
+#include "ssdcache.h"
+#include "coalesce.h"
+#include "dedup.h"
+
+#include <sys/file.h>
+#include <pthread.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SSD_MAGIC "PCNBDSC1"
+#define HEADER_SIZE 4096
+// index entries are read in pieces of this many
+#define LOAD_ENTRIES 4096
+// share of the protected segment
+#define PROTECTED_SHARE 80
+
+// on-disk index entry; all fields are little-endian. length is 0 for an
+// empty slot.
+struct ssd_entry
+{
+    u64 tag;
+    u64 index;
+    u32 length;
+    u32 crc;
+    // order of writes; the most recently written slots are evicted last
+    // after a restart
+    u64 seq;
+};
+
+struct ssd_header
+{
+    char magic[8];
+    u32 chunk_size;
+    u32 entry_size;
+    u64 slots;
+};
+
+enum slot_state {empty, writing, valid};
+enum ssd_segment {probation, protected, unlisted};
+
+struct ssd_slot
+{
+    u64 tag;
+    u64 index;
+    u32 length;
+    u32 crc;
+    u32 refs;
+    enum slot_state state;
+    enum ssd_segment segment;
+    // the CRC32 was checked since the cache was opened
+    int verified;
+
+    struct ssd_slot *prev;
+    struct ssd_slot *next;
+    struct ssd_slot *bucket_next;
+};
+
+// LRU list; the most recently used slot is at head.next
+struct ssd_list
+{
+    struct ssd_slot head;
+    u64 count;
+};
+
+static pthread_mutex_t ssd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cache_fd = -1;
+static struct ssd_slot *slots;
+static u64 slots_count;
+static u64 data_start;
+static u64 reserved;
+
+static struct ssd_slot **buckets;
+static u64 buckets_mask;
+static struct ssd_list lists[2];
+static struct ssd_slot *free_slots;
+static u64 protected_capacity;
+
+static u64 next_seq;
+static u64 hits;
+static u64 misses;
+
+/* ---------------------------- HELPERS --------------------------------- */
+
+static inline u64 slot_number(struct ssd_slot *slot)
+{
+    return slot - slots;
+}
+
+static inline u64 bucket_of(u64 tag, u64 index)
+{
+    u64 x = tag * 0x9E3779B97F4A7C15ULL ^ index;
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (x ^ (x >> 31)) & buckets_mask;
+}
+
+static inline void list_remove(struct ssd_slot *slot)
+{
+    slot->prev->next = slot->next;
+    slot->next->prev = slot->prev;
+    lists[slot->segment].count--;
+    slot->segment = unlisted;
+}
+
+static inline void list_push(enum ssd_segment segment, struct ssd_slot *slot)
+{
+    struct ssd_list *list = &lists[segment];
+
+    slot->next = list->head.next;
+    slot->prev = &list->head;
+    list->head.next->prev = slot;
+    list->head.next = slot;
+    list->count++;
+    slot->segment = segment;
+}
+
+static struct ssd_slot *lookup(u64 tag, u64 index)
+{
+    struct ssd_slot *slot = buckets[bucket_of(tag, index)];
+
+    while (slot && (slot->tag != tag || slot->index != index)) slot = slot->bucket_next;
+
+    return slot;
+}
+
+static void insert(struct ssd_slot *slot)
+{
+    struct ssd_slot **bucket = &buckets[bucket_of(slot->tag, slot->index)];
+
+    slot->bucket_next = *bucket;
+    *bucket = slot;
+}
+
+static void unhash(struct ssd_slot *slot)
+{
+    struct ssd_slot **link = &buckets[bucket_of(slot->tag, slot->index)];
+
+    while (*link != slot) link = &(*link)->bucket_next;
+    *link = slot->bucket_next;
+}
+
+// segmented LRU: the second hit moves a slot to the protected segment
+static void touch(struct ssd_slot *slot)
+{
+    enum ssd_segment segment = slot->segment;
+
+    list_remove(slot);
+    list_push(protected, slot);
+
+    if(segment == probation && lists[protected].count > protected_capacity) {
+        struct ssd_slot *demoted = lists[protected].head.prev;
+
+        list_remove(demoted);
+        list_push(probation, demoted);
+    }
+}
+
+// drop a slot from the cache; it is reused once nobody reads from it
+static void discard(struct ssd_slot *slot)
+{
+    unhash(slot);
+    list_remove(slot);
+    slot->state = empty;
+
+    if(slot->refs == 0) {
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+}
+
+// a free slot, or the least recently used one which is not in use
+static struct ssd_slot *take_slot(void)
+{
+    struct ssd_slot *slot = free_slots;
+    int i;
+
+    if(slot != NULL) {
+        free_slots = slot->next;
+        return slot;
+    }
+
+    for (i = probation; i <= protected; i++) {
+        for (slot = lists[i].head.prev; slot != &lists[i].head; slot = slot->prev) {
+            if(slot->refs == 0) {
+                unhash(slot);
+                list_remove(slot);
+                return slot;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static u64 image_tag(struct image *img)
+{
+    u64 tag = __atomic_load_n(&img->ssd_tag, __ATOMIC_RELAXED);
+    struct shared_identity id;
+
+    if(tag != 0 || shared_identity(img, &id) == error) return tag;
+
+    // never 0
+    tag = (u64) count_crc32(&id, sizeof id, 0) << 32 | (id.ino & 0xFFFFFFFF) | 1;
+    __atomic_store_n(&img->ssd_tag, tag, __ATOMIC_RELAXED);
+
+    return tag;
+}
+
+// the tag and the key of a chunk in the cache: the image and the index of the
+// chunk, or its content hash (see dedup.h); tags of content are even
+static u64 chunk_tag(struct image *img, u64 index, u64 *key)
+{
+    u64 hash[2];
+
+    if(chunk_hash(img, index, hash)) {
+        *key = hash[1];
+        return hash[0] & ~(u64) 1;
+    }
+
+    *key = index;
+    return image_tag(img);
+}
+
+/* ------------------------- INITIALIZATION ----------------------------- */
+
+static int compare_seq(const void *a, const void *b)
+{
+    const struct ssd_entry *x = a, *y = b;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// rebuild the lists from the index; error if the file has another geometry
+static status load_index(void)
+{
+    struct ssd_header header;
+    u64 i, j, loaded = 0;
+
+    if(read_full(cache_fd, (u8*) &header, sizeof header, 0) != sizeof header ||
+       memcmp(header.magic, SSD_MAGIC, sizeof header.magic) != 0 ||
+       le32toh(header.chunk_size) != BLOCK_CACHE_CHUNK ||
+       le32toh(header.entry_size) != sizeof(struct ssd_entry) ||
+       le64toh(header.slots) != slots_count) {
+        return error;
+    }
+
+    struct ssd_entry *entries = malloc(LOAD_ENTRIES * sizeof *entries);
+    // valid entries of the whole index, sorted by seq; the slot number is
+    // kept in the length field
+    struct ssd_entry *order = malloc(slots_count * sizeof *order);
+
+    if(entries == NULL || order == NULL) {
+        log_error("Cannot allocate memory for the SSD cache index.");
+        free(entries);
+        free(order);
+        return error;
+    }
+
+    for (i = 0; i < slots_count; i += LOAD_ENTRIES) {
+        u64 count = MIN(LOAD_ENTRIES, slots_count - i);
+        size_t length = count * sizeof *entries;
+
+        if(read_full(cache_fd, (u8*) entries, length, HEADER_SIZE + i * sizeof *entries) != (ssize_t) length) {
+            log_warning("SSD cache index is truncated.");
+            break;
+        }
+
+        for (j = 0; j < count; j++) {
+            struct ssd_slot *slot = &slots[i + j];
+
+            slot->tag = le64toh(entries[j].tag);
+            slot->index = le64toh(entries[j].index);
+            slot->length = le32toh(entries[j].length);
+            slot->crc = le32toh(entries[j].crc);
+
+            if(slot->length == 0 || slot->length > BLOCK_CACHE_CHUNK || lookup(slot->tag, slot->index)) {
+                continue;
+            }
+
+            slot->state = valid;
+            insert(slot);
+
+            order[loaded].seq = le64toh(entries[j].seq);
+            order[loaded].length = i + j;
+            loaded++;
+
+            next_seq = MAX(next_seq, order[loaded - 1].seq + 1);
+        }
+    }
+
+    qsort(order, loaded, sizeof *order, compare_seq);
+
+    for (i = 0; i < loaded; i++) list_push(probation, &slots[order[i].length]);
+
+    free(entries);
+    free(order);
+
+    log_info("SSD cache opened with " fu64 " of " fu64 " chunks.", loaded, slots_count);
+    return ok;
+}
+
+static status create_index(void)
+{
+    struct ssd_header header;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SSD_MAGIC, sizeof header.magic);
+    header.chunk_size = htole32(BLOCK_CACHE_CHUNK);
+    header.entry_size = htole32(sizeof(struct ssd_entry));
+    header.slots = htole64(slots_count);
+
+    // the index is zeroed by truncation: every slot is empty
+    if(ftruncate(cache_fd, 0) == -1 ||
+       ftruncate(cache_fd, data_start + slots_count * BLOCK_CACHE_CHUNK) == -1) {
+        log_error("Cannot resize the SSD cache: %s.", strerror(errno));
+        return error;
+    }
+
+    if(write_full(cache_fd, &header, sizeof header, 0) == error) {
+        log_error("Cannot write the SSD cache: %s.", strerror(errno));
+        return error;
+    }
+
+    log_info("SSD cache of " fu64 " chunks created.", slots_count);
+    return ok;
+}
+
+status initialize_ssd_cache(struct options *options)
+{
+    u64 i;
+
+    if(options->ssd_cache_path == NULL) return ok;
+
+    slots_count = MAX(16, options->ssd_cache_size / BLOCK_CACHE_CHUNK);
+    data_start = HEADER_SIZE + divide_up(slots_count * sizeof(struct ssd_entry), 4096) * 4096;
+
+    u64 buckets_count = 1;
+    while (buckets_count < slots_count) buckets_count <<= 1;
+
+    u64 size = slots_count * sizeof *slots + buckets_count * sizeof *buckets;
+
+    if(reserve_memory(size, "SSD cache index") == error) return error;
+
+    reserved = size;
+
+    slots = calloc(slots_count, sizeof *slots);
+    buckets = calloc(buckets_count, sizeof *buckets);
+    buckets_mask = buckets_count - 1;
+
+    if(slots == NULL || buckets == NULL) {
+        log_error("Cannot allocate memory for the SSD cache index.");
+        goto error;
+    }
+
+    for (i = probation; i <= protected; i++) {
+        lists[i].head.next = lists[i].head.prev = &lists[i].head;
+        lists[i].count = 0;
+    }
+
+    protected_capacity = slots_count * PROTECTED_SHARE / 100;
+    next_seq = 1;
+
+    cache_fd = open(options->ssd_cache_path, O_RDWR | O_CREAT, 0600);
+
+    if(cache_fd == -1) {
+        log_error("Cannot open SSD cache %s: %s.", options->ssd_cache_path, strerror(errno));
+        goto error;
+    }
+
+    // the index in memory must be the only one
+    if(flock(cache_fd, LOCK_EX | LOCK_NB) == -1) {
+        log_error("SSD cache %s is used by another process.", options->ssd_cache_path);
+        goto error;
+    }
+
+    // a cache of another size is started again
+    if(load_index() == error && create_index() == error) goto error;
+
+    // the rest is free
+    for (i = slots_count; i-- > 0;) {
+        if(slots[i].state == empty) {
+            slots[i].segment = unlisted;
+            slots[i].next = free_slots;
+            free_slots = &slots[i];
+        }
+    }
+
+    return ok;
+
+error:
+    close_ssd_cache();
+    return error;
+}
+
+void close_ssd_cache(void)
+{
+    if(reserved == 0) return;
+
+    log_debug("SSD cache: " fu64 " hits, " fu64 " misses.", hits, misses);
+
+    if(cache_fd != -1) {
+        fdatasync(cache_fd);
+        close(cache_fd);
+    }
+
+    free(slots);
+    free(buckets);
+    release_memory(reserved);
+
+    cache_fd = -1;
+    slots = NULL;
+    buckets = NULL;
+    free_slots = NULL;
+    reserved = 0;
+    hits = misses = 0;
+}
+
+int ssd_cache_enabled(void)
+{
+    return cache_fd != -1;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+static ssize_t read_image(struct image *img, u64 index, u8 *data)
+{
+    if(device_chunks(img)) return read_device_chunk(img, index, data);
+
+    u64 offset = index * BLOCK_CACHE_CHUNK;
+    ssize_t length = img->direct_fd != -1 ?
+        read_full(img->direct_fd, data, BLOCK_CACHE_CHUNK, offset) :
+        read_image_file(img, data, BLOCK_CACHE_CHUNK, offset);
+
+    if(length == -1) log_error("Cannot read image data: %s.", strerror(errno));
+
+    return length;
+}
+
+// write-through of a chunk read from the image
+static void store(u64 tag, u64 index, const u8 *data, u32 length)
+{
+    struct ssd_slot *slot;
+
+    pthread_mutex_lock(&ssd_lock);
+
+    // read by another thread in the meantime, or every slot is in use
+    if(lookup(tag, index) != NULL || (slot = take_slot()) == NULL) {
+        pthread_mutex_unlock(&ssd_lock);
+        return;
+    }
+
+    slot->state = writing;
+    slot->refs = 1;
+    u64 seq = next_seq++;
+
+    pthread_mutex_unlock(&ssd_lock);
+
+    u64 number = slot_number(slot);
+    u32 crc = count_crc32(data, length, 0);
+
+    struct ssd_entry entry = {
+        .tag = htole64(tag),
+        .index = htole64(index),
+        .length = htole32(length),
+        .crc = htole32(crc),
+        .seq = htole64(seq)
+    };
+
+    // the data first: an entry never describes data which was not written
+    status result = write_full(cache_fd, data, length, data_start + number * BLOCK_CACHE_CHUNK);
+
+    if(result == ok) {
+        result = write_full(cache_fd, &entry, sizeof entry, HEADER_SIZE + number * sizeof entry);
+    }
+
+    if(result == error) log_error("Cannot write the SSD cache: %s.", strerror(errno));
+
+    pthread_mutex_lock(&ssd_lock);
+
+    slot->refs = 0;
+
+    if(result == ok && lookup(tag, index) == NULL) {
+        slot->tag = tag;
+        slot->index = index;
+        slot->length = length;
+        slot->crc = crc;
+        slot->verified = 1;
+        slot->state = valid;
+
+        insert(slot);
+        list_push(probation, slot);
+    } else {
+        slot->state = empty;
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+
+    pthread_mutex_unlock(&ssd_lock);
+}
+
+// a chunk is read whole; the length is BLOCK_CACHE_CHUNK
+static ssize_t fetch_chunk(struct image *img, u64 offset, size_t size, u8 *data)
+{
+    u64 index = offset / BLOCK_CACHE_CHUNK;
+
+    (void) size;
+
+    if(!ssd_cache_enabled()) return read_image(img, index, data);
+
+    u64 key, tag = chunk_tag(img, index, &key);
+
+    pthread_mutex_lock(&ssd_lock);
+
+    struct ssd_slot *slot = lookup(tag, key);
+
+    if(slot == NULL) {
+        misses++;
+        pthread_mutex_unlock(&ssd_lock);
+    } else {
+        hits++;
+        slot->refs++;
+        touch(slot);
+        pthread_mutex_unlock(&ssd_lock);
+
+        u32 length = slot->length;
+        int verified = slot->verified;
+
+        ssize_t length_read = read_full(cache_fd, data, length,
+                data_start + slot_number(slot) * BLOCK_CACHE_CHUNK);
+
+        int correct = length_read == (ssize_t) length &&
+            (verified || count_crc32(data, length, 0) == slot->crc);
+
+        pthread_mutex_lock(&ssd_lock);
+
+        slot->refs--;
+
+        if(slot->state == empty) {
+            // discarded by another thread meanwhile
+            if(slot->refs == 0) {
+                slot->next = free_slots;
+                free_slots = slot;
+            }
+        } else if(correct) {
+            slot->verified = 1;
+        } else {
+            log_warning("Dropping a damaged chunk of the SSD cache.");
+            discard(slot);
+            hits--;
+            misses++;
+        }
+
+        pthread_mutex_unlock(&ssd_lock);
+
+        if(correct) return length;
+    }
+
+    ssize_t length = read_image(img, index, data);
+
+    if(length > 0) store(tag, key, data, length);
+
+    return length;
+}
+
+ssize_t load_chunk(struct image *img, u64 index, u8 *data)
+{
+    // concurrent misses of a chunk share one read
+    return read_coalesced(img, index * BLOCK_CACHE_CHUNK, BLOCK_CACHE_CHUNK, data, fetch_chunk);
+}
+
+int ssd_chunk_cached(struct image *img, u64 index)
+{
+    u64 key, tag = chunk_tag(img, index, &key);
+
+    pthread_mutex_lock(&ssd_lock);
+    int cached = lookup(tag, key) != NULL;
+    pthread_mutex_unlock(&ssd_lock);
+
+    return cached;
+}
+
+void ssd_cache_stats(u64 *hits_addr, u64 *misses_addr)
+{
+    pthread_mutex_lock(&ssd_lock);
+    *hits_addr = hits;
+    *misses_addr = misses;
+    pthread_mutex_unlock(&ssd_lock);
+}
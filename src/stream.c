@@ -0,0 +1,267 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "log.h"
+#include "signals.h"
+#include "stream.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// the stream is read in pieces of this size
+#define PIECE_SIZE (1 * megabyte)
+// how often the reader checks if it should stop, in milliseconds
+#define POLL_INTERVAL 250
+
+enum stream_state {streaming, ended, failed};
+
+struct stream
+{
+    int source;
+    int spill_fd;
+    const char *path;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // broadcast when data arrives and when the stream ends
+    pthread_cond_t arrived;
+
+    // bytes written to the spill file
+    u64 received;
+    enum stream_state state;
+    int stopping;
+};
+
+static void finish(struct stream *st, enum stream_state state)
+{
+    pthread_mutex_lock(&st->lock);
+    st->state = state;
+    pthread_cond_broadcast(&st->arrived);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static int stopping(struct stream *st)
+{
+    pthread_mutex_lock(&st->lock);
+    int result = st->stopping;
+    pthread_mutex_unlock(&st->lock);
+
+    return result;
+}
+
+static void *reader(void *arg)
+{
+    struct stream *st = arg;
+    struct pollfd source = {st->source, POLLIN, 0};
+    u64 received = 0;
+
+    // signals are handled by the main thread
+    block_signals_in_thread();
+
+    u8 *piece = malloc(PIECE_SIZE);
+
+    if(piece == NULL) {
+        log_error("Cannot allocate memory for reading a stream.");
+        finish(st, failed);
+        return NULL;
+    }
+
+    for (;;) {
+        int ready = poll(&source, 1, POLL_INTERVAL);
+
+        if(stopping(st)) {
+            finish(st, failed);
+            break;
+        }
+
+        if(ready == 0 || (ready == -1 && errno == EINTR)) continue;
+
+        ssize_t length = ready == -1 ? -1 : read(st->source, piece, PIECE_SIZE);
+
+        if(length == -1) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+
+            log_error("Cannot read image from %s: %s.", st->path, strerror(errno));
+            finish(st, failed);
+            break;
+        }
+
+        if(length == 0) {
+            log_info("Image read from %s: " fu64 " MiB.", st->path, received / megabyte);
+            finish(st, ended);
+            break;
+        }
+
+        ssize_t done = 0;
+
+        while (done < length) {
+            ssize_t once = pwrite(st->spill_fd, piece + done, length - done, received + done);
+
+            if(once == -1) {
+                if(errno == EINTR) continue;
+                break;
+            }
+
+            done += once;
+        }
+
+        if(done < length) {
+            log_error("Cannot write to the spill file of %s: %s.", st->path, strerror(errno));
+            finish(st, failed);
+            break;
+        }
+
+        received += length;
+
+        pthread_mutex_lock(&st->lock);
+        st->received = received;
+        pthread_cond_broadcast(&st->arrived);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    free(piece);
+    return NULL;
+}
+
+struct stream *open_stream(int source, const char *path, int *spill_fd)
+{
+    char spill_path[PATH_MAX];
+    const char *directory = getenv("TMPDIR");
+
+    snprintf(spill_path, sizeof spill_path, "%s/partclone-nbd-XXXXXX",
+            directory && *directory ? directory : "/var/tmp");
+
+    struct stream *st = calloc(1, sizeof *st);
+
+    if(st == NULL) {
+        log_error("Cannot allocate memory for a stream.");
+        return NULL;
+    }
+
+    st->source = source;
+    st->path = path;
+    st->spill_fd = mkstemp(spill_path);
+
+    if(st->spill_fd == -1) {
+        log_error("Cannot create a spill file %s: %s.", spill_path, strerror(errno));
+        free(st);
+        return NULL;
+    }
+
+    // removed when closed
+    unlink(spill_path);
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->arrived, NULL);
+
+    if(pthread_create(&st->thread, NULL, reader, st) != 0) {
+        log_error("Cannot start a thread reading the stream.");
+        pthread_cond_destroy(&st->arrived);
+        pthread_mutex_destroy(&st->lock);
+        close(st->spill_fd);
+        free(st);
+        return NULL;
+    }
+
+    log_info("Reading image from %s as it arrives.", path);
+
+    *spill_fd = st->spill_fd;
+    return st;
+}
+
+void close_stream(struct stream *st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->stopping = 1;
+    pthread_mutex_unlock(&st->lock);
+
+    pthread_join(st->thread, NULL);
+
+    if(st->source != STDIN_FILENO) close(st->source);
+
+    // the spill file is closed with the other pieces of the image
+    pthread_cond_destroy(&st->arrived);
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
+
+// the number of bytes of the range which have arrived; the lock is not held
+static u64 wait_range(struct stream *st, u64 offset, u64 length, enum stream_state *state)
+{
+    pthread_mutex_lock(&st->lock);
+
+    while (st->state == streaming && st->received < offset + length) {
+        pthread_cond_wait(&st->arrived, &st->lock);
+    }
+
+    u64 received = st->received;
+    *state = st->state;
+
+    pthread_mutex_unlock(&st->lock);
+
+    if(received <= offset) return 0;
+    return MIN(length, received - offset);
+}
+
+status wait_stream(struct stream *st, u64 offset, u64 length)
+{
+    enum stream_state state;
+
+    if(wait_range(st, offset, length, &state) == length) return ok;
+
+    log_error("The stream of %s %s before the data requested.", st->path,
+            state == failed ? "failed" : "ended");
+    return error;
+}
+
+ssize_t read_stream(struct stream *st, void *buf, size_t length, u64 offset)
+{
+    enum stream_state state;
+    size_t done = 0;
+
+    u64 available = wait_range(st, offset, length, &state);
+
+    if(available < length && state == failed) {
+        errno = EIO;
+        return -1;
+    }
+
+    while (done < available) {
+        ssize_t once = pread(st->spill_fd, (u8*) buf + done, available - done, offset + done);
+
+        if(once == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        if(once == 0) break;
+        done += once;
+    }
+
+    return done;
+}
@@ -0,0 +1,261 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "compressed.h"
+
+#ifdef HAVE_LZMA
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lzma.h>
+
+// An xz file is a sequence of blocks, each of which can be decompressed on
+// its own; the index at the end of every stream tells where they are. xz
+// writes many blocks with -T or --block-size; a file written as one block
+// is one unit, decompressed as a whole for every read.
+
+// compressed data is read in pieces of this size while decoding the index
+#define INPUT_SIZE (64 * kilobyte)
+
+struct xz_block
+{
+    u64 offset;
+    u64 total_size;
+    u64 unpadded_size;
+    // the check type of the stream of the block
+    u32 check;
+};
+
+static const char *lzma_message(lzma_ret ret)
+{
+    switch (ret) {
+        case LZMA_MEM_ERROR:
+            return "not enough memory";
+        case LZMA_OPTIONS_ERROR:
+            return "unsupported options";
+        case LZMA_BUF_ERROR:
+            return "unexpected end of file";
+        default:
+            return "corrupted data";
+    }
+}
+
+// the indexes of all streams of the file, combined
+static lzma_index *read_index(struct compressed *c)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    u64 position = 0;
+
+    if(lzma_file_info_decoder(&strm, &index, UINT64_MAX, c->source_size) != LZMA_OK) {
+        log_error("Cannot initialize liblzma.");
+        return NULL;
+    }
+
+    u8 *input = malloc(INPUT_SIZE);
+
+    if(input == NULL) {
+        log_error("Cannot allocate memory for reading the index of the image.");
+        goto error;
+    }
+
+    for (;;) {
+        if(strm.avail_in == 0) {
+            ssize_t length = read_source(c, input, INPUT_SIZE, position);
+
+            if(length <= 0) {
+                log_error("Cannot read the compressed image: %s.",
+                        length == 0 ? "unexpected end of file" : strerror(errno));
+                goto error;
+            }
+
+            strm.next_in = input;
+            strm.avail_in = length;
+            position += length;
+        }
+
+        lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+
+        if(ret == LZMA_STREAM_END) break;
+
+        if(ret == LZMA_SEEK_NEEDED) {
+            position = strm.seek_pos;
+            strm.avail_in = 0;
+        } else if(ret != LZMA_OK) {
+            log_error("Cannot read the index of the image: %s.", lzma_message(ret));
+            goto error;
+        }
+    }
+
+    lzma_end(&strm);
+    free(input);
+
+    return index;
+
+error:
+    lzma_end(&strm);
+    free(input);
+
+    // set only when the decoder finished
+    if(index) lzma_index_end(index, NULL);
+    return NULL;
+}
+
+static status decode_block(struct compressed *c, u64 unit, u8 *data)
+{
+    struct xz_block *block = (struct xz_block*) c->format + unit;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block options;
+    status result = error;
+    size_t i, in_position, out_position = 0;
+
+    u8 *input = malloc(block->total_size);
+
+    if(input == NULL) {
+        log_error("Cannot allocate memory for decompressing the image.");
+        return error;
+    }
+
+    if(read_source(c, input, block->total_size, block->offset) != (ssize_t) block->total_size) {
+        log_error("Cannot read the compressed image.");
+        free(input);
+        return error;
+    }
+
+    memset(&options, 0, sizeof options);
+    options.version = 1;
+    options.check = block->check;
+    options.filters = filters;
+    options.header_size = lzma_block_header_size_decode(input[0]);
+
+    lzma_ret ret = lzma_block_header_decode(&options, NULL, input);
+
+    if(ret != LZMA_OK) {
+        log_error("Cannot decompress the image: %s.", lzma_message(ret));
+        free(input);
+        return error;
+    }
+
+    ret = lzma_block_compressed_size(&options, block->unpadded_size);
+
+    if(ret == LZMA_OK) {
+        in_position = options.header_size;
+        ret = lzma_block_buffer_decode(&options, NULL, input, &in_position,
+                block->total_size, data, &out_position, c->starts[unit + 1] - c->starts[unit]);
+    }
+
+    if(ret != LZMA_OK) {
+        log_error("Cannot decompress the image: %s.", lzma_message(ret));
+    } else {
+        result = ok;
+    }
+
+    for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) free(filters[i].options);
+    free(input);
+
+    return result;
+}
+
+static void close_xz(struct compressed *c)
+{
+    free(c->format);
+}
+
+status open_xz(struct compressed *c, const char *path, struct options *options)
+{
+    lzma_index_iter iter;
+    u64 i = 0, largest = 0;
+
+    (void) path;
+
+    lzma_index *index = read_index(c);
+
+    if(index == NULL) return error;
+
+    u64 count = lzma_index_block_count(index);
+    struct xz_block *blocks = malloc(count * sizeof *blocks);
+
+    c->starts = malloc((count + 1) * sizeof *c->starts);
+
+    if(blocks == NULL || c->starts == NULL) {
+        log_error("Cannot allocate memory for the index of a compressed image.");
+        lzma_index_end(index, NULL);
+        free(blocks);
+        return error;
+    }
+
+    lzma_index_iter_init(&iter, index);
+
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        blocks[i].offset = iter.block.compressed_file_offset;
+        blocks[i].total_size = iter.block.total_size;
+        blocks[i].unpadded_size = iter.block.unpadded_size;
+        blocks[i].check = iter.stream.flags->check;
+
+        c->starts[i] = iter.block.uncompressed_file_offset;
+        largest = MAX(largest, iter.block.uncompressed_size);
+        i++;
+    }
+
+    c->starts[i] = lzma_index_uncompressed_size(index);
+    c->units = i;
+    c->decode = decode_block;
+    c->close = close_xz;
+    c->format = blocks;
+
+    lzma_index_end(index, NULL);
+
+    if(c->units == 0) {
+        log_error("No data in the compressed image.");
+        return error;
+    }
+
+    // every miss would decompress a whole block into memory (a single-block
+    // image: the whole image)
+    if(largest > options->window_cache) {
+        log_error("Blocks of the image are up to " fu64 " MiB, more than the window "
+                "cache (" fu64 " MiB). Recompress it in small blocks for random access "
+                "(xz -T or --block-size), or raise --window-cache.",
+                divide_up(largest, megabyte), options->window_cache / megabyte);
+        return error;
+    }
+
+    log_info("Index of the compressed image read (" fu64 " blocks).", c->units);
+    return ok;
+}
+
+#else
+
+status open_xz(struct compressed *c, const char *path, struct options *options)
+{
+    (void) c;
+    (void) path;
+    (void) options;
+
+    log_error("xz-compressed images are not supported by this build.");
+    return error;
+}
+
+#endif // HAVE_LZMA
@@ -0,0 +1,290 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "io.h"
+#include "image.h"
+#include "budget.h"
+#include "zeroes.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define ZEROES_MAGIC "PCNBDZB1"
+// data read at once while looking for zero blocks
+#define READ_SIZE (4 * megabyte)
+
+// file format; all fields are little-endian. The header is followed by the
+// bitmap of present blocks holding only zeroes, in 64-bit words.
+struct zeroes_header
+{
+    char magic[8];
+    // of the image file (the compressed one, if it is compressed)
+    u64 size;
+    s64 mtime;
+    u64 blocks_count;
+    u32 block_size;
+    u32 reserved;
+    u64 zero_blocks;
+};
+
+// 1 if the data holds only zeroes. Words are combined 64 bytes at a time
+// without branches, which the compiler turns into vector instructions.
+static int all_zeroes(const u8 *data, size_t length)
+{
+    size_t i, j;
+
+    for (i = 0; i + 64 <= length; i += 64) {
+        u64 words[8], any = 0;
+
+        memcpy(words, data + i, sizeof words);
+
+        for (j = 0; j < 8; j++) {
+            any |= words[j];
+        }
+
+        if(any != 0) return 0;
+    }
+
+    for (; i < length; i++) {
+        if(data[i] != 0) return 0;
+    }
+
+    return 1;
+}
+
+static status load_file(struct image *img, u64 *zeroes, const char *path, u64 *count)
+{
+    struct zeroes_header header;
+    size_t i;
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1) return error;
+
+    if(read_full(fd, &header, sizeof header, 0) != sizeof header ||
+       memcmp(header.magic, ZEROES_MAGIC, sizeof header.magic) != 0 ||
+       le64toh(header.size) != img->segments.size ||
+       (s64) le64toh(header.mtime) != (s64) img->segments.mtime ||
+       le64toh(header.blocks_count) != img->blocks_count ||
+       le32toh(header.block_size) != img->block_size) {
+        log_info("Zero block map %s is stale; it is built again.", path);
+        close(fd);
+        return error;
+    }
+
+    if(read_full(fd, zeroes, img->bitmap_size, sizeof header) != (ssize_t) img->bitmap_size) {
+        log_warning("Cannot read zero block map %s; it is built again.", path);
+        close(fd);
+        return error;
+    }
+
+    close(fd);
+
+    for (i = 0; i < img->bitmap_elements; i++) {
+        zeroes[i] = le64toh(zeroes[i]);
+    }
+
+    *count = le64toh(header.zero_blocks);
+    return ok;
+}
+
+static void save_file(struct image *img, u64 *zeroes, const char *path, u64 count)
+{
+    char tmp_path[PATH_MAX + 16];
+    struct zeroes_header header;
+    size_t i;
+
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", path, (long) getpid());
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd == -1) {
+        log_warning("Cannot create %s (%s); the zero block map is not saved.",
+                tmp_path, strerror(errno));
+        return;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, ZEROES_MAGIC, sizeof header.magic);
+    header.size = htole64(img->segments.size);
+    header.mtime = htole64(img->segments.mtime);
+    header.blocks_count = htole64(img->blocks_count);
+    header.block_size = htole32(img->block_size);
+    header.zero_blocks = htole64(count);
+
+    for (i = 0; i < img->bitmap_elements; i++) {
+        zeroes[i] = htole64(zeroes[i]);
+    }
+
+    // the header last: a partial file is never valid
+    status result = write_full(fd, zeroes, img->bitmap_size, sizeof header);
+
+    for (i = 0; i < img->bitmap_elements; i++) {
+        zeroes[i] = le64toh(zeroes[i]);
+    }
+
+    if(result == error || write_full(fd, &header, sizeof header, 0) == error ||
+       fdatasync(fd) == -1 || rename(tmp_path, path) == -1) {
+        log_warning("Cannot save %s: %s.", path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    close(fd);
+}
+
+// read the data of present blocks, run by run
+static status scan_image(struct image *img, u64 *zeroes, u64 *count)
+{
+    u64 block = 0, i;
+    size_t capacity = 0;
+    u8 *buffer = NULL;
+
+    *count = 0;
+
+    log_info("Looking for blocks of zeroes (the image is read once as a whole) ...");
+
+    while (block < img->blocks_count) {
+        u8 existence;
+        u64 blocks = find_run(img->bitmap_ptr, block, img->blocks_count, &existence);
+
+        if(existence) {
+            u64 rank = block_rank(img, block);
+            u64 done = 0;
+
+            while (done < blocks) {
+                u64 once = MIN(blocks - done, MAX(READ_SIZE / img->block_size, 1));
+                u64 start = rank_offset(img, rank + done);
+                size_t span = rank_offset(img, rank + done + once) - start;
+
+                if(span > capacity) {
+                    u8 *extended = realloc(buffer, span);
+
+                    if(extended == NULL) {
+                        log_error("Cannot allocate memory for finding zero blocks.");
+                        free(buffer);
+                        return error;
+                    }
+
+                    buffer = extended;
+                    capacity = span;
+                }
+
+                if(read_ranks(img, buffer, rank + done, once) == error) {
+                    free(buffer);
+                    return error;
+                }
+
+                // checksums are already moved out from between the blocks
+                for (i = 0; i < once; i++) {
+                    u64 zero_block = block + done + i;
+
+                    if(all_zeroes(buffer + i * img->block_size, img->block_size)) {
+                        zeroes[zero_block / 64] |= (u64) 1 << (zero_block % 64);
+                        (*count)++;
+                    }
+                }
+
+                done += once;
+            }
+        }
+
+        block += blocks;
+    }
+
+    free(buffer);
+    return ok;
+}
+
+/* ---------------------------- INTERFACE ------------------------------- */
+
+status find_zero_blocks(struct image *img, struct options *options)
+{
+    char path[PATH_MAX];
+    u64 count, i;
+
+    img->nonzero_ptr = NULL;
+
+    if(!options->zero_blocks) return ok;
+
+    if(img->segments.count == 0 || img->segments.stream != NULL) {
+        log_info("Zero blocks are not looked for in streamed or remote images.");
+        return ok;
+    }
+
+    if(reserve_memory(img->bitmap_size, "zero block map") == error) return error;
+
+    u64 *zeroes = calloc(img->bitmap_elements, sizeof *zeroes);
+
+    if(zeroes == NULL) {
+        log_error("Cannot allocate memory for the zero block map.");
+        release_memory(img->bitmap_size);
+        return error;
+    }
+
+    snprintf(path, sizeof path, "%s.zeroidx", img->segments.name);
+
+    if(load_file(img, zeroes, path, &count) == error) {
+        memset(zeroes, 0, img->bitmap_size);
+
+        if(scan_image(img, zeroes, &count) == error) {
+            free(zeroes);
+            release_memory(img->bitmap_size);
+            return error;
+        }
+
+        save_file(img, zeroes, path, count);
+    }
+
+    log_info(fu64 " of " fu64 " present blocks hold only zeroes; they are served as holes.",
+            count, present_blocks(img));
+
+    if(count == 0) {
+        free(zeroes);
+        release_memory(img->bitmap_size);
+        return ok;
+    }
+
+    // present blocks without them; the map is not needed any more
+    for (i = 0; i < img->bitmap_elements; i++) {
+        zeroes[i] = img->bitmap_ptr[i] & ~zeroes[i];
+    }
+
+    img->nonzero_ptr = zeroes;
+    return ok;
+}
+
+void free_zero_blocks(struct image *img)
+{
+    if(img->nonzero_ptr == NULL) return;
+
+    release_memory(img->bitmap_size);
+    free(img->nonzero_ptr);
+    img->nonzero_ptr = NULL;
+}
@@ -0,0 +1,435 @@
+/* Copyright © 2015-2016 Przemysław Kusiak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "partclone.h"
+#include "options.h"
+#include "log.h"
+#include "compressed.h"
+
+#ifdef HAVE_ZSTD
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zstd.h>
+
+// A zstd file is a sequence of frames, each of which can be decompressed on
+// its own. Frames are found in the seek table of the seekable format
+// (t2sz, zstd's contrib/seekable_format) or, without it, by walking the
+// frame and block headers of the file (pzstd, zstd --adapt, concatenated
+// files). A frame which does not record its content size (zstd writing to
+// a pipe) is decompressed once to measure it. zstd writes one frame unless
+// the input was split.
+
+#define FRAME_MAGIC 0xFD2FB528
+// a frame header is never longer
+#define FRAME_HEADER_MAX 18
+// compressed data is read in pieces of this size while measuring a frame
+#define INPUT_SIZE (128 * kilobyte)
+#define UNKNOWN_SIZE ((u64) -1)
+// skippable frames have magic 0x184D2A50 - 0x184D2A5F
+#define SKIPPABLE_MAGIC 0x184D2A50
+#define SKIPPABLE_MASK 0xFFFFFFF0
+#define SEEKABLE_MAGIC 0x8F92EAB1
+// the seek table is in a skippable frame with this magic
+#define SEEK_TABLE_MAGIC 0x184D2A5E
+#define SEEK_FOOTER_SIZE 9
+// of the decompressed data, optional at the end of a frame
+#define CHECKSUM_SIZE 4
+
+struct zstd_frame
+{
+    u64 offset;
+    u64 size;
+};
+
+struct zstd_index
+{
+    struct zstd_frame *frames;
+    u64 *starts;
+    u64 count;
+    u64 allocated;
+    u64 size;
+};
+
+static status add_frame(struct zstd_index *index, u64 offset, u64 compressed, u64 size)
+{
+    // empty frames are not units
+    if(size == 0) return ok;
+
+    if(index->count == index->allocated) {
+        u64 extended_count = index->allocated ? 2 * index->allocated : 1024;
+        struct zstd_frame *frames = realloc(index->frames, extended_count * sizeof *frames);
+
+        if(frames == NULL) {
+            log_error("Cannot allocate memory for the index of a compressed image.");
+            return error;
+        }
+
+        index->frames = frames;
+
+        // one more for the size of the data
+        u64 *starts = realloc(index->starts, (extended_count + 1) * sizeof *starts);
+
+        if(starts == NULL) {
+            log_error("Cannot allocate memory for the index of a compressed image.");
+            return error;
+        }
+
+        index->starts = starts;
+        index->allocated = extended_count;
+    }
+
+    index->frames[index->count].offset = offset;
+    index->frames[index->count].size = compressed;
+    index->starts[index->count] = index->size;
+
+    index->count++;
+    index->size += size;
+
+    return ok;
+}
+
+static inline u32 get_le32(const u8 *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (u32) data[3] << 24;
+}
+
+// frames listed in the seek table; ok with no frames if there is no table
+static status read_seek_table(struct compressed *c, struct zstd_index *index)
+{
+    u8 footer[SEEK_FOOTER_SIZE], header[8];
+    u64 i, offset = 0;
+
+    if(c->source_size < SEEK_FOOTER_SIZE + 8 ||
+       read_source(c, footer, SEEK_FOOTER_SIZE, c->source_size - SEEK_FOOTER_SIZE) != SEEK_FOOTER_SIZE ||
+       get_le32(footer + 5) != SEEKABLE_MAGIC) {
+        return ok;
+    }
+
+    u64 count = get_le32(footer);
+    // the frames have checksums
+    u64 entry_size = footer[4] & 0x80 ? 12 : 8;
+    u64 length = count * entry_size;
+
+    if(c->source_size < SEEK_FOOTER_SIZE + 8 + length ||
+       read_source(c, header, 8, c->source_size - SEEK_FOOTER_SIZE - length - 8) != 8 ||
+       get_le32(header) != SEEK_TABLE_MAGIC ||
+       get_le32(header + 4) != length + SEEK_FOOTER_SIZE) {
+        log_warning("The seek table of the image is damaged; frames are found by reading it.");
+        return ok;
+    }
+
+    u8 *entries = malloc(MAX(length, 1));
+
+    if(entries == NULL) {
+        log_error("Cannot allocate memory for the index of a compressed image.");
+        return error;
+    }
+
+    if(read_source(c, entries, length, c->source_size - SEEK_FOOTER_SIZE - length) != (ssize_t) length) {
+        log_error("Cannot read the seek table of the image.");
+        free(entries);
+        return error;
+    }
+
+    for (i = 0; i < count; i++) {
+        u64 compressed = get_le32(entries + i * entry_size);
+        u64 size = get_le32(entries + i * entry_size + 4);
+
+        if(add_frame(index, offset, compressed, size) == error) {
+            free(entries);
+            return error;
+        }
+
+        offset += compressed;
+    }
+
+    free(entries);
+
+    log_info("Seek table of the compressed image read (" fu64 " frames).", index->count);
+    return ok;
+}
+
+// the length of the frame header and the content size (UNKNOWN_SIZE if not
+// recorded)
+static status parse_frame_header(const u8 *header, size_t length, u64 *header_size, u64 *content_size)
+{
+    static const u8 dictionary_id_sizes[] = {0, 1, 2, 4};
+    static const u8 content_size_sizes[] = {0, 2, 4, 8};
+
+    u8 descriptor = header[4];
+    int single_segment = descriptor >> 5 & 1;
+    u64 size_length = content_size_sizes[descriptor >> 6];
+
+    // a frame of a single segment has no window descriptor but always records
+    // the content size
+    if(single_segment && size_length == 0) size_length = 1;
+
+    u64 size_offset = 5 + !single_segment + dictionary_id_sizes[descriptor & 3];
+
+    *header_size = size_offset + size_length;
+
+    if(*header_size > length) return error;
+
+    if(size_length == 0) {
+        *content_size = UNKNOWN_SIZE;
+        return ok;
+    }
+
+    u64 size = 0, i;
+
+    for (i = 0; i < size_length; i++) size |= (u64) header[size_offset + i] << (8 * i);
+
+    // two-byte sizes are stored minus 256
+    if(size_length == 2) size += 256;
+
+    *content_size = size;
+    return ok;
+}
+
+// the content size of a frame, by decompressing it
+static status measure_frame(struct compressed *c, u64 offset, u64 length, u64 *size)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    size_t output_size = ZSTD_DStreamOutSize();
+    status result = error;
+
+    u8 *input = malloc(INPUT_SIZE);
+    u8 *output = malloc(output_size);
+
+    if(dctx == NULL || input == NULL || output == NULL) {
+        log_error("Cannot allocate memory for reading the compressed image.");
+        goto end;
+    }
+
+    ZSTD_inBuffer in = {input, 0, 0};
+    u64 done = 0;
+
+    *size = 0;
+
+    for (;;) {
+        if(in.pos == in.size) {
+            ssize_t once = read_source(c, input, MIN(INPUT_SIZE, length - done), offset + done);
+
+            if(once <= 0) {
+                log_error("Cannot read the compressed image: %s.",
+                        once == 0 ? "unexpected end of file" : strerror(errno));
+                goto end;
+            }
+
+            in.size = once;
+            in.pos = 0;
+            done += once;
+        }
+
+        ZSTD_outBuffer out = {output, output_size, 0};
+        size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+
+        if(ZSTD_isError(ret)) {
+            log_error("Cannot decompress the image: %s.", ZSTD_getErrorName(ret));
+            goto end;
+        }
+
+        *size += out.pos;
+
+        // the end of the frame
+        if(ret == 0) break;
+    }
+
+    result = ok;
+
+end:
+    ZSTD_freeDCtx(dctx);
+    free(input);
+    free(output);
+
+    return result;
+}
+
+// frames found by walking the headers of the whole file
+static status scan_frames(struct compressed *c, struct zstd_index *index)
+{
+    u8 header[FRAME_HEADER_MAX];
+    u64 offset = 0;
+
+    log_info("Finding frames of the compressed image (it may be read as a whole) ...");
+
+    while (offset < c->source_size) {
+        ssize_t length = read_source(c, header, sizeof header, offset);
+
+        if(length < 8) goto corrupted;
+
+        u32 magic = get_le32(header);
+
+        if((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+            offset += 8 + (u64) get_le32(header + 4);
+            continue;
+        }
+
+        if(magic != FRAME_MAGIC) goto corrupted;
+
+        u64 header_size, content_size;
+
+        if(parse_frame_header(header, length, &header_size, &content_size) == error) {
+            goto corrupted;
+        }
+
+        u64 frame_end = offset + header_size;
+        int last = 0;
+
+        // 3-byte block headers: the last block flag, the type and the size
+        while (!last) {
+            u8 block[3];
+
+            if(read_source(c, block, 3, frame_end) != 3) goto corrupted;
+
+            u32 value = block[0] | block[1] << 8 | block[2] << 16;
+            u32 type = value >> 1 & 3;
+
+            // an RLE block holds one byte; type 3 is reserved
+            if(type == 3) goto corrupted;
+
+            last = value & 1;
+            frame_end += 3 + (type == 1 ? 1 : value >> 3);
+        }
+
+        if(header[4] & 4) frame_end += CHECKSUM_SIZE;
+
+        if(content_size == UNKNOWN_SIZE &&
+           measure_frame(c, offset, frame_end - offset, &content_size) == error) {
+            return error;
+        }
+
+        if(add_frame(index, offset, frame_end - offset, content_size) == error) return error;
+
+        offset = frame_end;
+    }
+
+    if(offset != c->source_size) goto corrupted;
+
+    log_info("Compressed image read: " fu64 " frames.", index->count);
+    return ok;
+
+corrupted:
+    log_error("Cannot read frames of the compressed image: corrupted data.");
+    return error;
+}
+
+static status decode_frame(struct compressed *c, u64 unit, u8 *data)
+{
+    struct zstd_frame *frame = (struct zstd_frame*) c->format + unit;
+    u64 length = c->starts[unit + 1] - c->starts[unit];
+    status result = error;
+
+    u8 *input = malloc(frame->size);
+
+    if(input == NULL) {
+        log_error("Cannot allocate memory for decompressing the image.");
+        return error;
+    }
+
+    if(read_source(c, input, frame->size, frame->offset) != (ssize_t) frame->size) {
+        log_error("Cannot read the compressed image.");
+        goto end;
+    }
+
+    size_t ret = ZSTD_decompress(data, length, input, frame->size);
+
+    if(ZSTD_isError(ret)) {
+        log_error("Cannot decompress the image: %s.", ZSTD_getErrorName(ret));
+    } else if(ret != length) {
+        log_error("Cannot decompress the image: a frame is shorter than recorded.");
+    } else {
+        result = ok;
+    }
+
+end:
+    free(input);
+    return result;
+}
+
+static void close_zstd(struct compressed *c)
+{
+    free(c->format);
+}
+
+status open_zstd(struct compressed *c, const char *path, struct options *options)
+{
+    struct zstd_index index;
+    u64 i, largest = 0;
+
+    (void) path;
+
+    memset(&index, 0, sizeof index);
+
+    if(read_seek_table(c, &index) == error) goto error;
+
+    if(index.count == 0 && scan_frames(c, &index) == error) goto error;
+
+    if(index.count == 0) {
+        log_error("No data in the compressed image.");
+        goto error;
+    }
+
+    for (i = 0; i < index.count; i++) {
+        largest = MAX(largest, (i + 1 < index.count ? index.starts[i + 1] : index.size) - index.starts[i]);
+    }
+
+    index.starts[index.count] = index.size;
+
+    c->starts = index.starts;
+    c->units = index.count;
+    c->decode = decode_frame;
+    c->close = close_zstd;
+    c->format = index.frames;
+
+    // every miss would decompress a whole frame into memory (a single-frame
+    // image: the whole image)
+    if(largest > options->window_cache) {
+        log_error("Frames of the image are up to " fu64 " MiB, more than the window "
+                "cache (" fu64 " MiB). Recompress it in small frames for random access "
+                "(pzstd, or the zstd seekable format), or raise --window-cache.",
+                divide_up(largest, megabyte), options->window_cache / megabyte);
+        return error;
+    }
+
+    return ok;
+
+error:
+    free(index.frames);
+    free(index.starts);
+    return error;
+}
+
+#else
+
+status open_zstd(struct compressed *c, const char *path, struct options *options)
+{
+    (void) c;
+    (void) path;
+    (void) options;
+
+    log_error("zstd-compressed images are not supported by this build.");
+    return error;
+}
+
+#endif // HAVE_ZSTD
@@ -0,0 +1,562 @@
+# Helpers of the tests: partclone images made on the fly, a server started on
+# a free port, a minimal NBD client and an HTTP server with range requests.
+#
+# Every test is a script run by ctest as "python3 test_NAME.py BINARY"; it
+# exits with 0 when it passes and with SKIP when it cannot run here.
+
+import os
+import random
+import re
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+
+SKIP = 77
+
+
+class Skip(Exception):
+    pass
+
+
+def run(test):
+    """Call test(binary, directory) in a temporary directory."""
+    binary = os.path.abspath(sys.argv[1])
+    directory = tempfile.mkdtemp(prefix="partclone-nbd-test-")
+
+    try:
+        test(binary, directory)
+    except Skip as reason:
+        print("skipped:", reason)
+        sys.exit(SKIP)
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+    print("ok")
+
+
+# ------------------------------- IMAGES -------------------------------------
+
+class Image:
+    """A partclone 0002 image: the bitmap and the data of present blocks."""
+
+    def __init__(self, blocks, block_size=4096, blocks_per_checksum=1, extra=0):
+        self.blocks = blocks
+        self.block_size = block_size
+        self.blocks_per_checksum = blocks_per_checksum
+        self.extra = extra
+        # data of present blocks by block number
+        self.data = {}
+
+    @staticmethod
+    def random(blocks, seed=1, used=0.5, **kwargs):
+        """Runs of present and absent blocks with random data."""
+        img = Image(blocks, **kwargs)
+        rnd = random.Random(seed)
+        block = 0
+
+        while block < blocks:
+            length = rnd.randint(1, 64)
+            present = rnd.random() < used
+
+            for i in range(block, min(blocks, block + length)):
+                if present:
+                    img.set(i, rnd.randbytes(img.block_size))
+
+            block += length
+
+        return img
+
+    def copy(self):
+        other = Image(self.blocks, self.block_size, self.blocks_per_checksum, self.extra)
+        other.data = dict(self.data)
+        return other
+
+    def set(self, block, data):
+        assert len(data) == self.block_size and block < self.blocks
+        self.data[block] = data
+
+    def clear(self, block):
+        self.data.pop(block, None)
+
+    @property
+    def bits(self):
+        return [1 if i in self.data else 0 for i in range(self.blocks)]
+
+    @property
+    def device_size(self):
+        return self.blocks * self.block_size + self.extra
+
+    def device(self):
+        """Contents of the device; absent blocks read as zeroes."""
+        hole = bytes(self.block_size)
+        return b"".join(self.data.get(i, hole) for i in range(self.blocks)) + bytes(self.extra)
+
+    def encode(self, fs=b"EXTFS"):
+        used = len(self.data)
+
+        header = b"partclone-image\0" + b"2.61".ljust(14, b"\0") + b"0002"
+        header += struct.pack("<H", 0xC0DE) + fs.ljust(16, b"\0")
+        header += struct.pack("<QQQQIIHHHHIBB", self.device_size, self.blocks, used, used,
+                              self.block_size, 0, 2, 64, 32, 4, self.blocks_per_checksum, 1, 1)
+        header += struct.pack("<I", zlib.crc32(header))
+
+        bitmap = bytearray((self.blocks + 7) // 8)
+
+        for i in self.data:
+            bitmap[i // 8] |= 1 << (i % 8)
+
+        out = [header, bytes(bitmap), struct.pack("<I", zlib.crc32(bitmap))]
+        count = crc = 0
+
+        for i in sorted(self.data):
+            out.append(self.data[i])
+            crc = zlib.crc32(self.data[i], crc)
+            count += 1
+
+            if count % self.blocks_per_checksum == 0:
+                out.append(struct.pack("<I", crc))
+                crc = 0
+
+        if count % self.blocks_per_checksum:
+            out.append(struct.pack("<I", crc))
+
+        return b"".join(out)
+
+    def write(self, path):
+        with open(path, "wb") as f:
+            f.write(self.encode())
+        return path
+
+
+def tool(name):
+    """Path of an external program; the test is skipped without it."""
+    path = shutil.which(name)
+    if path is None:
+        raise Skip(name + " not found")
+    return path
+
+
+# ------------------------------- SERVER -------------------------------------
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Server:
+    """partclone-nbd in server mode; stopped with SIGTERM."""
+
+    def __init__(self, binary, directory, images, *options, stdin=None, name="server",
+                 wait=True, env=None):
+        self.port = free_port()
+        self.log_path = os.path.join(directory, name + ".log")
+        command = [binary, "-s", "-q", "-p", str(self.port), "-L", self.log_path]
+        command += list(options) + list(images)
+
+        # the log of an earlier server is not mistaken for this one's
+        if os.path.exists(self.log_path):
+            os.unlink(self.log_path)
+
+        # env holds variables added to those of the tests
+        self.process = subprocess.Popen(command, stdin=stdin,
+                                        env=dict(os.environ, **(env or {})))
+
+        if wait:
+            self.wait()
+
+    def wait(self):
+        """Wait until the server listens."""
+        deadline = time.time() + 60
+
+        while "Server initialized" not in self.log():
+            if self.process.poll() is not None:
+                raise AssertionError("server exited:\n" + self.log())
+            if time.time() > deadline:
+                self.process.kill()
+                raise AssertionError("server did not start:\n" + self.log())
+            time.sleep(0.02)
+
+    def log(self):
+        try:
+            with open(self.log_path) as f:
+                return f.read()
+        except FileNotFoundError:
+            return ""
+
+    def client(self, name=b"", **kwargs):
+        c = Client(self.port, **kwargs)
+        c.export_name(name)
+        return c
+
+    def stop(self):
+        """Stop the server; its log."""
+        if self.process.poll() is None:
+            self.process.send_signal(signal.SIGTERM)
+        try:
+            code = self.process.wait(timeout=30)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            raise AssertionError("server did not stop:\n" + self.log())
+        assert code == 0, "server exited with %d:\n%s" % (code, self.log())
+        return self.log()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, kind, value, traceback):
+        if kind is None:
+            self.stop()
+        elif self.process.poll() is None:
+            self.process.kill()
+            self.process.wait()
+
+
+def stat(log, name):
+    """The numbers of the last "NAME: A ..., B ..." line of a log."""
+    lines = [line for line in log.splitlines() if name + ":" in line]
+    assert lines, "no %r in the log:\n%s" % (name, log)
+    return [int(n) for n in re.findall(r"\d+", lines[-1].split(name + ":", 1)[1])]
+
+
+# ------------------------------- CLIENT -------------------------------------
+
+IHAVEOPT = 0x49484156454F5054
+REPLY_MAGIC = 0x3E889045565A9
+
+NBD_OPT_EXPORT_NAME = 1
+NBD_OPT_LIST = 3
+NBD_OPT_INFO = 6
+NBD_OPT_GO = 7
+NBD_OPT_STRUCTURED_REPLY = 8
+NBD_OPT_LIST_META_CONTEXT = 9
+NBD_OPT_SET_META_CONTEXT = 10
+NBD_OPT_EXTENDED_HEADERS = 11
+
+NBD_REP_ACK = 1
+NBD_REP_SERVER = 2
+NBD_REP_INFO = 3
+NBD_REP_META_CONTEXT = 4
+
+NBD_INFO_EXPORT = 0
+NBD_INFO_BLOCK_SIZE = 3
+
+NBD_CMD_READ = 0
+NBD_CMD_DISC = 2
+NBD_CMD_CACHE = 5
+NBD_CMD_BLOCK_STATUS = 7
+
+NBD_REPLY_TYPE_NONE = 0
+NBD_REPLY_TYPE_OFFSET_DATA = 1
+NBD_REPLY_TYPE_OFFSET_HOLE = 2
+NBD_REPLY_TYPE_BLOCK_STATUS = 5
+NBD_REPLY_TYPE_BLOCK_STATUS_EXT = 6
+
+NBD_CMD_FLAG_REQ_ONE = 1 << 3
+
+NBD_STATE_HOLE = 1 << 0
+NBD_STATE_ZERO = 1 << 1
+
+NBD_FLAG_SEND_CACHE = 1 << 10
+
+
+class Client:
+    def __init__(self, port, fixed=True, no_zeroes=True):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+
+        assert self.recv(8) == b"NBDMAGIC"
+        assert struct.unpack(">Q", self.recv(8))[0] == IHAVEOPT
+        self.handshake_flags = struct.unpack(">H", self.recv(2))[0]
+
+        flags = (1 if fixed else 0) | (2 if no_zeroes else 0)
+        self.no_zeroes = no_zeroes
+        self.sock.sendall(struct.pack(">I", flags))
+
+        self.structured = False
+        self.extended = False
+        self.handle = 0
+
+    def recv(self, length):
+        data = b""
+        while len(data) < length:
+            part = self.sock.recv(length - len(data))
+            if not part:
+                raise EOFError("connection closed")
+            data += part
+        return data
+
+    # ---- negotiation ----
+
+    def option(self, option, data=b""):
+        """Send an option; its replies as (type, data) pairs."""
+        self.sock.sendall(struct.pack(">QII", IHAVEOPT, option, len(data)) + data)
+        replies = []
+
+        while True:
+            magic, replied, kind, length = struct.unpack(">QIII", self.recv(20))
+            assert magic == REPLY_MAGIC and replied == option
+            replies.append((kind, self.recv(length)))
+
+            if kind not in (NBD_REP_SERVER, NBD_REP_INFO, NBD_REP_META_CONTEXT):
+                return replies
+
+    def structured_replies(self):
+        assert self.option(NBD_OPT_STRUCTURED_REPLY) == [(NBD_REP_ACK, b"")]
+        self.structured = True
+
+    def export_name(self, name=b""):
+        self.sock.sendall(struct.pack(">QII", IHAVEOPT, NBD_OPT_EXPORT_NAME, len(name)) + name)
+        self.size, self.transmission_flags = struct.unpack(">QH", self.recv(10))
+        if not self.no_zeroes:
+            assert self.recv(124) == bytes(124)
+
+    def go(self, name=b"", infos=(), option=NBD_OPT_GO):
+        """NBD_OPT_GO or NBD_OPT_INFO; the replies and the infos by type."""
+        data = struct.pack(">I", len(name)) + name + struct.pack(">H", len(infos))
+        data += b"".join(struct.pack(">H", info) for info in infos)
+
+        replies = self.option(option, data)
+        infos = {}
+
+        for kind, reply in replies:
+            if kind == NBD_REP_INFO:
+                infos[struct.unpack(">H", reply[:2])[0]] = reply[2:]
+
+        if NBD_INFO_EXPORT in infos:
+            self.size, self.transmission_flags = struct.unpack(">QH", infos[NBD_INFO_EXPORT])
+
+        return replies, infos
+
+    def meta_contexts(self, name, queries, option=NBD_OPT_SET_META_CONTEXT):
+        """Context ids by name."""
+        data = struct.pack(">I", len(name)) + name + struct.pack(">I", len(queries))
+        data += b"".join(struct.pack(">I", len(q)) + q for q in queries)
+
+        contexts = {}
+
+        for kind, reply in self.option(option, data):
+            if kind == NBD_REP_META_CONTEXT:
+                contexts[reply[4:]] = struct.unpack(">I", reply[:4])[0]
+
+        return contexts
+
+    # ---- transmission ----
+
+    def command(self, kind, offset, length, flags=0):
+        self.handle += 1
+        if self.extended:
+            request = struct.pack(">IHHQQQ", 0x21E41C71, flags, kind, self.handle, offset, length)
+        else:
+            request = struct.pack(">IHHQQI", 0x25609513, flags, kind, self.handle, offset, length)
+        self.sock.sendall(request)
+        return self.handle
+
+    def reply(self):
+        """("simple", error, handle) or ("chunk", flags, type, handle, data)."""
+        magic = struct.unpack(">I", self.recv(4))[0]
+
+        if magic == 0x67446698:
+            error, handle = struct.unpack(">IQ", self.recv(12))
+            return ("simple", error, handle)
+        if magic == 0x668E33EF:
+            flags, kind, handle, length = struct.unpack(">HHQI", self.recv(16))
+            return ("chunk", flags, kind, handle, self.recv(length))
+        if magic == 0x6E8A278C:
+            flags, kind, handle, offset, length = struct.unpack(">HHQQQ", self.recv(28))
+            return ("chunk", flags, kind, handle, self.recv(length))
+
+        raise AssertionError("bad reply magic %x" % magic)
+
+    def chunks(self, handle):
+        """Chunks of a structured reply as (type, data) pairs."""
+        chunks = []
+
+        while True:
+            reply = self.reply()
+            assert reply[0] == "chunk" and reply[3] == handle, reply
+            assert not reply[2] & 0x8000, "error chunk %r" % (reply,)
+            chunks.append((reply[2], reply[4]))
+
+            if reply[1] & 1:
+                return chunks
+
+    def read(self, offset, length):
+        handle = self.command(NBD_CMD_READ, offset, length)
+
+        if not self.structured:
+            reply = self.reply()
+            assert reply[1] == 0, reply
+            return self.recv(length)
+
+        data = bytearray(length)
+        seen = 0
+
+        for kind, chunk in self.chunks(handle):
+            if kind == NBD_REPLY_TYPE_OFFSET_DATA:
+                start = struct.unpack(">Q", chunk[:8])[0] - offset
+                data[start:start + len(chunk) - 8] = chunk[8:]
+                seen += len(chunk) - 8
+            elif kind == NBD_REPLY_TYPE_OFFSET_HOLE:
+                layout = ">QQ" if self.extended and len(chunk) == 16 else ">QI"
+                seen += struct.unpack(layout, chunk)[1]
+
+        assert seen == length, (seen, length)
+        return bytes(data)
+
+    def block_status(self, offset, length, flags=0):
+        """Extents as (length, flags) pairs by context id."""
+        handle = self.command(NBD_CMD_BLOCK_STATUS, offset, length, flags)
+        contexts = {}
+
+        for kind, chunk in self.chunks(handle):
+            if kind == NBD_REPLY_TYPE_BLOCK_STATUS:
+                context = struct.unpack(">I", chunk[:4])[0]
+                contexts[context] = [struct.unpack(">II", chunk[i:i + 8])
+                                     for i in range(4, len(chunk), 8)]
+            elif kind == NBD_REPLY_TYPE_BLOCK_STATUS_EXT:
+                context = struct.unpack(">I", chunk[:4])[0]
+                contexts[context] = [struct.unpack(">QQ", chunk[i:i + 16])
+                                     for i in range(8, len(chunk), 16)]
+
+        return contexts
+
+    def block_flags(self, context, block_size):
+        """Flags of every block of the export in a metadata context."""
+        flags = []
+        offset = 0
+
+        while offset < self.size:
+            for length, value in self.block_status(offset, self.size - offset)[context]:
+                assert length % block_size == 0 or offset + length == self.size, length
+                flags += [value] * (length // block_size)
+                offset += length
+
+        return flags
+
+    def simple(self, kind, offset, length):
+        """A command answered by a simple reply (or one chunk); its error."""
+        self.command(kind, offset, length)
+        reply = self.reply()
+        return reply[1] if reply[0] == "simple" else reply
+
+    def disconnect(self):
+        self.command(NBD_CMD_DISC, 0, 0)
+        self.sock.close()
+
+
+# ----------------------------- HTTP SERVER ----------------------------------
+
+class HTTPServer:
+    """Files of a directory served with range requests, on 127.0.0.1.
+
+    ignore_range  answer every request with the whole file (200)
+    drop_every    close the kept-alive connection silently after every Nth
+                  response, so that the next request on it fails
+    max_range     answer at most this many bytes of a range (0: all)
+    delay         seconds to wait before every response
+    """
+
+    def __init__(self, directory, ignore_range=False, drop_every=0, delay=0,
+                 host="127.0.0.1", max_range=0):
+        self.directory = directory
+        self.ignore_range = ignore_range
+        self.drop_every = drop_every
+        self.max_range = max_range
+        self.delay = delay
+        self.requests = 0
+        self.ranges = 0
+        self.hosts = set()
+        self.lock = threading.Lock()
+
+        server = self
+
+        class Handler(BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def log_message(self, *args):
+                pass
+
+            def do_GET(self):
+                server.handle(self)
+
+            def do_HEAD(self):
+                server.handle(self)
+
+        class Listener(ThreadingHTTPServer):
+            address_family = socket.AF_INET6 if ":" in host else socket.AF_INET
+            daemon_threads = True
+
+        self.listener = Listener((host, 0), Handler)
+        self.port = self.listener.server_address[1]
+        self.host = "[%s]" % host if ":" in host else host
+
+        self.thread = threading.Thread(target=self.listener.serve_forever, daemon=True)
+        self.thread.start()
+
+    def url(self, name):
+        return "http://%s:%d/%s" % (self.host, self.port, name)
+
+    def handle(self, handler):
+        with self.lock:
+            self.requests += 1
+            number = self.requests
+            self.hosts.add(handler.headers.get("Host"))
+
+        if self.delay:
+            time.sleep(self.delay)
+
+        path = os.path.join(self.directory, handler.path.lstrip("/"))
+
+        if not os.path.isfile(path):
+            handler.send_response(404)
+            handler.send_header("Content-Length", "0")
+            handler.end_headers()
+            return
+
+        size = os.path.getsize(path)
+        match = re.match(r"bytes=(\d+)-(\d+)", handler.headers.get("Range", ""))
+
+        with open(path, "rb") as f:
+            if match and not self.ignore_range:
+                start, end = int(match.group(1)), min(int(match.group(2)), size - 1)
+
+                if self.max_range:
+                    end = min(end, start + self.max_range - 1)
+                f.seek(start)
+                data = f.read(end - start + 1)
+
+                with self.lock:
+                    self.ranges += 1
+
+                handler.send_response(206)
+                handler.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+            else:
+                data = f.read()
+                handler.send_response(200)
+
+        handler.send_header("Content-Length", str(len(data)))
+        handler.end_headers()
+
+        if handler.command == "GET":
+            try:
+                handler.wfile.write(data)
+            except ConnectionError:
+                # the client hung up on a response it did not want
+                handler.close_connection = True
+                return
+
+        if self.drop_every and number % self.drop_every == 0:
+            handler.close_connection = True
+
+    def close(self):
+        self.listener.shutdown()
+        self.listener.server_close()
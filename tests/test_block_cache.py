@@ -0,0 +1,52 @@
+# The block cache keeps frequently read chunks while a scan of the whole image
+# passes through it. The same reads are done by two servers, the second one
+# without the final reads of the hot chunks; the difference of their misses is
+# the number of hot chunks pushed out.
+
+import os
+
+from harness import run, Image, Server, stat
+
+CHUNK = 64 << 10
+HOT = [3, 40, 77, 120, 150, 201, 230, 250]
+
+
+def reads(server, img, again):
+    device = img.device()
+    c = server.client()
+
+    def read(offset, length):
+        assert c.read(offset, length) == device[offset:offset + length], offset
+
+    for _ in range(5):
+        for chunk in HOT:
+            read(chunk * CHUNK + 4096, 4096)
+
+    for offset in range(0, img.device_size, CHUNK):
+        read(offset, CHUNK)
+
+    if again:
+        for chunk in HOT:
+            read(chunk * CHUNK + 4096, 4096)
+
+    c.disconnect()
+
+
+def test(binary, directory):
+    # 256 chunks, 4 times the capacity of the cache
+    img = Image.random(4096, seed=34, used=1.0, blocks_per_checksum=1024)
+    path = img.write(os.path.join(directory, "image.pc"))
+    misses = []
+
+    for again in (True, False):
+        with Server(binary, directory, [path], "-C", "4", "--readahead=0",
+                    "--metadata-prefetch=0") as server:
+            reads(server, img, again)
+
+        hits, missed = stat(server.log(), "Block cache")
+        misses.append(missed)
+
+    assert misses[0] - misses[1] <= 1, misses
+
+
+run(test)
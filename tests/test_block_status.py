@@ -0,0 +1,41 @@
+# base:allocation block status follows the partclone bitmap: absent blocks are
+# reported as holes which read as zeroes, present blocks as data.
+
+import os
+
+from harness import run, Image, Server, Client, NBD_CMD_FLAG_REQ_ONE, \
+    NBD_STATE_HOLE, NBD_STATE_ZERO
+
+
+def test(binary, directory):
+    img = Image.random(1536, seed=26, used=0.5)
+    path = img.write(os.path.join(directory, "image.pc"))
+
+    with Server(binary, directory, [path]) as server:
+        c = Client(server.port)
+        c.structured_replies()
+
+        contexts = c.meta_contexts(b"", [b"base:allocation"])
+        assert list(contexts) == [b"base:allocation"], contexts
+        context = contexts[b"base:allocation"]
+
+        c.go()
+        assert c.size == img.device_size
+
+        hole = NBD_STATE_HOLE | NBD_STATE_ZERO
+        expected = [0 if bit else hole for bit in img.bits]
+        assert c.block_flags(context, img.block_size) == expected
+
+        # a single extent, starting in the middle of a run
+        start = img.bits.index(1, 100)
+        [(length, flags)] = c.block_status(start * img.block_size + 512, 1 << 20,
+                                           NBD_CMD_FLAG_REQ_ONE)[context]
+        end = img.bits.index(0, start)
+        assert (length, flags) == ((end - start) * img.block_size - 512, 0)
+
+        # holes are read as zeroes
+        assert c.read(0, c.size) == img.device()
+        c.disconnect()
+
+
+run(test)
@@ -0,0 +1,42 @@
+# NBD_CMD_CACHE reads the range ahead, so that later reads of it do not touch
+# the image. The image is served over HTTP to count its reads.
+
+import os
+import time
+
+from harness import run, Image, Server, HTTPServer, NBD_CMD_CACHE, NBD_FLAG_SEND_CACHE
+
+
+def settled(http):
+    """The number of requests, once no more come."""
+    count = -1
+
+    while count != http.requests:
+        count = http.requests
+        time.sleep(0.5)
+
+    return count
+
+
+def test(binary, directory):
+    img = Image.random(1024, seed=30, used=0.8)
+    img.write(os.path.join(directory, "image.pc"))
+    http = HTTPServer(directory)
+
+    with Server(binary, directory, [http.url("image.pc")], "-C", "16") as server:
+        c = server.client()
+        assert c.transmission_flags & NBD_FLAG_SEND_CACHE
+
+        before = settled(http)
+        assert c.simple(NBD_CMD_CACHE, 0, c.size) == 0
+        cached = settled(http)
+        assert cached > before, (before, cached)
+
+        assert c.read(0, c.size) == img.device()
+        assert http.requests == cached, (cached, http.requests)
+        c.disconnect()
+
+    http.close()
+
+
+run(test)
@@ -0,0 +1,51 @@
+# Clients reading the same chunk at the same time share one read of the image.
+# The image is served over a slow HTTP server, so that the reads overlap.
+
+import os
+import threading
+
+from harness import run, Image, Server, HTTPServer, stat
+
+CLIENTS = 8
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=48, used=0.7)
+    img.write(os.path.join(directory, "golden.pc"))
+    device = img.device()
+
+    http = HTTPServer(directory)
+
+    with Server(binary, directory, [http.url("golden.pc")], "-C", "16") as server:
+        http.delay = 0.3
+
+        offsets = [i * 4096 for i, bit in enumerate(img.bits) if bit][::300][:4]
+        barrier = threading.Barrier(CLIENTS)
+        failures = []
+
+        def client():
+            try:
+                c = server.client()
+                for offset in offsets:
+                    barrier.wait()
+                    assert c.read(offset, 4096) == device[offset:offset + 4096], offset
+                c.disconnect()
+            except Exception as e:
+                failures.append(e)
+                barrier.abort()
+
+        threads = [threading.Thread(target=client) for _ in range(CLIENTS)]
+        [t.start() for t in threads]
+        [t.join() for t in threads]
+
+        assert not failures, failures
+
+    reads, shared = stat(server.log(), "Chunk reads")
+
+    http.close()
+
+    assert shared > 0, (reads, shared)
+    assert reads < len(offsets) * CLIENTS, (reads, shared)
+
+
+run(test)
@@ -0,0 +1,103 @@
+# The daemon keeps detached images loaded and unloads the least recently used
+# idle image only when the memory limit refuses a load. There are no NBD
+# devices here: attaching fails after the image is loaded, which leaves it
+# loaded and idle.
+
+import os
+import signal
+import socket
+import subprocess
+import time
+
+from harness import run, Image
+
+
+class Daemon:
+    def __init__(self, binary, directory, *options):
+        self.binary = binary
+        self.socket = os.path.join(directory, "control.sock")
+        self.log_path = os.path.join(directory, "daemon.log")
+        self.process = subprocess.Popen([binary, "-a", "-q", "-S", self.socket,
+                                         "-L", self.log_path] + list(options))
+
+        while not os.path.exists(self.socket):
+            assert self.process.poll() is None, self.log()
+            time.sleep(0.02)
+
+    def log(self):
+        with open(self.log_path) as f:
+            return f.read()
+
+    def request(self, *words):
+        """The reply; its last line is "ok" or an error."""
+        result = subprocess.run([self.binary, "-S", self.socket] + list(words),
+                                stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                universal_newlines=True)
+        return result.stdout
+
+    def stats(self):
+        """Loaded images and the counters of loads."""
+        images = set()
+        counters = {}
+
+        for line in self.request("stats").splitlines():
+            words = line.split()
+            if words[0] == "image":
+                images.add(os.path.basename(words[1]))
+            elif words[0] == "loads":
+                counters = dict(zip(words[0::2], map(int, words[1::2])))
+
+        return images, counters
+
+    def stop(self):
+        self.process.send_signal(signal.SIGTERM)
+        assert self.process.wait(timeout=30) == 0, self.log()
+        assert not os.path.exists(self.socket)
+
+
+def test(binary, directory):
+    # the bitmaps take 1.25 MiB each; only one fits in 2 MiB
+    paths = {}
+
+    for name in ("first.pc", "second.pc"):
+        img = Image(10 << 20)
+        img.set(5, bytes(range(256)) * 16)
+        paths[name] = img.write(os.path.join(directory, name))
+
+    bad = os.path.join(directory, "bad.pc")
+    with open(bad, "wb") as f:
+        f.write(b"not a partclone image" * 100)
+
+    device = os.path.join(directory, "missing-device")
+    daemon = Daemon(binary, directory, "--memory-limit=2")
+
+    try:
+        assert daemon.request("attach", paths["first.pc"], device).startswith("error")
+        assert daemon.stats() == ({"first.pc"}, {"loads": 1, "warm": 0, "evictions": 0})
+
+        # failures which are not caused by the memory limit unload nothing
+        daemon.request("attach", bad, device)
+        daemon.request("attach", os.path.join(directory, "missing.pc"), device)
+        assert daemon.stats() == ({"first.pc"}, {"loads": 1, "warm": 0, "evictions": 0})
+
+        daemon.request("attach", paths["first.pc"], device)
+        assert daemon.stats() == ({"first.pc"}, {"loads": 1, "warm": 1, "evictions": 0})
+
+        # the idle image makes room for the new one
+        daemon.request("attach", paths["second.pc"], device)
+        assert daemon.stats() == ({"second.pc"}, {"loads": 2, "warm": 1, "evictions": 1})
+
+        # a control connection which sends nothing holds up other requests
+        # and signals only until it times out
+        silent = socket.socket(socket.AF_UNIX)
+        silent.connect(daemon.socket)
+        assert daemon.request("list").splitlines()[-1] == "ok"
+        assert "Incomplete control request" in daemon.log()
+
+        silent = socket.socket(socket.AF_UNIX)
+        silent.connect(daemon.socket)
+    finally:
+        daemon.stop()
+
+
+run(test)
@@ -0,0 +1,61 @@
+# With --dedup the caches keep chunks of the device by their content. Three
+# images are the same but for one early block: changed in the second one, and
+# present in the third one but not in the first one, so that the data of all
+# following blocks is stored elsewhere in its file. Each of them adds one
+# chunk to the cache; the others are shared.
+
+import os
+
+from harness import run, Image, Server, stat
+
+CHUNK = 64 << 10
+BLOCKS_PER_CHUNK = CHUNK // 4096
+
+
+def read_all(server, name, img):
+    device = img.device()
+    c = server.client(name=name.encode())
+
+    for offset in range(0, img.device_size, 1 << 20):
+        length = min(1 << 20, img.device_size - offset)
+        assert c.read(offset, length) == device[offset:offset + length], (name, offset)
+
+    c.disconnect()
+
+
+def test(binary, directory):
+    first = Image.random(2048, seed=49, used=0.7)
+
+    changed = first.copy()
+    block = min(first.data)
+    changed.set(block, bytes(reversed(first.data[block])))
+
+    # an absent block in a chunk holding present ones
+    block = next(i for i, bit in enumerate(first.bits) if not bit and
+                 any(first.bits[i - i % BLOCKS_PER_CHUNK:][:BLOCKS_PER_CHUNK]))
+    inserted = first.copy()
+    inserted.set(block, b"\x01" * 4096)
+
+    images = {"first.pc": first, "changed.pc": changed, "inserted.pc": inserted}
+    paths = [img.write(os.path.join(directory, name)) for name, img in images.items()]
+
+    chunks = len({i // BLOCKS_PER_CHUNK for i in first.data})
+
+    caches = {"Block cache": ["-C", "64"],
+              "SSD cache": ["--ssd-cache=" + os.path.join(directory, "ssd")]}
+
+    for cache, options in caches.items():
+        with Server(binary, directory, paths, "--dedup", "--readahead=0",
+                    "--metadata-prefetch=0", *options) as server:
+            for name, img in images.items():
+                read_all(server, name, img)
+
+        hits, misses = stat(server.log(), cache)
+
+        assert misses == chunks + 2, (cache, misses, chunks)
+
+    for path in paths:
+        assert os.path.isfile(path + ".hashidx"), path
+
+
+run(test)
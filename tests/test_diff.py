@@ -0,0 +1,40 @@
+# partclone:diff marks the blocks which changed since the base image.
+
+import os
+import random
+
+from harness import run, Image, Server, Client
+
+
+def test(binary, directory):
+    base = Image.random(1024, seed=27, used=0.5)
+    new = base.copy()
+    rnd = random.Random(27)
+    changed = set()
+
+    for block in rnd.sample(range(1024), 60):
+        if new.bits[block] and rnd.random() < 0.5:
+            new.clear(block)
+        else:
+            new.set(block, rnd.randbytes(new.block_size))
+        changed.add(block)
+
+    base_path = base.write(os.path.join(directory, "monday.pc"))
+    new_path = new.write(os.path.join(directory, "tuesday.pc"))
+
+    with Server(binary, directory, [new_path], "-b", base_path) as server:
+        c = Client(server.port)
+        c.structured_replies()
+
+        contexts = c.meta_contexts(b"", [b"base:allocation", b"partclone:diff"])
+        assert sorted(contexts) == [b"base:allocation", b"partclone:diff"], contexts
+        c.go()
+
+        expected = [1 if block in changed else 0 for block in range(1024)]
+        assert c.block_flags(contexts[b"partclone:diff"], new.block_size) == expected
+
+        assert c.read(0, c.size) == new.device()
+        c.disconnect()
+
+
+run(test)
@@ -0,0 +1,47 @@
+# With --direct-io image data is read with O_DIRECT through aligned windows,
+# although the data of an image starts at an unaligned offset and blocks are
+# interleaved with checksums. Reads of random ranges must match the device.
+
+import os
+import random
+
+from harness import run, Image, Server, Skip
+
+IMAGES = {
+    # a checksum after every block
+    "every.pc": dict(blocks=3001, block_size=4096, blocks_per_checksum=1),
+    # groups of 3 blocks; the last group is partial
+    "groups.pc": dict(blocks=2999, block_size=4096, blocks_per_checksum=3),
+    # blocks smaller than the alignment
+    "small.pc": dict(blocks=9001, block_size=512, blocks_per_checksum=5),
+}
+
+
+def test(binary, directory):
+    images = {}
+
+    for seed, (name, shape) in enumerate(IMAGES.items()):
+        blocks = shape.pop("blocks")
+        images[name] = Image.random(blocks, seed=35 + seed, used=0.7, **shape)
+        images[name].write(os.path.join(directory, name))
+
+    with Server(binary, directory, [directory], "--direct-io") as server:
+        if "Cannot open image file for direct I/O" in server.log():
+            raise Skip("O_DIRECT is not supported here")
+
+        for name, img in images.items():
+            device = img.device()
+            rnd = random.Random(name)
+            c = server.client(name.encode())
+
+            for _ in range(200):
+                offset = rnd.randrange(img.device_size)
+                length = rnd.randint(1, min(200000, img.device_size - offset))
+                assert c.read(offset, length) == device[offset:offset + length], \
+                    (name, offset, length)
+
+            assert c.read(0, img.device_size) == device, name
+            c.disconnect()
+
+
+run(test)
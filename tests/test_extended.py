@@ -0,0 +1,62 @@
+# Extended headers: 64-bit request lengths and block status extents. The
+# device is 8 GiB, mostly absent.
+
+import os
+import random
+import struct
+
+from harness import run, Image, Server, Client, NBD_OPT_EXTENDED_HEADERS, \
+    NBD_REP_ACK, NBD_INFO_BLOCK_SIZE, NBD_CMD_READ, NBD_REPLY_TYPE_OFFSET_DATA, \
+    NBD_REPLY_TYPE_OFFSET_HOLE, NBD_STATE_HOLE, NBD_STATE_ZERO
+
+BLOCKS = 1 << 21
+RUN = 64
+
+
+def test(binary, directory):
+    img = Image(BLOCKS)
+    rnd = random.Random(29)
+
+    for block in list(range(RUN)) + list(range(BLOCKS - RUN, BLOCKS)):
+        img.set(block, rnd.randbytes(img.block_size))
+
+    path = img.write(os.path.join(directory, "sparse.pc"))
+    size = img.device_size
+    run_size = RUN * img.block_size
+
+    with Server(binary, directory, [path]) as server:
+        c = Client(server.port)
+
+        assert c.option(NBD_OPT_EXTENDED_HEADERS) == [(NBD_REP_ACK, b"")]
+        c.structured = c.extended = True
+
+        context = c.meta_contexts(b"", [b"base:allocation"])[b"base:allocation"]
+        replies, infos = c.go(b"", [NBD_INFO_BLOCK_SIZE])
+        assert struct.unpack(">III", infos[NBD_INFO_BLOCK_SIZE])[2] == 0xFFFFFFFF
+
+        # the hole is longer than 32 bits allow
+        hole = NBD_STATE_HOLE | NBD_STATE_ZERO
+        assert c.block_status(0, size)[context] == \
+            [(run_size, 0), (size - 2 * run_size, hole), (run_size, 0)]
+
+        # one read over the hole and into the last run
+        offset = run_size
+        length = size - 2 * run_size + img.block_size
+        handle = c.command(NBD_CMD_READ, offset, length)
+        seen = 0
+
+        for kind, chunk in c.chunks(handle):
+            if kind == NBD_REPLY_TYPE_OFFSET_DATA:
+                start = struct.unpack(">Q", chunk[:8])[0]
+                assert chunk[8:] == img.data[start // img.block_size]
+                seen += len(chunk) - 8
+            elif kind == NBD_REPLY_TYPE_OFFSET_HOLE:
+                seen += struct.unpack(">QI", chunk)[1]
+
+        assert seen == length, (seen, length)
+
+        assert c.read(0, run_size) == b"".join(img.data[i] for i in range(RUN))
+        c.disconnect()
+
+
+run(test)
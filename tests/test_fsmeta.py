@@ -0,0 +1,157 @@
+# File system metadata is found in ext and NTFS images and prefetched when
+# the first client connects. The ext image here is built by hand: group
+# descriptors, four inode tables far apart and the root directory, found
+# through the extent of the root inode. Superblocks with garbage are
+# ignored, and the images are served as usual.
+
+import os
+import random
+import struct
+import time
+
+from harness import run, Image, Server, stat
+
+BLOCK = 4096
+GROUPS = 4
+INODES_PER_GROUP = 64
+INODE_SIZE = 256
+TABLES = [1000, 9000, 40000, 70000]
+ROOT_DIRECTORY = 20000
+
+
+def ext_image():
+    img = Image(GROUPS * 32768)
+
+    sb = bytearray(1024)
+    struct.pack_into("<I", sb, 4, GROUPS * 32768)          # blocks count
+    struct.pack_into("<I", sb, 20, 0)                      # first data block
+    struct.pack_into("<I", sb, 24, 2)                      # 4 KiB blocks
+    struct.pack_into("<I", sb, 32, 32768)                  # blocks per group
+    struct.pack_into("<I", sb, 40, INODES_PER_GROUP)
+    struct.pack_into("<H", sb, 56, 0xEF53)
+    struct.pack_into("<I", sb, 76, 1)                      # dynamic revision
+    struct.pack_into("<H", sb, 88, INODE_SIZE)
+    struct.pack_into("<I", sb, 96, 0x40)                   # extents
+    img.set(0, bytes(1024) + bytes(sb) + bytes(BLOCK - 2048))
+
+    gdt = bytearray(BLOCK)
+    for group, table in enumerate(TABLES):
+        struct.pack_into("<I", gdt, group * 32 + 8, table)
+    img.set(1, bytes(gdt))
+
+    # the root inode (2) with one extent
+    table = bytearray(INODES_PER_GROUP * INODE_SIZE)
+    root = INODE_SIZE
+    struct.pack_into("<I", table, root + 32, 0x80000)      # EXTENTS_FL
+    struct.pack_into("<HHHHI", table, root + 40, 0xF30A, 1, 4, 0, 0)
+    struct.pack_into("<IHHI", table, root + 52, 0, 1, 0, ROOT_DIRECTORY)
+
+    for first in TABLES:
+        data = table if first == TABLES[0] else bytearray(len(table))
+        for i in range(len(data) // BLOCK):
+            img.set(first + i, bytes(data[i * BLOCK:(i + 1) * BLOCK]))
+
+    img.set(ROOT_DIRECTORY, b"\x02" * BLOCK)
+    return img
+
+
+def garbage_images():
+    """Superblocks and boot sectors with valid signatures and random fields."""
+    rnd = random.Random(38)
+    images = {}
+
+    for i in range(12):
+        head = bytearray(rnd.randbytes(BLOCK))
+        struct.pack_into("<H", head, 1024 + 56, 0xEF53)
+        # sensible sizes half of the time, so that the descriptors and the
+        # root inode are parsed too
+        if i % 2:
+            struct.pack_into("<I", head, 1024 + 4, 256)
+            struct.pack_into("<III", head, 1024 + 20, 0, 2, 0)
+            struct.pack_into("<I", head, 1024 + 32, rnd.randint(1, 64))
+            struct.pack_into("<I", head, 1024 + 76, 1)
+            struct.pack_into("<H", head, 1024 + 88, 256)
+        img = Image(256)
+        img.set(0, bytes(head))
+        img.set(1, rnd.randbytes(BLOCK))
+        images["ext%02d.pc" % i] = (img, b"EXTFS")
+
+    for i in range(12):
+        head = bytearray(rnd.randbytes(BLOCK))
+        head[3:11] = b"NTFS    "
+        # sensible sector and cluster sizes half of the time, so that the
+        # MFT record is parsed too
+        if i % 2:
+            struct.pack_into("<HB", head, 0x0B, 512, 8)
+            struct.pack_into("<Q", head, 0x30, 2)
+            head[0x40] = 0xF6                              # 1 KiB records
+        img = Image(256)
+        img.set(0, bytes(head))
+        for block in range(1, 8):
+            record = bytearray(rnd.randbytes(BLOCK))
+            if i % 4 == 1:
+                # a valid update sequence; the attributes are random
+                record[0:4] = b"FILE"
+                struct.pack_into("<HH", record, 4, 0x30, 3)
+                record[510:512] = record[1022:1024] = record[0x30:0x32]
+            img.set(block, bytes(record))
+        images["ntfs%02d.pc" % i] = (img, b"NTFS")
+
+    return images
+
+
+def wait_for(server, text):
+    deadline = time.time() + 30
+    while text not in server.log():
+        assert time.time() < deadline, server.log()
+        time.sleep(0.02)
+
+
+def test(binary, directory):
+    img = ext_image()
+    path = img.write(os.path.join(directory, "ext.pc"))
+
+    with Server(binary, directory, [path], "-C", "64", "--readahead=0") as server:
+        c = server.client()
+        wait_for(server, "Metadata of EXTFS prefetched")
+
+        # the last inode table is in the block cache already
+        offset = TABLES[-1] * BLOCK
+        assert c.read(offset, 4096) == img.data[TABLES[-1]]
+        c.disconnect()
+
+    # the superblock and the descriptors, four tables, the root directory
+    tables = INODES_PER_GROUP * INODE_SIZE
+    total = BLOCK + GROUPS * 32 + GROUPS * tables + BLOCK
+    assert "prefetched: %d KiB in 6 ranges" % (total // 1024) in server.log(), server.log()
+
+    hits, misses = stat(server.log(), "Block cache")
+    assert hits >= 1, (hits, misses)
+
+    images = garbage_images()
+
+    for name, (img, fs) in images.items():
+        with open(os.path.join(directory, name), "wb") as f:
+            f.write(img.encode(fs))
+
+    os.unlink(path)
+
+    with Server(binary, directory, [directory], name="garbage") as server:
+        for name, (img, fs) in images.items():
+            c = server.client(name.encode())
+            assert c.read(0, img.device_size) == img.device(), name
+            c.disconnect()
+
+        # every image is looked at, whatever its superblock holds
+        deadline = time.time() + 30
+        while server.log().count("No metadata found") + \
+                server.log().count("prefetched:") < len(images):
+            assert time.time() < deadline, server.log()
+            time.sleep(0.02)
+
+    log = server.log()
+    assert "Unexpected values in ext superblock" in log, log
+    assert "Unexpected values in NTFS boot sector" in log, log
+
+
+run(test)
@@ -0,0 +1,63 @@
+# gzip-compressed images are served through an index of access points, built
+# at the first load and saved as IMAGE.gzidx, and used again by the next
+# server. Many compressed images can be served from one directory at once.
+
+import gzip
+import os
+import random
+import re
+
+from harness import run, Image, Server
+
+
+def check_reads(server, img, seed, name=b""):
+    device = img.device()
+    rnd = random.Random(seed)
+    c = server.client(name)
+
+    for _ in range(100):
+        offset = rnd.randrange(img.device_size)
+        length = rnd.randint(1, min(300000, img.device_size - offset))
+        assert c.read(offset, length) == device[offset:offset + length], (offset, length)
+
+    assert c.read(0, c.size) == device
+    c.disconnect()
+
+
+def test(binary, directory):
+    img = Image.random(4096, seed=42, used=0.6)
+    path = os.path.join(directory, "image.pc.gz")
+
+    with gzip.open(path, "wb") as f:
+        f.write(img.encode())
+
+    with Server(binary, directory, [path], "--index-span=1") as server:
+        check_reads(server, img, 1)
+
+    assert "Compressed image indexed" in server.log(), server.log()
+    assert os.path.exists(path + ".gzidx")
+
+    with Server(binary, directory, [path], "--index-span=1") as server:
+        check_reads(server, img, 2)
+
+    points = re.search(r"Index of the compressed image loaded \((\d+) access points\)",
+                       server.log())
+    assert points and int(points.group(1)) > 5, server.log()
+
+    # more exports than fit the first allocation of the list of exports;
+    # decompressed data of the first ones is read after all are loaded
+    many = os.path.join(directory, "many")
+    os.mkdir(many)
+    images = [Image.random(512, seed=seed, used=0.6) for seed in range(20)]
+
+    for i, img in enumerate(images):
+        with gzip.open(os.path.join(many, "%02d.pc.gz" % i), "wb") as f:
+            f.write(img.encode())
+
+    with Server(binary, directory, [many], "-w", "1", "-g", "1",
+                "--ssd-cache=" + os.path.join(directory, "ssd")) as server:
+        for i, img in enumerate(images):
+            check_reads(server, img, i, b"%02d.pc.gz" % i)
+
+
+run(test)
@@ -0,0 +1,80 @@
+# Images on a web server are read with range requests over kept-alive
+# connections: 206 responses, a server ignoring ranges, a server dropping
+# kept-alive connections, a server cutting ranges short, and an IPv6 literal
+# in the URL.
+
+import os
+import random
+import threading
+
+from harness import run, Image, Server, HTTPServer
+
+
+def check_reads(server, img, clients=4):
+    device = img.device()
+    failures = []
+
+    def client(seed):
+        try:
+            rnd = random.Random(seed)
+            c = server.client()
+
+            for _ in range(40):
+                offset = rnd.randrange(img.device_size)
+                length = rnd.randint(1, min(1 << 20, img.device_size - offset))
+                assert c.read(offset, length) == device[offset:offset + length], offset
+
+            c.disconnect()
+        except Exception as e:
+            failures.append(e)
+
+    threads = [threading.Thread(target=client, args=(seed,)) for seed in range(clients)]
+    [t.start() for t in threads]
+    [t.join() for t in threads]
+
+    assert not failures, failures
+
+
+def serve(binary, directory, img, http):
+    with Server(binary, directory, [http.url("image.pc")], name="http") as server:
+        check_reads(server, img)
+
+    assert "Cannot read from" not in server.log(), server.log()
+    assert http.ranges > 0
+    assert http.hosts == {"%s:%d" % (http.host, http.port)}, http.hosts
+
+    http.close()
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=46, used=0.7)
+    img.write(os.path.join(directory, "image.pc"))
+
+    serve(binary, directory, img, HTTPServer(directory))
+
+    # every third response ends its connection without a warning; the next
+    # request on it is sent again on a new one
+    serve(binary, directory, img, HTTPServer(directory, drop_every=3))
+
+    # ranges cut short by the server are requested again from where they end
+    serve(binary, directory, img, HTTPServer(directory, max_range=64 << 10))
+
+    http = HTTPServer(directory, ignore_range=True)
+
+    try:
+        Server(binary, directory, [http.url("image.pc")], name="no-ranges").stop()
+        raise AssertionError("an image without range requests was served")
+    except AssertionError as reason:
+        assert "range requests are not supported" in str(reason), reason
+
+    http.close()
+
+    try:
+        http = HTTPServer(directory, host="::1")
+    except OSError:
+        return
+
+    serve(binary, directory, img, http)
+
+
+run(test)
@@ -0,0 +1,112 @@
+# With --hydrate present blocks are copied in the background to a compacted
+# local file, and copied units are tracked in a map saved next to it. A
+# restart resumes from the map: units marked as copied are served from the
+# local file, the others are copied again. A map of another image is
+# ignored and hydration starts over.
+
+import os
+import re
+import struct
+import time
+
+from harness import run, Image, Server
+
+HEADER = struct.Struct("<8sIIQ")
+
+
+def serve(binary, directory, path, hydrated, img, blocks=None, wait=True):
+    """Read the given blocks (or the whole device) while hydrating, then wait
+    for the copy and read the whole device again."""
+    with Server(binary, directory, [path], "--hydrate=" + hydrated,
+                "--metadata-prefetch=0") as server:
+        c = server.client()
+
+        if blocks is None:
+            assert c.read(0, img.device_size) == img.device()
+
+        # a read within a unit comes either from the copy or from the image
+        for block in blocks or []:
+            data = c.read(block * img.block_size, img.block_size)
+            assert data == img.data[block], block
+
+        deadline = time.time() + 60
+        while wait and '" hydrated to ' not in server.log():
+            assert time.time() < deadline, server.log()
+            time.sleep(0.02)
+
+        assert c.read(0, img.device_size) == img.device()
+        c.disconnect()
+
+    copied = re.search(r"\((\d+) of (\d+) MiB copied\)", server.log())
+    assert copied, server.log()
+    return server.log(), int(copied.group(1)), int(copied.group(2))
+
+
+def test(binary, directory):
+    img = Image.random(8192, seed=40, used=0.9)
+    path = img.write(os.path.join(directory, "image.pc"))
+    hydrated = os.path.join(directory, "hydrated")
+    os.mkdir(hydrated)
+
+    log, copied, total = serve(binary, directory, path, hydrated, img)
+    assert copied == 0 and total > 16, log
+
+    [map_path] = [os.path.join(hydrated, f) for f in os.listdir(hydrated) if f.endswith(".map")]
+    data_path = map_path[:-len(".map")] + ".data"
+
+    with open(map_path, "rb") as f:
+        magic, identity, unit_size, units = HEADER.unpack(f.read(HEADER.size))
+
+    # every other unit is not copied; the copy holds garbage there
+    words = [0] * ((units + 63) // 64)
+
+    with open(data_path, "r+b") as f:
+        for unit in range(units):
+            if unit % 2 == 0:
+                words[unit // 64] |= 1 << (unit % 64)
+            else:
+                length = min(unit_size, os.path.getsize(data_path) - unit * unit_size)
+                f.seek(unit * unit_size)
+                f.write(b"\xee" * length)
+
+    def write_map(identity):
+        with open(map_path, "wb") as f:
+            f.write(HEADER.pack(magic, identity, unit_size, units))
+            f.write(b"".join(struct.pack("<Q", word) for word in words))
+
+    write_map(identity)
+
+    # a block of a copied unit changed in the image (but not its identity)
+    # is still served from the copy
+    ranks = sorted(img.data)
+    changed = ranks[unit_size // img.block_size // 2]
+    encoded = img.encode()
+    stat = os.stat(path)
+
+    with open(path, "r+b") as f:
+        f.seek(encoded.index(img.data[changed]))
+        f.write(b"\x55" * img.block_size)
+
+    os.utime(path, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+
+    per_unit = unit_size // img.block_size
+    blocks = [ranks[unit * per_unit + per_unit // 2] for unit in range(units - 1)]
+    assert changed in blocks
+
+    log, copied, total = serve(binary, directory, path, hydrated, img, blocks)
+    assert copied >= total // 2 - 1 and copied < total, log
+
+    # the map of another image; the image is whole again since all of it is
+    # read from there
+    with open(path, "r+b") as f:
+        f.seek(encoded.index(img.data[changed]))
+        f.write(img.data[changed])
+
+    os.utime(path, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+    write_map(identity ^ 1)
+
+    log, copied, total = serve(binary, directory, path, hydrated, img, wait=False)
+    assert "is not valid; starting over" in log and copied == 0, log
+
+
+run(test)
@@ -0,0 +1,51 @@
+# With --in-memory the data of present blocks is loaded, without checksums,
+# into one arena and every read is served from it. Blocks are loaded in
+# groups up to a checksum, several groups per read of the image; the last
+# group of an image may be partial.
+
+import os
+import random
+
+from harness import run, Image, Server
+
+IMAGES = {
+    # more than one read of the image while loading
+    "groups.pc": dict(blocks=4000, block_size=4096, blocks_per_checksum=7),
+    "every.pc": dict(blocks=1500, block_size=4096, blocks_per_checksum=1),
+    "small.pc": dict(blocks=6001, block_size=512, blocks_per_checksum=64),
+}
+
+
+def test(binary, directory):
+    images = {}
+
+    for seed, (name, shape) in enumerate(IMAGES.items()):
+        blocks = shape.pop("blocks")
+        img = Image.random(blocks, seed=39 + seed, used=0.7, **shape)
+
+        # a partial last group
+        if img.blocks_per_checksum > 1 and len(img.data) % img.blocks_per_checksum == 0:
+            img.clear(max(img.data))
+
+        images[name] = img
+        img.write(os.path.join(directory, name))
+
+    with Server(binary, directory, [directory], "--in-memory") as server:
+        for name, img in images.items():
+            device = img.device()
+            rnd = random.Random(name)
+            c = server.client(name.encode())
+
+            for _ in range(200):
+                offset = rnd.randrange(img.device_size)
+                length = rnd.randint(1, min(200000, img.device_size - offset))
+                assert c.read(offset, length) == device[offset:offset + length], \
+                    (name, offset, length)
+
+            assert c.read(0, img.device_size) == device, name
+            c.disconnect()
+
+    assert server.log().count("Image loaded in memory") == len(images), server.log()
+
+
+run(test)
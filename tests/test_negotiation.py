@@ -0,0 +1,54 @@
+# Fixed newstyle negotiation: NBD_OPT_LIST, NBD_OPT_INFO, NBD_OPT_GO with
+# block size constraints, and NO_ZEROES.
+
+import os
+import struct
+
+from harness import run, Image, Server, Client, NBD_OPT_LIST, NBD_OPT_INFO, \
+    NBD_REP_ACK, NBD_REP_SERVER, NBD_INFO_EXPORT, NBD_INFO_BLOCK_SIZE
+
+NBD_REP_ERR_UNKNOWN = 0x80000000 | 6
+NBD_FLAG_READ_ONLY = 1 << 1
+
+
+def test(binary, directory):
+    first = Image.random(512, seed=28, used=0.5)
+    second = Image.random(768, seed=29, used=0.5, block_size=1024)
+    paths = [first.write(os.path.join(directory, "first.pc")),
+             second.write(os.path.join(directory, "second.pc"))]
+
+    with Server(binary, directory, paths) as server:
+        c = Client(server.port)
+
+        replies = c.option(NBD_OPT_LIST)
+        names = [data[4:4 + struct.unpack(">I", data[:4])[0]]
+                 for kind, data in replies if kind == NBD_REP_SERVER]
+        assert sorted(names) == [b"first.pc", b"second.pc"], replies
+        assert replies[-1][0] == NBD_REP_ACK
+
+        # INFO does not end the negotiation
+        replies, infos = c.go(b"second.pc", [NBD_INFO_BLOCK_SIZE], NBD_OPT_INFO)
+        assert replies[-1][0] == NBD_REP_ACK
+        assert c.size == second.device_size
+        minimum, preferred, maximum = struct.unpack(">III", infos[NBD_INFO_BLOCK_SIZE])
+        assert (minimum, preferred) == (512, 1024) and maximum >= 1 << 20, infos
+
+        replies, infos = c.go(b"missing.pc")
+        assert replies == [(NBD_REP_ERR_UNKNOWN, b"")], replies
+
+        # the empty name is the first image
+        replies, infos = c.go(b"", [NBD_INFO_BLOCK_SIZE])
+        assert replies[-1][0] == NBD_REP_ACK and NBD_INFO_EXPORT in infos
+        assert c.size == first.device_size
+        assert c.transmission_flags & NBD_FLAG_READ_ONLY
+        assert c.read(0, c.size) == first.device()
+        c.disconnect()
+
+        # without NO_ZEROES the reply to NBD_OPT_EXPORT_NAME is padded
+        for no_zeroes in (True, False):
+            c = server.client(b"second.pc", no_zeroes=no_zeroes)
+            assert c.read(0, c.size) == second.device()
+            c.disconnect()
+
+
+run(test)
@@ -0,0 +1,76 @@
+# With --profile-dir the reads of the first session of an image are recorded
+# to a profile, and the profile is replayed as prefetch when the image is
+# served again. A profile of a changed image is not used; a profile file
+# whose identity does not match the image is rejected.
+
+import os
+import re
+import shutil
+import time
+
+from harness import run, Image, Server, stat
+
+CHUNK = 64 << 10
+# chunks read in the first session
+READ = [3, 4, 5, 40, 90, 91, 200]
+
+
+def serve(binary, directory, path, profiles, read=READ):
+    server = Server(binary, directory, [path], "--profile-dir=" + profiles, "-C", "64",
+                    "--readahead=0", "--metadata-prefetch=0")
+    c = server.client()
+
+    # replays start with the first client
+    deadline = time.time() + 30
+    while "Replaying profile" in server.log() and "replayed." not in server.log():
+        assert time.time() < deadline, server.log()
+        time.sleep(0.02)
+
+    for chunk in read:
+        c.read(chunk * CHUNK, 4096)
+
+    c.disconnect()
+    server.stop()
+    return server.log()
+
+
+def profile_path(log, what):
+    match = re.search(what + r" profile (\S+\.profile)", log)
+    assert match, log
+    return match.group(1)
+
+
+def test(binary, directory):
+    img = Image.random(4096, seed=37, used=1.0)
+    path = img.write(os.path.join(directory, "image.pc"))
+    profiles = os.path.join(directory, "profiles")
+    os.mkdir(profiles)
+
+    log = serve(binary, directory, path, profiles)
+    recorded = profile_path(log, "Recording")
+    assert "Profile %s saved (0 MiB in 4 runs)" % recorded in log, log
+    assert os.path.isfile(recorded)
+
+    # the replay loads the chunks; the same reads then hit the block cache
+    log = serve(binary, directory, path, profiles)
+    assert profile_path(log, "Replaying") == recorded
+    hits, misses = stat(log, "Block cache")
+    assert hits >= len(READ), (hits, misses)
+
+    # a changed image has a profile of its own
+    stat_result = os.stat(path)
+    os.utime(path, (stat_result.st_atime, stat_result.st_mtime + 10))
+
+    log = serve(binary, directory, path, profiles, read=[7])
+    changed = profile_path(log, "Recording")
+    assert changed != recorded, log
+
+    # the profile of the old image under the name of the new one
+    shutil.copy(recorded, changed)
+
+    log = serve(binary, directory, path, profiles)
+    assert "Profile %s is not valid for the image" % changed in log, log
+    assert profile_path(log, "Recording") == changed
+
+
+run(test)
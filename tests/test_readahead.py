@@ -0,0 +1,73 @@
+# Sequential and strided streams of reads are detected and the data ahead of
+# them is prefetched in the background; random reads prefetch nothing. Tasks
+# still queued when the server stops are dropped, not run.
+
+import os
+import random
+import re
+import time
+
+from harness import run, Image, Server, HTTPServer, stat
+
+CHUNK = 64 << 10
+
+
+def scan(binary, directory, path, offsets, length, *options):
+    """Prefetch ranges queued and fetched while reading at the offsets."""
+    img_options = ["--metadata-prefetch=0"] + list(options)
+
+    with Server(binary, directory, [path], *img_options) as server:
+        c = server.client()
+        for offset in offsets:
+            c.read(offset, length)
+        c.disconnect()
+
+    return stat(server.log(), "Prefetch ranges")
+
+
+def test(binary, directory):
+    img = Image.random(8192, seed=36, used=0.9)
+    path = img.write(os.path.join(directory, "image.pc"))
+
+    sequential = range(0, 8 << 20, CHUNK)
+    queued, fetched = scan(binary, directory, path, sequential, CHUNK, "-C", "64")
+    assert queued > 0 and fetched > 0, (queued, fetched)
+
+    strided = range(0, 24 << 20, 1 << 20)
+    queued, fetched = scan(binary, directory, path, strided, 4096, "-C", "64")
+    assert queued > 0 and fetched > 0, (queued, fetched)
+
+    # readahead into the page cache, without the block cache
+    queued, fetched = scan(binary, directory, path, sequential, CHUNK)
+    assert queued > 0 and fetched > 0, (queued, fetched)
+
+    rnd = random.Random(36)
+    scattered = [rnd.randrange(img.device_size - CHUNK) // 4096 * 4096 for _ in range(64)]
+    assert scan(binary, directory, path, scattered, 4096, "-C", "64") == [0, 0]
+
+    # every record of a strided stream over a slow server takes a while to
+    # prefetch; records still queued when the server stops are dropped
+    http = HTTPServer(directory)
+
+    with Server(binary, directory, [http.url("image.pc")], "--metadata-prefetch=0",
+                name="slow") as server:
+        http.delay = 0.3
+        c = server.client()
+
+        # the third record confirms the stream
+        for offset in range(0, 3 << 20, 1 << 20):
+            c.read(offset, 4096)
+
+        c.disconnect()
+        started = time.time()
+
+    stopped = time.time() - started
+    dropped = re.search(r"(\d+) queued tasks dropped", server.log())
+
+    assert dropped and int(dropped.group(1)) >= 4, server.log()
+    assert stopped < int(dropped.group(1)) * http.delay, stopped
+
+    http.close()
+
+
+run(test)
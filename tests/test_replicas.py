@@ -0,0 +1,168 @@
+# With --replicas=DIR[:DIR...] files named like the image in the directories
+# serve its reads too, if their header and bitmap are the same. A read which
+# fails on one copy is retried on another, and a slow read is hedged: issued
+# to a second copy, whose answer is used if it comes first.
+
+import os
+import random
+import subprocess
+import time
+
+from harness import run, tool, Image, Server, stat
+
+# reads of files whose path contains $SLOW_PATH take $SLOW_US longer
+SLOW_READS = r"""
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void delay(int fd)
+{
+    char link[64], path[4096];
+    const char *slow = getenv("SLOW_PATH");
+
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link, path, sizeof path - 1);
+
+    if(slow == NULL || length < 0) return;
+    path[length] = 0;
+
+    if(strstr(path, slow)) usleep(atoi(getenv("SLOW_US")));
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    static ssize_t (*real)(int, void *, size_t, off_t);
+
+    if(real == NULL) real = dlsym(RTLD_NEXT, "pread");
+    delay(fd);
+    return real(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    static ssize_t (*real)(int, void *, size_t, off64_t);
+
+    if(real == NULL) real = dlsym(RTLD_NEXT, "pread64");
+    delay(fd);
+    return real(fd, buf, count, offset);
+}
+"""
+
+
+def replica(img, directory, name):
+    os.mkdir(os.path.join(directory, name))
+    return img.write(os.path.join(directory, name, "image.pc"))
+
+
+def check_reads(server, img, seed):
+    device = img.device()
+    rnd = random.Random(seed)
+    c = server.client()
+
+    for _ in range(100):
+        offset = rnd.randrange(img.device_size)
+        length = rnd.randint(1, min(300000, img.device_size - offset))
+        assert c.read(offset, length) == device[offset:offset + length], (offset, length)
+
+    assert c.read(0, c.size) == device
+    c.disconnect()
+
+
+def test(binary, directory):
+    img = Image.random(4096, seed=47, used=0.9)
+    path = img.write(os.path.join(directory, "image.pc"))
+    dirs = [os.path.join(directory, name) for name in ["first", "moved", "second"]]
+
+    replica(img, directory, "first")
+    replica(img, directory, "second")
+
+    # the same size, but a present block moved in the bitmap
+    other = img.copy()
+    present = sorted(img.data)[10]
+    absent = min(set(range(img.blocks)) - set(img.data))
+    other.set(absent, other.data[present])
+    other.clear(present)
+    replica(other, directory, "moved")
+
+    with Server(binary, directory, [path], "--replicas=" + ":".join(dirs)) as server:
+        check_reads(server, img, 1)
+
+    log = server.log()
+    assert "Replica of the image: %s/image.pc." % dirs[0] in log, log
+    assert "Replica of the image: %s/image.pc." % dirs[2] in log, log
+    assert "%s/image.pc is not the same as the image" % dirs[1] in log, log
+
+    reads, hedged, answered, failed = stat(log, "Replicas")
+    assert reads > 0 and failed == 0, log
+
+    # a replica cut short while it is used: its reads are done by the image
+    with Server(binary, directory, [path], "--replicas=" + dirs[0]) as server:
+        os.truncate(os.path.join(dirs[0], "image.pc"), 0)
+        check_reads(server, img, 2)
+
+    log = server.log()
+    assert "Cannot read %s/image.pc" % dirs[0] in log, log
+
+    reads, hedged, answered, failed = stat(log, "Replicas")
+    assert failed > 0, log
+
+    # every export has its own replicas
+    os.mkdir(os.path.join(directory, "many"))
+    os.mkdir(os.path.join(directory, "many-replicas"))
+    small = [Image.random(256, seed=number) for number in range(20)]
+
+    for number, each in enumerate(small):
+        each.write(os.path.join(directory, "many", "%02d.pc" % number))
+        each.write(os.path.join(directory, "many-replicas", "%02d.pc" % number))
+
+    with Server(binary, directory, [os.path.join(directory, "many")],
+                "--replicas=" + os.path.join(directory, "many-replicas")) as server:
+        for number, each in enumerate(small):
+            c = server.client(b"%02d.pc" % number)
+            assert c.read(0, c.size) == each.device(), number
+            c.disconnect()
+
+    assert server.log().count("Replica of the image") == 20, server.log()
+
+    # a slow replica: its reads are hedged on the image, which answers first
+    source = os.path.join(directory, "slow_reads.c")
+    library = os.path.join(directory, "slow_reads.so")
+
+    with open(source, "w") as f:
+        f.write(SLOW_READS)
+
+    subprocess.check_call([tool("cc"), "-shared", "-fPIC", "-o", library, source, "-ldl"])
+    slow = replica(img, directory, "slow")
+    env = {"LD_PRELOAD": library, "SLOW_PATH": slow, "SLOW_US": "300000"}
+
+    with Server(binary, directory, [path], "--replicas=" + os.path.dirname(slow),
+                env=env) as server:
+        c = server.client()
+        device = img.device()
+        encoded = img.encode()
+        slow_reads = 0
+
+        # every other MiB of the file is read from the replica first
+        for block in sorted(img.data)[::256]:
+            if encoded.index(img.data[block]) // (1 << 20) % 2 == 0:
+                continue
+
+            # the replica is idle again
+            time.sleep(0.35)
+
+            offset = block * img.block_size
+            started = time.time()
+            assert c.read(offset, img.block_size) == device[offset:offset + img.block_size]
+            assert time.time() - started < 0.2, block
+            slow_reads += 1
+
+        c.disconnect()
+
+    reads, hedged, answered, failed = stat(server.log(), "Replicas")
+    assert slow_reads > 3 and answered >= slow_reads and failed == 0, server.log()
+
+run(test)
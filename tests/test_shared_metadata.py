@@ -0,0 +1,50 @@
+# Servers started at once with --shared-metadata publish the bitmap of an
+# image once and map it in the others. The shared memory object is removed by
+# the last one to stop.
+
+import os
+import re
+
+from harness import run, Image, Server, Skip
+
+SERVERS = 6
+
+
+def test(binary, directory):
+    if not os.path.isdir("/dev/shm"):
+        raise Skip("no /dev/shm")
+
+    img = Image.random(4096, seed=33, used=0.5)
+    path = img.write(os.path.join(directory, "image.pc"))
+
+    servers = [Server(binary, directory, [path], "-H", name="server%d" % i, wait=False)
+               for i in range(SERVERS)]
+
+    try:
+        for server in servers:
+            server.wait()
+
+        logs = "".join(server.log() for server in servers)
+        published = re.findall(r"Bitmap published in shared memory \((.*)\)", logs)
+        mapped = re.findall(r"Bitmap mapped from shared memory \((.*)\)", logs)
+
+        assert len(published) == 1 and len(mapped) == SERVERS - 1, logs
+        assert set(mapped) == set(published), logs
+        assert "stale" not in logs, logs
+
+        name = published[0]
+        assert os.path.exists("/dev/shm" + name), name
+
+        for server in servers:
+            c = server.client()
+            assert c.read(0, c.size) == img.device()
+            c.disconnect()
+    finally:
+        for server in servers:
+            server.stop()
+
+    assert not os.path.exists("/dev/shm" + name), name
+    assert not [f for f in os.listdir("/dev/shm") if f.startswith(name[1:])]
+
+
+run(test)
@@ -0,0 +1,48 @@
+# Images split into pieces (IMAGE.aa, IMAGE.ab, ...) are served as one file,
+# given by the first piece, the name without the suffix or a glob pattern;
+# split compressed images too.
+
+import gzip
+import os
+import random
+
+from harness import run, Image, Server
+
+PIECE = 1000003
+
+
+def split(data, prefix):
+    for number, start in enumerate(range(0, len(data), PIECE)):
+        suffix = "a" + chr(ord("a") + number)
+        with open(prefix + "." + suffix, "wb") as f:
+            f.write(data[start:start + PIECE])
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=44, used=0.7)
+    device = img.device()
+
+    plain = os.path.join(directory, "sda1.pc")
+    split(img.encode(), plain)
+
+    packed = os.path.join(directory, "sda1.pc.gz")
+    split(gzip.compress(img.encode()), packed)
+
+    assert os.path.exists(plain + ".ad")
+
+    for path in (plain + ".aa", plain, plain + ".a?", packed + ".aa"):
+        with Server(binary, directory, [path]) as server:
+            rnd = random.Random(44)
+            c = server.client()
+
+            # reads across the ends of the pieces
+            for _ in range(50):
+                offset = rnd.randrange(img.device_size)
+                length = rnd.randint(1, min(3 * PIECE, img.device_size - offset))
+                assert c.read(offset, length) == device[offset:offset + length], (path, offset)
+
+            assert c.read(0, c.size) == device, path
+            c.disconnect()
+
+
+run(test)
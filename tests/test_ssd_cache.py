@@ -0,0 +1,61 @@
+# The SSD cache survives a restart of the server, and a damaged chunk in it is
+# detected by its CRC32 and read from the image again.
+
+import os
+import struct
+
+from harness import run, Image, Server, stat
+
+CHUNK = 64 << 10
+HEADER_SIZE = 4096
+
+
+def read_all(binary, directory, path, cache, img):
+    with Server(binary, directory, [path], "--ssd-cache=" + cache, "--ssd-cache-size=32",
+                "--readahead=0", "--metadata-prefetch=0") as server:
+        c = server.client()
+        assert c.read(0, c.size) == img.device()
+        c.disconnect()
+
+    return server.log(), stat(server.log(), "SSD cache")
+
+
+def damage_chunk(cache):
+    """Overwrite the data of the first slot in use."""
+    with open(cache, "r+b") as f:
+        magic, chunk_size, entry_size, slots = struct.unpack("<8sIIQ", f.read(24))
+        assert magic == b"PCNBDSC1" and chunk_size == CHUNK, magic
+        data_start = HEADER_SIZE + (slots * entry_size + 4095) // 4096 * 4096
+
+        for slot in range(slots):
+            f.seek(HEADER_SIZE + slot * entry_size)
+            length = struct.unpack("<QQI", f.read(20))[2]
+
+            if length:
+                f.seek(data_start + slot * CHUNK + 100)
+                f.write(b"damaged" * 10)
+                return
+
+    raise AssertionError("the cache is empty")
+
+
+def test(binary, directory):
+    img = Image.random(1024, seed=41, used=0.7)
+    path = img.write(os.path.join(directory, "image.pc"))
+    cache = os.path.join(directory, "ssd.cache")
+
+    # without the block cache every read of a part of a chunk looks it up
+    log, (hits, misses) = read_all(binary, directory, path, cache, img)
+    assert misses > 0, (hits, misses)
+
+    log, (hits, misses) = read_all(binary, directory, path, cache, img)
+    assert misses == 0, (hits, misses)
+
+    damage_chunk(cache)
+
+    log, (hits, misses) = read_all(binary, directory, path, cache, img)
+    assert misses == 1, (hits, misses)
+    assert "Dropping a damaged chunk" in log, log
+
+
+run(test)
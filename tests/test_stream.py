@@ -0,0 +1,55 @@
+# An image read from a pipe is served while it streams in; reads of data not
+# received yet wait for it. The spill file is removed as soon as it is opened.
+
+import os
+import subprocess
+import threading
+import time
+
+from harness import run, Image, Server
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=45, used=0.7)
+    data = img.encode()
+    device = img.device()
+
+    spill = os.path.join(directory, "spill")
+    os.mkdir(spill)
+    os.environ["TMPDIR"] = spill
+
+    # the header, the bitmap and a part of the data
+    part = len(data) // 4
+
+    server = Server(binary, directory, ["-"], stdin=subprocess.PIPE, wait=False)
+    server.process.stdin.write(data[:part])
+    server.process.stdin.flush()
+
+    with server:
+        server.wait()
+        fds = "/proc/%d/fd" % server.process.pid
+        files = [os.readlink(os.path.join(fds, fd)) for fd in os.listdir(fds)]
+        assert [f for f in files if f.startswith(spill) and f.endswith("(deleted)")], files
+        assert os.listdir(spill) == []
+
+        c = server.client()
+        result = []
+
+        # the last present block has not arrived
+        last = max(img.data) * img.block_size
+        reader = threading.Thread(target=lambda: result.append(c.read(last, img.block_size)))
+        reader.start()
+
+        time.sleep(0.5)
+        assert reader.is_alive() and not result
+
+        server.process.stdin.write(data[part:])
+        server.process.stdin.close()
+        reader.join(30)
+
+        assert result == [device[last:last + img.block_size]]
+        assert c.read(0, c.size) == device
+        c.disconnect()
+
+
+run(test)
@@ -0,0 +1,98 @@
+# xz and zstd images made of many independently compressed blocks or frames
+# are served block by block; images with blocks larger than the window cache
+# are refused. Formats which this build or this system does not support are
+# skipped.
+
+import os
+import random
+import shutil
+import struct
+import subprocess
+
+from harness import run, Image, Server, Skip
+
+UNIT = 256 << 10
+
+
+def xz(data, block_size):
+    if shutil.which("xz") is None:
+        return None
+    return subprocess.run(["xz", "-z", "-c", "-0", "-T1", "--block-size=%d" % block_size],
+                          input=data, stdout=subprocess.PIPE, check=True).stdout
+
+
+def zstd(data, frame_size):
+    """Frames preceded by skippable frames with their sizes, as pzstd writes."""
+    if shutil.which("zstd") is None:
+        return None
+
+    out = []
+
+    for start in range(0, len(data), frame_size):
+        frame = subprocess.run(["zstd", "-q", "-c", "-1"], input=data[start:start + frame_size],
+                               stdout=subprocess.PIPE, check=True).stdout
+        out.append(struct.pack("<III", 0x184D2A50, 4, len(frame)) + frame)
+
+    return b"".join(out)
+
+
+def start(binary, directory, path, *options):
+    """A server, or the reason why it did not start."""
+    try:
+        return Server(binary, directory, [path], *options, name=os.path.basename(path))
+    except AssertionError as reason:
+        return str(reason)
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=43, used=0.8)
+    data = img.encode()
+    device = img.device()
+    tested = []
+
+    for name, compress in (("xz", xz), ("zst", zstd)):
+        units = compress(data, UNIT)
+
+        if units is None:
+            continue
+
+        path = os.path.join(directory, "image.pc." + name)
+        with open(path, "wb") as f:
+            f.write(units)
+
+        # units are decompressed on the worker threads without readahead too
+        server = start(binary, directory, path, "--window-cache=2", "--readahead=0")
+
+        if isinstance(server, str):
+            assert "not supported by this build" in server, server
+            continue
+
+        with server:
+            rnd = random.Random(43)
+            c = server.client()
+
+            for _ in range(100):
+                offset = rnd.randrange(img.device_size)
+                length = rnd.randint(1, min(600000, img.device_size - offset))
+                assert c.read(offset, length) == device[offset:offset + length], offset
+
+            assert c.read(0, c.size) == device
+            c.disconnect()
+
+        assert "worker threads started" in server.log(), server.log()
+
+        # one unit of the whole image does not fit in the window cache
+        path = os.path.join(directory, "single.pc." + name)
+        with open(path, "wb") as f:
+            f.write(compress(data, len(data)))
+
+        reason = start(binary, directory, path, "--window-cache=2")
+        assert isinstance(reason, str) and "more than the window" in reason, reason
+
+        tested.append(name)
+
+    if not tested:
+        raise Skip("neither xz nor zstd is supported")
+
+
+run(test)
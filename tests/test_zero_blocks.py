@@ -0,0 +1,66 @@
+# With --zero-blocks present blocks holding only zeroes are found once, saved
+# as IMAGE.zeroidx, and served as holes: base:allocation reports them as
+# holes and reads return zeroes. The map is built again when the image
+# changes.
+
+import os
+
+from harness import run, Image, Server, Client, NBD_STATE_HOLE, NBD_STATE_ZERO
+
+HOLE = NBD_STATE_HOLE | NBD_STATE_ZERO
+
+
+def check(server, img, zero_blocks):
+    c = Client(server.port)
+    c.structured_replies()
+    context = c.meta_contexts(b"", [b"base:allocation"])[b"base:allocation"]
+    c.go()
+
+    expected = [0 if bit and i not in zero_blocks else HOLE for i, bit in enumerate(img.bits)]
+    assert c.block_flags(context, img.block_size) == expected
+
+    assert c.read(0, c.size) == img.device()
+    c.disconnect()
+
+    line = "%d of %d present blocks hold only zeroes" % (len(zero_blocks), len(img.data))
+    assert line in server.log(), server.log()
+
+
+def test(binary, directory):
+    img = Image.random(2048, seed=50, used=0.7)
+    present = sorted(img.data)
+    zero_blocks = set(present[10:30] + present[500:501] + present[-1:])
+
+    for block in zero_blocks:
+        img.set(block, bytes(img.block_size))
+
+    path = img.write(os.path.join(directory, "image.pc"))
+
+    with Server(binary, directory, [path], "--zero-blocks") as server:
+        check(server, img, zero_blocks)
+
+    assert "Looking for blocks of zeroes" in server.log()
+    assert os.path.isfile(path + ".zeroidx")
+
+    # the saved map is used
+    with Server(binary, directory, [path], "--zero-blocks") as server:
+        check(server, img, zero_blocks)
+
+    assert "Looking for blocks of zeroes" not in server.log(), server.log()
+
+    # a changed image: one zero block gets data, another block is zeroed
+    img.set(present[500], b"\xff" * img.block_size)
+    img.set(present[700], bytes(img.block_size))
+    zero_blocks = zero_blocks - {present[500]} | {present[700]}
+
+    img.write(path)
+    stat = os.stat(path)
+    os.utime(path, (stat.st_atime, stat.st_mtime + 10))
+
+    with Server(binary, directory, [path], "--zero-blocks") as server:
+        check(server, img, zero_blocks)
+
+    assert "is stale; it is built again" in server.log(), server.log()
+
+
+run(test)